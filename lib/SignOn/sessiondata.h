@@ -76,6 +76,23 @@ enum SignonUiPolicy {
                                   required */
 };
 
+/*!
+ * @enum SignonCachePolicy
+ * Policy to define whether the result of a request can be taken from the
+ * results cached by the daemon.
+ * Results are cached only for the methods configured so, and only when the
+ * plugin tells for how long they stay valid.
+ * @see CachePolicy
+ * @see ResultExpiresIn
+ */
+enum SignonCachePolicy {
+    DefaultCachePolicy = 0,     /**< A cached result is used if still valid. */
+    RefreshCachePolicy,         /**< The plugin processes the request, and its
+                                  result replaces the cached one. */
+    NoCachePolicy,              /**< The plugin processes the request, and its
+                                  result is not cached. */
+};
+
 /*!
  * @class SessionData
  * @headerfile sessiondata.h SignOn/SessionData
@@ -231,6 +248,21 @@ public:
      */
     SIGNON_SESSION_DECLARE_PROPERTY(bool, KeepAlive)
 
+    /*!
+     * Declares the property CachePolicy setter and getter.
+     * Use CachePolicy to define whether a cached result can be used.
+     * @see SignonCachePolicy
+     */
+    SIGNON_SESSION_DECLARE_PROPERTY(int, CachePolicy)
+
+    /*!
+     * Declares the property ResultExpiresIn setter and getter.
+     * Set by a signon plugin in its result: number of seconds during which
+     * the result stays valid, and can be given to identical requests
+     * without the plugin being involved.
+     */
+    SIGNON_SESSION_DECLARE_PROPERTY(quint32, ResultExpiresIn)
+
 protected:
     QVariantMap m_data;
 };
@@ -75,6 +75,26 @@ enum AuthPluginState {
         Q_EXTERN_C AuthPluginInterface *auth_plugin_instance() \
         SIGNON_PLUGIN_INSTANCE(pluginclass)
 
+/*!
+ * Name of the property through which a plugin declares how many requests
+ * it can process at the same time; it is 1 if the property is not set.
+ * The plugin must set it in its constructor.
+ */
+#define SIGNON_PLUGIN_MAX_CONCURRENT_REQUESTS "maxConcurrentRequests"
+
+/*!
+ * Key of the identifier of the request, in the SessionData given to
+ * process() and in the UiSessionData given to userActionFinished() and
+ * refresh(); while cancel() is called, the property of this name holds the
+ * identifier of the request to cancel.
+ * A plugin processing several requests at the same time keeps the
+ * identifier with the state of each request, and reports them with the
+ * signals carrying it, such as requestResult(). The signals without it are
+ * only about the request being called for, or about the only request being
+ * processed.
+ */
+#define SIGNON_PLUGIN_REQUEST_ID "PluginRequestId"
+
 /*!
  * @class AuthPluginInterface.
  * Interface definition for authentication plugins
@@ -201,6 +221,41 @@ Q_SIGNALS:
     void statusChanged(const AuthPluginState state,
                        const QString &message = QString());
 
+    /*!
+     * Same as result(), for the request with the given identifier.
+     * @see SIGNON_PLUGIN_REQUEST_ID
+     */
+    void requestResult(quint32 requestId, const SignOn::SessionData &data);
+
+    /*!
+     * Same as store(), for the request with the given identifier.
+     */
+    void requestStore(quint32 requestId, const SignOn::SessionData &data);
+
+    /*!
+     * Same as error(), for the request with the given identifier.
+     */
+    void requestError(quint32 requestId, const SignOn::Error &err);
+
+    /*!
+     * Same as userActionRequired(), for the request with the given
+     * identifier.
+     */
+    void requestUserActionRequired(quint32 requestId,
+                                   const SignOn::UiSessionData &data);
+
+    /*!
+     * Same as refreshed(), for the request with the given identifier.
+     */
+    void requestRefreshed(quint32 requestId,
+                          const SignOn::UiSessionData &data);
+
+    /*!
+     * Same as statusChanged(), for the request with the given identifier.
+     */
+    void requestStatusChanged(quint32 requestId, const AuthPluginState state,
+                              const QString &message = QString());
+
 public Q_SLOTS:
     /*!
      * User interaction completed.
@@ -0,0 +1,66 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2011 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef SIGNON_PLUGINS_COMMON_DEBUG_H
+#define SIGNON_PLUGINS_COMMON_DEBUG_H
+
+#include <QDebug>
+
+#include "SignOn/signonplugincommon.h"
+
+namespace SignOn {
+
+/* 0 - fatal, 1 - critical(default), 2 - info/debug */
+extern int commonLoggingLevel;
+
+/*!
+ * Sets the logging level of the IPC code shared by the daemon and the
+ * plugin processes, which is in their hot paths: unlike in the plugins, its
+ * traces are not formatted unless they are output.
+ */
+void setCommonLoggingLevel(int level);
+
+} //namespace SignOn
+
+#ifdef SIGNON_PLUGIN_TRACE
+    #ifdef TRACE
+        #undef TRACE
+    #endif
+
+    #ifdef BLAME
+        #undef BLAME
+    #endif
+
+    #ifdef DEBUG_ENABLED
+        #define TRACE() \
+            if (SignOn::commonLoggingLevel >= 2) \
+                qDebug() << __FILE__ << __LINE__ << __func__
+        #define BLAME() \
+            if (SignOn::commonLoggingLevel >= 1) \
+                qCritical() << __FILE__ << __LINE__ << __func__
+    #else
+        #define TRACE() while (0) qDebug()
+        #define BLAME() while (0) qCritical()
+    #endif
+#endif
+
+#endif // SIGNON_PLUGINS_COMMON_DEBUG_H
@@ -27,7 +27,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-#include "SignOn/signonplugincommon.h"
+#include "SignOn/commondebug.h"
 
 using namespace SignOn;
 
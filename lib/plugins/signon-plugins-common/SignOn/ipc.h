@@ -27,6 +27,48 @@
 #ifndef SIGNON_PLUGINS_COMMON_IPC_H
 #define SIGNON_PLUGINS_COMMON_IPC_H
 
+/*
+ * Every message exchanged by the daemon and a plugin process, once the plugin
+ * process has announced that it is started, is a frame made of a fixed size
+ * header followed by its payload.
+ * The header holds, in network byte order: the protocol version (8 bits),
+ * flags (8 bits), the operation or response code (16 bits), the id of the
+ * request the frame belongs to (32 bits), and the payload length (32 bits).
+ * The payload is the QDataStream serialization of the frame arguments.
+ *
+ * The daemon gives each request a non-zero id, carried by all the operations
+ * and responses about it: several requests can be in flight on the same
+ * plugin process, up to the number of concurrent requests the plugin process
+ * declares in its PLUGIN_RESPONSE_MECHANISMS response. The frames of the
+ * startup queries use the request id 0.
+ */
+#define SIGNON_IPC_PROTOCOL_VERSION 2
+#define SIGNON_IPC_HEADER_SIZE 12
+#define SIGNON_IPC_MAX_PAYLOAD_SIZE (16 * 1024 * 1024)
+
+/*
+ * The daemon can share memory with a plugin process, whose file descriptor
+ * is inherited by the plugin process and given in its SSO_IPC_SHM_FD
+ * environment variable. The memory holds two rings of
+ * SIGNON_IPC_RING_CAPACITY bytes, one for each direction, the first one
+ * being written by the daemon.
+ * A frame flagged with SIGNON_IPC_FLAG_SHARED_MEMORY has its payload in the
+ * sender's ring; what travels over the pipe is its descriptor: the payload
+ * offset and length, and the sender's ring position after it (32 bits
+ * each). The receiver copies the payload out of the ring before parsing
+ * it, as the sender can still write there, and hands that position back.
+ * Compared with the pipes, a payload is copied once on each side rather
+ * than through the kernel, and isn't split into pipe-sized writes.
+ * The plugin process tells whether it uses the shared memory in its
+ * PLUGIN_RESPONSE_MECHANISMS response; the pipes are used otherwise, and
+ * whenever a ring is full.
+ */
+#define SIGNON_IPC_FLAG_SHARED_MEMORY 0x01
+#define SIGNON_IPC_SHARED_MEMORY_FD_ENV "SSO_IPC_SHM_FD"
+#define SIGNON_IPC_RING_CAPACITY (1024 * 1024)
+#define SIGNON_IPC_RING_HEADER_SIZE 64
+#define SIGNON_IPC_SHARED_MEMORY_THRESHOLD 4096
+
 enum PluginOperation {
     PLUGIN_OP_TYPE = 1,
     PLUGIN_OP_MECHANISMS,
@@ -45,6 +87,8 @@ enum PluginResponse {
     PLUGIN_RESPONSE_SIGNAL,
     PLUGIN_RESPONSE_UI,
     PLUGIN_RESPONSE_REFRESHED,
+    PLUGIN_RESPONSE_TYPE,
+    PLUGIN_RESPONSE_MECHANISMS,
     PLUGIN_RESPONSE_LAST
 };
 
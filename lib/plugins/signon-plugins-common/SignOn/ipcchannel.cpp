@@ -0,0 +1,356 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2011 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "ipcchannel.h"
+
+#include <QPointer>
+#include <QtEndian>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "SignOn/commondebug.h"
+#include "SignOn/ipc.h"
+
+using namespace SignOn;
+
+/* The payload offset, its length, and the ring position after it */
+static const int sharedDescriptorSize = 12;
+
+static const int ringSize =
+    SIGNON_IPC_RING_HEADER_SIZE + SIGNON_IPC_RING_CAPACITY;
+
+/* The buffers are given back once a frame larger than this is handled */
+static const int keptBufferSize = 64 * 1024;
+
+/* The ring position up to which the receiver has handled the payloads */
+static inline QBasicAtomicInt *ringTail(uchar *ring)
+{
+    return reinterpret_cast<QBasicAtomicInt *>(ring);
+}
+
+static inline uchar *ringData(uchar *ring)
+{
+    return ring + SIGNON_IPC_RING_HEADER_SIZE;
+}
+
+IpcChannel::IpcChannel(QIODevice *readChannel,
+                       QIODevice *writeChannel,
+                       QObject *parent)
+    : QObject(parent),
+      m_readChannel(readChannel),
+      m_writeChannel(writeChannel),
+      m_writeDevice(&m_writeBuffer),
+      m_readSize(0),
+      m_dispatching(false),
+      m_nestedReadsEnabled(false),
+      m_sharedMemory(0),
+      m_sharedMemoryEnabled(false),
+      m_sendRing(0),
+      m_receiveRing(0),
+      m_sendPosition(0)
+{
+    m_writeDevice.open(QIODevice::WriteOnly);
+    m_writeStream.setDevice(&m_writeDevice);
+}
+
+IpcChannel::~IpcChannel()
+{
+    m_writeStream.setDevice(0);
+    detachSharedMemory();
+}
+
+QDataStream &IpcChannel::startFrame(quint16 opcode, quint32 requestId,
+                                    quint8 flags)
+{
+    m_writeHeader = Header();
+    m_writeHeader.version = SIGNON_IPC_PROTOCOL_VERSION;
+    m_writeHeader.flags = flags;
+    m_writeHeader.opcode = opcode;
+    m_writeHeader.requestId = requestId;
+
+    /* The payload is written after the room left for the header, over the
+     * data of the previous frame */
+    m_writeDevice.seek(SIGNON_IPC_HEADER_SIZE);
+    m_writeStream.resetStatus();
+    return m_writeStream;
+}
+
+bool IpcChannel::sendFrame()
+{
+    if (m_writeChannel == 0) {
+        TRACE() << "NULL write channel.";
+        return false;
+    }
+
+    qint64 size = m_writeDevice.pos();
+    m_writeHeader.length = size - SIGNON_IPC_HEADER_SIZE;
+
+    if (m_sharedMemoryEnabled
+        && m_writeHeader.length >= SIGNON_IPC_SHARED_MEMORY_THRESHOLD
+        && writeShared(m_writeHeader.length)) {
+        m_writeHeader.flags |= SIGNON_IPC_FLAG_SHARED_MEMORY;
+        m_writeHeader.length = sharedDescriptorSize;
+        size = SIGNON_IPC_HEADER_SIZE + sharedDescriptorSize;
+    }
+
+    encodeHeader(m_writeHeader, m_writeBuffer.data());
+
+    TRACE() << m_writeHeader.opcode << m_writeHeader.length;
+
+    bool written = (m_writeChannel->write(m_writeBuffer.constData(), size) == size);
+    if (!written)
+        BLAME() << "Failed to write frame:" << m_writeChannel->errorString();
+
+    /* startFrame() seeks the device back before any new write */
+    if (m_writeBuffer.size() > keptBufferSize) {
+        m_writeBuffer.resize(SIGNON_IPC_HEADER_SIZE);
+        m_writeBuffer.squeeze();
+    }
+
+    return written;
+}
+
+bool IpcChannel::sendFrame(quint16 opcode, quint32 requestId)
+{
+    startFrame(opcode, requestId);
+    return sendFrame();
+}
+
+qint64 IpcChannel::readFrames(int maxFrames)
+{
+    /* The frames are read in order by the outermost call, unless the
+     * receiver takes them while it handles one */
+    if (m_dispatching && !m_nestedReadsEnabled)
+        return 0;
+
+    qint64 bytesRead = 0;
+    int frames = 0;
+    while (maxFrames <= 0 || frames < maxFrames) {
+        bool hasHeader = (m_readSize >= SIGNON_IPC_HEADER_SIZE);
+        int expectedSize = SIGNON_IPC_HEADER_SIZE;
+        if (hasHeader)
+            expectedSize += m_readHeader.length;
+
+        if (m_readSize < expectedSize) {
+            if (m_readBuffer.size() < expectedSize)
+                m_readBuffer.resize(expectedSize);
+
+            qint64 n = m_readChannel->read(m_readBuffer.data() + m_readSize,
+                                           expectedSize - m_readSize);
+            if (n <= 0)
+                break;
+
+            m_readSize += n;
+            bytesRead += n;
+            if (m_readSize < expectedSize)
+                continue;
+        }
+
+        if (!hasHeader) {
+            m_readHeader = decodeHeader(m_readBuffer.constData());
+            if (m_readHeader.version != SIGNON_IPC_PROTOCOL_VERSION
+                || m_readHeader.length > SIGNON_IPC_MAX_PAYLOAD_SIZE) {
+                BLAME() << "Invalid frame, version:" << m_readHeader.version
+                        << "length:" << m_readHeader.length;
+                m_readSize = 0;
+                emit error();
+                break;
+            }
+
+            if (m_readHeader.length > 0)
+                continue;
+        }
+
+        /* The frame is complete: hand out its payload from the read buffer */
+        const char *data = m_readBuffer.constData() + SIGNON_IPC_HEADER_SIZE;
+        quint32 payloadLength = m_readHeader.length;
+        bool shared = (m_readHeader.flags & SIGNON_IPC_FLAG_SHARED_MEMORY);
+        if (shared) {
+            const uchar *descriptor = reinterpret_cast<const uchar *>(data);
+            quint32 offset = 0;
+            quint32 length = 0;
+            quint32 ringPosition = 0;
+            if (m_readHeader.length == sharedDescriptorSize) {
+                offset = qFromBigEndian<quint32>(descriptor);
+                length = qFromBigEndian<quint32>(descriptor + 4);
+                ringPosition = qFromBigEndian<quint32>(descriptor + 8);
+            }
+
+            if (m_receiveRing == 0
+                || m_readHeader.length != sharedDescriptorSize
+                || offset > SIGNON_IPC_RING_CAPACITY
+                || length > SIGNON_IPC_RING_CAPACITY - offset) {
+                BLAME() << "Invalid shared memory frame, offset:" << offset
+                        << "length:" << length;
+                m_readSize = 0;
+                emit error();
+                break;
+            }
+
+            /* Copied before being parsed, as the sender can still write the
+             * ring: then the sender can reuse the room of the payload */
+            if (m_readBuffer.size() < int(SIGNON_IPC_HEADER_SIZE + length))
+                m_readBuffer.resize(SIGNON_IPC_HEADER_SIZE + length);
+            memcpy(m_readBuffer.data() + SIGNON_IPC_HEADER_SIZE,
+                   ringData(m_receiveRing) + offset, length);
+            ringTail(m_receiveRing)->fetchAndStoreRelease(ringPosition);
+
+            data = m_readBuffer.constData() + SIGNON_IPC_HEADER_SIZE;
+            payloadLength = length;
+        }
+        QByteArray payload = QByteArray::fromRawData(data, payloadLength);
+        m_readSize = 0;
+        frames++;
+
+        QPointer<IpcChannel> guard(this);
+        /* Shared, so that a nested read detaches the read buffer rather
+         * than overwriting the payload being handled */
+        QByteArray dispatchedBuffer(m_readBuffer);
+        bool dispatching = m_dispatching;
+        m_dispatching = true;
+        emit frameReceived(m_readHeader.opcode, m_readHeader.requestId, payload);
+        if (guard.isNull())
+            return bytesRead;
+        m_dispatching = dispatching;
+
+        if (m_readBuffer.size() > keptBufferSize) {
+            m_readBuffer.resize(SIGNON_IPC_HEADER_SIZE);
+            m_readBuffer.squeeze();
+        }
+    }
+
+    return bytesRead;
+}
+
+bool IpcChannel::writeShared(quint32 length)
+{
+    quint32 handled = ringTail(m_sendRing)->fetchAndAddAcquire(0);
+    quint32 offset = m_sendPosition % SIGNON_IPC_RING_CAPACITY;
+    quint32 skipped = 0;
+
+    /* A payload is never split: it goes at the beginning of the ring if it
+     * doesn't fit at its end */
+    if (offset + length > SIGNON_IPC_RING_CAPACITY) {
+        skipped = SIGNON_IPC_RING_CAPACITY - offset;
+        offset = 0;
+    }
+
+    if (m_sendPosition - handled + skipped + length > SIGNON_IPC_RING_CAPACITY) {
+        TRACE() << "The shared memory is full, using the channel";
+        return false;
+    }
+
+    memcpy(ringData(m_sendRing) + offset,
+           m_writeBuffer.constData() + SIGNON_IPC_HEADER_SIZE, length);
+    m_sendPosition += skipped + length;
+
+    uchar *descriptor =
+        reinterpret_cast<uchar *>(m_writeBuffer.data()) + SIGNON_IPC_HEADER_SIZE;
+    qToBigEndian<quint32>(offset, descriptor);
+    qToBigEndian<quint32>(length, descriptor + 4);
+    qToBigEndian<quint32>(m_sendPosition, descriptor + 8);
+    return true;
+}
+
+int IpcChannel::createSharedMemory()
+{
+    /* The file is removed right away: only the descriptor, inherited by
+     * the plugin process, refers to it */
+    QByteArray path("/dev/shm/signon-ipc-XXXXXX");
+    int fd = mkstemp(path.data());
+    if (fd < 0) {
+        BLAME() << "Cannot create the shared memory:" << strerror(errno);
+        return -1;
+    }
+    unlink(path.constData());
+
+    if (ftruncate(fd, 2 * ringSize) != 0) {
+        BLAME() << "Cannot size the shared memory:" << strerror(errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool IpcChannel::attachSharedMemory(int fd, bool creator)
+{
+    detachSharedMemory();
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 2 * ringSize) {
+        BLAME() << "Invalid shared memory";
+        return false;
+    }
+
+    void *memory = mmap(0, 2 * ringSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        fd, 0);
+    if (memory == MAP_FAILED) {
+        BLAME() << "Cannot map the shared memory:" << strerror(errno);
+        return false;
+    }
+
+    m_sharedMemory = static_cast<uchar *>(memory);
+    m_sendRing = creator ? m_sharedMemory : m_sharedMemory + ringSize;
+    m_receiveRing = creator ? m_sharedMemory + ringSize : m_sharedMemory;
+    m_sendPosition = 0;
+    return true;
+}
+
+void IpcChannel::detachSharedMemory()
+{
+    if (m_sharedMemory == 0)
+        return;
+
+    munmap(m_sharedMemory, 2 * ringSize);
+    m_sharedMemory = 0;
+    m_sharedMemoryEnabled = false;
+    m_sendRing = 0;
+    m_receiveRing = 0;
+}
+
+void IpcChannel::encodeHeader(const Header &header, char *data)
+{
+    uchar *dest = reinterpret_cast<uchar *>(data);
+    dest[0] = header.version;
+    dest[1] = header.flags;
+    qToBigEndian<quint16>(header.opcode, dest + 2);
+    qToBigEndian<quint32>(header.requestId, dest + 4);
+    qToBigEndian<quint32>(header.length, dest + 8);
+}
+
+IpcChannel::Header IpcChannel::decodeHeader(const char *data)
+{
+    const uchar *src = reinterpret_cast<const uchar *>(data);
+    Header header;
+    header.version = src[0];
+    header.flags = src[1];
+    header.opcode = qFromBigEndian<quint16>(src + 2);
+    header.requestId = qFromBigEndian<quint32>(src + 4);
+    header.length = qFromBigEndian<quint32>(src + 8);
+    return header;
+}
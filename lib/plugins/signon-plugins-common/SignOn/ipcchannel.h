@@ -0,0 +1,160 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2011 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef IPCCHANNEL_H
+#define IPCCHANNEL_H
+
+#include <QObject>
+#include <QIODevice>
+#include <QBuffer>
+#include <QByteArray>
+#include <QDataStream>
+
+namespace SignOn {
+
+/*!
+ * @class IpcChannel
+ * Sends and receives the frames of the plugin IPC protocol (see ipc.h).
+ * A frame is serialized into a buffer which is reused for every frame, and
+ * written with a single write. Incoming frames are read incrementally into
+ * another reusable buffer, as the data becomes available.
+ * When shared memory is attached, the large payloads are passed through it
+ * rather than through the channels (see ipc.h); they are still copied into
+ * the shared memory by the sender, and out of it by the receiver.
+ * The buffers shrink back once a large frame has been handled.
+ */
+class IpcChannel : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Header {
+        Header(): version(0), flags(0), opcode(0), requestId(0), length(0) {}
+
+        quint8 version;
+        quint8 flags;
+        quint16 opcode;
+        quint32 requestId;
+        quint32 length;
+    };
+
+    IpcChannel(QIODevice *readChannel,
+               QIODevice *writeChannel,
+               QObject *parent = 0);
+    ~IpcChannel();
+
+    /*!
+     * Starts a new frame: its payload is to be written to the returned
+     * stream, before calling sendFrame().
+     */
+    QDataStream &startFrame(quint16 opcode, quint32 requestId = 0,
+                            quint8 flags = 0);
+    bool sendFrame();
+
+    /*!
+     * Sends a frame without payload.
+     */
+    bool sendFrame(quint16 opcode, quint32 requestId = 0);
+
+    /*!
+     * Reads the available data, emitting frameReceived() for each complete
+     * frame, and at most maxFrames frames if maxFrames is positive.
+     * The reads block on a blocking device: its reader must pass maxFrames.
+     * @returns the number of bytes read.
+     */
+    qint64 readFrames(int maxFrames = -1);
+
+    /*!
+     * Drops the partially read frame, if any: to be called when the other
+     * end of the channel is restarted.
+     */
+    void reset() { m_readSize = 0; }
+
+    /*!
+     * Creates the memory to be shared with a plugin process.
+     * @returns its file descriptor, or -1 on failure.
+     */
+    static int createSharedMemory();
+
+    /*!
+     * Maps the shared memory; the file descriptor can be closed afterwards.
+     * @param creator whether this end of the channel created the memory.
+     */
+    bool attachSharedMemory(int fd, bool creator);
+    void detachSharedMemory();
+    bool hasSharedMemory() const { return m_sharedMemory != 0; }
+
+    /*!
+     * Enables the sending of the large payloads through the shared memory,
+     * once the other end has told it reads them.
+     */
+    void setSharedMemoryEnabled(bool enabled) { m_sharedMemoryEnabled = enabled; }
+
+    /*!
+     * Lets readFrames() be called again while a frame is being handled, for
+     * a receiver which processes the events meanwhile: the frames read then
+     * are emitted right away, and the receiver is in charge of their order.
+     * By default the nested calls read nothing.
+     */
+    void setNestedReadsEnabled(bool enabled) { m_nestedReadsEnabled = enabled; }
+
+    static void encodeHeader(const Header &header, char *data);
+    static Header decodeHeader(const char *data);
+
+Q_SIGNALS:
+    /*!
+     * Emitted for each received frame. The payload refers to the read
+     * buffer of the channel: it must be copied if it is needed after the
+     * signal has been handled.
+     */
+    void frameReceived(quint16 opcode, quint32 requestId,
+                       const QByteArray &payload);
+    void error();
+
+private:
+    bool writeShared(quint32 length);
+
+private:
+    QIODevice *m_readChannel;
+    QIODevice *m_writeChannel;
+
+    QByteArray m_writeBuffer;
+    QBuffer m_writeDevice;
+    QDataStream m_writeStream;
+    Header m_writeHeader;
+
+    QByteArray m_readBuffer;
+    int m_readSize;
+    Header m_readHeader;
+    bool m_dispatching;
+    bool m_nestedReadsEnabled;
+
+    uchar *m_sharedMemory;
+    bool m_sharedMemoryEnabled;
+    uchar *m_sendRing;
+    uchar *m_receiveRing;
+    quint32 m_sendPosition;
+};
+
+} //namespace SignOn
+
+#endif //IPCCHANNEL_H
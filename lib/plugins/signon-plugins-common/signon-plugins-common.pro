@@ -12,11 +12,15 @@ DEFINES += SIGNON_PLUGIN_TRACE
 
 SOURCES += \
     SignOn/blobiohandler.cpp \
-    SignOn/encrypteddevice.cpp
+    SignOn/commondebug.cpp \
+    SignOn/encrypteddevice.cpp \
+    SignOn/ipcchannel.cpp
 HEADERS += \
     SignOn/blobiohandler.h \
+    SignOn/commondebug.h \
     SignOn/encrypteddevice.h \
-    SignOn/ipc.h
+    SignOn/ipc.h \
+    SignOn/ipcchannel.h
 
 headers.files = \
     SignOn/blobiohandler.h
@@ -10,6 +10,7 @@ HEADERS = \
     debug.h \
     crypto-handlers.h \
     crypto-manager.h \
+    encrypted-vfs.h \
     export.h \
     extension-interface.h \
     key-handler.h \
@@ -24,6 +25,7 @@ SOURCES += \
     crypto-handlers.cpp \
     crypto-manager.cpp \
     debug.cpp \
+    encrypted-vfs.cpp \
     key-handler.cpp \
     misc.cpp
 
@@ -44,6 +46,11 @@ DEFINES += \
 LIBS += \
     -lcryptsetup
 
+CONFIG += link_pkgconfig
+PKGCONFIG += \
+    libcrypto \
+    sqlite3
+
 include( $${TOP_SRC_DIR}/common-installs-config.pri )
 
 headers.files = \
@@ -26,6 +26,7 @@
 #include "crypto-manager.h"
 #include "crypto-handlers.h"
 #include "debug.h"
+#include "encrypted-vfs.h"
 #include "misc.h"
 
 #include <QFile>
@@ -81,6 +82,142 @@ namespace SignOn {
         return false;
     }
 
+    /*
+        With the PageStorage type, the key of the pages is stored wrapped
+        by each of the encryption keys, as LUKS does in its key slots.
+    */
+    const QString CryptoManager::keySlotsFilePath() const
+    {
+        return m_fileSystemPath + QLatin1String(".keys");
+    }
+
+    QString CryptoManager::keySlotOf(const QByteArray &key,
+                                     QByteArray *pageKey) const
+    {
+        QSettings keySlots(keySlotsFilePath(), QSettings::IniFormat);
+        foreach (QString slot, keySlots.allKeys()) {
+            QByteArray unwrappedKey = EncryptedVfs::unwrapKey(
+                keySlots.value(slot).toByteArray(), key);
+            if (!unwrappedKey.isEmpty()) {
+                if (pageKey != 0)
+                    *pageKey = unwrappedKey;
+                return slot;
+            }
+        }
+
+        return QString();
+    }
+
+    bool CryptoManager::setupPageStorage()
+    {
+        removePageStorageFiles();
+        QFile::remove(keySlotsFilePath());
+
+        QByteArray pageKey = EncryptedVfs::generateKey();
+        QByteArray wrappedKey = EncryptedVfs::wrapKey(pageKey, m_accessCode);
+        if (wrappedKey.isEmpty()) {
+            BLAME() << "Could not create the key of the pages.";
+            return false;
+        }
+
+        {
+            QSettings keySlots(keySlotsFilePath(), QSettings::IniFormat);
+            keySlots.clear();
+            keySlots.setValue(QLatin1String("1"), wrappedKey);
+            keySlots.sync();
+            if (keySlots.status() != QSettings::NoError) {
+                BLAME() << "Could not write the key slots.";
+                return false;
+            }
+        }
+
+        return mountPageStorage();
+    }
+
+    bool CryptoManager::mountPageStorage()
+    {
+        if (keySlotOf(m_accessCode, &m_pageKey).isNull()) {
+            TRACE() << "The key is in none of the key slots.";
+            return false;
+        }
+
+        if (!EncryptedVfs::registerDatabase(m_fileSystemPath, m_pageKey)) {
+            BLAME() << "Failed to register the encrypted DB.";
+            m_pageKey.fill(0);
+            m_pageKey.clear();
+            return false;
+        }
+
+        updateMountState(Mounted);
+        return true;
+    }
+
+    bool CryptoManager::addKeySlot(const QByteArray &key,
+                                   const QByteArray &existingKey)
+    {
+        if (m_mountState != Mounted || keySlotOf(existingKey).isNull()) {
+            TRACE() << "FAILED to add key slot: storage not mounted or "
+                       "invalid existing key.";
+            return false;
+        }
+
+        if (!keySlotOf(key).isNull())
+            return true;
+
+        QByteArray wrappedKey = EncryptedVfs::wrapKey(m_pageKey, key);
+        if (wrappedKey.isEmpty())
+            return false;
+
+        QSettings keySlots(keySlotsFilePath(), QSettings::IniFormat);
+        int slot = 0;
+        foreach (QString slotIt, keySlots.allKeys())
+            slot = qMax(slot, slotIt.toInt());
+        keySlots.setValue(QString::number(slot + 1), wrappedKey);
+        keySlots.sync();
+        return keySlots.status() == QSettings::NoError;
+    }
+
+    bool CryptoManager::removeKeySlot(const QByteArray &key,
+                                      const QByteArray &remainingKey)
+    {
+        if (key == remainingKey || keySlotOf(remainingKey).isNull()) {
+            TRACE() << "FAILED to remove key slot: no other valid key.";
+            return false;
+        }
+
+        QString slot = keySlotOf(key);
+        if (slot.isNull())
+            return false;
+
+        QSettings keySlots(keySlotsFilePath(), QSettings::IniFormat);
+        keySlots.remove(slot);
+        keySlots.sync();
+        return keySlots.status() == QSettings::NoError;
+    }
+
+    bool CryptoManager::registerPageStorageCopy(const QString &filePath)
+    {
+        if (m_storageType != PageStorage || m_mountState != Mounted) {
+            TRACE() << "No mounted page storage to copy.";
+            return false;
+        }
+
+        return EncryptedVfs::registerDatabase(filePath, m_pageKey);
+    }
+
+    void CryptoManager::unregisterPageStorageCopy(const QString &filePath)
+    {
+        EncryptedVfs::unregisterDatabase(filePath);
+    }
+
+    void CryptoManager::removePageStorageFiles() const
+    {
+        QFile::remove(m_fileSystemPath);
+        QFile::remove(m_fileSystemPath + QLatin1String("-journal"));
+        QFile::remove(m_fileSystemPath + QLatin1String("-wal"));
+        QFile::remove(m_fileSystemPath + QLatin1String("-shm"));
+    }
+
     CryptoManager::CryptoManager(QObject *parent)
             : QObject(parent),
               m_accessCode(QByteArray()),
@@ -92,10 +229,9 @@ namespace SignOn {
               m_loopDeviceName(QString()),
               m_mountState(Unmounted),
               m_fileSystemType(Ext2),
-              m_fileSystemSize(4)
+              m_fileSystemSize(4),
+              m_storageType(FileSystemStorage)
     {
-        if (!CryptsetupHandler::loadDmMod())
-            BLAME() << "Could not load `dm_mod`!";
     }
 
     CryptoManager::CryptoManager(const QByteArray &encryptionKey,
@@ -106,12 +242,10 @@ namespace SignOn {
               m_loopDeviceName(QString()),
               m_mountState(Unmounted),
               m_fileSystemType(Ext2),
-              m_fileSystemSize(4)
+              m_fileSystemSize(4),
+              m_storageType(FileSystemStorage)
     {
         setFileSystemPath(fileSystemPath);
-
-        if (!CryptsetupHandler::loadDmMod())
-            BLAME() << "Could not load `dm_mod`!";
     }
 
     CryptoManager::~CryptoManager()
@@ -145,6 +279,16 @@ namespace SignOn {
         return true;
     }
 
+    void CryptoManager::setStorageType(const StorageType type)
+    {
+        if (m_mountState != Unmounted) {
+            BLAME() << "File system already mounted";
+            return;
+        }
+
+        m_storageType = type;
+    }
+
     void CryptoManager::setEncryptionKey(const QByteArray &key)
     {
         if (fileSystemIsMounted()) {
@@ -183,6 +327,9 @@ namespace SignOn {
             return false;
         }
 
+        if (m_storageType == PageStorage)
+            return setupPageStorage();
+
         if (!CryptsetupHandler::loadDmMod()) {
             BLAME() << "Could not load `dm_mod`!";
             return false;
@@ -263,6 +410,9 @@ namespace SignOn {
             return false;
         }
 
+        if (m_storageType == PageStorage)
+            return mountPageStorage();
+
         clearFileSystemResources();
 
         if (!CryptsetupHandler::loadDmMod()) {
@@ -346,6 +496,15 @@ namespace SignOn {
         }
 
         emit fileSystemUnmounting();
+
+        if (m_storageType == PageStorage) {
+            EncryptedVfs::unregisterDatabase(m_fileSystemPath);
+            m_pageKey.fill(0);
+            m_pageKey.clear();
+            updateMountState(Unmounted);
+            return true;
+        }
+
         bool isOk = true;
 
         if ((m_mountState >= Mounted)
@@ -383,12 +542,20 @@ namespace SignOn {
                 return false;
         }
 
+        if (m_storageType == PageStorage) {
+            removePageStorageFiles();
+            return QFile::remove(keySlotsFilePath());
+        }
+
         //TODO - implement effective deletion in specific handler object
         return false;
     }
 
     bool CryptoManager::fileSystemIsSetup() const
     {
+        if (m_storageType == PageStorage)
+            return QFileInfo(keySlotsFilePath()).size() > 0;
+
         return QFile::exists(fileSystemPath());
     }
 
@@ -446,6 +613,9 @@ namespace SignOn {
     bool CryptoManager::addEncryptionKey(const QByteArray &key,
                                          const QByteArray &existingKey)
     {
+        if (m_storageType == PageStorage)
+            return addKeySlot(key, existingKey);
+
         /*
          * TODO -- limit number of stored keys to the total available slots - 1.
          */
@@ -464,6 +634,9 @@ namespace SignOn {
     bool CryptoManager::removeEncryptionKey(const QByteArray &key,
                                             const QByteArray &remainingKey)
     {
+        if (m_storageType == PageStorage)
+            return removeKeySlot(key, remainingKey);
+
         if (m_mountState >= LoopLuksOpened) {
             if (CryptsetupHandler::removeKeySlot(
                 m_loopDeviceName, key, remainingKey))
@@ -485,6 +658,9 @@ namespace SignOn {
            return mountFileSystem();
         }
 
+        if (m_storageType == PageStorage)
+            return !keySlotOf(key).isNull();
+
         /* Variant that tests if the key is in the LUKS keychain
          * by using a file on the encrypted storage containing the keychain.
          */
@@ -44,6 +44,9 @@ namespace SignOn {
     /*!
         @class CryptoManager
         Encrypted file system manager. Uses cryptsetup and LUKS.
+        With the PageStorage type, the secrets DB is encrypted page by page
+        instead, by an SQLite VFS, without root privileges: the file system
+        path is then the one of the DB itself, opened with that VFS.
         @ingroup Accounts_and_SSO_Framework
     */
     class SIGNON_EXPORT CryptoManager : public QObject
@@ -71,6 +74,15 @@ namespace SignOn {
             Ext4
         };
 
+        /*!
+          @enum StorageType
+          How the secrets are encrypted.
+        */
+        enum StorageType {
+            FileSystemStorage = 0, /**< A LUKS file system in a loop device. */
+            PageStorage            /**< The pages of the DB, with AES-GCM. */
+        };
+
         /*!
             Constructs a CryptoManager object with the given parent.
             @param parent
@@ -131,6 +143,20 @@ namespace SignOn {
         */
         quint32 fileSystemSize() const { return m_fileSystemSize; }
 
+        /*!
+            Sets how the secrets are encrypted; to be called before the
+            file system is set up or mounted.
+            @param type The storage type.
+            @see StorageType
+        */
+        void setStorageType(const StorageType type);
+
+        /*!
+            @return the storage type.
+            @see StorageType
+        */
+        StorageType storageType() const { return m_storageType; }
+
         /*!
             Sets the file system's path.
             @param path The path of the file system's file/source.
@@ -228,6 +254,16 @@ namespace SignOn {
         bool removeEncryptionKey(const QByteArray &key,
                                  const QByteArray &remainingKey);
 
+        /*!
+            With the PageStorage type, encrypts the file at the given path
+            with the key of the DB, so that it can receive a copy of the DB
+            still encrypted, until unregisterPageStorageCopy().
+            @attention The storage must be mounted prior to calling this.
+            @returns true, if succeeded, false otherwise.
+        */
+        bool registerPageStorageCopy(const QString &filePath);
+        static void unregisterPageStorageCopy(const QString &filePath);
+
     Q_SIGNALS:
         void fileSystemMounted();
         void fileSystemUnmounting();
@@ -246,6 +282,16 @@ namespace SignOn {
         void removeKeyFromKeychain(const QByteArray &key) const;
         bool keychainContainsKey(const QByteArray &key) const;
 
+        const QString keySlotsFilePath() const;
+        QString keySlotOf(const QByteArray &key,
+                          QByteArray *pageKey = 0) const;
+        bool setupPageStorage();
+        bool mountPageStorage();
+        bool addKeySlot(const QByteArray &key, const QByteArray &existingKey);
+        bool removeKeySlot(const QByteArray &key,
+                           const QByteArray &remainingKey);
+        void removePageStorageFiles() const;
+
     private:
         //TODO remove this
         void serializeData();
@@ -262,6 +308,9 @@ namespace SignOn {
         FileSystemMountState m_mountState;
         FileSystemType m_fileSystemType;
         quint32 m_fileSystemSize;
+
+        StorageType m_storageType;
+        QByteArray m_pageKey;
     };
 
 } //namespace SignonDaemonNS
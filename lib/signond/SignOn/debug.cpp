@@ -22,16 +22,127 @@
 
 #include "debug.h"
 
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QFile>
+
+#include <fcntl.h>
+#include <sys/time.h>
+#include <unistd.h>
+
 using namespace SignOn;
 
 SIGNON_EXPORT int signonLoggingLevel = 1; // criticals
+SIGNON_EXPORT int signonTraceCategories = 0;
+SIGNON_EXPORT int signonTraceEventCategories = 0;
+
+static int traceCategories = TraceAllCategories;
+
+/* The trace buffer: a ring of fixed size events, which keeps the last
+ * ones. The function and the event refer to string literals. */
+struct TraceEvent {
+    qint64 time; // usecs
+    const char *function;
+    const char *event;
+    qint64 value1;
+    qint64 value2;
+    int category;
+};
+
+static const int traceEventCount = 4096;
+static TraceEvent traceEvents[traceEventCount];
+static QBasicAtomicInt traceEventIndex = Q_BASIC_ATOMIC_INITIALIZER(0);
+
+static void updateTraceCategories()
+{
+    signonTraceCategories = (signonLoggingLevel >= 2) ? traceCategories : 0;
+}
+
+/* The descriptor is left open by the QFile */
+static bool writeTraceEvents(int fd)
+{
+    QFile file;
+    if (!file.open(fd, QIODevice::WriteOnly))
+        return false;
+
+    uint end = traceEventIndex.fetchAndAddRelaxed(0);
+    uint begin = (end > uint(traceEventCount)) ? end - traceEventCount : 0;
+
+    char line[256];
+    for (uint index = begin; index != end; index++) {
+        const TraceEvent &traceEvent = traceEvents[index % traceEventCount];
+        if (traceEvent.event == 0)
+            continue;
+
+        int length = qsnprintf(line, sizeof(line),
+                               "%lld.%06lld %d %s %s %lld %lld\n",
+                               traceEvent.time / 1000000,
+                               traceEvent.time % 1000000,
+                               traceEvent.category,
+                               traceEvent.function,
+                               traceEvent.event,
+                               traceEvent.value1,
+                               traceEvent.value2);
+        if (length < 0)
+            continue;
+        if (length >= int(sizeof(line)))
+            length = sizeof(line) - 1;
+        if (file.write(line, length) != length)
+            return false;
+    }
+
+    return file.flush();
+}
 
 namespace SignOn {
 
 SIGNON_EXPORT void setLoggingLevel(int level)
 {
     signonLoggingLevel = level;
+    updateTraceCategories();
 }
 
-}; // namespace
+SIGNON_EXPORT void setTraceCategories(int categories)
+{
+    traceCategories = categories;
+    updateTraceCategories();
+}
+
+SIGNON_EXPORT void setTraceEventCategories(int categories)
+{
+    signonTraceEventCategories = categories;
+}
+
+SIGNON_EXPORT void recordTraceEvent(int category, const char *function,
+                                    const char *event,
+                                    qint64 value1, qint64 value2)
+{
+    uint index = traceEventIndex.fetchAndAddRelaxed(1);
+    TraceEvent &traceEvent = traceEvents[index % traceEventCount];
 
+    struct timeval now;
+    gettimeofday(&now, 0);
+    traceEvent.time = qint64(now.tv_sec) * 1000000 + now.tv_usec;
+    traceEvent.function = function;
+    traceEvent.event = event;
+    traceEvent.value1 = value1;
+    traceEvent.value2 = value2;
+    traceEvent.category = category;
+}
+
+SIGNON_EXPORT bool dumpTraceEvents(const QString &fileName)
+{
+    /* Never written through an existing file or symbolic link, and
+     * readable by the user only */
+    int fd = ::open(QFile::encodeName(fileName).constData(),
+                    O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    if (fd < 0)
+        return false;
+
+    bool ok = writeTraceEvents(fd);
+    if (::close(fd) != 0)
+        ok = false;
+    return ok;
+}
+
+}; // namespace
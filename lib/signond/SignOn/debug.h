@@ -25,6 +25,25 @@
 
 #include <SignOn/export.h>
 
+#include <QString>
+
+namespace SignOn {
+
+/*!
+ * The categories of the traces: the traces of a source file are in the
+ * category it defines as SIGNON_TRACE_CATEGORY before including this
+ * header, or in TraceGeneral.
+ */
+enum TraceCategory {
+    TraceGeneral = 1 << 0,
+    TraceSession = 1 << 1,
+    TracePlugin = 1 << 2,
+    TraceStorage = 1 << 3,
+    TraceAllCategories = 0xffff
+};
+
+}
+
 #ifdef SIGNON_TRACE
     #ifdef TRACE
         #undef TRACE
@@ -36,10 +55,25 @@
 
     #include <QDebug>
 
+    /* The categories compiled in: the traces of the others are optimized
+     * out */
+    #ifndef SIGNON_TRACE_CATEGORIES
+        #define SIGNON_TRACE_CATEGORIES SignOn::TraceAllCategories
+    #endif
+
+    #ifndef SIGNON_TRACE_CATEGORY
+        #define SIGNON_TRACE_CATEGORY SignOn::TraceGeneral
+    #endif
+
     #ifdef DEBUG_ENABLED
         /* 0 - fatal, 1 - critical(default), 2 - info/debug */
         extern int signonLoggingLevel;
 
+        /* The categories whose debug messages are output, none if the
+         * logging level is below 2, and those whose events are recorded */
+        extern int signonTraceCategories;
+        extern int signonTraceEventCategories;
+
         static inline bool debugEnabled()
         {
             return signonLoggingLevel >= 2;
@@ -50,15 +84,40 @@
             return signonLoggingLevel >= 1;
         }
 
+        static inline bool traceEnabled(int category)
+        {
+            return (SIGNON_TRACE_CATEGORIES & category)
+                && (signonTraceCategories & category);
+        }
+
+        static inline bool traceEventsEnabled(int category)
+        {
+            return (SIGNON_TRACE_CATEGORIES & category)
+                && (signonTraceEventCategories & category);
+        }
+
         #define TRACE() \
-            if (debugEnabled()) qDebug() << __FILE__ << __LINE__ << __func__
+            if (traceEnabled(SIGNON_TRACE_CATEGORY)) \
+                qDebug() << __FILE__ << __LINE__ << __func__
         #define BLAME() \
             if (criticalsEnabled()) qCritical() << __FILE__ << __LINE__ << __func__
+
+        /* Records an event, given as a string literal, with two integer
+         * values: nothing is formatted until the events are dumped */
+        #define TRACE_EVENT(event, value1, value2) \
+            if (traceEventsEnabled(SIGNON_TRACE_CATEGORY)) \
+                SignOn::recordTraceEvent(SIGNON_TRACE_CATEGORY, __func__, \
+                                         event, value1, value2)
     #else
         static inline bool debugEnabled() { return false; }
         static inline bool criticalsEnabled() { return false; }
+        static inline bool traceEnabled(int) { return false; }
+        static inline bool traceEventsEnabled(int) { return false; }
         #define TRACE() while (0) qDebug()
         #define BLAME() while (0) qDebug()
+        #define TRACE_EVENT(event, value1, value2) \
+            while (0) SignOn::recordTraceEvent(SIGNON_TRACE_CATEGORY, __func__, \
+                                               event, value1, value2)
     #endif
 #endif
 
@@ -66,6 +125,28 @@ namespace SignOn {
 
 void setLoggingLevel(int level);
 
+/*!
+ * Sets the categories whose debug messages are output when the logging
+ * level is 2 (all by default).
+ */
+void setTraceCategories(int categories);
+
+/*!
+ * Sets the categories whose events are recorded in the trace buffer (none
+ * by default).
+ */
+void setTraceEventCategories(int categories);
+
+void recordTraceEvent(int category, const char *function, const char *event,
+                      qint64 value1, qint64 value2);
+
+/*!
+ * Writes the recorded events, oldest first, to a new file of the given name,
+ * readable by the user only.
+ * @returns false if the file couldn't be written, or if it already exists.
+ */
+bool dumpTraceEvents(const QString &fileName);
+
 };
 
 #endif // SIGNON_DEBUG_H
@@ -0,0 +1,733 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2011 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#define SIGNON_TRACE_CATEGORY SignOn::TraceStorage
+
+#include "encrypted-vfs.h"
+#include "debug.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QMap>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QtEndian>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <sqlite3.h>
+#include <string.h>
+
+using namespace SignOn;
+
+static const int blockSize = 4096;
+static const int nonceSize = 12;
+static const int tagSize = 16;
+static const int keySize = 32;
+static const int saltSize = 16;
+static const int kdfIterations = 10000;
+
+/* A block is stored as its nonce, the length of its data, the encrypted
+ * data padded to the block size, and the authentication tag */
+static const int blockHeaderSize = nonceSize + 4;
+static const int storedBlockSize = blockHeaderSize + blockSize + tagSize;
+
+/* The kind of the file, the index of the block and its length */
+static const int blockAadSize = 1 + 8 + 4;
+
+/* Authenticated along with a wrapped key */
+static const char wrappedKeyLabel[] = "signon-key";
+
+static const char vfsName[] = "signon-encrypted";
+
+enum FileKind {
+    MainDatabase = 0,
+    Journal,
+    WriteAheadLog,
+    TemporaryFile
+};
+
+struct EncryptedFile {
+    sqlite3_file base;
+    /* The file opened by the default VFS, allocated after this structure */
+    sqlite3_file *real;
+    unsigned char kind;
+    unsigned char key[keySize];
+    EVP_CIPHER_CTX *cipher;
+    /* A block as stored in the file, and its decrypted data */
+    unsigned char *stored;
+    unsigned char *data;
+};
+
+static QMutex vfsMutex;
+static QMap<QString, QByteArray> databaseKeys;
+/* The default VFS, which stores the blocks */
+static sqlite3_vfs *defaultVfs = 0;
+static sqlite3_vfs encryptedVfs;
+
+static bool sealData(EVP_CIPHER_CTX *cipher, const unsigned char *key,
+                     const unsigned char *nonce,
+                     const unsigned char *aad, int aadLength,
+                     const unsigned char *in, int length,
+                     unsigned char *out, unsigned char *tag)
+{
+    int outLength = 0;
+    return EVP_EncryptInit_ex(cipher, EVP_aes_256_gcm(), 0, key, nonce)
+        && EVP_EncryptUpdate(cipher, 0, &outLength, aad, aadLength)
+        && (length == 0
+            || EVP_EncryptUpdate(cipher, out, &outLength, in, length))
+        && EVP_EncryptFinal_ex(cipher, out + length, &outLength)
+        && EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_GCM_GET_TAG, tagSize, tag);
+}
+
+static bool openData(EVP_CIPHER_CTX *cipher, const unsigned char *key,
+                     const unsigned char *nonce,
+                     const unsigned char *aad, int aadLength,
+                     const unsigned char *in, int length,
+                     unsigned char *out, const unsigned char *tag)
+{
+    int outLength = 0;
+    return EVP_DecryptInit_ex(cipher, EVP_aes_256_gcm(), 0, key, nonce)
+        && EVP_DecryptUpdate(cipher, 0, &outLength, aad, aadLength)
+        && (length == 0
+            || EVP_DecryptUpdate(cipher, out, &outLength, in, length))
+        && EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_GCM_SET_TAG, tagSize,
+                               const_cast<unsigned char *>(tag))
+        && EVP_DecryptFinal_ex(cipher, out + length, &outLength) > 0;
+}
+
+static void encodeBlockAad(unsigned char *aad, const EncryptedFile *file,
+                           sqlite3_int64 index, quint32 length)
+{
+    aad[0] = file->kind;
+    qToBigEndian<quint64>(index, aad + 1);
+    qToBigEndian<quint32>(length, aad + 9);
+}
+
+/* Reads a block into file->data, zero-filled after its length. A block past
+ * the end of the file is empty, and so is an altered journal or log block: a
+ * crash interrupted its writing, and the journal ends there */
+static int readBlock(EncryptedFile *file, sqlite3_int64 index, int *length)
+{
+    memset(file->data, 0, blockSize);
+    *length = 0;
+
+    int rc = file->real->pMethods->xRead(file->real, file->stored,
+                                         storedBlockSize,
+                                         index * storedBlockSize);
+    if (rc == SQLITE_IOERR_SHORT_READ)
+        return SQLITE_OK;
+    if (rc != SQLITE_OK)
+        return rc;
+
+    quint32 dataLength = qFromBigEndian<quint32>(file->stored + nonceSize);
+    unsigned char aad[blockAadSize];
+    encodeBlockAad(aad, file, index, dataLength);
+
+    if (dataLength > (quint32)blockSize
+        || !openData(file->cipher, file->key, file->stored, aad, blockAadSize,
+                     file->stored + blockHeaderSize, dataLength, file->data,
+                     file->stored + blockHeaderSize + blockSize)) {
+        memset(file->data, 0, blockSize);
+        if (file->kind != Journal && file->kind != WriteAheadLog) {
+            BLAME() << "Block" << index << "of the database is altered.";
+            return SQLITE_IOERR_READ;
+        }
+        return SQLITE_OK;
+    }
+
+    *length = dataLength;
+    return SQLITE_OK;
+}
+
+/* Writes the first length bytes of file->data as the block */
+static int writeBlock(EncryptedFile *file, sqlite3_int64 index, int length)
+{
+    unsigned char aad[blockAadSize];
+    encodeBlockAad(aad, file, index, length);
+
+    memset(file->stored + blockHeaderSize + length, 0, blockSize - length);
+    qToBigEndian<quint32>(length, file->stored + nonceSize);
+    if (RAND_bytes(file->stored, nonceSize) != 1
+        || !sealData(file->cipher, file->key, file->stored, aad, blockAadSize,
+                     file->data, length, file->stored + blockHeaderSize,
+                     file->stored + blockHeaderSize + blockSize)) {
+        BLAME() << "Cannot encrypt block" << index;
+        return SQLITE_IOERR_WRITE;
+    }
+
+    return file->real->pMethods->xWrite(file->real, file->stored,
+                                        storedBlockSize,
+                                        index * storedBlockSize);
+}
+
+/* The size of the data: the full blocks and the length of the last one */
+static int dataSize(EncryptedFile *file, sqlite3_int64 *size)
+{
+    *size = 0;
+
+    sqlite3_int64 storedSize = 0;
+    int rc = file->real->pMethods->xFileSize(file->real, &storedSize);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    sqlite3_int64 blocks = storedSize / storedBlockSize;
+    if (blocks == 0)
+        return SQLITE_OK;
+
+    unsigned char header[blockHeaderSize];
+    rc = file->real->pMethods->xRead(file->real, header, blockHeaderSize,
+                                     (blocks - 1) * storedBlockSize);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    quint32 length = qFromBigEndian<quint32>(header + nonceSize);
+    *size = (blocks - 1) * blockSize + qMin(length, (quint32)blockSize);
+    return SQLITE_OK;
+}
+
+static int encryptedClose(sqlite3_file *pFile)
+{
+    EncryptedFile *file = (EncryptedFile *)pFile;
+
+    int rc = SQLITE_OK;
+    if (file->real->pMethods != 0)
+        rc = file->real->pMethods->xClose(file->real);
+
+    if (file->cipher != 0)
+        EVP_CIPHER_CTX_free(file->cipher);
+    if (file->data != 0)
+        OPENSSL_cleanse(file->data, blockSize);
+    OPENSSL_cleanse(file->key, keySize);
+    sqlite3_free(file->stored);
+    sqlite3_free(file->data);
+    return rc;
+}
+
+static int encryptedRead(sqlite3_file *pFile, void *buffer, int amount,
+                         sqlite3_int64 offset)
+{
+    EncryptedFile *file = (EncryptedFile *)pFile;
+    unsigned char *out = (unsigned char *)buffer;
+
+    sqlite3_int64 size = 0;
+    int rc = dataSize(file, &size);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    int done = 0;
+    while (done < amount) {
+        sqlite3_int64 position = offset + done;
+        if (position >= size) {
+            memset(out + done, 0, amount - done);
+            break;
+        }
+
+        int length = 0;
+        rc = readBlock(file, position / blockSize, &length);
+        if (rc != SQLITE_OK)
+            return rc;
+
+        int start = position % blockSize;
+        int count = qMin(blockSize - start, amount - done);
+        memcpy(out + done, file->data + start, count);
+        done += count;
+    }
+
+    return (offset + amount > size) ? SQLITE_IOERR_SHORT_READ : SQLITE_OK;
+}
+
+static int encryptedWrite(sqlite3_file *pFile, const void *buffer, int amount,
+                          sqlite3_int64 offset)
+{
+    EncryptedFile *file = (EncryptedFile *)pFile;
+    const unsigned char *in = (const unsigned char *)buffer;
+
+    sqlite3_int64 size = 0;
+    int rc = dataSize(file, &size);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    /* Writing past the end of the file fills the gap with zeros */
+    sqlite3_int64 end = offset + amount;
+    for (sqlite3_int64 index = qMin(offset, size) / blockSize;
+         index * blockSize < end; index++) {
+        sqlite3_int64 blockStart = index * blockSize;
+        sqlite3_int64 start = qMax(offset, blockStart) - blockStart;
+        sqlite3_int64 stop = qMin(end, blockStart + blockSize) - blockStart;
+
+        int length = 0;
+        if (start > 0 || stop < blockSize) {
+            rc = readBlock(file, index, &length);
+            if (rc != SQLITE_OK)
+                return rc;
+        }
+
+        if (start < stop) {
+            memcpy(file->data + start, in + (blockStart + start - offset),
+                   stop - start);
+            length = qMax((sqlite3_int64)length, stop);
+        } else {
+            length = blockSize;
+        }
+
+        rc = writeBlock(file, index, length);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    return SQLITE_OK;
+}
+
+static int encryptedTruncate(sqlite3_file *pFile, sqlite3_int64 size)
+{
+    EncryptedFile *file = (EncryptedFile *)pFile;
+
+    sqlite3_int64 currentSize = 0;
+    int rc = dataSize(file, &currentSize);
+    if (rc != SQLITE_OK || size >= currentSize)
+        return rc;
+
+    sqlite3_int64 blocks = size / blockSize;
+    int remainder = size % blockSize;
+    if (remainder > 0) {
+        int length = 0;
+        rc = readBlock(file, blocks, &length);
+        if (rc != SQLITE_OK)
+            return rc;
+
+        memset(file->data + remainder, 0, blockSize - remainder);
+        rc = writeBlock(file, blocks, remainder);
+        if (rc != SQLITE_OK)
+            return rc;
+        blocks++;
+    }
+
+    return file->real->pMethods->xTruncate(file->real,
+                                           blocks * storedBlockSize);
+}
+
+static int encryptedSync(sqlite3_file *pFile, int flags)
+{
+    EncryptedFile *file = (EncryptedFile *)pFile;
+    return file->real->pMethods->xSync(file->real, flags);
+}
+
+static int encryptedFileSize(sqlite3_file *pFile, sqlite3_int64 *size)
+{
+    return dataSize((EncryptedFile *)pFile, size);
+}
+
+static int encryptedLock(sqlite3_file *pFile, int lock)
+{
+    EncryptedFile *file = (EncryptedFile *)pFile;
+    return file->real->pMethods->xLock(file->real, lock);
+}
+
+static int encryptedUnlock(sqlite3_file *pFile, int lock)
+{
+    EncryptedFile *file = (EncryptedFile *)pFile;
+    return file->real->pMethods->xUnlock(file->real, lock);
+}
+
+static int encryptedCheckReservedLock(sqlite3_file *pFile, int *result)
+{
+    EncryptedFile *file = (EncryptedFile *)pFile;
+    return file->real->pMethods->xCheckReservedLock(file->real, result);
+}
+
+static int encryptedFileControl(sqlite3_file *pFile, int op, void *arg)
+{
+    EncryptedFile *file = (EncryptedFile *)pFile;
+
+    /* The sizes are the ones of the data, not of the stored blocks */
+#ifdef SQLITE_FCNTL_SIZE_HINT
+    if (op == SQLITE_FCNTL_SIZE_HINT)
+        return SQLITE_OK;
+#endif
+#ifdef SQLITE_FCNTL_CHUNK_SIZE
+    if (op == SQLITE_FCNTL_CHUNK_SIZE)
+        return SQLITE_OK;
+#endif
+    /* Tells the connections that their file is encrypted */
+#ifdef SQLITE_FCNTL_VFSNAME
+    if (op == SQLITE_FCNTL_VFSNAME) {
+        *(char **)arg = sqlite3_mprintf("%s", vfsName);
+        return SQLITE_OK;
+    }
+#endif
+
+    return file->real->pMethods->xFileControl(file->real, op, arg);
+}
+
+/* The new databases get pages of the block size, so that a page is
+ * written as one block */
+static int encryptedSectorSize(sqlite3_file *)
+{
+    return blockSize;
+}
+
+static int encryptedDeviceCharacteristics(sqlite3_file *)
+{
+    return 0;
+}
+
+static int encryptedShmMap(sqlite3_file *pFile, int region, int regionSize,
+                           int extend, void volatile **memory)
+{
+    EncryptedFile *file = (EncryptedFile *)pFile;
+    return file->real->pMethods->xShmMap(file->real, region, regionSize,
+                                         extend, memory);
+}
+
+static int encryptedShmLock(sqlite3_file *pFile, int offset, int n, int flags)
+{
+    EncryptedFile *file = (EncryptedFile *)pFile;
+    return file->real->pMethods->xShmLock(file->real, offset, n, flags);
+}
+
+static void encryptedShmBarrier(sqlite3_file *pFile)
+{
+    EncryptedFile *file = (EncryptedFile *)pFile;
+    file->real->pMethods->xShmBarrier(file->real);
+}
+
+static int encryptedShmUnmap(sqlite3_file *pFile, int deleteFlag)
+{
+    EncryptedFile *file = (EncryptedFile *)pFile;
+    return file->real->pMethods->xShmUnmap(file->real, deleteFlag);
+}
+
+/* Version 2: no memory mapping, which would bypass the decryption */
+static const sqlite3_io_methods encryptedMethods = {
+    2,
+    encryptedClose,
+    encryptedRead,
+    encryptedWrite,
+    encryptedTruncate,
+    encryptedSync,
+    encryptedFileSize,
+    encryptedLock,
+    encryptedUnlock,
+    encryptedCheckReservedLock,
+    encryptedFileControl,
+    encryptedSectorSize,
+    encryptedDeviceCharacteristics,
+    encryptedShmMap,
+    encryptedShmLock,
+    encryptedShmBarrier,
+    encryptedShmUnmap
+};
+
+static QByteArray databaseKey(const char *fileName, int flags)
+{
+    if (fileName == 0
+        || !(flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_MAIN_JOURNAL
+                      | SQLITE_OPEN_WAL)))
+        return QByteArray();
+
+    QString path = QDir::cleanPath(QFileInfo(QString::fromUtf8(fileName))
+                                   .absoluteFilePath());
+
+    QMutexLocker locker(&vfsMutex);
+    QMap<QString, QByteArray>::const_iterator i;
+    for (i = databaseKeys.constBegin(); i != databaseKeys.constEnd(); ++i) {
+        if (path == i.key()
+            || path == i.key() + QLatin1String("-journal")
+            || path == i.key() + QLatin1String("-wal"))
+            return i.value();
+    }
+    return QByteArray();
+}
+
+static int vfsOpen(sqlite3_vfs *, const char *name, sqlite3_file *pFile,
+                   int flags, int *outFlags)
+{
+    EncryptedFile *file = (EncryptedFile *)pFile;
+    memset(file, 0, encryptedVfs.szOsFile);
+    file->real = (sqlite3_file *)(file + 1);
+
+    /* The temporary files are deleted when closed: a new key is enough */
+    bool isTemporary = flags & (SQLITE_OPEN_TEMP_DB | SQLITE_OPEN_TEMP_JOURNAL
+                                | SQLITE_OPEN_SUBJOURNAL
+                                | SQLITE_OPEN_TRANSIENT_DB);
+    QByteArray key = isTemporary ?
+        EncryptedVfs::generateKey() : databaseKey(name, flags);
+
+    /* A file of a database with no key would be stored in clear */
+    if (key.isEmpty()) {
+        BLAME() << "No key to open" << name;
+        return SQLITE_CANTOPEN;
+    }
+
+    int rc = defaultVfs->xOpen(defaultVfs, name, file->real, flags, outFlags);
+    if (rc != SQLITE_OK) {
+        if (file->real->pMethods != 0)
+            file->real->pMethods->xClose(file->real);
+        return rc;
+    }
+
+    if (isTemporary)
+        file->kind = TemporaryFile;
+    else if (flags & SQLITE_OPEN_MAIN_JOURNAL)
+        file->kind = Journal;
+    else if (flags & SQLITE_OPEN_WAL)
+        file->kind = WriteAheadLog;
+    else
+        file->kind = MainDatabase;
+    memcpy(file->key, key.constData(), keySize);
+    OPENSSL_cleanse(key.data(), keySize);
+    file->cipher = EVP_CIPHER_CTX_new();
+    file->stored = (unsigned char *)sqlite3_malloc(storedBlockSize);
+    file->data = (unsigned char *)sqlite3_malloc(blockSize);
+    if (file->cipher == 0 || file->stored == 0 || file->data == 0) {
+        encryptedClose(pFile);
+        return SQLITE_NOMEM;
+    }
+
+    file->base.pMethods = &encryptedMethods;
+    return SQLITE_OK;
+}
+
+static int vfsDelete(sqlite3_vfs *, const char *name, int syncDir)
+{
+    return defaultVfs->xDelete(defaultVfs, name, syncDir);
+}
+
+static int vfsAccess(sqlite3_vfs *, const char *name, int flags, int *result)
+{
+    return defaultVfs->xAccess(defaultVfs, name, flags, result);
+}
+
+static int vfsFullPathname(sqlite3_vfs *, const char *name, int size,
+                           char *out)
+{
+    return defaultVfs->xFullPathname(defaultVfs, name, size, out);
+}
+
+static void *vfsDlOpen(sqlite3_vfs *, const char *fileName)
+{
+    return defaultVfs->xDlOpen(defaultVfs, fileName);
+}
+
+static void vfsDlError(sqlite3_vfs *, int size, char *message)
+{
+    defaultVfs->xDlError(defaultVfs, size, message);
+}
+
+static void (*vfsDlSym(sqlite3_vfs *, void *handle, const char *symbol))(void)
+{
+    return defaultVfs->xDlSym(defaultVfs, handle, symbol);
+}
+
+static void vfsDlClose(sqlite3_vfs *, void *handle)
+{
+    defaultVfs->xDlClose(defaultVfs, handle);
+}
+
+static int vfsRandomness(sqlite3_vfs *, int size, char *out)
+{
+    return defaultVfs->xRandomness(defaultVfs, size, out);
+}
+
+static int vfsSleep(sqlite3_vfs *, int microseconds)
+{
+    return defaultVfs->xSleep(defaultVfs, microseconds);
+}
+
+static int vfsCurrentTime(sqlite3_vfs *, double *time)
+{
+    return defaultVfs->xCurrentTime(defaultVfs, time);
+}
+
+static int vfsGetLastError(sqlite3_vfs *, int size, char *message)
+{
+    return defaultVfs->xGetLastError(defaultVfs, size, message);
+}
+
+/* To be called with the mutex locked */
+static bool registerVfs()
+{
+    if (defaultVfs != 0)
+        return true;
+
+    sqlite3_vfs *vfs = sqlite3_vfs_find(0);
+    if (vfs == 0) {
+        BLAME() << "No default SQLite VFS.";
+        return false;
+    }
+
+    memset(&encryptedVfs, 0, sizeof(sqlite3_vfs));
+    encryptedVfs.iVersion = 1;
+    encryptedVfs.szOsFile = sizeof(EncryptedFile) + vfs->szOsFile;
+    encryptedVfs.mxPathname = vfs->mxPathname;
+    encryptedVfs.zName = vfsName;
+    encryptedVfs.xOpen = vfsOpen;
+    encryptedVfs.xDelete = vfsDelete;
+    encryptedVfs.xAccess = vfsAccess;
+    encryptedVfs.xFullPathname = vfsFullPathname;
+    encryptedVfs.xDlOpen = vfsDlOpen;
+    encryptedVfs.xDlError = vfsDlError;
+    encryptedVfs.xDlSym = vfsDlSym;
+    encryptedVfs.xDlClose = vfsDlClose;
+    encryptedVfs.xRandomness = vfsRandomness;
+    encryptedVfs.xSleep = vfsSleep;
+    encryptedVfs.xCurrentTime = vfsCurrentTime;
+    encryptedVfs.xGetLastError = vfsGetLastError;
+
+    defaultVfs = vfs;
+    if (sqlite3_vfs_register(&encryptedVfs, 0) != SQLITE_OK) {
+        BLAME() << "Cannot register the encrypting SQLite VFS.";
+        defaultVfs = 0;
+        return false;
+    }
+    return true;
+}
+
+bool EncryptedVfs::initialize()
+{
+    /* SQLite can only be configured before it is initialized, unless it
+     * was built with the URI file names enabled */
+    if (sqlite3_config(SQLITE_CONFIG_URI, 1) != SQLITE_OK
+        && !sqlite3_compileoption_used("USE_URI=1")) {
+        qCritical() << "Cannot enable the SQLite URI file names: "
+            "SQLite is already in use.";
+        return false;
+    }
+
+    QMutexLocker locker(&vfsMutex);
+    return registerVfs();
+}
+
+const char *EncryptedVfs::name()
+{
+    return vfsName;
+}
+
+bool EncryptedVfs::registerDatabase(const QString &path,
+                                    const QByteArray &key)
+{
+    if (key.size() != keySize) {
+        BLAME() << "Invalid database key.";
+        return false;
+    }
+
+    QMutexLocker locker(&vfsMutex);
+    if (!registerVfs())
+        return false;
+
+    TRACE() << path;
+    databaseKeys.insert(QDir::cleanPath(QFileInfo(path).absoluteFilePath()),
+                        key);
+    return true;
+}
+
+void EncryptedVfs::unregisterDatabase(const QString &path)
+{
+    TRACE() << path;
+    QMutexLocker locker(&vfsMutex);
+    databaseKeys.remove(QDir::cleanPath(QFileInfo(path).absoluteFilePath()));
+}
+
+QByteArray EncryptedVfs::generateKey()
+{
+    QByteArray key(keySize, 0);
+    if (RAND_bytes((unsigned char *)key.data(), keySize) != 1) {
+        BLAME() << "Cannot generate a key.";
+        return QByteArray();
+    }
+    return key;
+}
+
+static bool deriveKey(const QByteArray &passphrase, const unsigned char *salt,
+                      unsigned char *derivedKey)
+{
+    return PKCS5_PBKDF2_HMAC(passphrase.constData(), passphrase.size(),
+                             salt, saltSize, kdfIterations, EVP_sha256(),
+                             keySize, derivedKey) == 1;
+}
+
+/* A wrapped key is made of the salt of the derived key, the nonce, the
+ * encrypted key and the authentication tag */
+static const int wrappedKeySize = saltSize + nonceSize + keySize + tagSize;
+
+QByteArray EncryptedVfs::wrapKey(const QByteArray &key,
+                                 const QByteArray &passphrase)
+{
+    if (key.size() != keySize)
+        return QByteArray();
+
+    QByteArray wrappedKey(wrappedKeySize, 0);
+    unsigned char *salt = (unsigned char *)wrappedKey.data();
+    unsigned char *nonce = salt + saltSize;
+    unsigned char derivedKey[keySize];
+
+    EVP_CIPHER_CTX *cipher = EVP_CIPHER_CTX_new();
+    bool isOk = cipher != 0
+        && RAND_bytes(salt, saltSize + nonceSize) == 1
+        && deriveKey(passphrase, salt, derivedKey)
+        && sealData(cipher, derivedKey, nonce,
+                    (const unsigned char *)wrappedKeyLabel,
+                    sizeof(wrappedKeyLabel) - 1,
+                    (const unsigned char *)key.constData(), keySize,
+                    nonce + nonceSize, nonce + nonceSize + keySize);
+    OPENSSL_cleanse(derivedKey, keySize);
+    if (cipher != 0)
+        EVP_CIPHER_CTX_free(cipher);
+
+    if (!isOk) {
+        BLAME() << "Cannot wrap the key.";
+        return QByteArray();
+    }
+    return wrappedKey;
+}
+
+QByteArray EncryptedVfs::unwrapKey(const QByteArray &wrappedKey,
+                                   const QByteArray &passphrase)
+{
+    if (wrappedKey.size() != wrappedKeySize)
+        return QByteArray();
+
+    const unsigned char *salt = (const unsigned char *)wrappedKey.constData();
+    const unsigned char *nonce = salt + saltSize;
+    unsigned char derivedKey[keySize];
+    QByteArray key(keySize, 0);
+
+    EVP_CIPHER_CTX *cipher = EVP_CIPHER_CTX_new();
+    bool isOk = cipher != 0
+        && deriveKey(passphrase, salt, derivedKey)
+        && openData(cipher, derivedKey, nonce,
+                    (const unsigned char *)wrappedKeyLabel,
+                    sizeof(wrappedKeyLabel) - 1,
+                    nonce + nonceSize, keySize, (unsigned char *)key.data(),
+                    nonce + nonceSize + keySize);
+    OPENSSL_cleanse(derivedKey, keySize);
+    if (cipher != 0)
+        EVP_CIPHER_CTX_free(cipher);
+
+    if (!isOk) {
+        OPENSSL_cleanse(key.data(), keySize);
+        return QByteArray();
+    }
+    return key;
+}
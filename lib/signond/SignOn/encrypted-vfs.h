@@ -0,0 +1,88 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2011 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef SIGNON_ENCRYPTED_VFS_H
+#define SIGNON_ENCRYPTED_VFS_H
+
+#include <QByteArray>
+#include <QString>
+
+namespace SignOn {
+
+/*!
+ * @class EncryptedVfs
+ * SQLite VFS encrypting the files of the registered databases, their
+ * journals included. A file is stored by blocks of 4096 bytes, each one
+ * sealed with AES-256-GCM under its own random nonce, so that an altered or
+ * misplaced block is detected when it is read.
+ * The VFS is not the default one: the databases are opened with its name(),
+ * and it refuses to open the files of the databases it has no key for. The
+ * temporary files are encrypted with a key of their own.
+ */
+class EncryptedVfs
+{
+public:
+    /*!
+     * Registers the VFS and enables the URI file names, which let a database
+     * opened by the Qt SQLite driver select the VFS with "?vfs=": to be
+     * called before SQLite is used.
+     * @returns false if the URI file names can't be enabled.
+     */
+    static bool initialize();
+
+    /*!
+     * @returns the name of the VFS.
+     */
+    static const char *name();
+
+    /*!
+     * Encrypts the database at the given path with the given key, as long
+     * as it is registered: the database must be opened with the VFS after
+     * this call and closed before unregisterDatabase().
+     * @param key the database key, see generateKey().
+     */
+    static bool registerDatabase(const QString &path, const QByteArray &key);
+    static void unregisterDatabase(const QString &path);
+
+    /*!
+     * @returns a new random database key, or an empty array on failure.
+     */
+    static QByteArray generateKey();
+
+    /*!
+     * Encrypts a database key with a key derived from the passphrase.
+     * @returns the wrapped key, or an empty array on failure.
+     */
+    static QByteArray wrapKey(const QByteArray &key,
+                              const QByteArray &passphrase);
+
+    /*!
+     * @returns the key wrapped by wrapKey() with the same passphrase, or an
+     * empty array if the passphrase is not the one.
+     */
+    static QByteArray unwrapKey(const QByteArray &wrappedKey,
+                                const QByteArray &passphrase);
+};
+
+} //namespace SignOn
+
+#endif // SIGNON_ENCRYPTED_VFS_H
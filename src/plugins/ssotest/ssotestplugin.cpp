@@ -22,6 +22,10 @@
 
 #include <QMutex>
 #include <QMutexLocker>
+#include <QEventLoop>
+#include <QTimer>
+#include <unistd.h>
+
 #include "ssotestplugin.h"
 
 #include "SignOn/signonplugincommon.h"
@@ -32,6 +36,8 @@ namespace SsoTestPluginNS {
 
     static QMutex mutex;
     static bool is_canceled = false;
+    static QEventLoop *delayLoop = 0;
+    static int runs = 0;
 
     SsoTestPlugin::SsoTestPlugin(QObject *parent) : AuthPluginInterface(parent)
     {
@@ -56,6 +62,8 @@ namespace SsoTestPluginNS {
         TRACE();
         QMutexLocker locker(&mutex);
         is_canceled = true;
+        if (delayLoop != 0)
+            delayLoop->quit();
     }
     /*
      * dummy plugin is used for testing purposes only
@@ -73,6 +81,17 @@ namespace SsoTestPluginNS {
 
         TRACE();
 
+        /* Blocks the call for the given time (ms) in an event loop of its
+         * own, like the plugins waiting for the network; a cancel ends it */
+        int delay = inData.getProperty(QLatin1String("Delay")).toInt();
+        if (delay > 0) {
+            QEventLoop loop;
+            delayLoop = &loop;
+            QTimer::singleShot(delay, &loop, SLOT(quit()));
+            loop.exec();
+            delayLoop = 0;
+        }
+
         QMetaObject::invokeMethod(this,
                                   "execProcess",
                                   Qt::QueuedConnection,
@@ -82,7 +101,15 @@ namespace SsoTestPluginNS {
 
     void SsoTestPlugin::execProcess(const SignOn::SessionData &inData, const QString &mechanism)
     {
-        SignOn::SessionData outData(inData);
+        /* The process id and the number of runs tell the tests which plugin
+         * process replied, and whether it actually processed the request */
+        QVariantMap outMap;
+        foreach (QString key, inData.propertyNames())
+            outMap.insert(key, inData.getProperty(key));
+        outMap.insert(QLatin1String("ProcessId"), (int)getpid());
+        outMap.insert(QLatin1String("Run"), ++runs);
+
+        SignOn::SessionData outData(outMap);
         outData.setRealm("testRealm_after_test");
 
         for (int i = 0; i < 10; i++)
@@ -99,6 +126,13 @@ namespace SsoTestPluginNS {
             return;
         }
 
+        /* The error the tests ask for */
+        int errorType = inData.getProperty(QLatin1String("Error")).toInt();
+        if (errorType > 0) {
+            emit error(Error(errorType, QLatin1String("Error requested by the test")));
+            return;
+        }
+
         if (mechanism == QLatin1String("BLOB")) {
             emit result(outData);
             return;
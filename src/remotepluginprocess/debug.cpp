@@ -24,6 +24,8 @@
 #include <QString>
 #include <QtGlobal>
 
+#include "SignOn/commondebug.h"
+
 int debugLevel = -1;
 
 void debugInit()
@@ -32,5 +34,6 @@ void debugInit()
 
     QString ssoDebug(qgetenv("SSO_DEBUG"));
     debugLevel = ssoDebug.toInt();
+    SignOn::setCommonLoggingLevel(debugLevel);
 }
 
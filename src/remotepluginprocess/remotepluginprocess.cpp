@@ -26,6 +26,8 @@
 #include <QBuffer>
 #include <QDataStream>
 
+#include <unistd.h>
+
 #ifdef HAVE_GCONF
 #include <gq/GConfItem>
 #endif
@@ -34,18 +36,14 @@
 #include "remotepluginprocess.h"
 
 // signon-plugins-common
-#include "SignOn/blobiohandler.h"
+#include "SignOn/ipcchannel.h"
 #include "SignOn/ipc.h"
 
 #include "SignOnCrypto/Encryptor"
 using namespace SignOn;
 
-static bool isProcessing = false;
-
 namespace RemotePluginProcessNS {
 
-    static CancelEventThread *cancelThread = NULL;
-
     /* ---------------------- RemotePluginProcess ---------------------- */
 
     RemotePluginProcess::RemotePluginProcess(QObject *parent) : QObject(parent)
@@ -53,6 +51,10 @@ namespace RemotePluginProcessNS {
         m_plugin = NULL;
         m_readnotifier = NULL;
         m_errnotifier = NULL;
+        m_channel = NULL;
+        m_maxConcurrentRequests = 1;
+        m_dispatchedRequestId = 0;
+        m_callingPlugin = false;
 
         qRegisterMetaType<SignOn::SessionData>("SignOn::SessionData");
         qRegisterMetaType<QString>("QString");
@@ -63,12 +65,6 @@ namespace RemotePluginProcessNS {
         delete m_plugin;
         delete m_readnotifier;
         delete m_errnotifier;
-
-        if (cancelThread) {
-            cancelThread->quit();
-            cancelThread->wait();
-            delete cancelThread;
-        }
     }
 
     RemotePluginProcess* RemotePluginProcess::createRemotePluginProcess(QString &type, QObject *parent)
@@ -134,8 +130,31 @@ namespace RemotePluginProcessNS {
         connect(m_plugin, SIGNAL(statusChanged(const AuthPluginState, const QString&)),
                   this, SLOT(statusChanged(const AuthPluginState, const QString&)));
 
+        connect(m_plugin, SIGNAL(requestResult(quint32, const SignOn::SessionData&)),
+                  this, SLOT(requestResult(quint32, const SignOn::SessionData&)));
+
+        connect(m_plugin, SIGNAL(requestStore(quint32, const SignOn::SessionData&)),
+                  this, SLOT(requestStore(quint32, const SignOn::SessionData&)));
+
+        connect(m_plugin, SIGNAL(requestError(quint32, const SignOn::Error &)),
+                  this, SLOT(requestError(quint32, const SignOn::Error &)));
+
+        connect(m_plugin, SIGNAL(requestUserActionRequired(quint32, const SignOn::UiSessionData&)),
+                  this, SLOT(requestUserActionRequired(quint32, const SignOn::UiSessionData&)));
+
+        connect(m_plugin, SIGNAL(requestRefreshed(quint32, const SignOn::UiSessionData&)),
+                  this, SLOT(requestRefreshed(quint32, const SignOn::UiSessionData&)));
+
+        connect(m_plugin, SIGNAL(requestStatusChanged(quint32, const AuthPluginState, const QString&)),
+                  this, SLOT(requestStatusChanged(quint32, const AuthPluginState, const QString&)));
+
         m_plugin->setParent(this);
 
+        int maxConcurrentRequests =
+            m_plugin->property(SIGNON_PLUGIN_MAX_CONCURRENT_REQUESTS).toInt();
+        if (maxConcurrentRequests > 1)
+            m_maxConcurrentRequests = maxConcurrentRequests;
+
         TRACE() << "plugin is fully initialized";
         return true;
     }
@@ -144,8 +163,9 @@ namespace RemotePluginProcessNS {
     {
         TRACE();
 
-        m_inFile.open(STDIN_FILENO, QIODevice::ReadOnly);
-        m_outFile.open(STDOUT_FILENO, QIODevice::WriteOnly);
+        /* Unbuffered, as the frames are read into the channel's own buffer */
+        m_inFile.open(STDIN_FILENO, QIODevice::ReadOnly | QIODevice::Unbuffered);
+        m_outFile.open(STDOUT_FILENO, QIODevice::WriteOnly | QIODevice::Unbuffered);
 
         m_readnotifier = new QSocketNotifier(STDIN_FILENO, QSocketNotifier::Read);
         m_errnotifier = new QSocketNotifier(STDIN_FILENO, QSocketNotifier::Exception);
@@ -153,134 +173,169 @@ namespace RemotePluginProcessNS {
         connect(m_readnotifier, SIGNAL(activated(int)), this, SLOT(startTask()));
         connect(m_errnotifier, SIGNAL(activated(int)), this, SIGNAL(processStopped()));
 
-        if (!cancelThread)
-            cancelThread = new CancelEventThread(m_plugin);
-
-        TRACE() << "cancel thread created";
+        m_channel = new IpcChannel(&m_inFile, &m_outFile, this);
+        /* The plugin might process the events while it is called: the
+         * frames read then are handled by frameReceived() */
+        m_channel->setNestedReadsEnabled(true);
 
-        m_blobIOHandler = new BlobIOHandler(&m_inFile, &m_outFile, this);
-
-        connect(m_blobIOHandler,
-                SIGNAL(dataReceived(const QVariantMap &)),
+        connect(m_channel,
+                SIGNAL(frameReceived(quint16, quint32, const QByteArray&)),
                 this,
-                SLOT(sessionDataReceived(const QVariantMap &)));
-
-        connect(m_blobIOHandler,
-                SIGNAL(error()),
-                this,
-                SLOT(blobIOError()));
-
-        m_blobIOHandler->setReadChannelSocketNotifier(m_readnotifier);
+                SLOT(frameReceived(quint16, quint32, const QByteArray&)));
+
+        connect(m_channel, SIGNAL(error()), this, SLOT(channelError()));
+
+        /* The daemon gives the descriptor of the memory it shares with us */
+        QByteArray sharedMemoryFd = qgetenv(SIGNON_IPC_SHARED_MEMORY_FD_ENV);
+        if (!sharedMemoryFd.isEmpty()) {
+            bool ok = false;
+            int fd = sharedMemoryFd.toInt(&ok);
+            if (ok && fd > STDERR_FILENO) {
+                if (m_channel->attachSharedMemory(fd, false))
+                    m_channel->setSharedMemoryEnabled(true);
+                ::close(fd);
+            }
+        }
 
         return true;
     }
 
-    void RemotePluginProcess::blobIOError()
+    void RemotePluginProcess::channelError()
     {
         TRACE();
-        error(
-            Error(Error::InternalServer,
-            QLatin1String("Failed to I/O session data to/from the signon daemon.")));
-        connect(m_readnotifier, SIGNAL(activated(int)), this, SLOT(startTask()));
+        /* The stream is out of sync with the daemon: nothing else can be
+         * read from it */
+        m_plugin->abort();
+        emit processStopped();
     }
 
-    void RemotePluginProcess::result(const SignOn::SessionData &data)
+    quint32 RemotePluginProcess::implicitRequestId() const
     {
-        TRACE();
-        disableCancelThread();
+        /* The plugin replies while it is called for the request... */
+        if (m_dispatchedRequestId != 0)
+            return m_dispatchedRequestId;
 
-        if (isProcessing) {
+        /* ...or later, which can be only about the request being processed */
+        if (m_requests.count() == 1)
+            return *m_requests.constBegin();
 
-            QDataStream out(&m_outFile);
-            QVariantMap resultDataMap;
+        return 0;
+    }
 
-            foreach(QString key, data.propertyNames())
-                resultDataMap[key] = data.getProperty(key);
+    void RemotePluginProcess::sendSessionData(quint16 opcode,
+                                              quint32 requestId,
+                                              const SessionData &data)
+    {
+        if (!m_requests.contains(requestId)) {
+            BLAME() << "Dropping plugin response" << opcode
+                    << "for unknown request" << requestId;
+            return;
+        }
 
-            out << (quint32)PLUGIN_RESPONSE_RESULT;
+        QVariantMap dataMap;
 
-            m_blobIOHandler->sendData(resultDataMap);
-            m_outFile.flush();
-            isProcessing = false;
-        }
+        foreach(QString key, data.propertyNames())
+            dataMap[key] = data.getProperty(key);
+        dataMap.remove(QLatin1String(SIGNON_PLUGIN_REQUEST_ID));
+
+        QDataStream &out = m_channel->startFrame(opcode, requestId);
+        out << dataMap;
+        m_channel->sendFrame();
     }
 
-    void RemotePluginProcess::store(const SignOn::SessionData &data)
+    void RemotePluginProcess::result(const SignOn::SessionData &data)
     {
-        TRACE();
-        QDataStream out(&m_outFile);
-        QVariantMap storeDataMap;
+        requestResult(implicitRequestId(), data);
+    }
 
-        foreach(QString key, data.propertyNames())
-            storeDataMap[key] = data.getProperty(key);
+    void RemotePluginProcess::requestResult(quint32 requestId,
+                                            const SignOn::SessionData &data)
+    {
+        TRACE() << requestId;
 
-        out << (quint32)PLUGIN_RESPONSE_STORE;
-        m_blobIOHandler->sendData(storeDataMap);
-        m_outFile.flush();
+        sendSessionData(PLUGIN_RESPONSE_RESULT, requestId, data);
+        m_requests.remove(requestId);
+    }
+
+    void RemotePluginProcess::store(const SignOn::SessionData &data)
+    {
+        requestStore(implicitRequestId(), data);
+    }
+
+    void RemotePluginProcess::requestStore(quint32 requestId,
+                                           const SignOn::SessionData &data)
+    {
+        TRACE() << requestId;
+        sendSessionData(PLUGIN_RESPONSE_STORE, requestId, data);
     }
 
     void RemotePluginProcess::error(const SignOn::Error &err)
     {
-        TRACE();
-        disableCancelThread();
+        requestError(implicitRequestId(), err);
+    }
 
-        if (isProcessing) {
-            QDataStream out(&m_outFile);
+    void RemotePluginProcess::requestError(quint32 requestId,
+                                           const SignOn::Error &err)
+    {
+        TRACE() << requestId;
 
-            out << (quint32)PLUGIN_RESPONSE_ERROR;
+        if (m_requests.remove(requestId)) {
+            QDataStream &out =
+                m_channel->startFrame(PLUGIN_RESPONSE_ERROR, requestId);
             out << (quint32)err.type();
             out << err.message();
-            m_outFile.flush();
+            m_channel->sendFrame();
             TRACE() << "error is sent" << err.type() << " " << err.message();
-            isProcessing = false;
+        } else {
+            BLAME() << "Dropping plugin error for unknown request" << requestId;
         }
     }
 
     void RemotePluginProcess::userActionRequired(const SignOn::UiSessionData &data)
     {
-        TRACE();
-        disableCancelThread();
-
-        QDataStream out(&m_outFile);
-        QVariantMap resultDataMap;
+        requestUserActionRequired(implicitRequestId(), data);
+    }
 
-        foreach(QString key, data.propertyNames())
-            resultDataMap[key] = data.getProperty(key);
+    void RemotePluginProcess::requestUserActionRequired(quint32 requestId,
+                                                        const SignOn::UiSessionData &data)
+    {
+        TRACE() << requestId;
 
-        out << (quint32)PLUGIN_RESPONSE_UI;
-        m_blobIOHandler->sendData(resultDataMap);
-        m_outFile.flush();
+        sendSessionData(PLUGIN_RESPONSE_UI, requestId, data);
     }
 
     void RemotePluginProcess::refreshed(const SignOn::UiSessionData &data)
     {
-        TRACE();
-        disableCancelThread();
-
-        QDataStream out(&m_outFile);
-        QVariantMap resultDataMap;
-
-        foreach(QString key, data.propertyNames())
-            resultDataMap[key] = data.getProperty(key);
-
-        m_readnotifier->setEnabled(true);
+        requestRefreshed(implicitRequestId(), data);
+    }
 
-        out << (quint32)PLUGIN_RESPONSE_REFRESHED;
+    void RemotePluginProcess::requestRefreshed(quint32 requestId,
+                                               const SignOn::UiSessionData &data)
+    {
+        TRACE() << requestId;
 
-        m_blobIOHandler->sendData(resultDataMap);
-        m_outFile.flush();
+        sendSessionData(PLUGIN_RESPONSE_REFRESHED, requestId, data);
     }
 
     void RemotePluginProcess::statusChanged(const AuthPluginState state, const QString &message)
     {
-        TRACE();
-        QDataStream out(&m_outFile);
+        requestStatusChanged(implicitRequestId(), state, message);
+    }
+
+    void RemotePluginProcess::requestStatusChanged(quint32 requestId,
+                                                   const AuthPluginState state,
+                                                   const QString &message)
+    {
+        TRACE() << requestId;
+
+        if (!m_requests.contains(requestId))
+            return;
 
-        out << (quint32)PLUGIN_RESPONSE_SIGNAL;
+        QDataStream &out =
+            m_channel->startFrame(PLUGIN_RESPONSE_SIGNAL, requestId);
         out << (quint32)state;
         out << message;
-
-        m_outFile.flush();
+        m_channel->sendFrame();
     }
 
     QString RemotePluginProcess::getPluginName(const QString &type)
@@ -296,164 +351,80 @@ namespace RemotePluginProcessNS {
 
     void RemotePluginProcess::type()
     {
-        QDataStream out(&m_outFile);
+        QDataStream &out = m_channel->startFrame(PLUGIN_RESPONSE_TYPE);
         out << m_plugin->type();
+        m_channel->sendFrame();
     }
 
     void RemotePluginProcess::mechanisms()
     {
-        QDataStream out(&m_outFile);
-        QStringList mechanisms = m_plugin->mechanisms();
-        QVariant mechsVar = mechanisms;
-        out << mechsVar;
+        QDataStream &out = m_channel->startFrame(PLUGIN_RESPONSE_MECHANISMS);
+        out << m_plugin->mechanisms() << (quint32)m_maxConcurrentRequests
+            << m_channel->hasSharedMemory();
+        m_channel->sendFrame();
     }
 
-    void RemotePluginProcess::process()
-    {
-        isProcessing = true;
-
-        QDataStream in(&m_inFile);
-        in >> m_currentMechanism;
-
-        int processBlobSize = -1;
-        in >> processBlobSize;
-
-        disconnect(m_readnotifier, SIGNAL(activated(int)), this, SLOT(startTask()));
-
-        m_currentOperation = PLUGIN_OP_PROCESS;
-        m_blobIOHandler->receiveData(processBlobSize);
-    }
-
-    void RemotePluginProcess::userActionFinished()
-    {
-        QDataStream in(&m_inFile);
-        int processBlobSize = -1;
-        in >> processBlobSize;
-
-        disconnect(m_readnotifier, SIGNAL(activated(int)), this, SLOT(startTask()));
-
-        m_currentOperation = PLUGIN_OP_PROCESS_UI;
-        m_blobIOHandler->receiveData(processBlobSize);
-    }
-
-    void RemotePluginProcess::refresh()
-    {
-        QDataStream in(&m_inFile);
-        int processBlobSize = -1;
-        in >> processBlobSize;
-
-        disconnect(m_readnotifier, SIGNAL(activated(int)), this, SLOT(startTask()));
-
-        m_currentOperation = PLUGIN_OP_REFRESH;
-        m_blobIOHandler->receiveData(processBlobSize);
-    }
-
-    void RemotePluginProcess::sessionDataReceived(const QVariantMap &sessionDataMap)
+    void RemotePluginProcess::startTask()
     {
-        enableCancelThread();
-        TRACE() << "The cancel thread is started";
-
-        if (m_currentOperation == PLUGIN_OP_PROCESS) {
-            SessionData inData(sessionDataMap);
-            m_plugin->process(inData, m_currentMechanism);
-            m_currentMechanism.clear();
-
-        } else if(m_currentOperation == PLUGIN_OP_PROCESS_UI) {
-            UiSessionData inData(sessionDataMap);
-            m_plugin->userActionFinished(inData);
-
-        } else if(m_currentOperation == PLUGIN_OP_REFRESH) {
-            UiSessionData inData(sessionDataMap);
-            m_plugin->refresh(inData);
-
-        } else {
-            TRACE() << "Wrong operation code.";
-            error(Error(Error::InternalServer,
-                        QLatin1String("Plugin process - invalid operation code.")));
+        /* The cancel requests are read here too, while the plugin is
+         * processing, even in an event loop of its own: the plugin gets them
+         * from the event loop.
+         * One frame per activation, as stdin blocks: the notifier fires again
+         * while more data is available, whereas reading on would block the
+         * event loop until the daemon sends another frame. */
+        if (m_channel->readFrames(1) == 0) {
+            TRACE() << "stdin closed";
+            m_plugin->abort();
+            emit processStopped();
         }
-
-        m_currentOperation = PLUGIN_OP_STOP;
-        connect(m_readnotifier, SIGNAL(activated(int)), this, SLOT(startTask()));
     }
 
-    void RemotePluginProcess::enableCancelThread()
+    void RemotePluginProcess::frameReceived(quint16 opcode, quint32 requestId,
+                                            const QByteArray &payload)
     {
-        TRACE();
-
-        if (!cancelThread)
-            cancelThread = new CancelEventThread(m_plugin);
-
-        QEventLoop loop;
-        connect(cancelThread,
-                SIGNAL(started()),
-                &loop,
-                SLOT(quit()));
-
-        m_readnotifier->setEnabled(false);
-        QTimer::singleShot(0.5*1000, &loop, SLOT(quit()));
-        cancelThread->start();
-        loop.exec();
-        QThread::yieldCurrentThread();
-    }
-
-    void RemotePluginProcess::disableCancelThread()
-    {
-        TRACE();
-
-        if (!cancelThread || !cancelThread->isRunning())
+        /* A cancel can't wait for the plugin call in progress, which might
+         * well be waiting for it; the other operations are not nested in a
+         * plugin call, but handled in order once it returns, as well as the
+         * cancels of the requests still queued */
+        if (m_callingPlugin
+            && (opcode != PLUGIN_OP_CANCEL || !m_requests.contains(requestId))) {
+            PendingFrame frame;
+            frame.opcode = opcode;
+            frame.requestId = requestId;
+            frame.payload = QByteArray(payload.constData(), payload.size());
+            m_pendingFrames.enqueue(frame);
             return;
-
-        /**
-         * Sort of terrible workaround which
-         * I do not know how to fix: the thread
-         * could hang up during wait up without
-         * these loops and sleeps
-         */
-        cancelThread->quit();
-
-        TRACE() << "Before the isFinished loop ";
-
-        int i = 0;
-        while (!cancelThread->isFinished()) {
-            cancelThread->quit();
-            TRACE() << "Internal iteration " << i++;
-            usleep(0.005 * 1000000);
         }
 
-        if (!cancelThread->wait(500)) {
-            BLAME() << "Cannot disable cancel thread";
-            int i;
-            for (i = 0; i < 5; i++) {
-                usleep(0.01 * 1000000);
-                if (cancelThread->wait(500))
-                    break;
-            }
+        dispatchFrame(opcode, requestId, payload);
 
-            if (i == 5) {
-                BLAME() << "Cannot do anything with cancel thread";
-                cancelThread->terminate();
-                cancelThread->wait();
-            }
+        while (!m_callingPlugin && !m_pendingFrames.isEmpty()) {
+            PendingFrame frame = m_pendingFrames.dequeue();
+            dispatchFrame(frame.opcode, frame.requestId, frame.payload);
         }
-
-        m_readnotifier->setEnabled(true);
-
-        delete cancelThread;
-        cancelThread = NULL;
     }
 
-    void RemotePluginProcess::startTask()
+    void RemotePluginProcess::dispatchFrame(quint16 opcode, quint32 requestId,
+                                            const QByteArray &payload)
     {
-        quint32 opcode = PLUGIN_OP_STOP;
         bool is_stopped = false;
+        QDataStream in(payload);
 
-        QDataStream in(&m_inFile);
-        in >> opcode;
+        /* Saved, as the plugin might process the events while it's called,
+         * and get a cancel meanwhile */
+        quint32 dispatchedRequestId = m_dispatchedRequestId;
+        m_dispatchedRequestId = requestId;
+        bool callingPlugin = m_callingPlugin;
+        m_callingPlugin = true;
 
         switch (opcode) {
             case PLUGIN_OP_CANCEL:
             {
-                m_plugin->cancel(); break;
+                if (!m_requests.contains(requestId))
+                    break;
+                m_plugin->setProperty(SIGNON_PLUGIN_REQUEST_ID, requestId);
+                m_plugin->cancel();
+                m_plugin->setProperty(SIGNON_PLUGIN_REQUEST_ID, QVariant());
                 //still do not have clear understanding
                 //of the cancelation-stop mechanism
                 //is_stopped = true;
@@ -466,14 +437,37 @@ namespace RemotePluginProcessNS {
                 mechanisms();
                 break;
             case PLUGIN_OP_PROCESS:
-                process();
-                break;
+            {
+                QString mechanism;
+                QVariantMap sessionDataMap;
+                in >> mechanism >> sessionDataMap;
+                sessionDataMap.insert(QLatin1String(SIGNON_PLUGIN_REQUEST_ID),
+                                      requestId);
+
+                m_requests.insert(requestId);
+                m_plugin->process(SessionData(sessionDataMap), mechanism);
+            }
+            break;
             case PLUGIN_OP_PROCESS_UI:
-                userActionFinished();
-                break;
+            {
+                QVariantMap sessionDataMap;
+                in >> sessionDataMap;
+                sessionDataMap.insert(QLatin1String(SIGNON_PLUGIN_REQUEST_ID),
+                                      requestId);
+
+                m_plugin->userActionFinished(UiSessionData(sessionDataMap));
+            }
+            break;
             case PLUGIN_OP_REFRESH:
-                refresh();
-                break;
+            {
+                QVariantMap sessionDataMap;
+                in >> sessionDataMap;
+                sessionDataMap.insert(QLatin1String(SIGNON_PLUGIN_REQUEST_ID),
+                                      requestId);
+
+                m_plugin->refresh(UiSessionData(sessionDataMap));
+            }
+            break;
             case PLUGIN_OP_STOP:
                 is_stopped = true;
                 break;
@@ -485,12 +479,10 @@ namespace RemotePluginProcessNS {
             break;
         };
 
-        TRACE() << "operation is completed";
+        m_dispatchedRequestId = dispatchedRequestId;
+        m_callingPlugin = callingPlugin;
 
-        if (!is_stopped) {
-            if (!m_outFile.flush())
-                is_stopped = true;
-        }
+        TRACE() << "operation is completed";
 
         if (is_stopped)
         {
@@ -498,53 +490,5 @@ namespace RemotePluginProcessNS {
             emit processStopped();
         }
     }
-
-    CancelEventThread::CancelEventThread(AuthPluginInterface *plugin)
-    {
-        m_plugin = plugin;
-        m_cancelNotifier = 0;
-    }
-
-    CancelEventThread::~CancelEventThread()
-    {
-        delete m_cancelNotifier;
-    }
-
-    void CancelEventThread::run()
-    {
-        if (!m_cancelNotifier) {
-            m_cancelNotifier = new QSocketNotifier(STDIN_FILENO, QSocketNotifier::Read);
-            connect(m_cancelNotifier, SIGNAL(activated(int)), this, SLOT(cancel()), Qt::DirectConnection);
-        }
-
-        m_cancelNotifier->setEnabled(true);
-        exec();
-        m_cancelNotifier->setEnabled(false);
-    }
-
-    void CancelEventThread::cancel()
-    {
-        char buf[4];
-        memset(buf, 0, 4);
-        int n = 0;
-
-        if (!(n = read(STDIN_FILENO, buf, 4))) {
-            qCritical() << "Cannot read from cancel socket";
-            return;
-        }
-
-        /*
-         * Read the actual value of
-         * */
-        QByteArray ba(buf, 4);
-        quint32 opcode;
-        QDataStream ds(ba);
-        ds >> opcode;
-
-        if (opcode != PLUGIN_OP_CANCEL)
-            qCritical() << "wrong operation code: breakage of remotepluginprocess threads synchronization: " << opcode;
-        else
-            QMetaObject::invokeMethod(m_plugin, "cancel", Qt::QueuedConnection);
-    }
 } //namespace RemotePluginProcessNS
 
@@ -30,12 +30,13 @@
 #include <QByteArray>
 #include <QVariant>
 #include <QMap>
+#include <QSet>
+#include <QQueue>
 #include <QIODevice>
 #include <QFile>
 #include <QDir>
 #include <QLibrary>
 #include <QSocketNotifier>
-#include <QThread>
 
 #include "SignOn/uisessiondata.h"
 #include "SignOn/authpluginif.h"
@@ -62,33 +63,11 @@ extern "C" {
 using namespace SignOn;
 
 namespace SignOn {
-    class BlobIOHandler;
+    class IpcChannel;
 };
 
 namespace RemotePluginProcessNS {
 
-/*!
- * @class CancelEventThread
- * Thread to enable cancel functionality.
- */
- class CancelEventThread : public QThread
-{
-    Q_OBJECT
-
-    public:
-        CancelEventThread(AuthPluginInterface *plugin);
-        ~CancelEventThread();
-
-        void run();
-
-    public Q_SLOTS:
-        void cancel();
-
-    private:
-        AuthPluginInterface *m_plugin;
-        QSocketNotifier *m_cancelNotifier;
-};
-
 /*!
  * @class RemotePluginProcess
  * Class to execute plugin process.
@@ -108,7 +87,6 @@ class RemotePluginProcess : public QObject
 
     public Q_SLOTS:
         void startTask();
-        void sessionDataReceived(const QVariantMap &sessionDataMap);
 
     private:
         AuthPluginInterface *m_plugin;
@@ -119,11 +97,24 @@ class RemotePluginProcess : public QObject
         QSocketNotifier *m_readnotifier;
         QSocketNotifier *m_errnotifier;
 
-        BlobIOHandler *m_blobIOHandler;
-
-        //Requiered for async session data reading
-        quint32 m_currentOperation;
-        QString m_currentMechanism;
+        IpcChannel *m_channel;
+
+        //Declared by the plugin, 1 by default
+        int m_maxConcurrentRequests;
+        //The requests which have not got their result or error yet
+        QSet<quint32> m_requests;
+        //The request whose operation the plugin is being called for
+        quint32 m_dispatchedRequestId;
+
+        /* The frames received while the plugin is being called, other than
+         * the cancels, wait for the call to return */
+        struct PendingFrame {
+            quint16 opcode;
+            quint32 requestId;
+            QByteArray payload;
+        };
+        QQueue<PendingFrame> m_pendingFrames;
+        bool m_callingPlugin;
 
     private:
         QString getPluginName(const QString &type);
@@ -131,12 +122,11 @@ class RemotePluginProcess : public QObject
         void mechanism();
         void mechanisms();
 
-        void process();
-        void userActionFinished();
-        void refresh();
-
-        void enableCancelThread();
-        void disableCancelThread();
+        quint32 implicitRequestId() const;
+        void dispatchFrame(quint16 opcode, quint32 requestId,
+                           const QByteArray &payload);
+        void sendSessionData(quint16 opcode, quint32 requestId,
+                             const SessionData &data);
 
     private Q_SLOTS:
         void result(const SignOn::SessionData &data);
@@ -145,7 +135,19 @@ class RemotePluginProcess : public QObject
         void userActionRequired(const SignOn::UiSessionData &data);
         void refreshed(const SignOn::UiSessionData &data);
         void statusChanged(const AuthPluginState state, const QString &message);
-        void blobIOError();
+        void requestResult(quint32 requestId, const SignOn::SessionData &data);
+        void requestStore(quint32 requestId, const SignOn::SessionData &data);
+        void requestError(quint32 requestId, const SignOn::Error &err);
+        void requestUserActionRequired(quint32 requestId,
+                                       const SignOn::UiSessionData &data);
+        void requestRefreshed(quint32 requestId,
+                              const SignOn::UiSessionData &data);
+        void requestStatusChanged(quint32 requestId,
+                                  const AuthPluginState state,
+                                  const QString &message);
+        void frameReceived(quint16 opcode, quint32 requestId,
+                           const QByteArray &payload);
+        void channelError();
 
     Q_SIGNALS :
         void processStopped();
@@ -25,6 +25,8 @@
 #include <QBuffer>
 #include <QDBusConnection>
 #include <QDBusConnectionInterface>
+#include <QDBusPendingReply>
+#include <QHash>
 
 #include "accesscontrolmanager.h"
 #include "signond-common.h"
@@ -48,19 +50,80 @@ namespace SignonDaemonNS {
 
     static const char keychainToken[] = "signond::keychain-access";
 
+    /* Cached access control decisions, indexed by the unique bus name of the
+     * peer (which is never reused) and then by identity id. */
+    typedef QHash<quint32, bool> UseDecisions;
+    typedef QHash<quint32, AccessControlManager::IdentityOwnership> OwnerDecisions;
+    static QHash<QString, UseDecisions> useDecisions;
+    static QHash<QString, OwnerDecisions> ownerDecisions;
+
+    /* Process ids of the peers, by unique bus name, and the requests for the
+     * ones still being resolved by the bus daemon. */
+    static QHash<QString, pid_t> peerPids;
+    static QHash<QString, QDBusPendingReply<uint> > pendingPeerPids;
+
+    /* The lists of the identities, as loaded by their storage jobs: the DB
+     * is read only for the ones not loaded since they changed */
+    static QHash<quint32, QStringList> accessControlLists;
+    static QHash<quint32, QStringList> ownerLists;
+
+    /* The new identities have no lists */
+    static inline bool isListLoaded(const QHash<quint32, QStringList> &lists,
+                                    const quint32 identityId)
+    {
+        return identityId == SIGNOND_NEW_IDENTITY || lists.contains(identityId);
+    }
+
+    /* A decision depending on the tokens of the peer is cached only if they
+     * could be read, that is if the process id of the peer was resolved */
+    static inline bool isDecisionCacheable(const QString &peerService,
+                                           bool dependsOnPeer)
+    {
+        return !dependsOnPeer || peerPids.contains(peerService);
+    }
+
     bool AccessControlManager::isPeerAllowedToUseIdentity(const QDBusContext &peerContext,
                                                           const quint32 identityId)
+    {
+        return isPeerAllowedToUseIdentity(peerContext.connection(),
+                                          peerContext.message(),
+                                          identityId);
+    }
+
+    bool AccessControlManager::isPeerAllowedToUseIdentity(const QDBusConnection &connection,
+                                                          const QDBusMessage &message,
+                                                          const quint32 identityId)
     {
         RETURN_IF_AC_DISABLED(true);
 
-        // TODO - improve this, the error handling and more precise behaviour
+        QString peerService = message.service();
+        QHash<QString, UseDecisions>::const_iterator peerDecisions =
+            useDecisions.constFind(peerService);
+        if (peerDecisions != useDecisions.constEnd()) {
+            UseDecisions::const_iterator cached =
+                peerDecisions.value().constFind(identityId);
+            if (cached != peerDecisions.value().constEnd())
+                return cached.value();
+        }
 
-        CredentialsDB *db = CredentialsAccessManager::instance()->credentialsDB();
-        if (db == 0) {
-            TRACE() << "NULL db pointer, secure storage might be unavailable,";
-            return false;
+        QStringList acl;
+        if (isListLoaded(accessControlLists, identityId)) {
+            acl = accessControlLists.value(identityId);
+        } else {
+            /* Not loaded since the identity changed or the cache was
+             * cleared: the read waits for the storage thread */
+            // TODO - improve this, the error handling and more precise behaviour
+
+            CredentialsDBThread *db = CredentialsAccessManager::instance()->credentialsDB();
+            if (db == 0) {
+                TRACE() << "NULL db pointer, secure storage might be unavailable,";
+                return false;
+            }
+            acl = db->accessControlList(identityId);
+            if (db->errorOccurred())
+                return false;
+            accessControlLists.insert(identityId, acl);
         }
-        QStringList acl = db->accessControlList(identityId);
 
         TRACE() << QString(QLatin1String("Access control list of identity: "
                                          "%1: [%2].Tokens count: %3\t"))
@@ -68,13 +131,11 @@ namespace SignonDaemonNS {
             .arg(acl.join(QLatin1String(", ")))
             .arg(acl.size());
 
-        if (db->errorOccurred())
-            return false;
-
-        if (acl.isEmpty())
-            return true;
-
-        return peerHasOneOfTokens(peerContext, acl);
+        bool allowed = acl.isEmpty()
+            || peerHasOneOfTokens(pidOfPeer(connection, peerService), acl);
+        if (isDecisionCacheable(peerService, !acl.isEmpty()))
+            useDecisions[peerService].insert(identityId, allowed);
+        return allowed;
     }
 
     AccessControlManager::IdentityOwnership AccessControlManager::isPeerOwnerOfIdentity(
@@ -83,20 +144,90 @@ namespace SignonDaemonNS {
     {
         RETURN_IF_AC_DISABLED(ApplicationIsOwner);
 
-        CredentialsDB *db = CredentialsAccessManager::instance()->credentialsDB();
-        if (db == 0) {
-            TRACE() << "NULL db pointer, secure storage might be unavailable,";
-            return ApplicationIsNotOwner;
+        QString peerService = peerContext.message().service();
+        QHash<QString, OwnerDecisions>::const_iterator peerDecisions =
+            ownerDecisions.constFind(peerService);
+        if (peerDecisions != ownerDecisions.constEnd()) {
+            OwnerDecisions::const_iterator cached =
+                peerDecisions.value().constFind(identityId);
+            if (cached != peerDecisions.value().constEnd())
+                return cached.value();
         }
-        QStringList ownerTokens = db->ownerList(identityId);
 
-        if (db->errorOccurred())
-            return ApplicationIsNotOwner;
+        QStringList ownerTokens;
+        if (isListLoaded(ownerLists, identityId)) {
+            ownerTokens = ownerLists.value(identityId);
+        } else {
+            CredentialsDBThread *db = CredentialsAccessManager::instance()->credentialsDB();
+            if (db == 0) {
+                TRACE() << "NULL db pointer, secure storage might be unavailable,";
+                return ApplicationIsNotOwner;
+            }
+            ownerTokens = db->ownerList(identityId);
+
+            if (db->errorOccurred())
+                return ApplicationIsNotOwner;
+            ownerLists.insert(identityId, ownerTokens);
+        }
 
+        IdentityOwnership ownership;
         if (ownerTokens.isEmpty())
-            return IdentityDoesNotHaveOwner;
+            ownership = IdentityDoesNotHaveOwner;
+        else
+            ownership = peerHasOneOfTokens(peerContext, ownerTokens) ?
+                ApplicationIsOwner : ApplicationIsNotOwner;
+
+        if (isDecisionCacheable(peerService, !ownerTokens.isEmpty()))
+            ownerDecisions[peerService].insert(identityId, ownership);
+        return ownership;
+    }
+
+    void AccessControlManager::identityChanged(const quint32 identityId)
+    {
+        TRACE() << "Dropping access decisions on identity" << identityId;
+
+        QMutableHashIterator<QString, UseDecisions> useIt(useDecisions);
+        while (useIt.hasNext())
+            useIt.next().value().remove(identityId);
 
-        return peerHasOneOfTokens(peerContext, ownerTokens) ? ApplicationIsOwner : ApplicationIsNotOwner;
+        QMutableHashIterator<QString, OwnerDecisions> ownerIt(ownerDecisions);
+        while (ownerIt.hasNext())
+            ownerIt.next().value().remove(identityId);
+
+        accessControlLists.remove(identityId);
+        ownerLists.remove(identityId);
+    }
+
+    void AccessControlManager::identityLoaded(const quint32 identityId,
+                                              const QStringList &accessControlList,
+                                              const QStringList &ownerList)
+    {
+        accessControlLists.insert(identityId, accessControlList);
+        ownerLists.insert(identityId, ownerList);
+    }
+
+    bool AccessControlManager::isIdentityLoaded(const quint32 identityId)
+    {
+        RETURN_IF_AC_DISABLED(true);
+
+        return isListLoaded(accessControlLists, identityId)
+            && isListLoaded(ownerLists, identityId);
+    }
+
+    void AccessControlManager::peerDisconnected(const QString &peerService)
+    {
+        peerPids.remove(peerService);
+        pendingPeerPids.remove(peerService);
+        useDecisions.remove(peerService);
+        ownerDecisions.remove(peerService);
+    }
+
+    void AccessControlManager::clearCachedDecisions()
+    {
+        useDecisions.clear();
+        ownerDecisions.clear();
+        accessControlLists.clear();
+        ownerLists.clear();
     }
 
     bool AccessControlManager::isPeerKeychainWidget(const QDBusContext &peerContext)
@@ -134,7 +265,13 @@ namespace SignonDaemonNS {
     bool AccessControlManager::peerHasOneOfTokens(const QDBusContext &peerContext,
                                                   const QStringList &tokens)
     {
-        QStringList peerTokens = accessTokens(peerContext);
+        return peerHasOneOfTokens(pidOfPeer(peerContext), tokens);
+    }
+
+    bool AccessControlManager::peerHasOneOfTokens(const pid_t peerPid,
+                                                  const QStringList &tokens)
+    {
+        QStringList peerTokens = accessTokens(peerPid);
 
         TRACE() << peerTokens << " vs. " << tokens;
 
@@ -217,8 +354,70 @@ namespace SignonDaemonNS {
 
     pid_t AccessControlManager::pidOfPeer(const QDBusContext &peerContext)
     {
-        QString service = peerContext.message().service();
-        return peerContext.connection().interface()->servicePid(service).value();
+        return pidOfPeer(peerContext.connection(),
+                         peerContext.message().service());
+    }
+
+    pid_t AccessControlManager::pidOfPeer(const QDBusConnection &connection,
+                                          const QString &peerService)
+    {
+        QHash<QString, pid_t>::const_iterator cached =
+            peerPids.constFind(peerService);
+        if (cached != peerPids.constEnd())
+            return cached.value();
+
+        pid_t pid;
+        if (pendingPeerPids.contains(peerService)) {
+            /* Most likely the reply has already been received */
+            QDBusPendingReply<uint> reply = pendingPeerPids.take(peerService);
+            reply.waitForFinished();
+            pid = reply.isValid() ? reply.value() : 0;
+        } else {
+            pid = connection.interface()->servicePid(peerService).value();
+        }
+
+        if (pid != 0)
+            peerPids.insert(peerService, pid);
+        else
+            BLAME() << "Cannot resolve the process id of" << peerService;
+
+        return pid;
+    }
+
+    void AccessControlManager::requestPidOfPeer(const QDBusContext &peerContext)
+    {
+        (void)requestPidOfPeer(peerContext.connection(),
+                               peerContext.message().service());
+    }
+
+    QDBusPendingCall AccessControlManager::requestPidOfPeer(const QDBusConnection &connection,
+                                                            const QString &peerService)
+    {
+        if (pendingPeerPids.contains(peerService))
+            return pendingPeerPids.value(peerService);
+
+        QHash<QString, pid_t>::const_iterator cached =
+            peerPids.constFind(peerService);
+        if (cached != peerPids.constEnd())
+            return QDBusPendingCall::fromCompletedCall(
+                QDBusMessage().createReply(QVariant(uint(cached.value()))));
+
+        QDBusPendingReply<uint> reply =
+            connection.interface()->asyncCall(
+                QLatin1String("GetConnectionUnixProcessID"), peerService);
+        pendingPeerPids.insert(peerService, reply);
+        return reply;
+    }
+
+    bool AccessControlManager::isPidOfPeerKnown(const QString &peerService)
+    {
+        if (peerPids.contains(peerService))
+            return true;
+
+        QHash<QString, QDBusPendingReply<uint> >::const_iterator pending =
+            pendingPeerPids.constFind(peerService);
+        return pending != pendingPeerPids.constEnd()
+            && pending.value().isFinished();
     }
 
 } //namespace SignonDaemonNS
@@ -36,6 +36,7 @@
 #include <QDBusConnection>
 #include <QDBusContext>
 #include <QDBusMessage>
+#include <QDBusPendingCall>
 
 #include "signonauthsession.h"
 
@@ -71,6 +72,16 @@ namespace SignonDaemonNS {
         static bool isPeerAllowedToUseIdentity(const QDBusContext &peerContext,
                                                const quint32 identityId);
 
+        /*!
+            @overload isPeerAllowedToUseIdentity(const QDBusContext &peerContext, const quint32 identityId)
+            For the calls carried on after their dispatch.
+            @param connection, the connection the call came on.
+            @param message, the call of the peer.
+        */
+        static bool isPeerAllowedToUseIdentity(const QDBusConnection &connection,
+                                               const QDBusMessage &message,
+                                               const quint32 identityId);
+
         /*!
             Checks if a specific process is the owner of a SignonIdentity, thus having full control over it.
             @param peerContext, the DBUS context created by the process to be checked for ownership
@@ -105,6 +116,17 @@ namespace SignonDaemonNS {
             return isPeerAllowedToUseIdentity(peerContext, ownerIdentityId);
         }
 
+        /*!
+            @overload isPeerAllowedToUseAuthSession(const QDBusContext &peerContext, const quint32 ownerIdentityId)
+            For the calls carried on after their dispatch.
+        */
+        static bool isPeerAllowedToUseAuthSession(const QDBusConnection &connection,
+                                                  const QDBusMessage &message,
+                                                  const quint32 ownerIdentityId)
+        {
+            return isPeerAllowedToUseIdentity(connection, message, ownerIdentityId);
+        }
+
         /*!
             @param peerContext, the DBUS context created by the process to be checked.
             @returns true, if the peer is the Keychain Widget, false otherwise.
@@ -131,6 +153,40 @@ namespace SignonDaemonNS {
         */
         static pid_t pidOfPeer(const QDBusContext &peerContext);
 
+        /*!
+            @overload pidOfPeer(const QDBusContext &peerContext)
+            The process ids are resolved once per peer and cached until the
+            peer leaves the bus.
+            @param connection, the connection the peer is on.
+            @param peerService, the unique bus name of the peer.
+            @returns process id of service client.
+        */
+        static pid_t pidOfPeer(const QDBusConnection &connection,
+                               const QString &peerService);
+
+        /*!
+            Starts resolving the process id of a peer without waiting for the
+            bus daemon to reply, so that a later pidOfPeer() finds it ready.
+            @param peerContext, the context, which process id we'll want to know
+        */
+        static void requestPidOfPeer(const QDBusContext &peerContext);
+
+        /*!
+            @overload requestPidOfPeer(const QDBusContext &peerContext)
+            @param connection, the connection the peer is on.
+            @param peerService, the unique bus name of the peer.
+            @returns the pending lookup, finished if the process id is known.
+        */
+        static QDBusPendingCall requestPidOfPeer(const QDBusConnection &connection,
+                                                 const QString &peerService);
+
+        /*!
+            @param peerService, the unique bus name of the peer.
+            @returns true if pidOfPeer() returns without waiting for the bus
+            daemon: the process id is known, or its lookup is finished.
+        */
+        static bool isPidOfPeerKnown(const QString &peerService);
+
         /*!
             @param peerId, the id of the process for which to retrieve the tokens list
             @returns A list with the Aegis Access Control tokens of the process.
@@ -143,6 +199,44 @@ namespace SignonDaemonNS {
         */
         static QStringList accessTokens(const QDBusContext &peerContext);
 
+        /*!
+            The access control decisions are cached per peer and identity;
+            this must be called whenever the access control list or the
+            owner list of an identity might have changed.
+            @param identityId, the identity whose decisions are dropped.
+        */
+        static void identityChanged(const quint32 identityId);
+
+        /*!
+            Caches the lists of an identity, as loaded by a storage job, so
+            that the decisions on it are taken without waiting for the DB;
+            they are dropped along with the decisions.
+            @param identityId, the identity which was loaded.
+            @param accessControlList, the access control list of the identity.
+            @param ownerList, the owner list of the identity.
+        */
+        static void identityLoaded(const quint32 identityId,
+                                   const QStringList &accessControlList,
+                                   const QStringList &ownerList);
+
+        /*!
+            @param identityId, the identity to be checked.
+            @returns true if the decisions on the identity are taken without
+            reading the DB.
+        */
+        static bool isIdentityLoaded(const quint32 identityId);
+
+        /*!
+            Drops the cached process id and access control decisions of a peer.
+            @param peerService, the unique bus name of the peer which left the bus.
+        */
+        static void peerDisconnected(const QString &peerService);
+
+        /*!
+            Drops all the cached access control decisions, and lists.
+        */
+        static void clearCachedDecisions();
+
     private:
         /*!
             Checks if a specific peer has a set of Aegis Access Control tokens.
@@ -152,6 +246,12 @@ namespace SignonDaemonNS {
         */
         static bool peerHasOneOfTokens(const QDBusContext &peerContext, const QStringList &tokens);
 
+        /*!
+            @overload peerHasOneOfTokens(const QDBusContext &peerContext, const QStringList &tokens)
+            @param peerPid, the process id of the peer.
+        */
+        static bool peerHasOneOfTokens(const pid_t peerPid, const QStringList &tokens);
+
         /*!
             Checks if a specific peer has a set the Aegis Access Control token.
             @param peerContext, to DBUS context created by the process to be checked.
@@ -28,6 +28,7 @@
 #include "signond-common.h"
 
 #include "SignOn/ExtensionInterface"
+#include "SignOn/encrypted-vfs.h"
 #include "SignOn/misc.h"
 
 #include <QFile>
@@ -54,6 +55,7 @@ CAMConfiguration::CAMConfiguration()
           m_useEncryption(signonDefaultUseEncryption),
           m_fileSystemType(QLatin1String(signonDefaultFileSystemType)),
           m_fileSystemSize(signonMinumumDbSize),
+          m_encryptPages(signonDefaultEncryptPages),
           m_encryptionPassphrase(QByteArray())
 {}
 
@@ -75,7 +77,13 @@ void CAMConfiguration::serialize(QIODevice *device)
 
     const char *usingEncryption = m_useEncryption ? "true" : "false";
     stream << "Using encryption: " << usingEncryption << '\n';
+    const char *encryptingPages = m_encryptPages ? "true" : "false";
+    stream << "Encrypting the DB pages: " << encryptingPages << '\n';
     stream << "Credentials database name: " << m_dbName << '\n';
+    stream << "Metadata database journal mode: "
+           << m_metaDataDBConfiguration.m_journalMode << '\n';
+    stream << "Secrets database journal mode: "
+           << m_secretsDBConfiguration.m_journalMode << '\n';
     stream << "======================================================\n\n";
     device->write(buffer.toUtf8());
     device->close();
@@ -93,6 +101,13 @@ QString CAMConfiguration::encryptedFSPath() const
         QLatin1String(signonDefaultFileSystemName);
 }
 
+QString CAMConfiguration::encryptedPagesDBPath() const
+{
+    return m_storagePath +
+        QDir::separator() +
+        QLatin1String(signonDefaultPagesDbName);
+}
+
 /* ---------------------- CredentialsAccessManager ---------------------- */
 
 CredentialsAccessManager *CredentialsAccessManager::m_pInstance = NULL;
@@ -162,6 +177,18 @@ bool CredentialsAccessManager::init(const CAMConfiguration &camConfiguration)
         return false;
     }
 
+    /* The secrets DB is opened with the encrypting VFS, which must be set
+     * up before the metadata DB initializes SQLite */
+    if (m_CAMConfiguration.m_useEncryption
+        && m_CAMConfiguration.m_encryptPages) {
+        if (!EncryptedVfs::initialize()) {
+            qCritical() << "Cannot open the page-encrypted secrets DB.";
+            return false;
+        }
+        m_CAMConfiguration.m_secretsDBConfiguration.m_vfs =
+            QLatin1String(EncryptedVfs::name());
+    }
+
     if (!openMetaDataDB()) {
         BLAME() << "Failed to create metadata DB!!!";
         return false;
@@ -177,7 +204,14 @@ bool CredentialsAccessManager::init(const CAMConfiguration &camConfiguration)
                          this, SLOT(onEncryptedFSUnmounting()),
                          Qt::UniqueConnection);
 
-        m_pCryptoFileSystemManager->setFileSystemPath(m_CAMConfiguration.encryptedFSPath());
+        if (m_CAMConfiguration.m_encryptPages) {
+            m_pCryptoFileSystemManager->setStorageType(CryptoManager::PageStorage);
+            m_pCryptoFileSystemManager->setFileSystemPath(
+                m_CAMConfiguration.encryptedPagesDBPath());
+        } else {
+            m_pCryptoFileSystemManager->setFileSystemPath(
+                m_CAMConfiguration.encryptedFSPath());
+        }
 
         m_pCryptoFileSystemManager->setFileSystemSize(m_CAMConfiguration.m_fileSystemSize);
         m_pCryptoFileSystemManager->setFileSystemType(m_CAMConfiguration.m_fileSystemType);
@@ -299,7 +333,15 @@ bool CredentialsAccessManager::openSecretsDB()
 {
     QString dbPath;
 
-    if (m_CAMConfiguration.m_useEncryption) {
+    if (m_CAMConfiguration.m_useEncryption
+        && m_CAMConfiguration.m_encryptPages) {
+        /* The DB file is the encrypted storage itself */
+        if (!m_pCryptoFileSystemManager->fileSystemIsMounted()) {
+            m_error = CredentialsDbNotMounted;
+            return false;
+        }
+        dbPath = m_CAMConfiguration.encryptedPagesDBPath();
+    } else if (m_CAMConfiguration.m_useEncryption) {
 
 #ifndef SIGNON_AEGISFS
         if (!m_pCryptoFileSystemManager->fileSystemIsMounted()) {
@@ -398,6 +440,11 @@ bool CredentialsAccessManager::openSecretsDB()
         return false;
 #else
     if (!isSecretsDBOpen() && !m_pCredentialsDB->openSecretsDB(dbPath)) {
+        //the encrypted DB is not on aegisfs, and must not be removed
+        if (m_CAMConfiguration.m_useEncryption
+            && m_CAMConfiguration.m_encryptPages)
+            return false;
+
         //a workaround aimed on solving possible problems with aegisfs
         QFile::remove(dbPath);
         if (!m_pCredentialsDB->openSecretsDB(dbPath))
@@ -453,7 +500,10 @@ bool CredentialsAccessManager::openMetaDataDB()
 
     QString dbPath = m_CAMConfiguration.metadataDBPath();
 
-    m_pCredentialsDB = new CredentialsDB(dbPath);
+    m_pCredentialsDB =
+        new CredentialsDBThread(dbPath,
+                                m_CAMConfiguration.m_metaDataDBConfiguration,
+                                m_CAMConfiguration.m_secretsDBConfiguration);
 
     if (!m_pCredentialsDB->init()) {
         m_error = CredentialsDbConnectionError;
@@ -558,13 +608,31 @@ bool CredentialsAccessManager::deleteCredentialsSystem()
     return m_error == NoError;
 }
 
-CredentialsDB *CredentialsAccessManager::credentialsDB() const
+CredentialsDBThread *CredentialsAccessManager::credentialsDB() const
 {
     RETURN_IF_NOT_INITIALIZED(NULL);
 
     return m_pCredentialsDB;
 }
 
+bool CredentialsAccessManager::prepareSecretsCopy(const QString &filePath)
+{
+    RETURN_IF_NOT_INITIALIZED(false);
+
+    if (!m_CAMConfiguration.m_useEncryption)
+        return true;
+
+    if (!m_CAMConfiguration.m_encryptPages)
+        return false;
+
+    return m_pCryptoFileSystemManager->registerPageStorageCopy(filePath);
+}
+
+void CredentialsAccessManager::releaseSecretsCopy(const QString &filePath)
+{
+    CryptoManager::unregisterPageStorageCopy(filePath);
+}
+
 bool CredentialsAccessManager::isCredentialsSystemReady() const
 {
 #ifdef SIGNON_AEGISFS
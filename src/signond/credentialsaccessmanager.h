@@ -31,7 +31,7 @@
 #ifndef CREDENTIALS_ACCESS_MANAGER_H
 #define CREDENTIALS_ACCESS_MANAGER_H
 
-#include "credentialsdb.h"
+#include "credentialsdbthread.h"
 #include "signonui_interface.h"
 
 #include <QObject>
@@ -121,14 +121,22 @@ struct CAMConfiguration
      */
     QString encryptedFSPath() const;
 
+    /*!
+     * Returns the path of the secrets DB encrypted page by page.
+     */
+    QString encryptedPagesDBPath() const;
+
     QString m_storagePath;      /*!< The base directory for storage. */
     QString m_dbName;           /*!< The database file name. */
     bool m_useEncryption;       /*!< Flag for encryption use, enables/disables all of the bellow. */
     QString m_fileSystemType;   /*!< The encrypted file system type (ext2, ext3, ext4). */
     quint32 m_fileSystemSize;   /*!< The encrypted file system size. */
+    bool m_encryptPages;        /*!< Encrypt the DB pages instead of using a LUKS file system. */
     QByteArray m_encryptionPassphrase; /*!< Passphrase used for opening encrypted FS. */
     QString m_encryptedStoragePath; /*!< The directory for encrypted storage. */
     QString m_aegisPath;        /*!< The base directory for aegisfs. */
+    SqlDatabaseConfiguration m_metaDataDBConfiguration; /*!< The settings of the metadata DB. */
+    SqlDatabaseConfiguration m_secretsDBConfiguration; /*!< The settings of the secrets DB. */
 };
 
 /*!
@@ -308,9 +316,20 @@ public:
     bool isCredentialsSystemReady() const;
 
     /*!
-      @returns the credentials database object.
+      @returns the thread running the operations on the credentials
+      database.
+    */
+    CredentialsDBThread *credentialsDB() const;
+
+    /*!
+      Lets a copy of the open secrets DB be written at the given path: with
+      the page-encrypted storage, the copy is encrypted with the key of the
+      DB, until releaseSecretsCopy().
+      @returns false if the DB can't be copied while it is open, as the one
+      of the LUKS file system.
     */
-    CredentialsDB *credentialsDB() const;
+    bool prepareSecretsCopy(const QString &filePath);
+    static void releaseSecretsCopy(const QString &filePath);
 
     /*!
       @returns the CAM in use configuration.
@@ -376,7 +395,7 @@ private:
     QList<SignOn::AbstractKeyManager *> keyManagers;
     QList<SignOn::ExtensionInterface *> keyManagerExtensions;
 
-    CredentialsDB *m_pCredentialsDB;
+    CredentialsDBThread *m_pCredentialsDB;
     SignOn::CryptoManager *m_pCryptoFileSystemManager;
     SignOn::KeyHandler *m_keyHandler;
     SignOn::AbstractKeyAuthorizer *m_keyAuthorizer;
@@ -22,12 +22,18 @@
  * 02110-1301 USA
  */
 
+#define SIGNON_TRACE_CATEGORY SignOn::TraceStorage
+
 #include "credentialsdb.h"
 #include "signond-common.h"
 
 #include <Accounts/Manager>
 #include <Accounts/Account>
 
+#include <QFileInfo>
+#include <QUrl>
+
+#include <sqlite3.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/wait.h>
@@ -45,11 +51,34 @@ namespace SignonDaemonNS {
 
 static const QString driver = QLatin1String("QSQLITE");
 
+SqlDatabaseConfiguration::SqlDatabaseConfiguration():
+    m_cacheSize(0),
+    m_mmapSize(0),
+    m_busyTimeout(0)
+{
+}
+
+bool SqlDatabaseConfiguration::isJournalModeValid(const QString &journalMode)
+{
+    return journalMode == S("DELETE") || journalMode == S("TRUNCATE")
+        || journalMode == S("PERSIST") || journalMode == S("WAL");
+}
+
+bool SqlDatabaseConfiguration::isSynchronousValid(const QString &synchronous)
+{
+    /* The SQLite versions not knowing EXTRA would take it for NORMAL */
+    return synchronous == S("OFF") || synchronous == S("NORMAL")
+        || synchronous == S("FULL");
+}
+
 SqlDatabase::SqlDatabase(const QString &databaseName,
                          const QString &connectionName,
                          int version):
     m_lastError(QSqlError()),
+    m_backupDB(0),
+    m_backup(0),
     m_version(version),
+    m_foreignKeys(false),
     m_database(QSqlDatabase::addDatabase(driver, connectionName))
 
 {
@@ -61,6 +90,8 @@ SqlDatabase::SqlDatabase(const QString &databaseName,
 
 SqlDatabase::~SqlDatabase()
 {
+    finishBackup();
+    clearPreparedQueries();
     m_database.commit();
     m_database.close();
 }
@@ -95,30 +126,248 @@ bool SqlDatabase::init()
 bool SqlDatabase::updateDB(int version)
 {
     TRACE() << "Update DB from version " << version << " to " << m_version;
+    /* The schema might have changed: don't reuse the old statements */
+    clearPreparedQueries();
     exec(QString::fromLatin1("PRAGMA user_version = %1").arg(m_version));
     return true;
 }
 
 bool SqlDatabase::connect()
 {
-    if (!m_database.open()) {
+    if (m_configuration.m_busyTimeout > 0)
+        m_database.setConnectOptions(
+            QString::fromLatin1("QSQLITE_BUSY_TIMEOUT=%1")
+            .arg(m_configuration.m_busyTimeout));
+
+    /* The Qt driver opens the DB with the default VFS, unless it is named
+     * in a URI */
+    QString databaseName = m_database.databaseName();
+    if (!m_configuration.m_vfs.isEmpty())
+        m_database.setDatabaseName(QString::fromLatin1("file:%1?vfs=%2")
+            .arg(QString::fromLatin1(QUrl::toPercentEncoding(
+                QFileInfo(databaseName).absoluteFilePath(), "/")))
+            .arg(m_configuration.m_vfs));
+
+    bool opened = m_database.open();
+    m_database.setDatabaseName(databaseName);
+    if (!opened) {
         TRACE() << "Could not open database connection.\n";
         m_lastError = m_database.lastError();
         return false;
     }
+
+    if (!usesConfiguredVfs()) {
+        qCritical() << "The DB" << databaseName << "is not opened with the"
+            << m_configuration.m_vfs << "VFS";
+        m_database.close();
+        m_lastError = QSqlError(QLatin1String("Could not open database"),
+                                QLatin1String("Wrong SQLite VFS"),
+                                QSqlError::ConnectionError);
+        return false;
+    }
+
+    applyConfiguration();
+
+    /* Use the native foreign keys support, if SQLite provides it: the
+     * setting is per connection and it is silently ignored by the SQLite
+     * versions which don't support it, hence the check. */
+    exec(S("PRAGMA foreign_keys = ON"));
+    QSqlQuery q = exec(S("PRAGMA foreign_keys"));
+    m_foreignKeys = q.first() && q.value(0).toInt() == 1;
+    q.clear();
+    TRACE() << "Native foreign keys:" << m_foreignKeys;
+
     return true;
 }
 
+void SqlDatabase::applyConfiguration()
+{
+    /* The settings are not errors of the operations: they are only logged.
+     * The keywords are checked when the configuration is loaded: only the
+     * known ones make it into the statements. */
+    QStringList pragmas;
+    if (SqlDatabaseConfiguration::isJournalModeValid(m_configuration.m_journalMode))
+        pragmas << QString::fromLatin1("PRAGMA journal_mode = %1")
+            .arg(m_configuration.m_journalMode);
+    if (SqlDatabaseConfiguration::isSynchronousValid(m_configuration.m_synchronous))
+        pragmas << QString::fromLatin1("PRAGMA synchronous = %1")
+            .arg(m_configuration.m_synchronous);
+    if (m_configuration.m_cacheSize > 0)
+        pragmas << QString::fromLatin1("PRAGMA cache_size = -%1")
+            .arg(m_configuration.m_cacheSize);
+    if (m_configuration.m_mmapSize > 0)
+        pragmas << QString::fromLatin1("PRAGMA mmap_size = %1")
+            .arg(m_configuration.m_mmapSize);
+    /* The sorts and temporary tables of the DB are kept out of the files */
+    if (!m_configuration.m_vfs.isEmpty())
+        pragmas << S("PRAGMA temp_store = MEMORY");
+
+    foreach (QString pragma, pragmas) {
+        QSqlQuery q(m_database);
+        if (!q.exec(pragma)) {
+            BLAME() << pragma << "failed:" << errorInfo(q.lastError());
+            continue;
+        }
+        /* journal_mode returns the mode in use, which is the old one if
+         * the new one is not supported */
+        if (q.first())
+            TRACE() << pragma << "->" << q.value(0).toString();
+    }
+}
+
+bool SqlDatabase::usesConfiguredVfs()
+{
+    if (m_configuration.m_vfs.isEmpty())
+        return true;
+
+    sqlite3 *db = handle();
+    if (db == 0)
+        return false;
+
+    /* Without URI file names, SQLite takes the URI for a path: the open
+     * fails, unless a "file:" directory exists in the current one */
+    bool isOk = false;
+#ifdef SQLITE_FCNTL_VFSNAME
+    char *vfsName = 0;
+    if (sqlite3_file_control(db, "main", SQLITE_FCNTL_VFSNAME,
+                             &vfsName) == SQLITE_OK && vfsName != 0)
+        isOk = (m_configuration.m_vfs == QString::fromUtf8(vfsName));
+    sqlite3_free(vfsName);
+#else
+    isOk = !QFileInfo(QLatin1String("file:")).exists();
+#endif
+    return isOk;
+}
+
+sqlite3 *SqlDatabase::handle()
+{
+    QVariant handle = m_database.driver()->handle();
+    if (!handle.isValid() || qstrcmp(handle.typeName(), "sqlite3*") != 0)
+        return 0;
+    return *static_cast<sqlite3 **>(handle.data());
+}
+
 void SqlDatabase::disconnect()
 {
+    /* The connection cannot be closed while a backup reads it */
+    finishBackup();
+    clearPreparedQueries();
     m_database.close();
 }
 
+bool SqlDatabase::startBackup(const QString &fileName)
+{
+    finishBackup();
+
+    sqlite3 *source = handle();
+    if (source == 0) {
+        BLAME() << "No SQLite handle for" << m_database.databaseName();
+        m_lastError = QSqlError(QLatin1String("Backup failed"),
+                                QLatin1String("No SQLite handle"),
+                                QSqlError::ConnectionError);
+        return false;
+    }
+
+    /* The copy is written by the VFS of the DB: the pages of an encrypted
+     * DB stay encrypted */
+    QByteArray vfs = m_configuration.m_vfs.toLatin1();
+    int result = sqlite3_open_v2(QFile::encodeName(fileName).constData(),
+                                 &m_backupDB,
+                                 SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                                 vfs.isEmpty() ? 0 : vfs.constData());
+    if (result == SQLITE_OK) {
+        m_backup = sqlite3_backup_init(m_backupDB, "main", source, "main");
+        if (m_backup != 0) {
+            TRACE() << "Backup of" << m_database.databaseName() << "to"
+                << fileName;
+            /* A step copying no page counts the pages to copy */
+            sqlite3_backup_step(m_backup, 0);
+            return true;
+        }
+        result = sqlite3_errcode(m_backupDB);
+    }
+
+    setBackupError(result);
+    sqlite3_close(m_backupDB);
+    m_backupDB = 0;
+    return false;
+}
+
+bool SqlDatabase::backupStep(int pages)
+{
+    if (m_backup == 0)
+        return true;
+
+    int result = sqlite3_backup_step(m_backup, pages);
+    switch (result) {
+    case SQLITE_DONE:
+        TRACE() << "Backup of" << m_database.databaseName() << "done";
+        finishBackup();
+        return true;
+    case SQLITE_OK:
+    case SQLITE_BUSY:
+    case SQLITE_LOCKED:
+        /* The pages left are copied by the next steps */
+        TRACE() << sqlite3_backup_remaining(m_backup) << "pages left of"
+            << sqlite3_backup_pagecount(m_backup);
+        return false;
+    default:
+        setBackupError(result);
+        finishBackup();
+        return false;
+    }
+}
+
+int SqlDatabase::backupRemaining() const
+{
+    return (m_backup != 0) ? sqlite3_backup_remaining(m_backup) : 0;
+}
+
+void SqlDatabase::finishBackup()
+{
+    if (m_backupDB == 0)
+        return;
+
+    if (m_backup != 0) {
+        sqlite3_backup_finish(m_backup);
+        m_backup = 0;
+    }
+    sqlite3_close(m_backupDB);
+    m_backupDB = 0;
+}
+
+void SqlDatabase::setBackupError(int result)
+{
+    QString text = (m_backupDB != 0) ?
+        QString::fromUtf8(sqlite3_errmsg(m_backupDB)) :
+        QString::number(result);
+    BLAME() << "Backup of" << m_database.databaseName() << "failed:" << text;
+    m_lastError = QSqlError(QLatin1String("Backup failed"), text,
+                            QSqlError::UnknownError, result);
+}
+
 bool SqlDatabase::startTransaction()
 {
     return m_database.transaction();
 }
 
+bool SqlDatabase::startReadTransaction()
+{
+    if (!m_database.transaction()) {
+        m_lastError = m_database.lastError();
+        return false;
+    }
+
+    /* The transaction reads the DB from its first query on */
+    QSqlQuery query = exec(S("SELECT count(*) FROM sqlite_master"));
+    query.finish();
+    if (errorOccurred()) {
+        rollback();
+        return false;
+    }
+    return true;
+}
+
 bool SqlDatabase::commit()
 {
     return m_database.commit();
@@ -147,6 +396,28 @@ QSqlQuery SqlDatabase::exec(const QString &queryStr)
     return query;
 }
 
+QSqlQuery SqlDatabase::prepare(const QString &queryStr)
+{
+    QHash<QString, QSqlQuery>::const_iterator it =
+        m_preparedQueries.constFind(queryStr);
+    if (it != m_preparedQueries.constEnd())
+        return it.value();
+
+    QSqlQuery query(QString(), m_database);
+    if (!query.prepare(queryStr)) {
+        TRACE() << "Query prepare warning: " << query.lastQuery();
+        return query;
+    }
+
+    m_preparedQueries.insert(queryStr, query);
+    return query;
+}
+
+void SqlDatabase::clearPreparedQueries()
+{
+    m_preparedQueries.clear();
+}
+
 QSqlQuery SqlDatabase::exec(QSqlQuery &query)
 {
 
@@ -161,7 +432,8 @@ QSqlQuery SqlDatabase::exec(QSqlQuery &query)
 }
 
 
-bool SqlDatabase::transactionalExec(const QStringList &queryList)
+bool SqlDatabase::transactionalExec(const QStringList &queryList,
+                                    const QVariantList &values)
 {
     if (!startTransaction()) {
         m_lastError = m_database.lastError();
@@ -171,9 +443,20 @@ bool SqlDatabase::transactionalExec(const QStringList &queryList)
 
     bool allOk = true;
     foreach (QString queryStr, queryList) {
-        TRACE() << QString::fromLatin1("TRANSACT Query [%1]").arg(queryStr);
-        QSqlQuery query = exec(queryStr);
-        query.clear();
+        TRACE() << "TRANSACT Query" << queryStr;
+        /* Only the statements taking values are repeated enough to be
+         * worth caching */
+        int placeholders = queryStr.count(QLatin1Char('?'));
+        if (placeholders > 0) {
+            QSqlQuery query = prepare(queryStr);
+            for (int i = 0; i < placeholders && i < values.count(); i++)
+                query.addBindValue(values.at(i));
+            exec(query);
+            query.finish();
+        } else {
+            QSqlQuery query = exec(queryStr);
+            query.clear();
+        }
 
         if (errorOccurred()) {
             allOk = false;
@@ -181,6 +464,8 @@ bool SqlDatabase::transactionalExec(const QStringList &queryList)
         }
     }
 
+    TRACE_EVENT("transaction", queryList.count(), allOk);
+
     if (allOk && commit()) {
         TRACE() << "Commit SUCCEEDED.";
         return true;
@@ -239,6 +524,7 @@ QString SqlDatabase::errorInfo(const QSqlError &error)
 
 QStringList SqlDatabase::queryList(const QString &query_str)
 {
+    /* Not cached: the statements given as text are the one-shot ones */
     QSqlQuery query(QString(), m_database);
     if (!query.prepare(query_str))
         TRACE() << "Query prepare warning: " << query.lastQuery();
@@ -253,14 +539,18 @@ QStringList SqlDatabase::queryList(QSqlQuery &q)
     while (query.next()) {
         list.append(query.value(0).toString());
     }
-    query.clear();
+    query.finish();
     return list;
 }
 
 bool SqlDatabase::erase()
 {
     QString fileName = m_database.databaseName();
-    m_database.close();
+    disconnect();
+
+    /* The WAL files of a removed DB must not be applied to the new one */
+    QFile::remove(fileName + QLatin1String("-wal"));
+    QFile::remove(fileName + QLatin1String("-shm"));
     return QFile::remove(fileName);
 }
 
@@ -303,6 +593,47 @@ QStringList MetaDataDB::tableUpdates2()
     return tableUpdates;
 }
 
+QStringList MetaDataDB::tableUpdates3()
+{
+    /* Indexes for the per-identity lookups; REALMS and REFS are already
+     * covered by their primary keys. */
+    QStringList tableUpdates = QStringList()
+        << QString::fromLatin1(
+            "CREATE INDEX IF NOT EXISTS idx_ACL_identity_id "
+            "ON ACL (identity_id, method_id, mechanism_id, token_id)")
+        << QString::fromLatin1(
+            "CREATE INDEX IF NOT EXISTS idx_OWNER_identity_id "
+            "ON OWNER (identity_id, token_id)");
+
+    return tableUpdates;
+}
+
+bool MetaDataDB::dropForeignKeyTriggers()
+{
+    /* The triggers emulating the foreign keys constraints are redundant if
+     * SQLite enforces the constraints declared in the tables. */
+    if (!m_foreignKeys)
+        return true;
+
+    QStringList triggers = queryList(
+        S("SELECT name FROM sqlite_master "
+          "WHERE type = 'trigger' AND name GLOB 'fk*'"));
+    foreach (QString trigger, triggers) {
+        QSqlQuery query =
+            exec(QString::fromLatin1("DROP TRIGGER IF EXISTS %1").arg(trigger));
+        query.clear();
+
+        if (lastError().isValid()) {
+            BLAME() << "Error occurred while dropping trigger" << trigger;
+            return false;
+        }
+        commit();
+    }
+    TRACE() << "Dropped" << triggers.count() << "triggers";
+
+    return true;
+}
+
 bool MetaDataDB::createTables()
 {
     /* !!! Foreign keys support seems to be disabled, for the moment... */
@@ -344,8 +675,31 @@ bool MetaDataDB::createTables()
             "(identity_id INTEGER CONSTRAINT fk_identity_id REFERENCES CREDENTIALS(id) ON DELETE CASCADE,"
             "token_id INTEGER CONSTRAINT fk_token_id REFERENCES TOKENS(id) ON DELETE CASCADE,"
             "ref TEXT,"
-            "PRIMARY KEY (identity_id, token_id, ref))")
+            "PRIMARY KEY (identity_id, token_id, ref))");
+
+    createTableQuery << foreignKeyTriggers();
+
+    //insert table updates
+    createTableQuery << tableUpdates2();
+    createTableQuery << tableUpdates3();
 
+    foreach (QString createTable, createTableQuery) {
+        exec(createTable);
+
+        if (lastError().isValid()) {
+            BLAME() << "Error occurred while creating the database.";
+            return false;
+        }
+        commit();
+    }
+    TRACE() << "Creation successful";
+
+    return dropForeignKeyTriggers();
+}
+
+QStringList MetaDataDB::foreignKeyTriggers()
+{
+    QStringList triggers = QStringList()
 /*
 * triggers generated with
 * http://www.rcs-comp.com/site/index.php/view/Utilities-SQLite_foreign_key_trigger_generator
@@ -536,21 +890,7 @@ bool MetaDataDB::createTables()
 /*
 end of generated code
 */
-    //insert table updates
-    createTableQuery << tableUpdates2();
-
-    foreach (QString createTable, createTableQuery) {
-        exec(createTable);
-
-        if (lastError().isValid()) {
-            BLAME() << "Error occurred while creating the database.";
-            return false;
-        }
-        commit();
-    }
-    TRACE() << "Creation successful";
-
-    return true;
+    return triggers;
 }
 
 bool MetaDataDB::updateDB(int version)
@@ -607,23 +947,41 @@ bool MetaDataDB::updateDB(int version)
         }
     }
 
+    //convert from 2 to 3
+    if (version == 1 || version == 2) {
+        QStringList createIndexQuery = tableUpdates3();
+        foreach (QString createIndex, createIndexQuery) {
+            QSqlQuery query = exec(createIndex);
+            query.clear();
+
+            if (lastError().isValid()) {
+                TRACE() << "Error occurred while creating indexes.";
+                return false;
+            }
+            commit();
+        }
+        TRACE() << "Index creation successful";
+
+        if (!dropForeignKeyTriggers())
+            return false;
+    }
+
     return SqlDatabase::updateDB(version);
 }
 
 QStringList MetaDataDB::methods(const quint32 id, const QString &securityToken)
 {
     if (securityToken.isEmpty()) {
-        QStringList list = queryList(
-            QString::fromLatin1("SELECT DISTINCT METHODS.method FROM "
-                "( ACL JOIN METHODS ON ACL.method_id = METHODS.id ) "
-                "WHERE ACL.identity_id = '%1'").arg(id));
-        return list;
-    }
-    QSqlQuery q = newQuery();
-    q.prepare(S("SELECT DISTINCT METHODS.method FROM "
-                "( ACL JOIN METHODS ON ACL.method_id = METHODS.id) "
-                "WHERE ACL.identity_id = :id AND ACL.token_id = "
-                "(SELECT id FROM TOKENS where token = :token)"));
+        QSqlQuery q = prepare(S("SELECT DISTINCT METHODS.method FROM "
+                                "( ACL JOIN METHODS ON ACL.method_id = METHODS.id ) "
+                                "WHERE ACL.identity_id = :id"));
+        q.bindValue(S(":id"), id);
+        return queryList(q);
+    }
+    QSqlQuery q = prepare(S("SELECT DISTINCT METHODS.method FROM "
+                            "( ACL JOIN METHODS ON ACL.method_id = METHODS.id) "
+                            "WHERE ACL.identity_id = :id AND ACL.token_id = "
+                            "(SELECT id FROM TOKENS where token = :token)"));
     q.bindValue(S(":id"), id);
     q.bindValue(S(":token"), securityToken);
     return queryList(q);
@@ -633,125 +991,195 @@ quint32 MetaDataDB::methodId(const QString &method)
 {
     TRACE() << "method:" << method;
 
-    QSqlQuery q = newQuery();
-    q.prepare(S("SELECT id FROM METHODS WHERE method = :method"));
+    QSqlQuery q = prepare(S("SELECT id FROM METHODS WHERE method = :method"));
     q.bindValue(S(":method"), method);
     exec(q);
     if (!q.first()) {
         TRACE() << "No result or invalid method query.";
-        q.clear();
+        q.finish();
         return 0;
     }
 
     quint32 result = q.value(0).toUInt();
-    q.clear();
+    q.finish();
 
     return result;
 }
 
-SignonIdentityInfo MetaDataDB::identity(const quint32 id)
-{
-    QString query_str;
+/* Keys of the filter accepted by MetaDataDB::identities() */
+static const QString filterAuthMethod = QLatin1String("AuthMethod");
+static const QString filterUsername = QLatin1String("Username");
+static const QString filterRealm = QLatin1String("Realm");
+static const QString filterCaption = QLatin1String("Caption");
 
-    query_str = QString::fromLatin1(
-            "SELECT caption, username, flags, type "
-            "FROM credentials WHERE id = %1").arg(id);
-    QSqlQuery query = exec(query_str);
+static void bindValues(QSqlQuery &query, const QVariantList &values,
+                       int times = 1)
+{
+    for (int i = 0; i < times; i++) {
+        foreach (const QVariant &value, values)
+            query.addBindValue(value);
+    }
+}
 
-    if (!query.first()) {
+SignonIdentityInfo MetaDataDB::identity(const quint32 id)
+{
+    QList<SignonIdentityInfo> list =
+        loadIdentities(S("CREDENTIALS.id = ?"), QVariantList() << id);
+    if (list.isEmpty()) {
         TRACE() << "No result or invalid credentials query.";
-        query.clear();
         return SignonIdentityInfo();
     }
 
-    QString caption = query.value(0).toString();
-    QString username = query.value(1).toString();
-    int flags = query.value(2).toInt();
-    bool savePassword = flags & RememberPassword;
-    bool validated =  flags & Validated;
-    bool isUserNameSecret = flags & UserNameIsSecret;
-    if (isUserNameSecret) username = QString();
-    int type = query.value(3).toInt();
-    query.clear();
-
-    QStringList realms = queryList(
-            QString::fromLatin1("SELECT realm FROM REALMS "
-                    "WHERE identity_id = %1").arg(id));
-
-    QStringList ownerTokens = queryList(
-            QString::fromLatin1("SELECT token FROM TOKENS "
-                                "WHERE id IN "
-                                "(SELECT token_id FROM OWNER WHERE identity_id = '%1' )")
-                                .arg(id));
-
-
-    query_str = QString::fromLatin1("SELECT token FROM TOKENS "
-            "WHERE id IN "
-            "(SELECT token_id FROM ACL WHERE identity_id = '%1' )")
-            .arg(id);
-    query = exec(query_str);
-    QStringList securityTokens;
-    while (query.next()) {
-        securityTokens.append(query.value(0).toString());
-    }
-    query.clear();
-
-    QMap<QString, QVariant> methods;
-    query_str = QString::fromLatin1(
-            "SELECT DISTINCT ACL.method_id, METHODS.method FROM "
-            "( ACL JOIN METHODS ON ACL.method_id = METHODS.id ) "
-            "WHERE ACL.identity_id = '%1'").arg(id);
-    query = exec(query_str);
-    while (query.next()) {
-        QString queryStr =
-            QString::fromLatin1("SELECT DISTINCT MECHANISMS.mechanism FROM "
-                "( MECHANISMS JOIN ACL "
-                "ON ACL.mechanism_id = MECHANISMS.id ) "
-                "WHERE ACL.method_id = '%1' AND ACL.identity_id = '%2' ")
-                .arg(query.value(0).toInt()).arg(id);
-        QStringList mechanisms = queryList(queryStr);
-        methods.insert(query.value(1).toString(), mechanisms);
-    }
-    query.clear();
-
-    int refCount = 0;
-    //TODO query for refcount
-
-    SignonIdentityInfo info =
-        SignonIdentityInfo(id, username, QString(), savePassword,
-                           caption, methods, realms, securityTokens,
-                           ownerTokens,
-                           type, refCount, validated);
-    info.setUserNameSecret(isUserNameSecret);
-    return info;
+    return list.first();
 }
 
 QList<SignonIdentityInfo> MetaDataDB::identities(const QMap<QString, QString> &filter)
 {
-    TRACE();
-    Q_UNUSED(filter)
-    QList<SignonIdentityInfo> result;
+    TRACE() << filter;
 
-    QString queryStr(QString::fromLatin1("SELECT id FROM credentials"));
+    /* Every filter value is a wildcard pattern (as in SQL GLOB) which must
+     * match the respective identity field; the criteria are ANDed. */
+    QStringList conditions;
+    QVariantList values;
+    QMapIterator<QString, QString> it(filter);
+    while (it.hasNext()) {
+        it.next();
+        if (it.key() == filterCaption) {
+            conditions << S("CREDENTIALS.caption GLOB ?");
+        } else if (it.key() == filterUsername) {
+            conditions << S("CREDENTIALS.username GLOB ?");
+        } else if (it.key() == filterRealm) {
+            conditions << S("CREDENTIALS.id IN "
+                            "(SELECT identity_id FROM REALMS "
+                            "WHERE realm GLOB ?)");
+        } else if (it.key() == filterAuthMethod) {
+            conditions << S("CREDENTIALS.id IN "
+                            "(SELECT ACL.identity_id FROM "
+                            "( ACL JOIN METHODS ON ACL.method_id = METHODS.id ) "
+                            "WHERE METHODS.method GLOB ?)");
+        } else {
+            TRACE() << "Ignoring unknown filter criteria:" << it.key();
+            continue;
+        }
+        values << it.value();
+    }
 
-    // TODO - process filtering step here !!!
+    if (conditions.isEmpty())
+        conditions << S("1");
 
-    queryStr += QString::fromLatin1(" ORDER BY id");
+    return loadIdentities(conditions.join(S(" AND ")), values);
+}
 
-    QSqlQuery query = exec(queryStr);
+QList<SignonIdentityInfo>
+MetaDataDB::loadIdentities(const QString &condition,
+                           const QVariantList &values)
+{
+    /* All the identities matching the condition are loaded with a fixed
+     * number of queries: the CREDENTIALS rows, then all the string lists
+     * (realms, ACL and owner tokens) tagged by list type, then all the
+     * (method, mechanism) pairs; the results are assembled in memory. */
+    QList<SignonIdentityInfo> result;
+    QString selection =
+        QString::fromLatin1("(SELECT id FROM CREDENTIALS WHERE %1)")
+        .arg(condition);
+
+    QSqlQuery query = prepare(QString::fromLatin1(
+        "SELECT id, caption, username, flags, type "
+        "FROM CREDENTIALS WHERE %1 ORDER BY id").arg(condition));
+    bindValues(query, values);
+    exec(query);
     if (errorOccurred()) {
         TRACE() << "Error occurred while fetching credentials from database.";
+        query.finish();
         return result;
     }
 
     while (query.next()) {
-        SignonIdentityInfo info = identity(query.value(0).toUInt());
-        if (errorOccurred())
-            break;
+        quint32 id = query.value(0).toUInt();
+        QString caption = query.value(1).toString();
+        QString username = query.value(2).toString();
+        int flags = query.value(3).toInt();
+        bool savePassword = flags & RememberPassword;
+        bool validated =  flags & Validated;
+        bool isUserNameSecret = flags & UserNameIsSecret;
+        if (isUserNameSecret) username = QString();
+        int type = query.value(4).toInt();
+
+        int refCount = 0;
+        //TODO query for refcount
+
+        SignonIdentityInfo info =
+            SignonIdentityInfo(id, username, QString(), savePassword,
+                               caption, QMap<QString, QVariant>(),
+                               QStringList(), QStringList(), QStringList(),
+                               type, refCount, validated);
+        info.setUserNameSecret(isUserNameSecret);
         result << info;
     }
+    query.finish();
+
+    if (result.isEmpty())
+        return result;
+
+    QHash<quint32, QStringList> realms;
+    QHash<quint32, QStringList> securityTokens;
+    QHash<quint32, QStringList> ownerTokens;
+
+    QSqlQuery listsQuery = prepare(QString::fromLatin1(
+        "SELECT 0, identity_id, realm, rowid FROM REALMS "
+        "WHERE identity_id IN %1 "
+        "UNION "
+        "SELECT 1, ACL.identity_id, TOKENS.token, TOKENS.id FROM "
+        "( ACL JOIN TOKENS ON ACL.token_id = TOKENS.id ) "
+        "WHERE ACL.identity_id IN %1 "
+        "UNION "
+        "SELECT 2, OWNER.identity_id, TOKENS.token, TOKENS.id FROM "
+        "( OWNER JOIN TOKENS ON OWNER.token_id = TOKENS.id ) "
+        "WHERE OWNER.identity_id IN %1 "
+        "ORDER BY 1, 4").arg(selection));
+    bindValues(listsQuery, values, 3);
+    exec(listsQuery);
+    while (listsQuery.next()) {
+        quint32 id = listsQuery.value(1).toUInt();
+        QString value = listsQuery.value(2).toString();
+        switch (listsQuery.value(0).toInt()) {
+            case 0: realms[id].append(value); break;
+            case 1: securityTokens[id].append(value); break;
+            case 2: ownerTokens[id].append(value); break;
+            default: break;
+        }
+    }
+    listsQuery.finish();
+
+    QHash<quint32, QMap<MethodName, MechanismsList> > methods;
+    QSqlQuery methodsQuery = prepare(QString::fromLatin1(
+        "SELECT DISTINCT ACL.identity_id, METHODS.method, "
+        "MECHANISMS.mechanism FROM "
+        "( ACL JOIN METHODS ON ACL.method_id = METHODS.id ) "
+        "LEFT JOIN MECHANISMS ON ACL.mechanism_id = MECHANISMS.id "
+        "WHERE ACL.identity_id IN %1").arg(selection));
+    bindValues(methodsQuery, values);
+    exec(methodsQuery);
+    while (methodsQuery.next()) {
+        /* A NULL mechanism means that the method has no mechanisms
+         * restrictions: just make sure that the method is listed. */
+        quint32 id = methodsQuery.value(0).toUInt();
+        MechanismsList &mechanisms =
+            methods[id][methodsQuery.value(1).toString()];
+        if (!methodsQuery.value(2).isNull())
+            mechanisms.append(methodsQuery.value(2).toString());
+    }
+    methodsQuery.finish();
+
+    QList<SignonIdentityInfo>::iterator i;
+    for (i = result.begin(); i != result.end(); ++i) {
+        quint32 id = i->id();
+        i->setRealms(realms.value(id));
+        i->setAccessControlList(securityTokens.value(id));
+        i->setOwnerList(ownerTokens.value(id));
+        i->setMethods(methods.value(id));
+    }
 
-    query.clear();
     return result;
 }
 
@@ -779,40 +1207,36 @@ quint32 MetaDataDB::updateIdentity(const SignonIdentityInfo &info)
 
     /* Security tokens insert */
     foreach (QString token, info.accessControlList()) {
-        QSqlQuery tokenInsert = newQuery();
-        tokenInsert.prepare(S("INSERT OR IGNORE INTO TOKENS (token) "
-                              "VALUES ( :token )"));
+        QSqlQuery tokenInsert = prepare(S("INSERT OR IGNORE INTO TOKENS (token) "
+                                          "VALUES ( :token )"));
         tokenInsert.bindValue(S(":token"), token);
         exec(tokenInsert);
-        tokenInsert.clear();
+        tokenInsert.finish();
     }
 
     foreach (QString token, info.ownerList()) {
         if (!token.isEmpty()) {
-            QSqlQuery tokenInsert = newQuery();
-            tokenInsert.prepare(S("INSERT OR IGNORE INTO TOKENS (token) "
-                                  "VALUES ( :token )"));
+            QSqlQuery tokenInsert = prepare(S("INSERT OR IGNORE INTO TOKENS (token) "
+                                              "VALUES ( :token )"));
             tokenInsert.bindValue(S(":token"), token);
             exec(tokenInsert);
-            tokenInsert.clear();
+            tokenInsert.finish();
         }
     }
 
     if (!info.isNew()) {
         //remove acl
-        QString queryStr = QString::fromLatin1(
-                    "DELETE FROM ACL WHERE "
-                    "identity_id = '%1'")
-                    .arg(info.id());
-        QSqlQuery insertQuery = exec(queryStr);
-        insertQuery.clear();
+        QSqlQuery aclDelete = prepare(S("DELETE FROM ACL WHERE "
+                                        "identity_id = :id"));
+        aclDelete.bindValue(S(":id"), info.id());
+        exec(aclDelete);
+        aclDelete.finish();
         //remove owner
-        queryStr = QString::fromLatin1(
-                    "DELETE FROM OWNER WHERE "
-                    "identity_id = '%1'")
-                    .arg(info.id());
-        insertQuery = exec(queryStr);
-        insertQuery.clear();
+        QSqlQuery ownerDelete = prepare(S("DELETE FROM OWNER WHERE "
+                                          "identity_id = :id"));
+        ownerDelete.bindValue(S(":id"), info.id());
+        exec(ownerDelete);
+        ownerDelete.finish();
     }
 
     /* ACL insert, this will do basically identity level ACL */
@@ -822,90 +1246,84 @@ quint32 MetaDataDB::updateIdentity(const SignonIdentityInfo &info)
         if (!info.accessControlList().isEmpty()) {
             foreach (QString token, info.accessControlList()) {
                 foreach (QString mech, it.value()) {
-                    QSqlQuery aclInsert = newQuery();
-                    aclInsert.prepare(S("INSERT OR REPLACE INTO ACL "
-                                        "(identity_id, method_id, mechanism_id, token_id) "
-                                        "VALUES ( :id, "
-                                        "( SELECT id FROM METHODS WHERE method = :method ),"
-                                        "( SELECT id FROM MECHANISMS WHERE mechanism= :mech ), "
-                                        "( SELECT id FROM TOKENS WHERE token = :token ))"));
+                    QSqlQuery aclInsert = prepare(S("INSERT OR REPLACE INTO ACL "
+                                                    "(identity_id, method_id, mechanism_id, token_id) "
+                                                    "VALUES ( :id, "
+                                                    "( SELECT id FROM METHODS WHERE method = :method ),"
+                                                    "( SELECT id FROM MECHANISMS WHERE mechanism= :mech ), "
+                                                    "( SELECT id FROM TOKENS WHERE token = :token ))"));
                     aclInsert.bindValue(S(":id"), id);
                     aclInsert.bindValue(S(":method"), it.key());
                     aclInsert.bindValue(S(":mech"), mech);
                     aclInsert.bindValue(S(":token"), token);
                     exec(aclInsert);
-                    aclInsert.clear();
+                    aclInsert.finish();
                 }
                 //insert entires for empty mechs list
                 if (it.value().isEmpty()) {
-                    QSqlQuery aclInsert = newQuery();
-                    aclInsert.prepare(S("INSERT OR REPLACE INTO ACL (identity_id, method_id, token_id) "
-                                        "VALUES ( :id, "
-                                        "( SELECT id FROM METHODS WHERE method = :method ),"
-                                        "( SELECT id FROM TOKENS WHERE token = :token ))"));
+                    QSqlQuery aclInsert = prepare(S("INSERT OR REPLACE INTO ACL (identity_id, method_id, token_id) "
+                                                    "VALUES ( :id, "
+                                                    "( SELECT id FROM METHODS WHERE method = :method ),"
+                                                    "( SELECT id FROM TOKENS WHERE token = :token ))"));
                     aclInsert.bindValue(S(":id"), id);
                     aclInsert.bindValue(S(":method"), it.key());
                     aclInsert.bindValue(S(":token"), token);
                     exec(aclInsert);
-                    aclInsert.clear();
+                    aclInsert.finish();
                 }
             }
         } else {
             foreach (QString mech, it.value()) {
-                QSqlQuery aclInsert = newQuery();
-                aclInsert.prepare(S("INSERT OR REPLACE INTO ACL "
-                                    "(identity_id, method_id, mechanism_id) "
-                                    "VALUES ( :id, "
-                                    "( SELECT id FROM METHODS WHERE method = :method ),"
-                                    "( SELECT id FROM MECHANISMS WHERE mechanism= :mech )"
-                                    ")"));
+                QSqlQuery aclInsert = prepare(S("INSERT OR REPLACE INTO ACL "
+                                                "(identity_id, method_id, mechanism_id) "
+                                                "VALUES ( :id, "
+                                                "( SELECT id FROM METHODS WHERE method = :method ),"
+                                                "( SELECT id FROM MECHANISMS WHERE mechanism= :mech )"
+                                                ")"));
                 aclInsert.bindValue(S(":id"), id);
                 aclInsert.bindValue(S(":method"), it.key());
                 aclInsert.bindValue(S(":mech"), mech);
                 exec(aclInsert);
-                aclInsert.clear();
+                aclInsert.finish();
             }
             //insert entires for empty mechs list
             if (it.value().isEmpty()) {
-                QSqlQuery aclInsert = newQuery();
-                aclInsert.prepare(S("INSERT OR REPLACE INTO ACL (identity_id, method_id) "
-                                    "VALUES ( :id, "
-                                    "( SELECT id FROM METHODS WHERE method = :method )"
-                                    ")"));
+                QSqlQuery aclInsert = prepare(S("INSERT OR REPLACE INTO ACL (identity_id, method_id) "
+                                                "VALUES ( :id, "
+                                                "( SELECT id FROM METHODS WHERE method = :method )"
+                                                ")"));
                 aclInsert.bindValue(S(":id"), id);
                 aclInsert.bindValue(S(":method"), it.key());
                 exec(aclInsert);
-                aclInsert.clear();
+                aclInsert.finish();
             }
         }
     }
     //insert acl in case where methods are missing
     if (info.methods().isEmpty()) {
         foreach (QString token, info.accessControlList()) {
-            QSqlQuery aclInsert = newQuery();
-            aclInsert.prepare(S("INSERT OR REPLACE INTO ACL "
-                                "(identity_id, token_id) "
-                                "VALUES ( :id, "
-                                "( SELECT id FROM TOKENS WHERE token = :token ))"));
+            QSqlQuery aclInsert = prepare(S("INSERT OR REPLACE INTO ACL "
+                                            "(identity_id, token_id) "
+                                            "VALUES ( :id, "
+                                            "( SELECT id FROM TOKENS WHERE token = :token ))"));
             aclInsert.bindValue(S(":id"), id);
             aclInsert.bindValue(S(":token"), token);
             exec(aclInsert);
-            aclInsert.clear();
+            aclInsert.finish();
         }
     }
 
     //insert owner list
     foreach (QString token, info.ownerList()) {
         if (!token.isEmpty()) {
-            QSqlQuery ownerInsert = newQuery();
-            ownerInsert.prepare(S("INSERT OR REPLACE INTO OWNER "
+            QSqlQuery ownerInsert = prepare(S("INSERT OR REPLACE INTO OWNER "
                             "(identity_id, token_id) "
                             "VALUES ( :id, "
                             "( SELECT id FROM TOKENS WHERE token = :token ))"));
             ownerInsert.bindValue(S(":id"), id);
             ownerInsert.bindValue(S(":token"), token);
             exec(ownerInsert);
-            ownerInsert.clear();
+            ownerInsert.finish();
         }
     }
 
@@ -923,16 +1341,12 @@ bool MetaDataDB::removeIdentity(const quint32 id)
     TRACE();
 
     QStringList queries = QStringList()
-        << QString::fromLatin1(
-            "DELETE FROM CREDENTIALS WHERE id = %1").arg(id)
-        << QString::fromLatin1(
-            "DELETE FROM ACL WHERE identity_id = %1").arg(id)
-        << QString::fromLatin1(
-            "DELETE FROM REALMS WHERE identity_id = %1").arg(id)
-        << QString::fromLatin1(
-            "DELETE FROM owner WHERE identity_id = %1").arg(id);
+        << QLatin1String("DELETE FROM CREDENTIALS WHERE id = ?")
+        << QLatin1String("DELETE FROM ACL WHERE identity_id = ?")
+        << QLatin1String("DELETE FROM REALMS WHERE identity_id = ?")
+        << QLatin1String("DELETE FROM owner WHERE identity_id = ?");
 
-    return transactionalExec(queries);
+    return transactionalExec(queries, QVariantList() << id);
 }
 
 bool MetaDataDB::clear()
@@ -953,18 +1367,20 @@ bool MetaDataDB::clear()
 
 QStringList MetaDataDB::accessControlList(const quint32 identityId)
 {
-    return queryList(QString::fromLatin1("SELECT token FROM TOKENS "
-            "WHERE id IN "
-            "(SELECT token_id FROM ACL WHERE identity_id = '%1' )")
-            .arg(identityId));
+    QSqlQuery q = prepare(S("SELECT token FROM TOKENS "
+                            "WHERE id IN "
+                            "(SELECT token_id FROM ACL WHERE identity_id = :id )"));
+    q.bindValue(S(":id"), identityId);
+    return queryList(q);
 }
 
 QStringList MetaDataDB::ownerList(const quint32 identityId)
 {
-    return queryList(QString::fromLatin1("SELECT token FROM TOKENS "
-            "WHERE id IN "
-            "(SELECT token_id FROM OWNER WHERE identity_id = '%1' )")
-            .arg(identityId));
+    QSqlQuery q = prepare(S("SELECT token FROM TOKENS "
+                            "WHERE id IN "
+                            "(SELECT token_id FROM OWNER WHERE identity_id = :id )"));
+    q.bindValue(S(":id"), identityId);
+    return queryList(q);
 }
 
 bool MetaDataDB::addReference(const quint32 id, const QString &token, const QString &reference)
@@ -980,23 +1396,21 @@ bool MetaDataDB::addReference(const quint32 id, const QString &token, const QStr
     bool allOk = true;
 
     /* Security token insert */
-    QSqlQuery tokenInsert = newQuery();
-    tokenInsert.prepare(S("INSERT OR IGNORE INTO TOKENS (token) "
-                          "VALUES ( :token )"));
+    QSqlQuery tokenInsert = prepare(S("INSERT OR IGNORE INTO TOKENS (token) "
+                                      "VALUES ( :token )"));
     tokenInsert.bindValue(S(":token"), token);
     exec(tokenInsert);
     if (errorOccurred()) {
                 allOk = false;
     }
-    tokenInsert.clear();
+    tokenInsert.finish();
 
-    QSqlQuery refsInsert = newQuery();
-    refsInsert.prepare(S("INSERT OR REPLACE INTO REFS "
-                         "(identity_id, token_id, ref) "
-                         "VALUES ( :id, "
-                         "( SELECT id FROM TOKENS WHERE token = :token ),"
-                         ":reference"
-                         ")"));
+    QSqlQuery refsInsert = prepare(S("INSERT OR REPLACE INTO REFS "
+                                     "(identity_id, token_id, ref) "
+                                     "VALUES ( :id, "
+                                     "( SELECT id FROM TOKENS WHERE token = :token ),"
+                                     ":reference"
+                                     ")"));
     refsInsert.bindValue(S(":id"), id);
     refsInsert.bindValue(S(":token"), token);
     refsInsert.bindValue(S(":reference"), reference);
@@ -1004,6 +1418,7 @@ bool MetaDataDB::addReference(const quint32 id, const QString &token, const QStr
     if (errorOccurred()) {
                 allOk = false;
     }
+    refsInsert.finish();
 
     if (allOk && commit()) {
         TRACE() << "Data insertion ok.";
@@ -1030,26 +1445,26 @@ bool MetaDataDB::removeReference(const quint32 id, const QString &token, const Q
     }
 
     bool allOk = true;
-    QSqlQuery refsDelete = newQuery();
+    QSqlQuery refsDelete;
 
     if (reference.isEmpty()) {
-        refsDelete.prepare(S("DELETE FROM REFS "
-                             "WHERE identity_id = :id AND "
-                             "token_id = ( SELECT id FROM TOKENS WHERE token = :token )"));
+        refsDelete = prepare(S("DELETE FROM REFS "
+                               "WHERE identity_id = :id AND "
+                               "token_id = ( SELECT id FROM TOKENS WHERE token = :token )"));
         refsDelete.bindValue(S(":id"), id);
         refsDelete.bindValue(S(":token"), token);
     } else {
-        refsDelete.prepare(S("DELETE FROM REFS "
-                             "WHERE identity_id = :id AND "
-                             "token_id = ( SELECT id FROM TOKENS WHERE token = :token ) "
-                             "AND ref = :ref"));
+        refsDelete = prepare(S("DELETE FROM REFS "
+                               "WHERE identity_id = :id AND "
+                               "token_id = ( SELECT id FROM TOKENS WHERE token = :token ) "
+                               "AND ref = :ref"));
         refsDelete.bindValue(S(":id"), id);
         refsDelete.bindValue(S(":token"), token);
         refsDelete.bindValue(S(":ref"), reference);
     }
 
     exec(refsDelete);
-    refsDelete.clear();
+    refsDelete.finish();
     if (errorOccurred()) {
                 allOk = false;
     }
@@ -1065,14 +1480,15 @@ bool MetaDataDB::removeReference(const quint32 id, const QString &token, const Q
 
 QStringList MetaDataDB::references(const quint32 id, const QString &token)
 {
-    if (token.isEmpty())
-        return queryList(QString::fromLatin1("SELECT ref FROM REFS "
-            "WHERE identity_id = '%1'")
-            .arg(id));
-    QSqlQuery q = newQuery();
-    q.prepare(S("SELECT ref FROM REFS "
-                "WHERE identity_id = :id AND "
-                "token_id = (SELECT id FROM TOKENS WHERE token = :token )"));
+    if (token.isEmpty()) {
+        QSqlQuery q = prepare(S("SELECT ref FROM REFS "
+                                "WHERE identity_id = :id"));
+        q.bindValue(S(":id"), id);
+        return queryList(q);
+    }
+    QSqlQuery q = prepare(S("SELECT ref FROM REFS "
+                            "WHERE identity_id = :id AND "
+                            "token_id = (SELECT id FROM TOKENS WHERE token = :token )"));
     q.bindValue(S(":id"), id);
     q.bindValue(S(":token"), token);
     return queryList(q);
@@ -1087,23 +1503,21 @@ bool MetaDataDB::insertMethods(QMap<QString, QStringList> methods)
     QMapIterator<QString, QStringList> it(methods);
     while (it.hasNext()) {
         it.next();
-        QSqlQuery methodInsert = newQuery();
-        methodInsert.prepare(S("INSERT OR IGNORE INTO METHODS (method) "
-                               "VALUES( :method )"));
+        QSqlQuery methodInsert = prepare(S("INSERT OR IGNORE INTO METHODS (method) "
+                                           "VALUES( :method )"));
         methodInsert.bindValue(S(":method"), it.key());
         exec(methodInsert);
-        methodInsert.clear();
+        methodInsert.finish();
 
         if (errorOccurred()) allOk = false;
         //insert (unique) mechanism names
         foreach (QString mech, it.value()) {
-            QSqlQuery mechInsert = newQuery();
-            mechInsert.prepare(S("INSERT OR IGNORE INTO MECHANISMS (mechanism) "
-                                 "VALUES( :mech )"));
+            QSqlQuery mechInsert = prepare(S("INSERT OR IGNORE INTO MECHANISMS (mechanism) "
+                                             "VALUES( :mech )"));
             mechInsert.bindValue(S(":mech"), mech);
             exec(mechInsert);
             if (errorOccurred()) allOk = false;
-            mechInsert.clear();
+            mechInsert.finish();
         }
     }
     return allOk;
@@ -1112,7 +1526,7 @@ bool MetaDataDB::insertMethods(QMap<QString, QStringList> methods)
 quint32 MetaDataDB::updateCredentials(const SignonIdentityInfo &info)
 {
     quint32 id;
-    QSqlQuery q = newQuery();
+    QSqlQuery q;
 
     int flags = 0;
     if (info.validated()) flags |= Validated;
@@ -1121,16 +1535,16 @@ quint32 MetaDataDB::updateCredentials(const SignonIdentityInfo &info)
 
     if (!info.isNew()) {
         TRACE() << "UPDATE:" << info.id() ;
-        q.prepare(S("UPDATE CREDENTIALS SET caption = :caption, "
-                    "username = :username, "
-                    "flags = :flags, "
-                    "type = :type WHERE id = :id"));
+        q = prepare(S("UPDATE CREDENTIALS SET caption = :caption, "
+                      "username = :username, "
+                      "flags = :flags, "
+                      "type = :type WHERE id = :id"));
         q.bindValue(S(":id"), info.id());
     } else {
         TRACE() << "INSERT:" << info.id();
-        q.prepare(S("INSERT INTO CREDENTIALS "
-                    "(caption, username, flags, type) "
-                    "VALUES(:caption, :username, :flags, :type)"));
+        q = prepare(S("INSERT INTO CREDENTIALS "
+                      "(caption, username, flags, type) "
+                      "VALUES(:caption, :username, :flags, :type)"));
     }
     q.bindValue(S(":username"),
                 info.isUserNameSecret() ? QString() : info.userName());
@@ -1140,7 +1554,7 @@ quint32 MetaDataDB::updateCredentials(const SignonIdentityInfo &info)
     exec(q);
     if (errorOccurred()) {
         TRACE() << "Error occurred while updating crendentials";
-        q.clear();
+        q.finish();
         return 0;
     }
 
@@ -1149,7 +1563,7 @@ quint32 MetaDataDB::updateCredentials(const SignonIdentityInfo &info)
         QVariant idVariant = q.lastInsertId();
         if (!idVariant.isValid()) {
             TRACE() << "Error occurred while inserting crendentials";
-            q.clear();
+            q.finish();
             return 0;
         }
 
@@ -1158,27 +1572,25 @@ quint32 MetaDataDB::updateCredentials(const SignonIdentityInfo &info)
         id = info.id() ;
     }
 
-    q.clear();
+    q.finish();
     return id;
 }
 
 bool MetaDataDB::updateRealms(quint32 id, const QStringList &realms, bool isNew)
 {
-    QString queryStr;
-
     if (!isNew) {
         //remove realms list
-        queryStr = QString::fromLatin1(
-            "DELETE FROM REALMS WHERE identity_id = '%1'")
-            .arg(id);
-        exec(queryStr);
+        QSqlQuery realmsDelete = prepare(S("DELETE FROM REALMS "
+                                           "WHERE identity_id = :id"));
+        realmsDelete.bindValue(S(":id"), id);
+        exec(realmsDelete);
+        realmsDelete.finish();
     }
 
     /* Realms insert */
     bool result = true;
-    QSqlQuery q = newQuery();
-    q.prepare(S("INSERT OR IGNORE INTO REALMS (identity_id, realm) "
-                "VALUES (:id, :realm)"));
+    QSqlQuery q = prepare(S("INSERT OR IGNORE INTO REALMS (identity_id, realm) "
+                            "VALUES (:id, :realm)"));
     foreach (QString realm, realms) {
         q.bindValue(S(":id"), id);
         q.bindValue(S(":realm"), realm);
@@ -1190,7 +1602,7 @@ bool MetaDataDB::updateRealms(quint32 id, const QStringList &realms, bool isNew)
         }
     }
 
-    q.clear();
+    q.finish();
     return result;
 }
 
@@ -1251,7 +1663,7 @@ bool SecretsDB::updateCredentials(const quint32 id,
         TRACE() << "Could not start transaction. Error inserting credentials.";
         return false;
     }
-    QSqlQuery query = newQuery();
+    QSqlQuery query;
     /* Credentials insert */
     QString password;
     if (info.storePassword())
@@ -1265,24 +1677,25 @@ bool SecretsDB::updateCredentials(const quint32 id,
     /* The identity might not be new and have no secret info stored at
      * the same time - e.g. if the secrets db has been deleted */
     bool hasSecretInfoStored = false;
-    QString queryStr = QString::fromLatin1(
-        "SELECT id FROM credentials WHERE id = %1").arg(info.id());
-
-    QSqlQuery selectQuery = exec(queryStr);
+    QSqlQuery selectQuery = prepare(S("SELECT id FROM CREDENTIALS "
+                                      "WHERE id = :id"));
+    selectQuery.bindValue(S(":id"), info.id());
+    exec(selectQuery);
     if (selectQuery.first())
         hasSecretInfoStored = true;
+    selectQuery.finish();
 
     if (!info.isNew() && hasSecretInfoStored) {
         TRACE() << "UPDATE:" << id;
-        query.prepare(S("UPDATE CREDENTIALS SET username = :username, "
-                        "password = :password "
-                        "WHERE id = :id"));
+        query = prepare(S("UPDATE CREDENTIALS SET username = :username, "
+                          "password = :password "
+                          "WHERE id = :id"));
 
      } else {
         TRACE() << "INSERT:" << id;
-        query.prepare(S("INSERT OR REPLACE INTO CREDENTIALS "
-                        "(id, username, password) "
-                        "VALUES(:id, :username, :password)"));
+        query = prepare(S("INSERT OR REPLACE INTO CREDENTIALS "
+                          "(id, username, password) "
+                          "VALUES(:id, :username, :password)"));
     }
 
     query.bindValue(S(":id"), id);
@@ -1290,9 +1703,7 @@ bool SecretsDB::updateCredentials(const quint32 id,
     query.bindValue(S(":password"), password);
 
     exec(query);
-
-    selectQuery.clear();
-    query.clear();
+    query.finish();
 
     if (errorOccurred()) {
         rollback();
@@ -1307,25 +1718,23 @@ bool SecretsDB::removeCredentials(const quint32 id)
     TRACE();
 
     QStringList queries = QStringList()
-        << QString::fromLatin1(
-            "DELETE FROM CREDENTIALS WHERE id = %1").arg(id)
-        << QString::fromLatin1(
-            "DELETE FROM STORE WHERE identity_id = %1").arg(id);
+        << QLatin1String("DELETE FROM CREDENTIALS WHERE id = ?")
+        << QLatin1String("DELETE FROM STORE WHERE identity_id = ?");
 
-    return transactionalExec(queries);
+    return transactionalExec(queries, QVariantList() << id);
 }
 
 bool SecretsDB::loadCredentials(SignonIdentityInfo &info)
 {
     TRACE();
 
-    QString queryStr =
-        QString::fromLatin1("SELECT username, password FROM credentials "
-                            "WHERE id = %1").arg(info.id());
-    QSqlQuery query = exec(queryStr);
+    QSqlQuery query = prepare(S("SELECT username, password FROM CREDENTIALS "
+                                "WHERE id = :id"));
+    query.bindValue(S(":id"), info.id());
+    exec(query);
     if (!query.first()) {
         TRACE() << "No result or invalid credentials query.";
-        query.clear();
+        query.finish();
         return false;
     }
 
@@ -1335,7 +1744,7 @@ bool SecretsDB::loadCredentials(SignonIdentityInfo &info)
 
     QString password = query.value(1).toString();
     info.setPassword(password);
-    query.clear();
+    query.finish();
     return true;
 }
 
@@ -1343,9 +1752,8 @@ bool SecretsDB::checkPassword(const quint32 id,
                               const QString &username,
                               const QString &password)
 {
-    QSqlQuery query = newQuery();
-    query.prepare(S("SELECT id FROM CREDENTIALS "
-                    "WHERE id = :id AND username = :username AND password = :password"));
+    QSqlQuery query = prepare(S("SELECT id FROM CREDENTIALS "
+                                "WHERE id = :id AND username = :username AND password = :password"));
     query.bindValue(S(":id"), id);
     query.bindValue(S(":username"), username);
     query.bindValue(S(":password"), password);
@@ -1354,12 +1762,12 @@ bool SecretsDB::checkPassword(const quint32 id,
 
     if (errorOccurred()) {
         TRACE() << "Error occurred while checking password";
-        result.clear();
+        result.finish();
         return false;
     }
     bool valid = false;
     valid = result.first();
-    result.clear();
+    result.finish();
 
     return valid;
 }
@@ -1368,15 +1776,14 @@ QVariantMap SecretsDB::loadData(quint32 id, quint32 method)
 {
     TRACE();
 
-    QSqlQuery q = newQuery();
-    q.prepare(S("SELECT key, value "
-                "FROM STORE WHERE identity_id = :id AND method_id = :method"));
+    QSqlQuery q = prepare(S("SELECT key, value "
+                            "FROM STORE WHERE identity_id = :id AND method_id = :method"));
     q.bindValue(S(":id"), id);
     q.bindValue(S(":method"), method);
     exec(q);
 
     if (errorOccurred()) {
-        q.clear();
+        q.finish();
         return QVariantMap();
     }
 
@@ -1390,7 +1797,7 @@ QVariantMap SecretsDB::loadData(quint32 id, quint32 method)
         result.insert(q.value(0).toString(), data);
     }
 
-    q.clear();
+    q.finish();
 
     return result;
 }
@@ -1399,57 +1806,94 @@ bool SecretsDB::storeData(quint32 id, quint32 method, const QVariantMap &data)
 {
     TRACE();
 
-    if (!startTransaction()) {
-        TRACE() << "Could not start transaction. Error inserting data.";
+    /* The values are compared serialized with the stored ones, so that
+     * only the keys which change are written */
+    QSqlQuery q = prepare(S("SELECT key, value "
+                            "FROM STORE WHERE identity_id = :id AND method_id = :method"));
+    q.bindValue(S(":id"), id);
+    q.bindValue(S(":method"), method);
+    exec(q);
+
+    if (errorOccurred()) {
+        q.finish();
         return false;
     }
 
-    bool allOk = true;
+    QHash<QString, QByteArray> stored;
+    while (q.next())
+        stored.insert(q.value(0).toString(), q.value(1).toByteArray());
+    q.finish();
+
+    QMap<QString, QByteArray> inserted;
+    QMap<QString, QByteArray> replaced;
+    QStringList removed;
     qint32 dataCounter = 0;
-    if (!(data.keys().empty())) {
-        QMapIterator<QString, QVariant> it(data);
-        while (it.hasNext()) {
-            it.next();
-
-            QByteArray array;
-            QDataStream stream(&array, QIODevice::WriteOnly);
-            stream << it.value();
-
-            dataCounter += it.key().size() +array.size();
-            if (dataCounter >= SSO_MAX_TOKEN_STORAGE) {
-                BLAME() << "storing data max size exceeded";
-                allOk = false;
-                break;
-            }
-            /* Key/value insert/replace/delete */
-            QSqlQuery query = newQuery();
-            if (it.value().isValid() && !it.value().isNull()) {
-                TRACE() << "insert";
-                query.prepare(S(
-                    "INSERT OR REPLACE INTO STORE "
-                    "(identity_id, method_id, key, value) "
-                    "VALUES(:id, :method, :key, :value)"));
-                query.bindValue(S(":value"), array);
-            } else {
-                TRACE() << "remove";
-                query.prepare(S(
-                    "DELETE FROM STORE WHERE identity_id = :id "
-                    "AND method_id = :method "
-                    "AND key = :key"));
+    QMapIterator<QString, QVariant> it(data);
+    while (it.hasNext()) {
+        it.next();
 
-            }
-            query.bindValue(S(":id"), id);
-            query.bindValue(S(":method"), method);
-            query.bindValue(S(":key"), it.key());
-            exec(query);
-            query.clear();
-            if (errorOccurred()) {
-                allOk = false;
-                break;
-            }
+        QByteArray array;
+        QDataStream stream(&array, QIODevice::WriteOnly);
+        stream << it.value();
+
+        dataCounter += it.key().size() +array.size();
+        if (dataCounter >= SSO_MAX_TOKEN_STORAGE) {
+            BLAME() << "storing data max size exceeded";
+            return false;
+        }
+
+        QHash<QString, QByteArray>::const_iterator current =
+            stored.constFind(it.key());
+        if (it.value().isValid() && !it.value().isNull()) {
+            if (current == stored.constEnd())
+                inserted.insert(it.key(), array);
+            else if (current.value() != array)
+                replaced.insert(it.key(), array);
+        } else if (current != stored.constEnd()) {
+            removed.append(it.key());
         }
     }
 
+    TRACE() << "insert:" << inserted.count() << "replace:" << replaced.count()
+        << "remove:" << removed.count();
+    if (inserted.isEmpty() && replaced.isEmpty() && removed.isEmpty())
+        return true;
+
+    if (!startTransaction()) {
+        TRACE() << "Could not start transaction. Error inserting data.";
+        return false;
+    }
+
+    bool allOk = true;
+    QSqlQuery insertQuery = prepare(S("INSERT INTO STORE "
+                                      "(identity_id, method_id, key, value) "
+                                      "VALUES(:id, :method, :key, :value)"));
+    QMapIterator<QString, QByteArray> insertIt(inserted);
+    while (allOk && insertIt.hasNext()) {
+        insertIt.next();
+        allOk = storeValue(insertQuery, id, method,
+                           insertIt.key(), insertIt.value());
+    }
+
+    QSqlQuery replaceQuery = prepare(S("UPDATE STORE SET value = :value "
+                                       "WHERE identity_id = :id "
+                                       "AND method_id = :method "
+                                       "AND key = :key"));
+    QMapIterator<QString, QByteArray> replaceIt(replaced);
+    while (allOk && replaceIt.hasNext()) {
+        replaceIt.next();
+        allOk = storeValue(replaceQuery, id, method,
+                           replaceIt.key(), replaceIt.value());
+    }
+
+    QSqlQuery removeQuery = prepare(S("DELETE FROM STORE WHERE identity_id = :id "
+                                      "AND method_id = :method "
+                                      "AND key = :key"));
+    foreach (QString key, removed) {
+        if (!allOk) break;
+        allOk = storeValue(removeQuery, id, method, key, QByteArray());
+    }
+
     if (allOk && commit()) {
         TRACE() << "Data insertion ok.";
         return true;
@@ -1459,6 +1903,19 @@ bool SecretsDB::storeData(quint32 id, quint32 method, const QVariantMap &data)
     return false;
 }
 
+bool SecretsDB::storeValue(QSqlQuery &query, quint32 id, quint32 method,
+                           const QString &key, const QByteArray &value)
+{
+    query.bindValue(S(":id"), id);
+    query.bindValue(S(":method"), method);
+    query.bindValue(S(":key"), key);
+    if (!value.isNull())
+        query.bindValue(S(":value"), value);
+    exec(query);
+    query.finish();
+    return !errorOccurred();
+}
+
 bool SecretsDB::removeData(quint32 id, quint32 method)
 {
     TRACE();
@@ -1468,18 +1925,18 @@ bool SecretsDB::removeData(quint32 id, quint32 method)
         return false;
     }
 
-    QSqlQuery q = newQuery();
+    QSqlQuery q;
     if (method == 0) {
-        q.prepare(S("DELETE FROM STORE WHERE identity_id = :id"));
+        q = prepare(S("DELETE FROM STORE WHERE identity_id = :id"));
     } else {
-        q.prepare(S("DELETE FROM STORE WHERE identity_id = :id "
-                    "AND method_id = :method"));
+        q = prepare(S("DELETE FROM STORE WHERE identity_id = :id "
+                      "AND method_id = :method"));
         q.bindValue(S(":method"), method);
     }
     q.bindValue(S(":id"), id);
 
     exec(q);
-    q.clear();
+    q.finish();
 
     if (!errorOccurred() && commit()) {
         TRACE() << "Data removal ok.";
@@ -1520,13 +1977,21 @@ CredentialsDB::ErrorMonitor::~ErrorMonitor()
 
 /*    -------   CredentialsDB  implementation   -------    */
 
-CredentialsDB::CredentialsDB(const QString &metaDataDbName):
+CredentialsDB::CredentialsDB(const QString &metaDataDbName,
+                             const SqlDatabaseConfiguration &metaDataConfiguration,
+                             const SqlDatabaseConfiguration &secretsConfiguration):
     secretsDB(0),
-    metaDataDB(new MetaDataDB(metaDataDbName, this))
+    metaDataDB(new MetaDataDB(metaDataDbName, this)),
+    m_secretsConfiguration(secretsConfiguration),
+    m_secretsBackup(false),
+    m_identityCache(SSO_IDENTITY_CACHE_SIZE),
+    m_identityCacheHits(0),
+    m_identityCacheMisses(0)
 {
     noSecretsDB = QSqlError(QLatin1String("Secrets DB not opened"),
                             QLatin1String("Secrets DB not opened"),
                             QSqlError::ConnectionError);
+    metaDataDB->setConfiguration(metaDataConfiguration);
 }
 
 CredentialsDB::~CredentialsDB()
@@ -1552,6 +2017,7 @@ bool CredentialsDB::init()
 bool CredentialsDB::openSecretsDB(const QString &secretsDbName)
 {
     secretsDB = new SecretsDB(secretsDbName);
+    secretsDB->setConfiguration(m_secretsConfiguration);
 
     if (!secretsDB->init()) {
         TRACE() << SqlDatabase::errorInfo(lastError());
@@ -1579,6 +2045,103 @@ void CredentialsDB::closeSecretsDB()
     }
 }
 
+bool CredentialsDB::startBackup(const QString &metaDataFileName,
+                                const QString &secretsFileName)
+{
+    TRACE();
+
+    INIT_ERROR();
+    finishBackup();
+
+    if (!secretsFileName.isEmpty()) {
+        RETURN_IF_NO_SECRETS_DB(false);
+    }
+
+    if (!metaDataDB->startBackup(metaDataFileName))
+        return false;
+
+    if (!secretsFileName.isEmpty()) {
+        if (!secretsDB->startBackup(secretsFileName)) {
+            metaDataDB->finishBackup();
+            return false;
+        }
+        m_secretsBackup = true;
+    }
+
+    return true;
+}
+
+bool CredentialsDB::backupStep(int pages)
+{
+    INIT_ERROR();
+
+    if (!metaDataDB->backupInProgress() && !m_secretsBackup)
+        return true;
+
+    /* Closing the secrets DB aborts the backup */
+    if (m_secretsBackup
+        && (!isSecretsDBOpen() || !secretsDB->backupInProgress())) {
+        TRACE() << "Secrets DB closed during the backup";
+        finishBackup();
+        _lastError = noSecretsDB;
+        return false;
+    }
+
+    /* A copy completed alone would miss the changes made afterwards to
+     * its DB, but not the other copy: the steps leave the last page of each
+     * DB, the changes made meanwhile through the connections being copied
+     * as well (the DBs are not vacuumed, so they don't shrink) */
+    int metaDataLeft = metaDataDB->backupRemaining();
+    int secretsLeft = m_secretsBackup ? secretsDB->backupRemaining() : 0;
+    if (metaDataLeft > pages || secretsLeft > pages) {
+        if (metaDataLeft > 1)
+            metaDataDB->backupStep(qMin(pages, metaDataLeft - 1));
+        if (secretsLeft > 1)
+            secretsDB->backupStep(qMin(pages, secretsLeft - 1));
+
+        if (metaDataDB->errorOccurred()
+            || (m_secretsBackup && secretsDB->errorOccurred())) {
+            finishBackup();
+        } else if (!metaDataDB->backupInProgress()
+                   || (m_secretsBackup && !secretsDB->backupInProgress())) {
+            finishBackup();
+            _lastError = QSqlError(S("Backup failed"),
+                                   S("A DB was copied alone"),
+                                   QSqlError::UnknownError);
+        }
+        return false;
+    }
+
+    /* The last step reads both DBs at once, in read transactions, and
+     * copies what is left of them */
+    bool done = false;
+    if (metaDataDB->startReadTransaction()) {
+        if (!m_secretsBackup) {
+            done = metaDataDB->backupStep(-1);
+        } else if (secretsDB->startReadTransaction()) {
+            done = metaDataDB->backupStep(-1) && secretsDB->backupStep(-1);
+            secretsDB->rollback();
+        }
+        metaDataDB->rollback();
+    }
+
+    if (!done && !metaDataDB->errorOccurred()
+        && !(m_secretsBackup && secretsDB->errorOccurred()))
+        _lastError = QSqlError(S("Backup failed"),
+                               S("The DBs could not be copied together"),
+                               QSqlError::UnknownError);
+    finishBackup();
+    return done;
+}
+
+void CredentialsDB::finishBackup()
+{
+    metaDataDB->finishBackup();
+    if (secretsDB != 0)
+        secretsDB->finishBackup();
+    m_secretsBackup = false;
+}
+
 CredentialsDBError CredentialsDB::lastError() const
 {
     return _lastError;
@@ -1603,7 +2166,21 @@ SignonIdentityInfo CredentialsDB::credentials(const quint32 id, bool queryPasswo
 {
     TRACE() << "id:" << id << "queryPassword:" << queryPassword;
     INIT_ERROR();
-    SignonIdentityInfo info = metaDataDB->identity(id);
+
+    /* Always copy-construct: SignonIdentityInfo::operator=() doesn't copy
+     * all the fields. */
+    SignonIdentityInfo *cached = m_identityCache.object(id);
+    if (cached != 0)
+        m_identityCacheHits++;
+    else
+        m_identityCacheMisses++;
+
+    TRACE_EVENT("credentials", id, cached != 0);
+
+    SignonIdentityInfo info(cached != 0 ? *cached : metaDataDB->identity(id));
+    if (cached == 0 && !info.isNew() && !metaDataDB->errorOccurred())
+        m_identityCache.insert(id, new SignonIdentityInfo(info));
+
     if (queryPassword && !info.isNew() && isSecretsDBOpen()) {
         secretsDB->loadCredentials(info);
     }
@@ -1628,6 +2205,9 @@ quint32 CredentialsDB::updateCredentials(const SignonIdentityInfo &info,
                                          bool storeSecret)
 {
     INIT_ERROR();
+    if (!info.isNew())
+        m_identityCache.remove(info.id());
+
     quint32 id = metaDataDB->updateIdentity(info);
     if (id == 0) return id;
 
@@ -1646,6 +2226,7 @@ bool CredentialsDB::removeCredentials(const quint32 id)
      * available */
     RETURN_IF_NO_SECRETS_DB(false);
 
+    m_identityCache.remove(id);
     return secretsDB->removeCredentials(id) &&
         metaDataDB->removeIdentity(id);
 }
@@ -1659,6 +2240,7 @@ bool CredentialsDB::clear()
     /* We don't allow clearing the DB if the secrets DB is not available */
     RETURN_IF_NO_SECRETS_DB(false);
 
+    m_identityCache.clear();
     return secretsDB->clear() && metaDataDB->clear();
 }
 
@@ -1732,12 +2314,14 @@ QString CredentialsDB::credentialsOwnerSecurityToken(const quint32 identityId)
 bool CredentialsDB::addReference(const quint32 id, const QString &token, const QString &reference)
 {
     INIT_ERROR();
+    m_identityCache.remove(id);
     return metaDataDB->addReference(id, token, reference);
 }
 
 bool CredentialsDB::removeReference(const quint32 id, const QString &token, const QString &reference)
 {
     INIT_ERROR();
+    m_identityCache.remove(id);
     return metaDataDB->removeReference(id, token, reference);
 }
 
@@ -1752,6 +2336,8 @@ void CredentialsDB::eraseAccountsSsoContent()
     BLAME() << "Removing signon and accounts DBs due to "
                "signon DB data inconsistency.";
 
+    m_identityCache.clear();
+
     /* Erasing signon database files. */
     if (!metaDataDB->erase())
         BLAME() << "Failed to remove signon metadata db.";
@@ -31,16 +31,23 @@
 #ifndef CREDENTIALS_DB_H
 #define CREDENTIALS_DB_H
 
+#include <QCache>
 #include <QObject>
 #include <QtSql>
 
 #include "signonidentityinfo.h"
 
 #define SSO_MAX_TOKEN_STORAGE (4*1024) // 4 kB for token store/identity/method
-#define SSO_METADATADB_VERSION 2
+#define SSO_METADATADB_VERSION 3
 #define SSO_SECRETSDB_VERSION 1
+#define SSO_IDENTITY_CACHE_SIZE 100 // identities kept in memory
+#define SSO_BACKUP_STEP_PAGES 64 // pages copied by each backup step
 
 class TestDatabase;
+class DatabaseBenchmark;
+
+struct sqlite3;
+struct sqlite3_backup;
 
 namespace SignonDaemonNS {
 
@@ -54,6 +61,35 @@ enum IdentityFlags {
     UserNameIsSecret = 0x0004,
 };
 
+/*!
+    @struct SqlDatabaseConfiguration
+    The SQLite settings of a database connection, applied each time the
+    connection is opened. The zero or empty values keep the SQLite defaults.
+    @ingroup Accounts_and_SSO_Framework
+ */
+struct SqlDatabaseConfiguration
+{
+    SqlDatabaseConfiguration();
+
+    /*!
+     * @returns whether the journal mode is one of the accepted ones; MEMORY
+     * and OFF are not, as a crash could then corrupt the DB.
+     */
+    static bool isJournalModeValid(const QString &journalMode);
+
+    /*!
+     * @returns whether the synchronous level is one of the accepted ones.
+     */
+    static bool isSynchronousValid(const QString &synchronous);
+
+    QString m_journalMode;  /*!< DELETE, TRUNCATE, PERSIST or WAL. */
+    QString m_synchronous;  /*!< OFF, NORMAL or FULL. */
+    int m_cacheSize;        /*!< The page cache size, in kilobytes. */
+    qint64 m_mmapSize;      /*!< The bytes of the file mapped in memory. */
+    int m_busyTimeout;      /*!< The milliseconds waited for a locked DB. */
+    QString m_vfs;          /*!< The SQLite VFS opening the DB files. */
+};
+
 /*!
     @class SqlDatabase
     Will be used manage the SQL database interaction.
@@ -62,6 +98,7 @@ enum IdentityFlags {
 class SqlDatabase
 {
     friend class ::TestDatabase;
+    friend class ::DatabaseBenchmark;
 public:
     /*!
         Constructs a SqlDatabase object using the given hostname.
@@ -75,6 +112,12 @@ public:
     */
     virtual ~SqlDatabase();
 
+    /*!
+     * Sets the settings of the connection: to be called before init().
+     */
+    void setConfiguration(const SqlDatabaseConfiguration &configuration)
+        { m_configuration = configuration; }
+
     /*!
      * Connects to the DB and if necessary creates the tables
      */
@@ -95,6 +138,11 @@ public:
     void disconnect();
 
     bool startTransaction();
+    /*!
+     * Starts a transaction which reads the DB: until rollback(), this
+     * connection reads the DB as it is now.
+     */
+    bool startReadTransaction();
     bool commit();
     void rollback();
 
@@ -139,7 +187,23 @@ public:
     QSqlQuery newQuery() const { return QSqlQuery(m_database); }
 
     /*!
-        Executes a specific database query.
+        Returns a prepared query for the given statement. Prepared queries
+        are cached per connection and reused by subsequent calls with the
+        same statement text, so values must be bound as parameters rather
+        than formatted into the statement. Call QSqlQuery::finish() (and
+        not clear()) on the query when done with it.
+        @param query, the query string.
+        @returns the prepared sql query.
+    */
+    QSqlQuery prepare(const QString &query);
+
+    /*!
+        Discards all the cached prepared queries.
+    */
+    void clearPreparedQueries();
+
+    /*!
+        Executes a specific database query; the query is not cached.
         If an error occurres the lastError() method can be used for handling decissions.
         @param query, the query string.
         @returns the resulting sql query, which can be process in the case of a 'SELECT' statement.
@@ -158,10 +222,15 @@ public:
         Executes a specific database set of queryes (INSERTs, UPDATEs, DELETEs) in a transaction
         context (No nested transactions supported - sqlite reasons).
         If an error occurres the lastError() method can be used for handling decissions.
+        The queries with positional placeholders are cached, see prepare();
+        the others are executed once.
         @param queryList, the query list to be executed.
+        @param values, the values to be bound to the placeholders of each
+        of the queries, in order.
         @returns true if the transaction commits successfully, false otherwise.
     */
-    bool transactionalExec(const QStringList &queryList);
+    bool transactionalExec(const QStringList &queryList,
+                           const QVariantList &values = QVariantList());
 
     /*!
         @returns true, if the database has any tables created, false otherwise.
@@ -194,15 +263,54 @@ public:
 
     QString connectionName() const { return m_database.connectionName(); }
 
+    /*!
+        @returns true if SQLite enforces the foreign keys constraints on
+        this connection.
+    */
+    bool foreignKeysEnabled() const { return m_foreignKeys; }
+
+    /*!
+     * Starts an online copy of the DB into the given file, made by
+     * backupStep() while the DB stays in use.
+     */
+    bool startBackup(const QString &fileName);
+    /*!
+     * Copies the next pages of the backup, or all of them if pages is
+     * negative; the changes made meanwhile through this connection are
+     * copied too.
+     * @returns true once the copy is complete.
+     */
+    bool backupStep(int pages);
+    /*!
+     * @returns the number of pages left to copy, as of the last step.
+     */
+    int backupRemaining() const;
+    /*!
+     * Ends the backup, aborting it if it is not complete.
+     */
+    void finishBackup();
+    bool backupInProgress() const { return m_backup != 0; }
+
 protected:
     QStringList queryList(const QString &query_str);
     QStringList queryList(QSqlQuery &query);
     virtual bool erase();
 
+private:
+    void applyConfiguration();
+    bool usesConfiguredVfs();
+    sqlite3 *handle();
+    void setBackupError(int result);
+
 private:
     QSqlError m_lastError;
+    QHash<QString, QSqlQuery> m_preparedQueries;
+    SqlDatabaseConfiguration m_configuration;
+    sqlite3 *m_backupDB;
+    sqlite3_backup *m_backup;
 protected:
     int m_version;
+    bool m_foreignKeys;
     QSqlDatabase m_database;
 
     friend class CredentialsDB;
@@ -213,6 +321,7 @@ class CredentialsDB;
 class MetaDataDB: public SqlDatabase
 {
     friend class ::TestDatabase;
+    friend class ::DatabaseBenchmark;
 public:
     MetaDataDB(const QString &name, CredentialsDB *credentialsDB):
         SqlDatabase(name, QLatin1String("SSO-metadata"), SSO_METADATADB_VERSION),
@@ -246,7 +355,12 @@ private:
     bool insertMethods(QMap<QString, QStringList> methods);
     quint32 updateCredentials(const SignonIdentityInfo &info);
     bool updateRealms(quint32 id, const QStringList &realms, bool isNew);
+    QList<SignonIdentityInfo> loadIdentities(const QString &condition,
+                                             const QVariantList &values);
+    QStringList foreignKeyTriggers();
     QStringList tableUpdates2();
+    QStringList tableUpdates3();
+    bool dropForeignKeyTriggers();
     CredentialsDB *_credentialsDB;
 
 };
@@ -272,6 +386,10 @@ public:
     QVariantMap loadData(quint32 id, quint32 method);
     bool storeData(quint32 id, quint32 method, const QVariantMap &data);
     bool removeData(quint32 id, quint32 method);
+
+private:
+    bool storeValue(QSqlQuery &query, quint32 id, quint32 method,
+                    const QString &key, const QByteArray &value);
 };
 
 /*!
@@ -288,6 +406,7 @@ class CredentialsDB : public QObject
     Q_DISABLE_COPY(CredentialsDB)
 
     friend class ::TestDatabase;
+    friend class ::DatabaseBenchmark;
     friend class MetaDataDB;
 
     class ErrorMonitor
@@ -305,7 +424,11 @@ class CredentialsDB : public QObject
     friend class ErrorMonitor;
 
 public:
-    CredentialsDB(const QString &metaDataDbName);
+    CredentialsDB(const QString &metaDataDbName,
+                  const SqlDatabaseConfiguration &metaDataConfiguration =
+                      SqlDatabaseConfiguration(),
+                  const SqlDatabaseConfiguration &secretsConfiguration =
+                      SqlDatabaseConfiguration());
     ~CredentialsDB();
 
     bool init();
@@ -344,6 +467,37 @@ public:
     bool removeReference(const quint32 id, const QString &token, const QString &reference = QString());
     QStringList references(const quint32 id, const QString &token = QString());
 
+    /*!
+     * The identities metadata loaded by credentials() are kept in a bounded
+     * cache, which the methods modifying the DB keep up to date; secrets are
+     * never cached.
+     * @returns the number of identity lookups served from the cache.
+     */
+    int identityCacheHits() const { return m_identityCacheHits; }
+    /*!
+     * @returns the number of identity lookups which hit the DB.
+     */
+    int identityCacheMisses() const { return m_identityCacheMisses; }
+
+    /*!
+     * Starts the online copy of the metadata DB and, if secretsFileName is
+     * not empty, of the secrets DB: the copy is made by backupStep(), the
+     * DBs staying in use meanwhile.
+     */
+    bool startBackup(const QString &metaDataFileName,
+                     const QString &secretsFileName = QString());
+    /*!
+     * Copies the next pages of the backup. On error, the backup is aborted.
+     * The copies of the two DBs are completed together, by the last step:
+     * they are of the same point in time, the one of that step.
+     * @returns true once both DBs are copied.
+     */
+    bool backupStep(int pages);
+    /*!
+     * Ends the backup, aborting it if it is not complete.
+     */
+    void finishBackup();
+
 private:
     /* In case of signon database corruption, all accounts and sso databases'
      * content will be deleted. */
@@ -354,6 +508,11 @@ private:
     MetaDataDB *metaDataDB;
     CredentialsDBError _lastError;
     CredentialsDBError noSecretsDB;
+    SqlDatabaseConfiguration m_secretsConfiguration;
+    bool m_secretsBackup;
+    QCache<quint32, SignonIdentityInfo> m_identityCache;
+    int m_identityCacheHits;
+    int m_identityCacheMisses;
 };
 
 } // namespace SignonDaemonNS
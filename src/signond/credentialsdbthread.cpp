@@ -0,0 +1,472 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2011 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#define SIGNON_TRACE_CATEGORY SignOn::TraceStorage
+
+#include "credentialsdbthread.h"
+#include "signond-common.h"
+
+#include <QCoreApplication>
+#include <QEvent>
+#include <QMutexLocker>
+
+#define SIGNON_CREDENTIALS_DB_JOB_FINISHED (QEvent::User + 1003)
+
+using namespace SignonDaemonNS;
+
+namespace SignonDaemonNS {
+
+class CredentialsDBJobEvent : public QEvent
+{
+public:
+    CredentialsDBJobEvent(CredentialsDBJob *job)
+        : QEvent((QEvent::Type)SIGNON_CREDENTIALS_DB_JOB_FINISHED),
+          m_job(job)
+    {}
+
+    /* Also the jobs of the events not delivered are deleted */
+    ~CredentialsDBJobEvent() { delete m_job; }
+
+    CredentialsDBJob *m_job;
+};
+
+} //namespace SignonDaemonNS
+
+CredentialsDBJob::CredentialsDBJob(Operation operation)
+    : m_operation(operation),
+      m_id(0),
+      m_flag(true),
+      m_ok(false),
+      m_sync(false),
+      m_done(false)
+{
+}
+
+CredentialsDBJob::~CredentialsDBJob()
+{
+}
+
+void CredentialsDBJob::run(CredentialsDB *db)
+{
+    switch (m_operation) {
+    case Init:
+        m_ok = db->init();
+        break;
+    case OpenSecretsDB:
+        m_ok = db->openSecretsDB(m_method);
+        break;
+    case CloseSecretsDB:
+        db->closeSecretsDB();
+        m_ok = true;
+        break;
+    case CheckPassword:
+        m_ok = db->checkPassword(m_id, m_userName, m_password);
+        break;
+    case Credentials:
+        m_info = db->credentials(m_id, m_flag);
+        break;
+    case Identities:
+        m_identities = db->credentials(m_filter);
+        break;
+    case InsertCredentials:
+        m_id = db->insertCredentials(m_info, m_flag);
+        m_ok = (m_id != 0);
+        break;
+    case UpdateCredentials:
+        m_id = db->updateCredentials(m_info, m_flag);
+        m_ok = (m_id != 0);
+        break;
+    case RemoveCredentials:
+        m_ok = db->removeCredentials(m_id);
+        break;
+    case Clear:
+        m_ok = db->clear();
+        break;
+    case AccessControlList:
+        m_list = db->accessControlList(m_id);
+        break;
+    case OwnerList:
+        m_list = db->ownerList(m_id);
+        break;
+    case LoadData:
+        m_data = db->loadData(m_id, m_method);
+        break;
+    case StoreData:
+        m_ok = db->storeData(m_id, m_method, m_data);
+        break;
+    case RemoveData:
+        m_ok = db->removeData(m_id, m_method);
+        break;
+    case AddReference:
+        m_ok = db->addReference(m_id, m_token, m_reference);
+        break;
+    case RemoveReference:
+        m_ok = db->removeReference(m_id, m_token, m_reference);
+        break;
+    case StartBackup:
+        m_ok = db->startBackup(m_list.value(0), m_list.value(1));
+        break;
+    case BackupStep:
+        m_ok = db->backupStep(SSO_BACKUP_STEP_PAGES);
+        break;
+    case FinishBackup:
+        db->finishBackup();
+        m_ok = true;
+        break;
+    }
+}
+
+bool CredentialsDBJob::readsIdentity() const
+{
+    if (m_id == 0)
+        return false;
+
+    switch (m_operation) {
+    case CheckPassword:
+    case Credentials:
+    case AccessControlList:
+    case OwnerList:
+    case LoadData:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool CredentialsDBJob::writesIdentity(quint32 id) const
+{
+    switch (m_operation) {
+    case CheckPassword:
+    case Credentials:
+    case Identities:
+    case AccessControlList:
+    case OwnerList:
+    case LoadData:
+    case StartBackup:
+    case BackupStep:
+    case FinishBackup:
+        return false;
+    /* The identity is not known to the clients until it is inserted */
+    case InsertCredentials:
+        return false;
+    case UpdateCredentials:
+        return m_id == id || m_info.id() == id;
+    case RemoveCredentials:
+    case StoreData:
+    case RemoveData:
+    case AddReference:
+    case RemoveReference:
+        return m_id == id;
+    default:
+        return true;
+    }
+}
+
+void CredentialsDBJob::finished()
+{
+    if (errorOccurred())
+        BLAME() << "Storage operation" << m_operation << "failed:"
+                << m_error.text();
+}
+
+CredentialsDBThread::CredentialsDBThread(const QString &metaDataDbName,
+                                         const SqlDatabaseConfiguration &metaDataConfiguration,
+                                         const SqlDatabaseConfiguration &secretsConfiguration,
+                                         QObject *parent)
+    : QThread(parent),
+      m_metaDataDbName(metaDataDbName),
+      m_metaDataConfiguration(metaDataConfiguration),
+      m_secretsConfiguration(secretsConfiguration),
+      m_db(0),
+      m_stopping(false),
+      m_secretsDBOpen(false)
+{
+}
+
+CredentialsDBThread::~CredentialsDBThread()
+{
+    /* The jobs already given are run before the thread quits */
+    m_mutex.lock();
+    m_stopping = true;
+    m_jobQueued.wakeOne();
+    m_mutex.unlock();
+
+    wait();
+}
+
+bool CredentialsDBThread::init()
+{
+    start();
+
+    CredentialsDBJob job(CredentialsDBJob::Init);
+    exec(&job);
+    return job.m_ok;
+}
+
+void CredentialsDBThread::post(CredentialsDBJob *job)
+{
+    TRACE_EVENT("post", job->m_operation, job->m_id);
+
+    QMutexLocker locker(&m_mutex);
+    job->m_sync = false;
+    m_jobs.enqueue(job);
+    m_jobQueued.wakeOne();
+}
+
+void CredentialsDBThread::exec(CredentialsDBJob *job)
+{
+    TRACE_EVENT("exec", job->m_operation, job->m_id);
+
+    QMutexLocker locker(&m_mutex);
+    job->m_sync = true;
+    job->m_done = false;
+    m_jobs.enqueue(job);
+    m_jobQueued.wakeOne();
+
+    while (!job->m_done)
+        m_jobDone.wait(&m_mutex);
+
+    m_lastError = job->m_error;
+}
+
+void CredentialsDBThread::run()
+{
+    m_db = new CredentialsDB(m_metaDataDbName, m_metaDataConfiguration,
+                             m_secretsConfiguration);
+
+    forever {
+        m_mutex.lock();
+        while (m_jobs.isEmpty() && !m_stopping)
+            m_jobQueued.wait(&m_mutex);
+
+        if (m_jobs.isEmpty()) {
+            m_mutex.unlock();
+            break;
+        }
+        CredentialsDBJob *job = takeNextJob();
+        m_mutex.unlock();
+
+        job->run(m_db);
+        job->m_error = m_db->lastError();
+
+        m_mutex.lock();
+        bool sync = job->m_sync;
+        job->m_done = true;
+        if (sync)
+            m_jobDone.wakeAll();
+        m_mutex.unlock();
+
+        /* The waiting thread may have deleted a synchronous job by now */
+        if (!sync)
+            QCoreApplication::postEvent(this, new CredentialsDBJobEvent(job));
+    }
+
+    delete m_db;
+    m_db = 0;
+}
+
+/* Called with the mutex locked: the first read which no job queued before
+ * it writes to, else the first job */
+CredentialsDBJob *CredentialsDBThread::takeNextJob()
+{
+    for (int i = 0; i < m_jobs.count(); i++) {
+        CredentialsDBJob *job = m_jobs.at(i);
+        if (!job->readsIdentity())
+            continue;
+
+        bool overtakes = true;
+        for (int j = 0; j < i && overtakes; j++)
+            overtakes = !m_jobs.at(j)->writesIdentity(job->m_id);
+
+        if (overtakes) {
+            if (i > 0)
+                TRACE_EVENT("overtake", job->m_operation, job->m_id);
+            return m_jobs.takeAt(i);
+        }
+    }
+
+    return m_jobs.dequeue();
+}
+
+void CredentialsDBThread::customEvent(QEvent *event)
+{
+    if (event->type() != SIGNON_CREDENTIALS_DB_JOB_FINISHED) {
+        QThread::customEvent(event);
+        return;
+    }
+
+    CredentialsDBJobEvent *jobEvent = static_cast<CredentialsDBJobEvent *>(event);
+    TRACE_EVENT("finished", jobEvent->m_job->m_operation, jobEvent->m_job->m_id);
+    jobEvent->m_job->finished();
+}
+
+bool CredentialsDBThread::openSecretsDB(const QString &secretsDbName)
+{
+    CredentialsDBJob job(CredentialsDBJob::OpenSecretsDB);
+    job.m_method = secretsDbName;
+    exec(&job);
+    m_secretsDBOpen = job.m_ok;
+    return job.m_ok;
+}
+
+void CredentialsDBThread::closeSecretsDB()
+{
+    CredentialsDBJob job(CredentialsDBJob::CloseSecretsDB);
+    exec(&job);
+    m_secretsDBOpen = false;
+}
+
+bool CredentialsDBThread::checkPassword(const quint32 id,
+                                        const QString &username,
+                                        const QString &password)
+{
+    CredentialsDBJob job(CredentialsDBJob::CheckPassword);
+    job.m_id = id;
+    job.m_userName = username;
+    job.m_password = password;
+    exec(&job);
+    return job.m_ok;
+}
+
+SignonIdentityInfo CredentialsDBThread::credentials(const quint32 id,
+                                                    bool queryPassword)
+{
+    CredentialsDBJob job(CredentialsDBJob::Credentials);
+    job.m_id = id;
+    job.m_flag = queryPassword;
+    exec(&job);
+    return job.m_info;
+}
+
+QList<SignonIdentityInfo>
+CredentialsDBThread::credentials(const QMap<QString, QString> &filter)
+{
+    CredentialsDBJob job(CredentialsDBJob::Identities);
+    job.m_filter = filter;
+    exec(&job);
+    return job.m_identities;
+}
+
+quint32 CredentialsDBThread::insertCredentials(const SignonIdentityInfo &info,
+                                               bool storeSecret)
+{
+    CredentialsDBJob job(CredentialsDBJob::InsertCredentials);
+    job.m_info = info;
+    job.m_flag = storeSecret;
+    exec(&job);
+    return job.m_id;
+}
+
+quint32 CredentialsDBThread::updateCredentials(const SignonIdentityInfo &info,
+                                               bool storeSecret)
+{
+    CredentialsDBJob job(CredentialsDBJob::UpdateCredentials);
+    job.m_info = info;
+    job.m_flag = storeSecret;
+    exec(&job);
+    return job.m_id;
+}
+
+bool CredentialsDBThread::removeCredentials(const quint32 id)
+{
+    CredentialsDBJob job(CredentialsDBJob::RemoveCredentials);
+    job.m_id = id;
+    exec(&job);
+    return job.m_ok;
+}
+
+bool CredentialsDBThread::clear()
+{
+    CredentialsDBJob job(CredentialsDBJob::Clear);
+    exec(&job);
+    return job.m_ok;
+}
+
+QStringList CredentialsDBThread::accessControlList(const quint32 identityId)
+{
+    CredentialsDBJob job(CredentialsDBJob::AccessControlList);
+    job.m_id = identityId;
+    exec(&job);
+    return job.m_list;
+}
+
+QStringList CredentialsDBThread::ownerList(const quint32 identityId)
+{
+    CredentialsDBJob job(CredentialsDBJob::OwnerList);
+    job.m_id = identityId;
+    exec(&job);
+    return job.m_list;
+}
+
+QVariantMap CredentialsDBThread::loadData(const quint32 id,
+                                          const QString &method)
+{
+    CredentialsDBJob job(CredentialsDBJob::LoadData);
+    job.m_id = id;
+    job.m_method = method;
+    exec(&job);
+    return job.m_data;
+}
+
+bool CredentialsDBThread::storeData(const quint32 id, const QString &method,
+                                    const QVariantMap &data)
+{
+    CredentialsDBJob job(CredentialsDBJob::StoreData);
+    job.m_id = id;
+    job.m_method = method;
+    job.m_data = data;
+    exec(&job);
+    return job.m_ok;
+}
+
+bool CredentialsDBThread::removeData(const quint32 id, const QString &method)
+{
+    CredentialsDBJob job(CredentialsDBJob::RemoveData);
+    job.m_id = id;
+    job.m_method = method;
+    exec(&job);
+    return job.m_ok;
+}
+
+bool CredentialsDBThread::addReference(const quint32 id,
+                                       const QString &token,
+                                       const QString &reference)
+{
+    CredentialsDBJob job(CredentialsDBJob::AddReference);
+    job.m_id = id;
+    job.m_token = token;
+    job.m_reference = reference;
+    exec(&job);
+    return job.m_ok;
+}
+
+bool CredentialsDBThread::removeReference(const quint32 id,
+                                          const QString &token,
+                                          const QString &reference)
+{
+    CredentialsDBJob job(CredentialsDBJob::RemoveReference);
+    job.m_id = id;
+    job.m_token = token;
+    job.m_reference = reference;
+    exec(&job);
+    return job.m_ok;
+}
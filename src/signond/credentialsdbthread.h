@@ -0,0 +1,229 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2011 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef CREDENTIALS_DB_THREAD_H
+#define CREDENTIALS_DB_THREAD_H
+
+#include <QMutex>
+#include <QQueue>
+#include <QThread>
+#include <QWaitCondition>
+
+#include "credentialsdb.h"
+
+namespace SignonDaemonNS {
+
+/*!
+ * @class CredentialsDBJob
+ * An operation on the credentials DB, run by the CredentialsDBThread. The
+ * arguments and the results of the operations are the ones of the
+ * CredentialsDB methods of the same name:
+ * - m_id is the identity, replaced by the stored one for InsertCredentials
+ *   and UpdateCredentials;
+ * - m_info is the identity to store, or the loaded one for Credentials;
+ * - m_data is the data to store, or the loaded one for LoadData;
+ * - m_flag is queryPassword for Credentials and storeSecret for
+ *   InsertCredentials and UpdateCredentials;
+ * - m_method is the DB file name for OpenSecretsDB;
+ * - m_list is, for StartBackup, the files into which the metadata DB and,
+ *   if there is a second one, the secrets DB are copied;
+ * - m_ok, m_list and m_identities are the other results; for BackupStep,
+ *   which copies SSO_BACKUP_STEP_PAGES pages, m_ok is whether the backup
+ *   is complete.
+ * The jobs reimplementing run() keep the operation which tells what they
+ * read and write: it decides which jobs they may overtake.
+ */
+class CredentialsDBJob
+{
+    friend class CredentialsDBThread;
+
+public:
+    enum Operation {
+        Init = 0,
+        OpenSecretsDB,
+        CloseSecretsDB,
+        CheckPassword,
+        Credentials,
+        Identities,
+        InsertCredentials,
+        UpdateCredentials,
+        RemoveCredentials,
+        Clear,
+        AccessControlList,
+        OwnerList,
+        LoadData,
+        StoreData,
+        RemoveData,
+        AddReference,
+        RemoveReference,
+        StartBackup,
+        BackupStep,
+        FinishBackup
+    };
+
+    CredentialsDBJob(Operation operation);
+    virtual ~CredentialsDBJob();
+
+    /*!
+     * Runs the operation in the storage thread; reimplemented by the jobs
+     * made of several operations.
+     */
+    virtual void run(CredentialsDB *db);
+
+    /*!
+     * Called in the main thread when a posted job has been run; the job is
+     * deleted afterwards. By default the errors are only logged.
+     */
+    virtual void finished();
+
+    bool errorOccurred() const { return m_error.isValid(); }
+
+    /*!
+     * @returns true if the job only reads the stored identity m_id.
+     */
+    bool readsIdentity() const;
+
+    /*!
+     * @returns true if the job might change what is read of the given
+     * identity, or has to be run before the reads of any identity.
+     */
+    bool writesIdentity(quint32 id) const;
+
+    Operation m_operation;
+
+    quint32 m_id;
+    SignonIdentityInfo m_info;
+    QMap<QString, QString> m_filter;
+    QString m_method;
+    QString m_userName;
+    QString m_password;
+    QString m_token;
+    QString m_reference;
+    QVariantMap m_data;
+    bool m_flag;
+
+    bool m_ok;
+    QStringList m_list;
+    QList<SignonIdentityInfo> m_identities;
+    CredentialsDBError m_error;
+
+private:
+    bool m_sync;
+    bool m_done;
+};
+
+/*!
+ * @class CredentialsDBThread
+ * Runs the operations on the credentials DB in a thread of their own, which
+ * owns the DB connections: the commits don't block the D-Bus clients
+ * waiting for the daemon.
+ * The jobs are run in the order they are given, but for the reads of an
+ * identity, which overtake the writes queued on the other identities:
+ * post() returns at once and the job is finished in the main thread; exec()
+ * waits for the job to be run. The other methods wait for the operation of the CredentialsDB
+ * method of the same name, and are meant for the operations which are not
+ * in the paths of the authentication requests.
+ */
+class CredentialsDBThread : public QThread
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(CredentialsDBThread)
+
+public:
+    CredentialsDBThread(const QString &metaDataDbName,
+                        const SqlDatabaseConfiguration &metaDataConfiguration =
+                            SqlDatabaseConfiguration(),
+                        const SqlDatabaseConfiguration &secretsConfiguration =
+                            SqlDatabaseConfiguration(),
+                        QObject *parent = 0);
+    ~CredentialsDBThread();
+
+    /*!
+     * Starts the thread and opens the DB in it.
+     */
+    bool init();
+
+    void post(CredentialsDBJob *job);
+    void exec(CredentialsDBJob *job);
+
+    bool openSecretsDB(const QString &secretsDbName);
+    bool isSecretsDBOpen() const { return m_secretsDBOpen; }
+    void closeSecretsDB();
+
+    /*!
+     * @returns the error of the last operation waited for.
+     */
+    CredentialsDBError lastError() const { return m_lastError; }
+    bool errorOccurred() const { return m_lastError.isValid(); }
+
+    bool checkPassword(const quint32 id, const QString &username,
+                       const QString &password);
+    SignonIdentityInfo credentials(const quint32 id, bool queryPassword = true);
+    QList<SignonIdentityInfo> credentials(const QMap<QString, QString> &filter);
+
+    quint32 insertCredentials(const SignonIdentityInfo &info,
+                              bool storeSecret = true);
+    quint32 updateCredentials(const SignonIdentityInfo &info,
+                              bool storeSecret = true);
+    bool removeCredentials(const quint32 id);
+
+    bool clear();
+
+    QStringList accessControlList(const quint32 identityId);
+    QStringList ownerList(const quint32 identityId);
+
+    QVariantMap loadData(const quint32 id, const QString &method);
+    bool storeData(const quint32 id, const QString &method,
+                   const QVariantMap &data);
+    bool removeData(const quint32 id, const QString &method = QString());
+
+    bool addReference(const quint32 id, const QString &token,
+                      const QString &reference);
+    bool removeReference(const quint32 id, const QString &token,
+                         const QString &reference = QString());
+
+protected:
+    void run();
+    void customEvent(QEvent *event);
+
+private:
+    CredentialsDBJob *takeNextJob();
+
+private:
+    QString m_metaDataDbName;
+    SqlDatabaseConfiguration m_metaDataConfiguration;
+    SqlDatabaseConfiguration m_secretsConfiguration;
+    CredentialsDB *m_db;
+
+    QMutex m_mutex;
+    QWaitCondition m_jobQueued;
+    QWaitCondition m_jobDone;
+    QQueue<CredentialsDBJob *> m_jobs;
+    bool m_stopping;
+
+    bool m_secretsDBOpen;
+    CredentialsDBError m_lastError;
+};
+
+} //namespace SignonDaemonNS
+
+#endif // CREDENTIALS_DB_THREAD_H
@@ -36,6 +36,7 @@ void installSigHandlers()
     sigaction(SIGHUP, &act, 0);
     sigaction(SIGTERM, &act, 0);
     sigaction(SIGINT, &act, 0);
+    sigaction(SIGUSR1, &act, 0);
 }
 
 int main(int argc, char *argv[])
@@ -0,0 +1,276 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2009-2010 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "plugincatalogue.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QFileSystemWatcher>
+#include <QSettings>
+
+#include "signond-common.h"
+#include "pluginproxy.h"
+
+namespace SignonDaemonNS {
+
+    PluginCatalogue *PluginCatalogue::m_instance = 0;
+
+    PluginCatalogue::PluginCatalogue(QObject *parent)
+            : QObject(parent),
+              m_watcher(new QFileSystemWatcher(this)),
+              m_dirty(true)
+    {
+        /* On Linux the watcher is backed by inotify: any plugin being
+         * installed, removed or replaced marks the catalogue as dirty. */
+        if (QDir(SIGNOND_PLUGINS_DIR).exists())
+            m_watcher->addPath(SIGNOND_PLUGINS_DIR);
+
+        connect(m_watcher, SIGNAL(directoryChanged(const QString&)),
+                this, SLOT(pluginsDirChanged()));
+    }
+
+    PluginCatalogue::~PluginCatalogue()
+    {
+        qDeleteAll(m_queries.keys());
+        m_instance = 0;
+    }
+
+    PluginCatalogue *PluginCatalogue::instance(QObject *parent)
+    {
+        if (m_instance == 0)
+            m_instance = new PluginCatalogue(parent);
+
+        return m_instance;
+    }
+
+    void PluginCatalogue::setCacheFileName(const QString &fileName)
+    {
+        m_cacheFileName = fileName;
+        load();
+        m_dirty = true;
+    }
+
+    QStringList PluginCatalogue::methods()
+    {
+        refreshIfRequired();
+        return m_entries.keys();
+    }
+
+    bool PluginCatalogue::contains(const QString &method)
+    {
+        refreshIfRequired();
+        return m_entries.contains(method);
+    }
+
+    bool PluginCatalogue::hasMechanisms(const QString &method)
+    {
+        refreshIfRequired();
+        return m_entries.value(method).hasMechanisms;
+    }
+
+    QStringList PluginCatalogue::mechanisms(const QString &method)
+    {
+        refreshIfRequired();
+        return m_entries.value(method).mechanisms;
+    }
+
+    void PluginCatalogue::setMechanisms(const QString &method,
+                                        const QStringList &mechanisms)
+    {
+        refreshIfRequired();
+        if (!m_entries.contains(method))
+            return;
+
+        Entry &entry = m_entries[method];
+        if (entry.hasMechanisms && entry.mechanisms == mechanisms)
+            return;
+
+        entry.mechanisms = mechanisms;
+        entry.hasMechanisms = true;
+        save();
+    }
+
+    bool PluginCatalogue::queryMechanisms(const QString &method)
+    {
+        if (!contains(method))
+            return false;
+
+        //a plugin process is already being started for the method
+        if (m_queries.values().contains(method))
+            return true;
+
+        PluginProxy *plugin = PluginProxy::requestPluginProxy(method);
+        if (!plugin) {
+            TRACE() << "Could not load plugin of type: " << method;
+            return false;
+        }
+
+        if (plugin->isStarted()) {
+            setMechanisms(method, plugin->mechanisms());
+            PluginProxyPool::instance()->release(plugin);
+            return true;
+        }
+
+        /* Queued, as the proxy is released or deleted from the slot */
+        m_queries.insert(plugin, method);
+        connect(plugin, SIGNAL(startupFinished(bool)),
+                this, SLOT(pluginStarted(bool)), Qt::QueuedConnection);
+        plugin->start();
+        return true;
+    }
+
+    void PluginCatalogue::pluginStarted(bool started)
+    {
+        PluginProxy *plugin = qobject_cast<PluginProxy *>(sender());
+        if (plugin == NULL || !m_queries.contains(plugin))
+            return;
+
+        QString method = m_queries.take(plugin);
+        disconnect(plugin, 0, this, 0);
+
+        if (started) {
+            setMechanisms(method, plugin->mechanisms());
+            PluginProxyPool::instance()->release(plugin);
+        } else {
+            TRACE() << "Could not load plugin of type: " << method;
+            delete plugin;
+        }
+
+        emit mechanismsQueried(method, started);
+    }
+
+    void PluginCatalogue::pluginsDirChanged()
+    {
+        TRACE() << "Plugins directory changed";
+        m_dirty = true;
+    }
+
+    void PluginCatalogue::refreshIfRequired()
+    {
+        if (!m_dirty)
+            return;
+
+        m_dirty = false;
+
+        QDir pluginsDir(SIGNOND_PLUGINS_DIR);
+        QStringList fileNames = pluginsDir.entryList(
+                QStringList() << QLatin1String("*.so*"),
+                QDir::Files | QDir::NoDotAndDotDot);
+
+        const QString prefix(SIGNOND_PLUGIN_PREFIX);
+        QMap<QString, Entry> entries;
+        bool changed = false;
+        foreach (QString fileName, fileNames) {
+            if (!fileName.startsWith(prefix))
+                continue;
+
+            QString method = fileName.mid(prefix.length(),
+                    fileName.indexOf(QLatin1String("plugin")) - prefix.length());
+            if (method.isEmpty() || entries.contains(method))
+                continue;
+
+            /* Prefer the file which the plugin process will load */
+            QFileInfo pluginFile(pluginsDir,
+                                 prefix + method + SIGNOND_PLUGIN_SUFFIX);
+            if (!pluginFile.exists())
+                pluginFile = QFileInfo(pluginsDir, fileName);
+
+            Entry entry = m_entries.value(method);
+            if (entry.fileName != pluginFile.absoluteFilePath()
+                || entry.lastModified != pluginFile.lastModified()
+                || entry.size != pluginFile.size()) {
+                entry = Entry();
+                entry.fileName = pluginFile.absoluteFilePath();
+                entry.lastModified = pluginFile.lastModified();
+                entry.size = pluginFile.size();
+                changed = true;
+            }
+            entries.insert(method, entry);
+        }
+
+        if (entries.count() != m_entries.count())
+            changed = true;
+
+        m_entries = entries;
+        if (changed)
+            save();
+
+        /* the directory might have been created after the daemon started */
+        if (m_watcher->directories().isEmpty() && pluginsDir.exists())
+            m_watcher->addPath(SIGNOND_PLUGINS_DIR);
+    }
+
+    void PluginCatalogue::load()
+    {
+        m_entries.clear();
+        if (m_cacheFileName.isEmpty() || !QFile::exists(m_cacheFileName))
+            return;
+
+        QSettings settings(m_cacheFileName, QSettings::IniFormat);
+        foreach (QString method, settings.childGroups()) {
+            settings.beginGroup(method);
+
+            Entry entry;
+            entry.fileName = settings.value(QLatin1String("FileName")).toString();
+            entry.lastModified =
+                settings.value(QLatin1String("LastModified")).toDateTime();
+            entry.size = settings.value(QLatin1String("Size"), -1).toLongLong();
+            entry.hasMechanisms = settings.contains(QLatin1String("Mechanisms"));
+            entry.mechanisms =
+                settings.value(QLatin1String("Mechanisms")).toStringList();
+
+            settings.endGroup();
+
+            if (!entry.fileName.isEmpty())
+                m_entries.insert(method, entry);
+        }
+
+        TRACE() << "Loaded" << m_entries.count() << "methods from" << m_cacheFileName;
+    }
+
+    void PluginCatalogue::save() const
+    {
+        if (m_cacheFileName.isEmpty())
+            return;
+
+        QSettings settings(m_cacheFileName, QSettings::IniFormat);
+        settings.clear();
+
+        QMapIterator<QString, Entry> it(m_entries);
+        while (it.hasNext()) {
+            it.next();
+            const Entry &entry = it.value();
+            settings.beginGroup(it.key());
+            settings.setValue(QLatin1String("FileName"), entry.fileName);
+            settings.setValue(QLatin1String("LastModified"), entry.lastModified);
+            settings.setValue(QLatin1String("Size"), entry.size);
+            if (entry.hasMechanisms)
+                settings.setValue(QLatin1String("Mechanisms"), entry.mechanisms);
+            settings.endGroup();
+        }
+
+        settings.sync();
+        if (settings.status() != QSettings::NoError)
+            TRACE() << "Cannot save the plugin catalogue to" << m_cacheFileName;
+    }
+
+} //namespace SignonDaemonNS
@@ -0,0 +1,125 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2009-2010 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef PLUGINCATALOGUE_H
+#define PLUGINCATALOGUE_H
+
+#include <QtCore>
+
+#ifndef SIGNOND_PLUGINS_DIR
+    #define SIGNOND_PLUGINS_DIR QLatin1String("/usr/lib/signon")
+#endif
+
+#ifndef SIGNOND_PLUGIN_PREFIX
+    #define SIGNOND_PLUGIN_PREFIX QLatin1String("lib")
+#endif
+
+#ifndef SIGNOND_PLUGIN_SUFFIX
+    #define SIGNOND_PLUGIN_SUFFIX QLatin1String("plugin.so")
+#endif
+
+class QFileSystemWatcher;
+
+namespace SignonDaemonNS {
+
+    class PluginProxy;
+
+    /*!
+     * @class PluginCatalogue
+     * Keeps the list of the installed authentication methods and of their
+     * mechanisms, so that they can be listed without scanning the plugins
+     * directory or starting a plugin process each time.
+     * Each method is recorded together with the path, modification time and
+     * size of its plugin file; the catalogue is saved to a cache file, and
+     * it is refreshed when the contents of the plugins directory change.
+     */
+    class PluginCatalogue : public QObject
+    {
+        Q_OBJECT
+
+    public:
+        static PluginCatalogue *instance(QObject *parent = 0);
+        ~PluginCatalogue();
+
+        /*!
+         * Sets the file the catalogue is saved to, and loads the entries
+         * stored there which still match the installed plugins.
+         */
+        void setCacheFileName(const QString &fileName);
+        QString cacheFileName() const { return m_cacheFileName; }
+
+        /*!
+         * @returns the names of the installed authentication methods.
+         */
+        QStringList methods();
+        bool contains(const QString &method);
+
+        /*!
+         * @returns whether the mechanisms of the method are known.
+         */
+        bool hasMechanisms(const QString &method);
+        QStringList mechanisms(const QString &method);
+        void setMechanisms(const QString &method,
+                           const QStringList &mechanisms);
+
+        /*!
+         * Starts a plugin process to learn the mechanisms of the method,
+         * without waiting for it: mechanismsQueried() is emitted once it is
+         * done, unless the mechanisms are already known when this returns.
+         * @returns false if the method is not installed.
+         */
+        bool queryMechanisms(const QString &method);
+
+    Q_SIGNALS:
+        void mechanismsQueried(const QString &method, bool found);
+
+    private Q_SLOTS:
+        void pluginsDirChanged();
+        void pluginStarted(bool started);
+
+    private:
+        PluginCatalogue(QObject *parent = 0);
+        void refreshIfRequired();
+        void load();
+        void save() const;
+
+        struct Entry {
+            Entry(): size(-1), hasMechanisms(false) {}
+
+            QString fileName;
+            QDateTime lastModified;
+            qint64 size;
+            QStringList mechanisms;
+            bool hasMechanisms;
+        };
+
+        static PluginCatalogue *m_instance;
+        QMap<QString, Entry> m_entries;
+        QHash<PluginProxy *, QString> m_queries;
+        QFileSystemWatcher *m_watcher;
+        QString m_cacheFileName;
+        bool m_dirty;
+    };
+
+} //namespace SignonDaemonNS
+
+#endif /* PLUGINCATALOGUE_H */
@@ -20,10 +20,13 @@
  * 02110-1301 USA
  */
 
+#define SIGNON_TRACE_CATEGORY SignOn::TracePlugin
+
 #include "pluginproxy.h"
 
 #include <sys/types.h>
 #include <pwd.h>
+#include <unistd.h>
 
 #include <QStringList>
 #include <QThreadStorage>
@@ -42,7 +45,7 @@
 #include "SignOn/authpluginif.h"
 
 // signon-plugins-common
-#include "SignOn/blobiohandler.h"
+#include "SignOn/ipcchannel.h"
 #include "SignOn/encrypteddevice.h"
 #include "SignOn/ipc.h"
 
@@ -56,6 +59,13 @@ using namespace SignOn;
 #define REMOTEPLUGIN_BIN_PATH QLatin1String("/usr/bin/signonpluginprocess")
 #define PLUGINPROCESS_START_TIMEOUT 5000
 #define PLUGINPROCESS_STOP_TIMEOUT 1000
+/* Delay before retrying to fill the pool of a method whose plugin failed to
+ * start; doubled on each consecutive failure, up to the maximum (seconds) */
+#define PLUGINPOOL_RETRY_DELAY 1
+#define PLUGINPOOL_MAX_RETRY_DELAY 300
+
+/* Written by the plugin process once the plugin is loaded */
+static const char pluginStartedBanner[] = "process started";
 
 using namespace SignOn;
 
@@ -105,21 +115,34 @@ namespace SignonDaemonNS {
         TRACE();
 
         m_type = type;
-        m_isProcessing = false;
-        m_isResultObtained = false;
-        m_currentResultOperation = -1;
-        m_blobIOHandler = NULL;
+        m_maxConcurrentRequests = 1;
+        m_lastRequestId = 0;
+        m_startupState = NotStarted;
         m_process = new PluginProcess(this);
 
+        m_channel = new IpcChannel(m_process, m_process, this);
+        connect(m_channel,
+                SIGNAL(frameReceived(quint16, quint32, const QByteArray&)),
+                this,
+                SLOT(onFrameReceived(quint16, quint32, const QByteArray&)));
+        connect(m_channel, SIGNAL(error()), this, SLOT(onChannelError()));
+
+        m_startupTimer = new QTimer(this);
+        m_startupTimer->setSingleShot(true);
+        m_startupTimer->setInterval(PLUGINPROCESS_START_TIMEOUT);
+        connect(m_startupTimer, SIGNAL(timeout()), this, SLOT(onStartupTimeout()));
+
 #ifdef SIGNOND_TRACE
         if (criticalsEnabled()) {
-            const char *level = debugEnabled() ? "2" : "1";
+            const char *level = traceEnabled(SignOn::TracePlugin) ? "2" : "1";
             QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
             env.insert(QLatin1String("SSO_DEBUG"), QLatin1String(level));
             m_process->setProcessEnvironment(env);
         }
 #endif
 
+        connect(m_process, SIGNAL(started()), this, SLOT(onStarted()));
+        connect(m_process, SIGNAL(readyRead()), this, SLOT(onReadStandardOutput()));
         connect(m_process, SIGNAL(readyReadStandardError()), this, SLOT(onReadStandardError()));
 
         /*
@@ -135,7 +158,7 @@ namespace SignonDaemonNS {
         if (m_process != NULL &&
             m_process->state() != QProcess::NotRunning)
         {
-            if (m_isProcessing)
+            if (isProcessing())
                 cancel();
 
             stop();
@@ -161,154 +184,336 @@ namespace SignonDaemonNS {
         }
     }
 
-    PluginProxy* PluginProxy::createNewPluginProxy(const QString &type)
+    PluginProxy* PluginProxy::requestPluginProxy(const QString &type)
     {
-        PluginProxy *pp = new PluginProxy(type);
+        PluginProxy *pp = PluginProxyPool::instance()->take(type);
+        if (pp != NULL)
+            return pp;
 
-        QStringList args = QStringList() << pp->m_type;
-        pp->m_process->start(REMOTEPLUGIN_BIN_PATH, args);
+        /* The caller will connect to startupFinished() and start() it */
+        return new PluginProxy(type);
+    }
 
-        QByteArray tmp;
+    void PluginProxy::start()
+    {
+        if (m_startupState != NotStarted) {
+            if (m_startupState != Started
+                || m_process->state() != QProcess::NotRunning)
+                return;
 
-        if (!pp->waitForStarted(PLUGINPROCESS_START_TIMEOUT)) {
-            TRACE() << "The process cannot be started";
-            delete pp;
-            return NULL;
+            //the process exited, but onExit() hasn't been called yet
+            m_startupState = NotStarted;
         }
 
-        if (!pp->readOnReady(tmp, PLUGINPROCESS_START_TIMEOUT)) {
-            TRACE() << "The process cannot load plugin";
-            delete pp;
-            return NULL;
+        TRACE() << "Starting plugin process of type" << m_type;
+        m_startupState = Launching;
+        m_startupBuffer.clear();
+        m_channel->reset();
+
+        /* The shared memory is inherited by the plugin process: the large
+         * payloads go through it once the plugin process says it uses it */
+        int sharedMemoryFd = IpcChannel::createSharedMemory();
+        if (sharedMemoryFd >= 0
+            && !m_channel->attachSharedMemory(sharedMemoryFd, true)) {
+            close(sharedMemoryFd);
+            sharedMemoryFd = -1;
         }
 
+        QProcessEnvironment env = m_process->processEnvironment();
+        if (env.isEmpty())
+            env = QProcessEnvironment::systemEnvironment();
+        if (sharedMemoryFd >= 0)
+            env.insert(QLatin1String(SIGNON_IPC_SHARED_MEMORY_FD_ENV),
+                       QString::number(sharedMemoryFd));
+        else
+            env.remove(QLatin1String(SIGNON_IPC_SHARED_MEMORY_FD_ENV));
+        m_process->setProcessEnvironment(env);
+
+        m_startupTimer->start();
+        m_process->start(REMOTEPLUGIN_BIN_PATH, QStringList(m_type));
+
+        /* The plugin process has its own copy of the descriptor by now */
+        if (sharedMemoryFd >= 0)
+            close(sharedMemoryFd);
+    }
+
+    void PluginProxy::onStarted()
+    {
+        TRACE();
+    }
+
+    void PluginProxy::onStartupTimeout()
+    {
+        if (m_startupState == NotStarted || m_startupState == Started)
+            return;
+
+        BLAME() << "Plugin process of type" << m_type
+                << "did not start in time, state:" << m_startupState;
+        finishStartup(false);
+    }
+
+    void PluginProxy::handleStartupOutput()
+    {
+        /* Only the banner is read here: what follows it is made of frames,
+         * read by the IPC channel */
+        int bannerSize = sizeof(pluginStartedBanner) - 1;
+        m_startupBuffer += m_process->read(bannerSize - m_startupBuffer.size());
+        if (m_startupBuffer.size() < bannerSize)
+            return;
+        m_startupBuffer.clear();
+
         if (debugEnabled()) {
-            QString pluginType = pp->queryType();
-            if (pluginType != pp->m_type) {
+            m_channel->sendFrame(PLUGIN_OP_TYPE);
+            m_startupState = QueryingType;
+        } else {
+            m_channel->sendFrame(PLUGIN_OP_MECHANISMS);
+            m_startupState = QueryingMechanisms;
+        }
+    }
+
+    void PluginProxy::handleStartupFrame(quint16 opcode, const QByteArray &payload)
+    {
+        QDataStream in(payload);
+        if (m_startupState == QueryingType && opcode == PLUGIN_RESPONSE_TYPE) {
+            QString pluginType;
+            in >> pluginType;
+
+            if (pluginType != m_type) {
                 BLAME() << QString::fromLatin1("Plugin returned type '%1', "
                                                "expected '%2'").
-                    arg(pluginType).arg(pp->m_type);
+                    arg(pluginType).arg(m_type);
+            }
+
+            m_channel->sendFrame(PLUGIN_OP_MECHANISMS);
+            m_startupState = QueryingMechanisms;
+        } else if (m_startupState == QueryingMechanisms
+                   && opcode == PLUGIN_RESPONSE_MECHANISMS) {
+            quint32 maxConcurrentRequests = 1;
+            bool sharedMemory = false;
+            m_mechanisms.clear();
+            in >> m_mechanisms >> maxConcurrentRequests >> sharedMemory;
+            if (in.status() != QDataStream::Ok) {
+                finishStartup(false);
+                return;
             }
+            m_maxConcurrentRequests = qMax(maxConcurrentRequests, (quint32)1);
+            m_channel->setSharedMemoryEnabled(sharedMemory);
+
+            TRACE() << m_mechanisms << m_maxConcurrentRequests << sharedMemory;
+            finishStartup(true);
+        } else {
+            BLAME() << "Unexpected plugin response during startup:" << opcode;
+            finishStartup(false);
+        }
+    }
+
+    void PluginProxy::finishStartup(bool started)
+    {
+        m_startupTimer->stop();
+        m_startupBuffer.clear();
+
+        if (started) {
+            TRACE() << "The process is started";
+            m_startupState = Started;
+        } else {
+            TRACE() << "The process cannot be started";
+            m_startupState = NotStarted;
+            if (m_process->state() != QProcess::NotRunning)
+                m_process->kill();
         }
-        pp->m_mechanisms = pp->queryMechanisms();
 
-        connect(pp->m_process, SIGNAL(readyRead()), pp, SLOT(onReadStandardOutput()));
+        /* The requests queued meanwhile go before any new one */
+        sendPendingRequests();
 
-        TRACE() << "The process is started";
-        return pp;
+        emit startupFinished(started);
     }
 
-   bool PluginProxy::process(const QString &cancelKey, const QVariantMap &inData, const QString &mechanism)
-   {
-       TRACE();
-
-        if (!restartIfRequired())
+    bool PluginProxy::sendProcess(const QString &cancelKey,
+                                  const QVariantMap &inData,
+                                  const QString &mechanism)
+    {
+        /* 0 is the id of the startup queries */
+        if (++m_lastRequestId == 0)
+            ++m_lastRequestId;
+
+        QDataStream &out = m_channel->startFrame(PLUGIN_OP_PROCESS,
+                                                 m_lastRequestId);
+        out << mechanism << inData;
+        if (!m_channel->sendFrame())
             return false;
 
-        m_isResultObtained = false;
-        m_cancelKey = cancelKey;
-        QVariant value = inData.value(SSOUI_KEY_UIPOLICY);
-        m_uiPolicy = value.toInt();
+        TRACE_EVENT("process", m_lastRequestId, m_requests.count());
 
-        QDataStream in(m_process);
-        in << (quint32)PLUGIN_OP_PROCESS;
-        in << mechanism;
+        Request request;
+        request.m_cancelKey = cancelKey;
+        request.m_uiPolicy = inData.value(SSOUI_KEY_UIPOLICY).toInt();
+        m_requests.insert(m_lastRequestId, request);
+        return true;
+    }
 
-        m_blobIOHandler->sendData(inData);
+    void PluginProxy::sendPendingRequests()
+    {
+        if (m_pendingRequests.isEmpty())
+            return;
 
-        m_isProcessing = true;
-        return true;
+        /* The requests are dropped before any error is emitted, as the
+         * receivers might send new ones */
+        QList<PendingRequest> requests = m_pendingRequests;
+        m_pendingRequests.clear();
+
+        foreach (const PendingRequest &request, requests) {
+            if (m_startupState == Started
+                && sendProcess(request.m_cancelKey, request.m_inData,
+                               request.m_mechanism))
+                continue;
+
+            emit processError(request.m_cancelKey,
+                              (int)Error::InternalServer,
+                              QLatin1String("The authentication plugin "
+                                            "could not be restarted."));
+        }
     }
 
-   bool PluginProxy::processUi(const QString &cancelKey, const QVariantMap &inData)
+   bool PluginProxy::process(const QString &cancelKey, const QVariantMap &inData, const QString &mechanism)
    {
-        TRACE();
+       TRACE();
 
-        if (!restartIfRequired())
+        if (m_requests.count() + m_pendingRequests.count()
+            >= m_maxConcurrentRequests) {
+            BLAME() << "The plugin process is busy:" << m_requests.count()
+                    << "requests being processed";
             return false;
+        }
 
-        m_cancelKey = cancelKey;
-
-        QDataStream in(m_process);
+        if (!restartIfRequired()) {
+            /* The request is sent once the process has started, or fails
+             * with processError() if it cannot be started */
+            PendingRequest request;
+            request.m_cancelKey = cancelKey;
+            request.m_inData = inData;
+            request.m_mechanism = mechanism;
+            m_pendingRequests.append(request);
+            return true;
+        }
 
-        in << (quint32)PLUGIN_OP_PROCESS_UI;
+        return sendProcess(cancelKey, inData, mechanism);
+    }
 
-        m_blobIOHandler->sendData(inData);
+   bool PluginProxy::processUi(const QString &cancelKey, const QVariantMap &inData)
+   {
+        TRACE();
 
-        m_isProcessing = true;
+        quint32 id = requestId(cancelKey);
+        if (id == 0) {
+            BLAME() << "No request being processed for" << cancelKey;
+            return false;
+        }
 
-        return true;
+        QDataStream &out = m_channel->startFrame(PLUGIN_OP_PROCESS_UI, id);
+        out << inData;
+        return m_channel->sendFrame();
     }
 
    bool PluginProxy::processRefresh(const QString &cancelKey, const QVariantMap &inData)
    {
         TRACE();
 
-        if (!restartIfRequired())
+        quint32 id = requestId(cancelKey);
+        if (id == 0) {
+            BLAME() << "No request being processed for" << cancelKey;
             return false;
+        }
 
-        m_cancelKey = cancelKey;
+        QDataStream &out = m_channel->startFrame(PLUGIN_OP_REFRESH, id);
+        out << inData;
+        return m_channel->sendFrame();
+    }
 
-        QDataStream in(m_process);
+   void PluginProxy::cancel(const QString &cancelKey)
+   {
+       TRACE() << cancelKey;
 
-        in << (quint32)PLUGIN_OP_REFRESH;
+       for (int i = 0; i < m_pendingRequests.count(); i++) {
+           if (m_pendingRequests.at(i).m_cancelKey != cancelKey)
+               continue;
 
-        m_blobIOHandler->sendData(inData);
+           m_pendingRequests.removeAt(i);
+           emit processError(cancelKey, (int)Error::SessionCanceled,
+                             QLatin1String("The operation is canceled"));
+           return;
+       }
 
-        m_isProcessing = true;
+       //do not cancel if the request is not going on
+       quint32 id = requestId(cancelKey);
+       if (id == 0) return;
 
-        return true;
+       TRACE_EVENT("cancel", id, 0);
+       m_channel->sendFrame(PLUGIN_OP_CANCEL, id);
     }
 
    void PluginProxy::cancel()
    {
        TRACE();
-       //do not cancel if there is no request going on
-       if (!m_isProcessing) return;
 
-       QDataStream in(m_process);
-       in << (quint32)PLUGIN_OP_CANCEL;
+       QList<PendingRequest> requests = m_pendingRequests;
+       m_pendingRequests.clear();
+       foreach (const PendingRequest &request, requests)
+           emit processError(request.m_cancelKey, (int)Error::SessionCanceled,
+                             QLatin1String("The operation is canceled"));
+
+       foreach (quint32 id, m_requests.keys())
+           m_channel->sendFrame(PLUGIN_OP_CANCEL, id);
     }
 
    void PluginProxy::stop()
    {
        TRACE();
-       QDataStream in(m_process);
-       in << (quint32)PLUGIN_OP_STOP;
+       m_channel->sendFrame(PLUGIN_OP_STOP);
     }
 
-    bool PluginProxy::readOnReady(QByteArray &buffer, int timeout)
+    bool PluginProxy::isProcessing()
     {
-        bool ready = m_process->waitForReadyRead(timeout);
-
-        if (ready) {
-            if (!m_process->bytesAvailable())
-                return false;
+        TRACE();
+        return !m_requests.isEmpty() || !m_pendingRequests.isEmpty();
+    }
 
-            while (m_process->bytesAvailable())
-                buffer += m_process->readAllStandardOutput();
+    quint32 PluginProxy::requestId(const QString &cancelKey) const
+    {
+        QHash<quint32, Request>::const_iterator i;
+        for (i = m_requests.constBegin(); i != m_requests.constEnd(); ++i) {
+            if (i.value().m_cancelKey == cancelKey)
+                return i.key();
         }
-
-        return ready;
+        return 0;
     }
 
-    bool PluginProxy::isProcessing()
+    void PluginProxy::failRequests(const QString &message)
     {
-        TRACE();
-        return m_isProcessing;
+        /* The requests are dropped before any error is emitted, as the
+         * receivers might send new ones */
+        QList<Request> requests = m_requests.values();
+        m_requests.clear();
+
+        foreach (const Request &request, requests)
+            emit processError(request.m_cancelKey,
+                              (int)Error::InternalServer, message);
     }
 
-    void PluginProxy::blobIOError()
+    void PluginProxy::onChannelError()
     {
         TRACE();
-        disconnect(m_blobIOHandler, SIGNAL(error()), this, SLOT(blobIOError()));
+
+        if (m_startupState != Started) {
+            if (m_startupState != NotStarted)
+                finishStartup(false);
+            return;
+        }
+
+        /* The stream cannot be trusted anymore: the process is stopped */
         stop();
 
-        connect(m_process, SIGNAL(readyRead()), this, SLOT(onReadStandardOutput()));
-        emit processError(
-            m_cancelKey,
-            (int)Error::InternalServer,
-            QLatin1String("Failed to I/O session data to/from the authentication plugin."));
+        failRequests(QLatin1String("Failed to I/O session data to/from the "
+                                   "authentication plugin."));
     }
 
     bool PluginProxy::isResultOperationCodeValid(const int opCode) const
@@ -327,153 +532,128 @@ namespace SignonDaemonNS {
     {
         TRACE();
 
-        if (!m_process->bytesAvailable()) {
-            qCritical() << "No information available on process";
+        if (m_startupState == NotStarted) {
+            //the process is being stopped
+            Q_UNUSED(m_process->readAllStandardOutput());
             return;
         }
 
-        disconnect(m_process, SIGNAL(readyRead()), this, SLOT(onReadStandardOutput()));
-
-        QDataStream reader(m_process);
-        do {
-            reader >> m_currentResultOperation;
+        if (m_startupState == Launching) {
+            handleStartupOutput();
+            if (m_startupState == Launching)
+                return;
+        }
 
-            TRACE() << "PROXY RESULT OPERATION:" << m_currentResultOperation;
+        m_channel->readFrames();
+    }
 
-            if (!isResultOperationCodeValid(m_currentResultOperation)) {
-                TRACE() << "Unknown operation code - skipping.";
+    void PluginProxy::onFrameReceived(quint16 opcode, quint32 requestId,
+                                      const QByteArray &payload)
+    {
+        TRACE() << "PROXY RESULT OPERATION:" << opcode << requestId
+                << payload.size();
+        TRACE_EVENT("response", opcode, requestId);
 
-                //flushing the stdin channel
-                Q_UNUSED(m_process->readAllStandardOutput());
-                break;
-            }
+        if (m_startupState != Started) {
+            handleStartupFrame(opcode, payload);
+            return;
+        }
 
-            if (m_currentResultOperation != PLUGIN_RESPONSE_SIGNAL
-                && m_currentResultOperation != PLUGIN_RESPONSE_ERROR) {
+        if (!isResultOperationCodeValid(opcode)) {
+            TRACE() << "Unknown operation code - skipping.";
+            return;
+        }
 
-                connect(m_blobIOHandler, SIGNAL(error()),
-                        this, SLOT(blobIOError()), Qt::UniqueConnection);
+        handlePluginResponse(opcode, requestId, payload);
+    }
 
-                int expectedDataSize = 0;
-                reader >> expectedDataSize;
-                TRACE() << "PROXY EXPECTED DATA SIZE:" << expectedDataSize;
+    void PluginProxy::handlePluginResponse(const quint32 resultOperation,
+                                           const quint32 requestId,
+                                           const QByteArray &payload)
+    {
+        TRACE() << resultOperation;
 
-                m_blobIOHandler->receiveData(expectedDataSize);
-            } else {
-                handlePluginResponse(m_currentResultOperation);
+        QVariantMap sessionDataMap;
+        quint32 code = 0;
+        QString message;
 
-                if (m_currentResultOperation == PLUGIN_RESPONSE_ERROR) {
-                    //flushing the stdin channel
-                    Q_UNUSED(m_process->readAllStandardOutput());
-                    break;
-                }
-            }
-        } while (m_process->bytesAvailable());
+        QDataStream in(payload);
+        if (resultOperation == PLUGIN_RESPONSE_ERROR
+            || resultOperation == PLUGIN_RESPONSE_SIGNAL)
+            in >> code >> message;
+        else
+            in >> sessionDataMap;
 
-        connect(m_process, SIGNAL(readyRead()), this, SLOT(onReadStandardOutput()));
-    }
+        if (in.status() != QDataStream::Ok) {
+            BLAME() << "Malformed plugin response:" << resultOperation;
+            onChannelError();
+            return;
+        }
 
-    void PluginProxy::sessionDataReceived(const QVariantMap &map)
-    {
-        handlePluginResponse(m_currentResultOperation, map);
-    }
+        if (!m_requests.contains(requestId)) {
+            BLAME() << "Unexpected plugin response" << resultOperation
+                    << "for request" << requestId;
+            return;
+        }
 
-    void PluginProxy::handlePluginResponse(const quint32 resultOperation,
-                                           const QVariantMap &sessionDataMap)
-    {
-        TRACE() << resultOperation;
+        /* The request is copied: the receivers of the signals below might
+         * send new requests */
+        Request request = m_requests.value(requestId);
 
         if (resultOperation == PLUGIN_RESPONSE_RESULT) {
             TRACE() << "PLUGIN_RESPONSE_RESULT";
 
-            m_isProcessing = false;
-
-            if (!m_isResultObtained)
-                emit processResultReply(m_cancelKey, sessionDataMap);
-            else
-                BLAME() << "Unexpected plugin response: ";
-
-            m_isResultObtained = true;
+            m_requests.remove(requestId);
+            emit processResultReply(request.m_cancelKey, sessionDataMap);
         } else if (resultOperation == PLUGIN_RESPONSE_STORE) {
             TRACE() << "PLUGIN_RESPONSE_STORE";
 
-            if (!m_isResultObtained)
-                emit processStore(m_cancelKey, sessionDataMap);
-            else
-                BLAME() << "Unexpected plugin store: ";
-
+            emit processStore(request.m_cancelKey, sessionDataMap);
         } else if (resultOperation == PLUGIN_RESPONSE_UI) {
             TRACE() << "PLUGIN_RESPONSE_UI";
 
-            if (!m_isResultObtained) {
-                bool allowed = true;
+            bool allowed = true;
 
-                if (m_uiPolicy == NoUserInteractionPolicy)
-                    allowed = false;
+            if (request.m_uiPolicy == NoUserInteractionPolicy)
+                allowed = false;
 
-                if (m_uiPolicy == ValidationPolicy) {
-                    bool credentialsQueried =
-                        (sessionDataMap.contains(SSOUI_KEY_QUERYUSERNAME)
-                        || sessionDataMap.contains(SSOUI_KEY_QUERYPASSWORD));
+            if (request.m_uiPolicy == ValidationPolicy) {
+                bool credentialsQueried =
+                    (sessionDataMap.contains(SSOUI_KEY_QUERYUSERNAME)
+                    || sessionDataMap.contains(SSOUI_KEY_QUERYPASSWORD));
 
-                    bool captchaQueried  =
-                        (sessionDataMap.contains(SSOUI_KEY_CAPTCHAIMG)
-                         || sessionDataMap.contains(SSOUI_KEY_CAPTCHAURL));
+                bool captchaQueried  =
+                    (sessionDataMap.contains(SSOUI_KEY_CAPTCHAIMG)
+                     || sessionDataMap.contains(SSOUI_KEY_CAPTCHAURL));
 
-                    if (credentialsQueried && !captchaQueried)
-                        allowed = false;
-                }
+                if (credentialsQueried && !captchaQueried)
+                    allowed = false;
+            }
 
-                if (!allowed) {
-                    //set error and return;
-                    TRACE() << "ui policy prevented ui launch";
+            if (!allowed) {
+                //set error and return;
+                TRACE() << "ui policy prevented ui launch";
 
-                    QVariantMap nonConstMap = sessionDataMap;
-                    nonConstMap.insert(SSOUI_KEY_ERROR, QUERY_ERROR_FORBIDDEN);
-                    processUi(m_cancelKey, nonConstMap);
-                } else {
-                    TRACE() << "open ui";
-                    emit processUiRequest(m_cancelKey, sessionDataMap);
-                }
+                QVariantMap nonConstMap = sessionDataMap;
+                nonConstMap.insert(SSOUI_KEY_ERROR, QUERY_ERROR_FORBIDDEN);
+                processUi(request.m_cancelKey, nonConstMap);
             } else {
-                BLAME() << "Unexpected plugin ui response: ";
+                TRACE() << "open ui";
+                emit processUiRequest(request.m_cancelKey, sessionDataMap);
             }
         } else if (resultOperation == PLUGIN_RESPONSE_REFRESHED) {
             TRACE() << "PLUGIN_RESPONSE_REFRESHED";
 
-            if (!m_isResultObtained)
-                emit processRefreshRequest(m_cancelKey, sessionDataMap);
-            else
-                BLAME() << "Unexpected plugin ui response: ";
+            emit processRefreshRequest(request.m_cancelKey, sessionDataMap);
         } else if (resultOperation == PLUGIN_RESPONSE_ERROR) {
             TRACE() << "PLUGIN_RESPONSE_ERROR";
-            quint32 err;
-            QString errorMessage;
-
-            QDataStream stream(m_process);
-            stream >> err;
-            stream >> errorMessage;
-            m_isProcessing = false;
-
-            if (!m_isResultObtained)
-                emit processError(m_cancelKey, (int)err, errorMessage);
-            else
-                BLAME() << "Unexpected plugin error: " << errorMessage;
 
-            m_isResultObtained = true;
+            m_requests.remove(requestId);
+            emit processError(request.m_cancelKey, (int)code, message);
         } else if (resultOperation == PLUGIN_RESPONSE_SIGNAL) {
             TRACE() << "PLUGIN_RESPONSE_SIGNAL";
-            quint32 state;
-            QString message;
 
-            QDataStream stream(m_process);
-            stream >> state;
-            stream >> message;
-
-            if (!m_isResultObtained)
-                emit stateChanged(m_cancelKey, (int)state, message);
-            else
-                BLAME() << "Unexpected plugin signal: " << state << message;
+            emit stateChanged(request.m_cancelKey, (int)code, message);
         }
     }
 
@@ -487,119 +667,191 @@ namespace SignonDaemonNS {
     {
         TRACE() << "Plugin process exit with code " << exitCode << " : " << exitStatus;
 
-        if (m_isProcessing || exitStatus == QProcess::CrashExit) {
+        if (m_startupState != Started) {
+            if (m_startupState != NotStarted)
+                finishStartup(false);
+            return;
+        }
+        m_startupState = NotStarted;
+
+        if (isProcessing() || exitStatus == QProcess::CrashExit) {
             qCritical() << "Challenge produces CRASH!";
-            emit processError(m_cancelKey, Error::InternalServer, QLatin1String("plugin processed crashed"));
+            failRequests(QLatin1String("plugin processed crashed"));
         }
         if (exitCode == 2) {
             TRACE() << "plugin process terminated because cannot change user";
         }
-
-        m_isProcessing = false;
     }
 
     void PluginProxy::onError(QProcess::ProcessError err)
     {
         TRACE() << "Error: " << err;
+
+        if (err == QProcess::FailedToStart && m_startupState == Launching)
+            finishStartup(false);
     }
 
-    QString PluginProxy::queryType()
+    bool PluginProxy::waitForFinished(int timeout)
     {
-        TRACE();
+        return m_process->waitForFinished(timeout);
+    }
 
-        if (!restartIfRequired())
-            return QString();
+    bool PluginProxy::restartIfRequired()
+    {
+        if (m_startupState == Started
+            && m_process->state() != QProcess::NotRunning)
+            return true;
 
-        QDataStream ds(m_process);
-        ds << (quint32)PLUGIN_OP_TYPE;
+        TRACE() << "RESTART REQUIRED";
+        start();
+        return false;
+    }
 
-        QByteArray buffer;
-        bool result;
+    /* ---------------------- PluginProxyPool ---------------------- */
 
-        if (!(result = readOnReady(buffer, PLUGINPROCESS_START_TIMEOUT)))
-            qCritical("PluginProxy returned NULL result");
+    PluginProxyPool *PluginProxyPool::m_instance = 0;
 
-        QString type;
-        QDataStream out(buffer);
-        out >> type;
-        return type;
+    PluginProxyPool::PluginProxyPool(QObject *parent)
+            : QObject(parent),
+              m_refillScheduled(false)
+    {
     }
 
-    QStringList PluginProxy::queryMechanisms()
+    PluginProxyPool::~PluginProxyPool()
     {
-        TRACE();
-
-        if (!restartIfRequired())
-            return QStringList();
-
-        QDataStream in(m_process);
-        in << (quint32)PLUGIN_OP_MECHANISMS;
+        foreach (QList<PluginProxy *> proxies, m_idle)
+            qDeleteAll(proxies);
+        m_idle.clear();
 
-        QByteArray buffer;
-        QStringList strList;
-        bool result;
-
-        if ((result = readOnReady(buffer, PLUGINPROCESS_START_TIMEOUT))) {
+        m_instance = 0;
+    }
 
-            QVariant mechanismsVar;
-            QDataStream out(buffer);
+    PluginProxyPool *PluginProxyPool::instance(QObject *parent)
+    {
+        if (m_instance == 0)
+            m_instance = new PluginProxyPool(parent);
 
-            out >> mechanismsVar;
-            QVariantList varList = mechanismsVar.toList();
+        return m_instance;
+    }
 
-            for (int i = 0; i < varList.count(); i++)
-                    strList << varList.at(i).toString();
+    void PluginProxyPool::setSize(const QString &type, int size)
+    {
+        TRACE() << type << size;
+
+        if (size > 0) {
+            m_sizes.insert(type, size);
+        } else {
+            m_sizes.remove(type);
+            m_failures.remove(type);
+            m_retryTimes.remove(type);
+        }
 
-            TRACE() << strList;
-        } else
-            qCritical("PluginProxy returned NULL result");
+        QList<PluginProxy *> &proxies = m_idle[type];
+        while (proxies.count() > qMax(size, 0))
+            delete proxies.takeLast();
 
-        return strList;
+        scheduleRefill();
     }
 
-    bool PluginProxy::waitForStarted(int timeout)
+    PluginProxy *PluginProxyPool::take(const QString &type)
     {
-        if (!m_process->waitForStarted(timeout))
-            return false;
+        QList<PluginProxy *> &proxies = m_idle[type];
+        for (int i = 0; i < proxies.count(); i++) {
+            PluginProxy *pp = proxies.at(i);
+            if (!pp->isStarted()
+                || pp->m_process->state() != QProcess::Running) {
+                //still starting, or died meanwhile
+                pp->start();
+                continue;
+            }
 
-        TRACE();
+            proxies.removeAt(i);
+            scheduleRefill();
 
-        if (m_blobIOHandler == NULL)
-        {
-            TRACE() << "inintializeing the data";
-            m_blobIOHandler = new BlobIOHandler(m_process, m_process, this);
+            TRACE() << "Plugin process of type" << type << "taken from the pool";
+            disconnect(pp, 0, this, 0);
+            pp->setParent(0);
+            return pp;
+        }
 
-            connect(m_blobIOHandler,
-                    SIGNAL(dataReceived(const QVariantMap &)),
-                    this,
-                    SLOT(sessionDataReceived(const QVariantMap &)), Qt::UniqueConnection);
+        return NULL;
+    }
 
-            QSocketNotifier *readNotifier =
-                new QSocketNotifier(STDIN_FILENO, QSocketNotifier::Read, this);
+    void PluginProxyPool::release(PluginProxy *pluginProxy)
+    {
+        if (pluginProxy == NULL)
+            return;
 
-            readNotifier->setEnabled(false);
-            m_blobIOHandler->setReadChannelSocketNotifier(readNotifier);
+        QString type = pluginProxy->type();
+        QList<PluginProxy *> &proxies = m_idle[type];
+        if (proxies.count() >= size(type)
+            || pluginProxy->isProcessing()
+            || !pluginProxy->isStarted()) {
+            delete pluginProxy;
+            return;
         }
 
-        return true;
+        pluginProxy->setParent(this);
+        proxies.append(pluginProxy);
     }
 
-    bool PluginProxy::waitForFinished(int timeout)
+    void PluginProxyPool::scheduleRefill()
     {
-        return m_process->waitForFinished(timeout);
+        if (m_refillScheduled)
+            return;
+
+        m_refillScheduled = true;
+        QMetaObject::invokeMethod(this, "refill", Qt::QueuedConnection);
     }
 
-    bool PluginProxy::restartIfRequired()
+    void PluginProxyPool::refill()
+    {
+        m_refillScheduled = false;
+
+        uint now = QDateTime::currentDateTime().toTime_t();
+        foreach (QString type, m_sizes.keys()) {
+            if (m_retryTimes.value(type, 0) > now)
+                continue;
+
+            QList<PluginProxy *> &proxies = m_idle[type];
+            while (proxies.count() < m_sizes.value(type)) {
+                PluginProxy *pp = new PluginProxy(type, this);
+                connect(pp, SIGNAL(startupFinished(bool)),
+                        this, SLOT(pluginProxyStartupFinished(bool)));
+                proxies.append(pp);
+                pp->start();
+            }
+        }
+    }
+
+    void PluginProxyPool::pluginProxyStartupFinished(bool started)
     {
-        if (m_process->state() == QProcess::NotRunning) {
-            TRACE() << "RESTART REQUIRED";
-            m_process->start(REMOTEPLUGIN_BIN_PATH, QStringList(m_type));
+        PluginProxy *pp = qobject_cast<PluginProxy *>(sender());
+        if (pp == NULL)
+            return;
 
-            QByteArray tmp;
-            if (!waitForStarted(PLUGINPROCESS_START_TIMEOUT) || !readOnReady(tmp, PLUGINPROCESS_START_TIMEOUT))
-                return false;
+        QString type = pp->type();
+        if (started) {
+            m_failures.remove(type);
+            m_retryTimes.remove(type);
+            return;
         }
-        return true;
+
+        /* Keep the configured size, but back off before starting another
+         * plugin of this type: the failure might be a transient one */
+        int failures = m_failures.value(type, 0) + 1;
+        m_failures.insert(type, failures);
+        int delay = PLUGINPOOL_RETRY_DELAY << qMin(failures - 1, 16);
+        delay = qMin(delay, PLUGINPOOL_MAX_RETRY_DELAY);
+        m_retryTimes.insert(type,
+                            QDateTime::currentDateTime().toTime_t() + delay);
+
+        BLAME() << "Cannot start pooled plugin of type" << type
+            << "- retrying in" << delay << "seconds";
+        m_idle[type].removeOne(pp);
+        pp->deleteLater();
+
+        QTimer::singleShot(delay * 1000, this, SLOT(refill()));
     }
 
 } //namespace SignonDaemonNS
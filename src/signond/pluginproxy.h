@@ -28,7 +28,7 @@
 #include <QtCore>
 
 namespace SignOn {
-    class BlobIOHandler;
+    class IpcChannel;
     class EncryptedDevice;
 };
 
@@ -61,13 +61,51 @@ namespace SignonDaemonNS {
 
         friend class SignonIdentity;
         friend class TestAuthSession;
+        friend class PluginProxyPool;
 
     public:
-        static PluginProxy *createNewPluginProxy(const QString &type);
+        /*!
+         * @enum StartupState
+         * The steps of the plugin process startup: the process is launched,
+         * it announces that the plugin is loaded, and then it is queried for
+         * its type and mechanisms.
+         */
+        enum StartupState {
+            NotStarted = 0,
+            Launching,
+            QueryingType,
+            QueryingMechanisms,
+            Started
+        };
+
+        /*!
+         * Returns a plugin proxy of the given type without waiting for its
+         * process to start: startupFinished() is emitted once it is done,
+         * unless the proxy comes already started from the PluginProxyPool.
+         */
+        static PluginProxy *requestPluginProxy(const QString &type);
         virtual ~PluginProxy();
 
+        /*!
+         * Starts the plugin process again if it has exited, without waiting
+         * for it.
+         * @returns whether the plugin process can take requests right away.
+         */
         bool restartIfRequired();
         bool isProcessing();
+        bool isStarted() const { return m_startupState == Started; }
+
+        /*!
+         * @returns the number of requests the plugin process can handle at
+         * the same time, as declared by the plugin.
+         */
+        int maxConcurrentRequests() const { return m_maxConcurrentRequests; }
+
+        /*!
+         * Starts the plugin process, if it is not running; does nothing if
+         * the process is already started or starting.
+         */
+        void start();
 
     public Q_SLOTS:
         QString type() const { return m_type; }
@@ -75,6 +113,7 @@ namespace SignonDaemonNS {
         bool process(const QString &cancelKey, const QVariantMap &inData, const QString &mechanism);
         bool processUi(const QString &cancelKey, const QVariantMap &inData);
         bool processRefresh(const QString &cancelKey, const QVariantMap &inData);
+        void cancel(const QString &cancelKey);
         void cancel();
         void stop();
 
@@ -85,42 +124,135 @@ namespace SignonDaemonNS {
         void processRefreshRequest(const QString &cancelKey, const QVariantMap &data);
         void processError(const QString &cancelKey, int error, const QString &message);
         void stateChanged(const QString &cancelKey, int state, const QString &message);
+        void startupFinished(bool started);
 
     private:
-        QString queryType();
-        QStringList queryMechanisms();
-
-        bool waitForStarted(int timeout);
         bool waitForFinished(int timeout);
 
-        bool readOnReady(QByteArray &buffer, int timeout);
+        void handleStartupOutput();
+        void handleStartupFrame(quint16 opcode, const QByteArray &payload);
+        void finishStartup(bool started);
+        bool sendProcess(const QString &cancelKey, const QVariantMap &inData,
+                         const QString &mechanism);
+        void sendPendingRequests();
 
         void handlePluginResponse(const quint32 resultOperation,
-                                  const QVariantMap &sessionDataMap = QVariantMap());
+                                  const quint32 requestId,
+                                  const QByteArray &payload);
+
+        quint32 requestId(const QString &cancelKey) const;
+        void failRequests(const QString &message);
 
         bool isResultOperationCodeValid(const int opCode) const;
 
     private Q_SLOTS:
+        void onStarted();
+        void onStartupTimeout();
         void onReadStandardOutput();
         void onReadStandardError();
         void onExit(int exitCode, QProcess::ExitStatus exitStatus);
         void onError(QProcess::ProcessError err);
-        void sessionDataReceived(const QVariantMap &map);
-        void blobIOError();
+        void onFrameReceived(quint16 opcode, quint32 requestId,
+                             const QByteArray &payload);
+        void onChannelError();
 
     private:
         PluginProxy(QString type, QObject *parent = NULL);
 
-        bool m_isProcessing;
-        bool m_isResultObtained;
+        /*
+         * A request sent to the plugin process, which has not got its
+         * result or error yet
+         * */
+        struct Request
+        {
+            Request(): m_uiPolicy(0) {}
+
+            QString m_cancelKey;
+            int m_uiPolicy;
+        };
+
         QString m_type;
-        QString m_cancelKey;
         QStringList m_mechanisms;
-        int m_uiPolicy;
-        int m_currentResultOperation;
+        int m_maxConcurrentRequests;
+
+        /*
+         * A request received while the plugin process was restarting: it is
+         * sent once the process has started
+         * */
+        struct PendingRequest
+        {
+            QString m_cancelKey;
+            QVariantMap m_inData;
+            QString m_mechanism;
+        };
+
+        QHash<quint32, Request> m_requests;
+        QList<PendingRequest> m_pendingRequests;
+        quint32 m_lastRequestId;
+
+        StartupState m_startupState;
+        QByteArray m_startupBuffer;
+        QTimer *m_startupTimer;
 
         PluginProcess *m_process;
-        SignOn::BlobIOHandler *m_blobIOHandler;
+        SignOn::IpcChannel *m_channel;
+    };
+
+    /*!
+     * @class PluginProxyPool
+     * Keeps a configurable number of started and idle plugin processes per
+     * authentication method, so that new sessions don't have to wait for a
+     * plugin process to start. The pool is refilled in the background.
+     */
+    class PluginProxyPool : public QObject
+    {
+        Q_OBJECT
+
+    public:
+        static PluginProxyPool *instance(QObject *parent = 0);
+        ~PluginProxyPool();
+
+        /*!
+         * Sets the number of idle plugin processes to keep for a method.
+         */
+        void setSize(const QString &type, int size);
+        int size(const QString &type) const { return m_sizes.value(type, 0); }
+
+        /*!
+         * @returns the number of consecutive failures to start a plugin of
+         * the given type; the pool retries after a growing delay.
+         */
+        int failures(const QString &type) const
+            { return m_failures.value(type, 0); }
+
+        /*!
+         * @returns an idle plugin proxy of the given type, or NULL if there
+         * is none. The caller takes ownership of the returned object.
+         */
+        PluginProxy *take(const QString &type);
+
+        /*!
+         * Hands back a plugin proxy which has not been used for processing;
+         * it is kept in the pool if there's room for it, deleted otherwise.
+         */
+        void release(PluginProxy *pluginProxy);
+
+    private Q_SLOTS:
+        void refill();
+        void pluginProxyStartupFinished(bool started);
+
+    private:
+        PluginProxyPool(QObject *parent = 0);
+        void scheduleRefill();
+
+        static PluginProxyPool *m_instance;
+        QHash<QString, int> m_sizes;
+        QHash<QString, QList<PluginProxy *> > m_idle;
+        /* Consecutive start failures, and the time (in seconds since the
+         * epoch) before which no plugin is started, per type */
+        QHash<QString, int> m_failures;
+        QHash<QString, uint> m_retryTimes;
+        bool m_refillScheduled;
     };
 } //namespace SignonDaemonNS
 
@@ -52,6 +52,10 @@ SignonAuthSession::~SignonAuthSession()
     if (parent())
         parent()->removeRef();
 
+    QString clientDBusService = m_authSessions.key(this);
+    if (!clientDBusService.isEmpty())
+        m_authSessions.remove(clientDBusService);
+
     if (m_registered)
     {
         emit unregistered();
@@ -71,7 +75,7 @@ QString SignonAuthSession::getAuthSessionObjectPath(const quint32 id,
                                                     SignonDaemon *parent,
                                                     bool &supportsAuthMethod,
                                                     pid_t ownerPid,
-                                                    const QString &clientDBusService)
+                                                    const QDBusMessage &message)
 {
     TRACE();
     supportsAuthMethod = true;
@@ -103,11 +107,19 @@ QString SignonAuthSession::getAuthSessionObjectPath(const quint32 id,
     }
 
     sas->objectRegistered();
-    m_authSessions.insert(clientDBusService, sas);
+    m_authSessions.insert(message.service(), sas);
 
     connect(core, SIGNAL(stateChanged(const QString&, int, const QString&)),
             sas, SLOT(stateChangedSlot(const QString&, int, const QString&)));
 
+    /* Don't block the daemon while the plugin process starts: the object
+     * path is sent once the plugin is known to be working. */
+    if (!core->isPluginStarted()) {
+        message.setDelayedReply(true);
+        sas->replyWhenPluginStarted(message);
+        core->startPlugin();
+    }
+
     TRACE() << "SignonAuthSession is created successfully: " << objectName;
     return objectName;
 }
@@ -187,3 +199,30 @@ void SignonAuthSession::objectRegistered()
 {
     m_registered = true;
 }
+
+void SignonAuthSession::replyWhenPluginStarted(const QDBusMessage &message)
+{
+    m_pendingReply = message;
+    connect(parent(), SIGNAL(pluginStartupFinished(bool)),
+            this, SLOT(pluginStartupFinished(bool)));
+}
+
+void SignonAuthSession::pluginStartupFinished(bool started)
+{
+    TRACE() << started;
+    disconnect(parent(), SIGNAL(pluginStartupFinished(bool)),
+               this, SLOT(pluginStartupFinished(bool)));
+
+    QDBusMessage reply;
+    if (started) {
+        reply = m_pendingReply.createReply(QVariant(objectName()));
+    } else {
+        reply = m_pendingReply.createErrorReply(SIGNOND_METHOD_NOT_KNOWN_ERR_NAME,
+                                                SIGNOND_METHOD_NOT_KNOWN_ERR_STR);
+        objectUnref();
+    }
+
+    QDBusConnection connection(SIGNOND_BUS);
+    connection.send(reply);
+    m_pendingReply = QDBusMessage();
+}
@@ -59,7 +59,7 @@ namespace SignonDaemonNS {
                                                 SignonDaemon *parent,
                                                 bool &supportsAuthMethod,
                                                 pid_t ownerPid,
-                                                const QString &clientDBusService);
+                                                const QDBusMessage &message);
         static void stopAllAuthSessions();
         static void destroySession(const QString &dbusService);
 
@@ -80,17 +80,20 @@ namespace SignonDaemonNS {
 
     private Q_SLOTS:
         void stateChangedSlot(const QString &sessionKey, int state, const QString &message);
+        void pluginStartupFinished(bool started);
 
     protected:
         SignonAuthSession(quint32 id, const QString &method, pid_t ownerPid);
         virtual ~SignonAuthSession();
         void objectUnref();
+        void replyWhenPluginStarted(const QDBusMessage &message);
 
     private:
         quint32 m_id;
         QString m_method;
         bool m_registered;
         pid_t m_ownerPid;
+        QDBusMessage m_pendingReply;
 
     Q_DISABLE_COPY(SignonAuthSession)
 }; //class SignonDaemon
@@ -22,8 +22,6 @@
 
 #include "signonauthsessionadaptor.h"
 #include "accesscontrolmanager.h"
-#include "credentialsaccessmanager.h"
-#include "credentialsdb.h"
 
 namespace SignonDaemonNS {
 
@@ -65,31 +63,6 @@ namespace SignonDaemonNS {
     {
         TRACE();
 
-        QString allowedMechanism(mechanism);
-
-        if (parent()->id() != SIGNOND_NEW_IDENTITY) {
-            CredentialsDB *db = CredentialsAccessManager::instance()->credentialsDB();
-            if (db) {
-                SignonIdentityInfo identityInfo = db->credentials(parent()->id(), false);
-                if (!identityInfo.checkMethodAndMechanism(parent()->method(),
-                                                          mechanism,
-                                                          allowedMechanism)) {
-                    QString errMsg;
-                    QTextStream(&errMsg) << SIGNOND_METHOD_OR_MECHANISM_NOT_ALLOWED_ERR_STR
-                                         << " Method:"
-                                         << parent()->method()
-                                         << ", mechanism:"
-                                         << mechanism
-                                         << ", allowed:"
-                                         << allowedMechanism;
-                    errorReply(SIGNOND_METHOD_OR_MECHANISM_NOT_ALLOWED_ERR_NAME, errMsg);
-                    return QVariantMap();
-                }
-            } else {
-                BLAME() << "Null database handler object.";
-            }
-        }
-
         QDBusContext &dbusContext = *static_cast<QDBusContext *>(parent());
         if (AccessControlManager::pidOfPeer(dbusContext) != parent()->ownerPid()) {
             TRACE() << "process called from peer that doesn't own the AuthSession object\n";
@@ -100,7 +73,9 @@ namespace SignonDaemonNS {
             return QVariantMap();
         }
 
-        return parent()->process(sessionDataVa, allowedMechanism);
+        /* The mechanism is checked against the identity once it is
+         * loaded for the request */
+        return parent()->process(sessionDataVa, mechanism);
     }
 
     void SignonAuthSessionAdaptor::cancel()
@@ -45,6 +45,10 @@
         qDebug() << __FILE__ << __LINE__ << __func__
     #define BLAME() \
         qCritical() << __FILE__ << __LINE__ << __func__
+    #ifndef TRACE_EVENT
+        #define TRACE_EVENT(event, value1, value2) \
+            while (0) qDebug() << event << value1 << value2
+    #endif
 #endif
 
 /*
@@ -64,11 +68,14 @@
 
 const char signonRestoreFileName[] = "restore.file";
 const char signonDefaultDbName[] = "signon.db";
+const char signonPluginCatalogueName[] = "plugins.cache";
 const char signonDefaultAegisFSStoragePath[] = "/home/user/.signon/private";
 const char signonDefaultStoragePath[] = "/home/user/.signon";
 const char signonDefaultFileSystemName[] = "signonfs";
+const char signonDefaultPagesDbName[] = "signon-secrets.db";
 const char signonDefaultFileSystemType[] = "ext2";
 const bool signonDefaultUseEncryption = true;
+const bool signonDefaultEncryptPages = false;
 const uint signonMinumumDbSize = 8;
 
 #endif // SIGNOND_COMMON_H_
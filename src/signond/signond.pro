@@ -17,6 +17,7 @@ HEADERS += \
     accesscontrolmanager.h \
     credentialsaccessmanager.h \
     credentialsdb.h \
+    credentialsdbthread.h \
     default-key-authorizer.h \
     signonsessioncore.h \
     signonauthsessionadaptor.h \
@@ -28,6 +29,7 @@ HEADERS += \
     signondisposable.h \
     signontrace.h \
     pluginproxy.h \
+    plugincatalogue.h \
     signonidentityinfo.h \
     signonui_interface.h \
     signonidentityadaptor.h \
@@ -37,6 +39,7 @@ SOURCES += \
     accesscontrolmanager.cpp \
     credentialsaccessmanager.cpp \
     credentialsdb.cpp \
+    credentialsdbthread.cpp \
     default-key-authorizer.cpp \
     signonsessioncore.cpp \
     signonauthsessionadaptor.cpp \
@@ -46,6 +49,7 @@ SOURCES += \
     signondisposable.cpp \
     signonui_interface.cpp \
     pluginproxy.cpp \
+    plugincatalogue.cpp \
     main.cpp \
     signondaemon.cpp \
     signonidentityinfo.cpp \
@@ -65,7 +69,8 @@ PKGCONFIG += \
     libcrypto \
     libsignoncrypto-qt \
     signon-plugins-common \
-    accounts-qt
+    accounts-qt \
+    sqlite3
 
 QMAKE_LIBDIR += \
     $${TOP_BUILD_DIR}/lib/plugins/signon-plugins-common \
@@ -22,6 +22,7 @@
  */
 
 extern "C" {
+    #include <string.h>
     #include <sys/socket.h>
     #include <sys/stat.h>
     #include <sys/types.h>
@@ -36,6 +37,7 @@ extern "C" {
 #include <QSocketNotifier>
 
 #include "SignOn/misc.h"
+#include "SignOn/commondebug.h"
 
 #include "signondaemon.h"
 #include "signond-common.h"
@@ -45,17 +47,23 @@ extern "C" {
 #include "signonauthsession.h"
 #include "accesscontrolmanager.h"
 #include "backupifadaptor.h"
+#include "pluginproxy.h"
+#include "plugincatalogue.h"
 
-#define SIGNON_RETURN_IF_CAM_UNAVAILABLE(_ret_arg_) do {                   \
+#define SIGNON_RETURN_IF_CAM_UNAVAILABLE_FOR(_msg_, _ret_arg_) do {       \
         if (m_pCAMManager && !m_pCAMManager->credentialsSystemOpened()) {  \
-            QDBusMessage errReply = message().createErrorReply(            \
+            QDBusMessage errReply = (_msg_).createErrorReply(              \
                     internalServerErrName,                                 \
                     internalServerErrStr + QLatin1String("Could not access Signon Database.")); \
             SIGNOND_BUS.send(errReply); \
+            (_msg_).setDelayedReply(true); \
             return _ret_arg_;           \
         }                               \
     } while(0)
 
+#define SIGNON_RETURN_IF_CAM_UNAVAILABLE(_ret_arg_) \
+    SIGNON_RETURN_IF_CAM_UNAVAILABLE_FOR(message(), _ret_arg_)
+
 #define BACKUP_DIR_NAME() \
     (QDir::separator() + QLatin1String("backup"))
 
@@ -65,9 +73,66 @@ namespace SignonDaemonNS {
 
 /* ---------------------- SignonDaemonConfiguration ---------------------- */
 
+static int traceCategoryMask(const QStringList &names)
+{
+    int categories = 0;
+    foreach (QString name, names) {
+        name = name.trimmed();
+        if (name == QLatin1String("general"))
+            categories |= TraceGeneral;
+        else if (name == QLatin1String("session"))
+            categories |= TraceSession;
+        else if (name == QLatin1String("plugin"))
+            categories |= TracePlugin;
+        else if (name == QLatin1String("storage"))
+            categories |= TraceStorage;
+        else if (name == QLatin1String("all"))
+            categories |= TraceAllCategories;
+    }
+    return categories;
+}
+
+/* Reads the SQLite settings of a database from the current group, the
+ * settings not given being the defaults */
+static SqlDatabaseConfiguration
+databaseConfiguration(const QSettings &settings,
+                      const SqlDatabaseConfiguration &defaults)
+{
+    SqlDatabaseConfiguration configuration = defaults;
+
+    /* A wrong keyword would be ignored by SQLite, or taken for another one:
+     * it is reported here, and the default is kept */
+    QString journalMode = settings.value(QLatin1String("JournalMode"),
+                                         defaults.m_journalMode).toString().toUpper();
+    if (journalMode.isEmpty()
+        || SqlDatabaseConfiguration::isJournalModeValid(journalMode))
+        configuration.m_journalMode = journalMode;
+    else
+        qWarning() << "Invalid JournalMode in" << settings.group() << ":"
+            << journalMode << "- expected DELETE, TRUNCATE, PERSIST or WAL";
+
+    QString synchronous = settings.value(QLatin1String("Synchronous"),
+                                         defaults.m_synchronous).toString().toUpper();
+    if (synchronous.isEmpty()
+        || SqlDatabaseConfiguration::isSynchronousValid(synchronous))
+        configuration.m_synchronous = synchronous;
+    else
+        qWarning() << "Invalid Synchronous in" << settings.group() << ":"
+            << synchronous << "- expected OFF, NORMAL or FULL";
+
+    configuration.m_cacheSize = settings.value(QLatin1String("CacheSize"),
+                                               defaults.m_cacheSize).toInt();
+    configuration.m_mmapSize = settings.value(QLatin1String("MmapSize"),
+                                              defaults.m_mmapSize).toLongLong();
+    configuration.m_busyTimeout = settings.value(QLatin1String("BusyTimeout"),
+                                                 defaults.m_busyTimeout).toInt();
+    return configuration;
+}
+
 SignonDaemonConfiguration::SignonDaemonConfiguration()
     : m_loadedFromFile(false),
       m_camConfiguration(),
+      m_backupSecrets(false),
       m_identityTimeout(300),//secs
       m_authSessionTimeout(300)//secs
 {}
@@ -82,14 +147,20 @@ SignonDaemonConfiguration::~SignonDaemonConfiguration()
 
     [General]
     UseSecureStorage=yes
+    BackupSecrets=no
     StoragePath=~/.signon/
     ;0 - fatal, 1 - critical(default), 2 - info/debug
     LoggingLevel=1
+    ;categories of the debug messages: general, session, plugin, storage, all
+    TraceCategories=all
+    ;categories of the events recorded in the trace buffer, dumped on SIGUSR1
+    TraceEvents=session,plugin
 
     [SecureStorage]
     FileSystemName=signonfs
     Size=8
     FileSystemType=ext2
+    EncryptPages=no
 
     [AegisFS]
     AegisPath=~/.signon/private
@@ -97,20 +168,52 @@ SignonDaemonConfiguration::~SignonDaemonConfiguration()
     [ObjectTimeouts]
     IdentityTimeout=300
     AuthSessionTimeout=300
+
+    [PluginPool]
+    ;number of plugin processes started in advance, per method
+    password=1
+
+    [Concurrency]
+    ;methods whose requests on an identity can't run along with other ones
+    password=exclusive
+
+    [PluginInstances]
+    ;plugin processes used in parallel by a session core, per method
+    password=2
+
+    [RequestCoalescing]
+    ;methods whose identical requests on an identity share one result
+    oauth2=yes
+
+    [ResultCache]
+    ;methods whose results are cached for as long as the plugin allows
+    oauth2=yes
  */
 void SignonDaemonConfiguration::load()
 {
-    //Daemon configuration file
+    //Daemon configuration file, which the tests give their own of
+
+    QProcessEnvironment environment = QProcessEnvironment::systemEnvironment();
+    QString configFileName = environment.value(QLatin1String("SSO_CONFIG_FILE"),
+                                               QLatin1String("/etc/signond.conf"));
 
-    if (QFile::exists(QLatin1String("/etc/signond.conf"))) {
+    if (QFile::exists(configFileName)) {
         m_loadedFromFile = true;
 
-        QSettings settings(QLatin1String("/etc/signond.conf"),
-                           QSettings::NativeFormat);
+        QSettings settings(configFileName, QSettings::NativeFormat);
 
         int loggingLevel =
             settings.value(QLatin1String("LoggingLevel"), 1).toInt();
         setLoggingLevel(loggingLevel);
+        setCommonLoggingLevel(loggingLevel);
+
+        QStringList traceCategories =
+            settings.value(QLatin1String("TraceCategories")).toStringList();
+        if (!traceCategories.isEmpty())
+            setTraceCategories(traceCategoryMask(traceCategories));
+
+        setTraceEventCategories(traceCategoryMask(
+            settings.value(QLatin1String("TraceEvents")).toStringList()));
 
         QString storagePath =
             QDir(settings.value(QLatin1String("StoragePath")).toString()).path();
@@ -127,6 +230,11 @@ void SignonDaemonConfiguration::load()
                 (useSecureStorage == QLatin1String("yes")
                 || useSecureStorage == QLatin1String("true"));
 
+        QString backupSecrets =
+            settings.value(QLatin1String("BackupSecrets")).toString();
+        m_backupSecrets = (backupSecrets == QLatin1String("yes")
+                           || backupSecrets == QLatin1String("true"));
+
         if (m_camConfiguration.m_useEncryption) {
             settings.beginGroup(QLatin1String("SecureStorage"));
 
@@ -143,6 +251,24 @@ void SignonDaemonConfiguration::load()
             m_camConfiguration.m_fileSystemType = settings.value(
                 QLatin1String("FileSystemType")).toString();
 
+            QString encryptPages =
+                settings.value(QLatin1String("EncryptPages")).toString();
+            if (!encryptPages.isEmpty())
+                m_camConfiguration.m_encryptPages =
+                    (encryptPages == QLatin1String("yes")
+                    || encryptPages == QLatin1String("true"));
+
+            /* The secrets already in the LUKS file system are not moved:
+             * a new page-encrypted DB would leave them out of reach */
+            if (m_camConfiguration.m_encryptPages
+                && QFile::exists(m_camConfiguration.encryptedFSPath())
+                && !QFile::exists(m_camConfiguration.encryptedPagesDBPath()
+                                  + QLatin1String(".keys"))) {
+                qWarning() << "EncryptPages ignored: the secrets are stored in"
+                    << m_camConfiguration.encryptedFSPath();
+                m_camConfiguration.m_encryptPages = false;
+            }
+
             settings.endGroup();
         }
 
@@ -157,6 +283,18 @@ void SignonDaemonConfiguration::load()
 
         settings.endGroup();
 
+        //Databases: the secrets DB settings default to the metadata DB ones
+        settings.beginGroup(QLatin1String("Database"));
+        m_camConfiguration.m_metaDataDBConfiguration =
+            databaseConfiguration(settings, SqlDatabaseConfiguration());
+        settings.endGroup();
+
+        settings.beginGroup(QLatin1String("SecretsDatabase"));
+        m_camConfiguration.m_secretsDBConfiguration =
+            databaseConfiguration(settings,
+                                  m_camConfiguration.m_metaDataDBConfiguration);
+        settings.endGroup();
+
         //Timeouts
         settings.beginGroup(QLatin1String("ObjectTimeouts"));
 
@@ -171,8 +309,64 @@ void SignonDaemonConfiguration::load()
 
         settings.endGroup();
 
+        //Plugin processes pool
+        settings.beginGroup(QLatin1String("PluginPool"));
+
+        foreach (QString method, settings.childKeys()) {
+            int size = settings.value(method).toInt(&isOk);
+            if (isOk && size > 0)
+                m_pluginPoolSizes.insert(method, size);
+        }
+
+        settings.endGroup();
+
+        //Concurrency of the requests on the same identity
+        settings.beginGroup(QLatin1String("Concurrency"));
+
+        foreach (QString method, settings.childKeys()) {
+            if (settings.value(method).toString() == QLatin1String("exclusive"))
+                m_exclusiveMethods.append(method);
+        }
+
+        settings.endGroup();
+
+        //Plugin processes per session core
+        settings.beginGroup(QLatin1String("PluginInstances"));
+
+        foreach (QString method, settings.childKeys()) {
+            int max = settings.value(method).toInt(&isOk);
+            if (isOk && max > 0)
+                m_maxPluginInstances.insert(method, max);
+        }
+
+        settings.endGroup();
+
+        //Coalescing of the identical requests on the same identity
+        settings.beginGroup(QLatin1String("RequestCoalescing"));
+
+        foreach (QString method, settings.childKeys()) {
+            QString coalescing = settings.value(method).toString();
+            if (coalescing == QLatin1String("yes")
+                || coalescing == QLatin1String("true"))
+                m_coalescingMethods.append(method);
+        }
+
+        settings.endGroup();
+
+        //Cache of the results of the requests
+        settings.beginGroup(QLatin1String("ResultCache"));
+
+        foreach (QString method, settings.childKeys()) {
+            QString caching = settings.value(method).toString();
+            if (caching == QLatin1String("yes")
+                || caching == QLatin1String("true"))
+                m_resultCacheMethods.append(method);
+        }
+
+        settings.endGroup();
+
     } else {
-        TRACE() << "/etc/signond.conf not found. Using default daemon configuration.";
+        TRACE() << configFileName << "not found. Using default daemon configuration.";
     }
 
     m_camConfiguration.m_encryptedStoragePath = m_camConfiguration.m_storagePath
@@ -183,7 +377,6 @@ void SignonDaemonConfiguration::load()
 
     //Environment variables
 
-    QProcessEnvironment environment = QProcessEnvironment::systemEnvironment();
     int value = 0;
     bool isOk = false;
     if (environment.contains(QLatin1String("SSO_IDENTITY_TIMEOUT"))) {
@@ -209,6 +402,169 @@ static int sigFd[2];
 
 SignonDaemon *SignonDaemon::m_instance = NULL;
 
+/*
+ * Queries or clears the identities in the storage thread, replying to the
+ * D-Bus call once done.
+ * */
+class DaemonStorageJob: public CredentialsDBJob
+{
+public:
+    DaemonStorageJob(Operation operation, const QDBusMessage &message)
+        : CredentialsDBJob(operation),
+          m_message(message)
+    {}
+
+    void finished();
+
+private:
+    QDBusMessage m_message;
+};
+
+void DaemonStorageJob::finished()
+{
+    if (m_operation == Identities) {
+        if (errorOccurred()) {
+            QDBusMessage errReply = m_message.createErrorReply(
+                    internalServerErrName,
+                    internalServerErrStr + QLatin1String("Querying database error occurred."));
+            SIGNOND_BUS.send(errReply);
+            return;
+        }
+
+        QDBusMessage reply = m_message.createReply();
+        reply << QVariant(SignonIdentityInfo::listToVariantList(m_identities));
+        SIGNOND_BUS.send(reply);
+        return;
+    }
+
+    if (!m_ok) {
+        QDBusMessage errReply = m_message.createErrorReply(
+                                                SIGNOND_INTERNAL_SERVER_ERR_NAME,
+                                                QString(SIGNOND_INTERNAL_SERVER_ERR_STR
+                                                        + QLatin1String("Database error occurred.")));
+        SIGNOND_BUS.send(errReply);
+        return;
+    }
+    AccessControlManager::clearCachedDecisions();
+    AuthCoreCache::instance()->clearResults();
+
+    QDBusMessage reply = m_message.createReply();
+    reply << true;
+    SIGNOND_BUS.send(reply);
+}
+
+/*
+ * Loads a stored identity for registerStoredIdentity(): the access control
+ * and the reply wait for it in the main thread.
+ * */
+class SignonDaemon::StoredIdentityJob: public CredentialsDBJob
+{
+public:
+    StoredIdentityJob(SignonDaemon *daemon, quint32 id,
+                      const QDBusMessage &message)
+        : CredentialsDBJob(Credentials),
+          m_daemon(daemon),
+          m_message(message)
+    {
+        m_id = id;
+        m_flag = false;
+    }
+
+    void finished()
+    {
+        if (!m_daemon.isNull())
+            m_daemon->storedIdentityLoaded(this);
+    }
+
+    QPointer<SignonDaemon> m_daemon;
+    QDBusMessage m_message;
+};
+
+static bool backupRunning = false;
+
+/*
+ * Copies the DBs into the backup directory in the storage thread, a few
+ * pages at a time: the jobs posted meanwhile are run between the steps.
+ * The first file names are the ones of the metadata and secrets DBs; all
+ * the files are removed if the copy fails.
+ * */
+class BackupJob: public CredentialsDBJob
+{
+public:
+    BackupJob(Operation operation, CredentialsDBThread *db,
+              const QStringList &fileNames, const QDBusMessage &message,
+              const QString &secretsCopy)
+        : CredentialsDBJob(operation),
+          m_db(db),
+          m_fileNames(fileNames),
+          m_message(message),
+          m_secretsCopy(secretsCopy),
+          m_continued(false)
+    {
+        if (operation == StartBackup)
+            m_list = fileNames;
+    }
+    ~BackupJob();
+
+    void finished();
+
+private:
+    void reply(uchar result);
+
+    /* The jobs are deleted along with the thread */
+    CredentialsDBThread *m_db;
+    QStringList m_fileNames;
+    QDBusMessage m_message;
+    /* The copy of the page-encrypted secrets DB, if any */
+    QString m_secretsCopy;
+    bool m_continued;
+};
+
+BackupJob::~BackupJob()
+{
+    /* The job is deleted without being finished if the DB is closed */
+    if (!m_continued) {
+        BLAME() << "Backup aborted";
+        reply(2);
+    }
+}
+
+void BackupJob::reply(uchar result)
+{
+    m_continued = true;
+    backupRunning = false;
+    if (!m_secretsCopy.isEmpty())
+        CredentialsAccessManager::releaseSecretsCopy(m_secretsCopy);
+
+    QDBusMessage msg = m_message.createReply();
+    msg << QVariant::fromValue(result);
+    SIGNOND_BUS.send(msg);
+}
+
+void BackupJob::finished()
+{
+    if (errorOccurred() || (m_operation == StartBackup && !m_ok)) {
+        BLAME() << "Backup failed:" << m_error.text();
+        foreach (QString fileName, m_fileNames)
+            QFile::remove(fileName);
+        reply(2);
+        return;
+    }
+
+    if (m_operation == BackupStep && m_ok) {
+        TRACE() << "Backup done";
+        foreach (QString fileName, m_fileNames)
+            setUserOwnership(fileName);
+        reply(0);
+        return;
+    }
+
+    /* The next step is run after the jobs posted meanwhile */
+    m_continued = true;
+    m_db->post(new BackupJob(BackupStep, m_db, m_fileNames, m_message,
+                             m_secretsCopy));
+}
+
 SignonDaemon::SignonDaemon(QObject *parent) : QObject(parent)
                                             , m_configuration(NULL)
 {
@@ -297,6 +653,22 @@ void SignonDaemon::handleUnixSignal()
                                       Qt::QueuedConnection);
             break;
         }
+        case SIGUSR1: {
+            /* Not in the shared /tmp, where the name could be taken by
+             * another user beforehand */
+            QString dirName =
+                QFile::decodeName(qgetenv("XDG_RUNTIME_DIR"));
+            if (dirName.isEmpty())
+                dirName = m_configuration->camConfiguration().m_storagePath;
+            QString fileName = dirName + QDir::separator()
+                + QString::fromLatin1("signond-trace-%1-%2")
+                .arg(getpid()).arg(QDateTime::currentDateTime().toTime_t());
+            if (dumpTraceEvents(fileName))
+                qCritical() << "Trace events dumped to" << fileName;
+            else
+                BLAME() << "Cannot dump the trace events to" << fileName;
+            break;
+        }
         case SIGINT:  {
             TRACE() << "\n\n SIGINT \n\n";
             //gently stop daemon
@@ -440,6 +812,11 @@ void SignonDaemon::init()
         qFatal("SignonDaemon requires to register daemon's service");
     }
 
+    // forget about the clients leaving the bus
+    connect(connection.interface(),
+            SIGNAL(serviceOwnerChanged(QString, QString, QString)),
+            SLOT(onServiceOwnerChanged(QString, QString, QString)));
+
     // handle D-Bus disconnection
     connection.connect(QString(),
                        QLatin1String("/org/freedesktop/DBus/Local"),
@@ -454,6 +831,36 @@ void SignonDaemon::init()
 
     Q_UNUSED(AuthCoreCache::instance(this));
 
+    PluginCatalogue *catalogue = PluginCatalogue::instance(this);
+    catalogue->setCacheFileName(
+        m_configuration->camConfiguration().m_storagePath
+        + QDir::separator() + QLatin1String(signonPluginCatalogueName));
+    connect(catalogue, SIGNAL(mechanismsQueried(const QString&, bool)),
+            this, SLOT(mechanismsQueried(const QString&, bool)));
+
+    PluginProxyPool *pluginPool = PluginProxyPool::instance(this);
+    QMapIterator<QString, int> pool(m_configuration->pluginPoolSizes());
+    while (pool.hasNext()) {
+        pool.next();
+        pluginPool->setSize(pool.key(), pool.value());
+    }
+
+    foreach (QString method, m_configuration->exclusiveMethods())
+        SignonSessionCore::setRequestPolicy(method,
+                                            SignonSessionCore::ExclusiveRequests);
+
+    QMapIterator<QString, int> instances(m_configuration->maxPluginInstances());
+    while (instances.hasNext()) {
+        instances.next();
+        SignonSessionCore::setMaxPluginInstances(instances.key(), instances.value());
+    }
+
+    foreach (QString method, m_configuration->coalescingMethods())
+        SignonSessionCore::setCoalescingEnabled(method, true);
+
+    foreach (QString method, m_configuration->resultCacheMethods())
+        SignonSessionCore::setResultCacheEnabled(method, true);
+
     TRACE() << "Signond SUCCESSFULLY initialized.";
 }
 
@@ -536,17 +943,19 @@ void SignonDaemon::identityStored(SignonIdentity *identity)
     }
 }
 
-void SignonDaemon::registerNewIdentity(QDBusObjectPath &objectPath)
+void SignonDaemon::registerNewIdentity(QDBusObjectPath &objectPath,
+                                       const QDBusMessage &message)
 {
     TRACE() << "Registering new identity:";
 
     SignonIdentity *identity = SignonIdentity::createIdentity(SIGNOND_NEW_IDENTITY, this);
 
     if (identity == NULL) {
-        QDBusMessage errReply = message().createErrorReply(
+        QDBusMessage errReply = message.createErrorReply(
                 internalServerErrName,
                 internalServerErrStr + QLatin1String("Could not create remote Identity object."));
         SIGNOND_BUS.send(errReply);
+        message.setDelayedReply(true);
         return;
     }
 
@@ -569,96 +978,140 @@ int SignonDaemon::authSessionTimeout() const
                                      m_configuration->authSessionTimeout());
 }
 
-void SignonDaemon::registerStoredIdentity(const quint32 id, QDBusObjectPath &objectPath, QList<QVariant> &identityData)
+void SignonDaemon::registerStoredIdentity(const quint32 id,
+                                          const QDBusMessage &message)
 {
-    SIGNON_RETURN_IF_CAM_UNAVAILABLE();
+    SIGNON_RETURN_IF_CAM_UNAVAILABLE_FOR(message, );
 
     TRACE() << "Registering identity:" << id;
 
-    //1st check if the existing identity is in cache
-    SignonIdentity *identity = m_storedIdentities.value(id, NULL);
+    CredentialsDBThread *db = m_pCAMManager->credentialsDB();
+    if (!db) {
+        qCritical() << Q_FUNC_INFO << m_pCAMManager->lastError();
+        return;
+    }
 
-    //if not create it
-    if (identity == NULL)
-        identity = SignonIdentity::createIdentity(id, this);
+    message.setDelayedReply(true);
+    db->post(new StoredIdentityJob(this, id, message));
+}
 
-    if (identity == NULL)
-    {
-        QDBusMessage errReply = message().createErrorReply(
-                internalServerErrName,
-                internalServerErrStr + QLatin1String("Could not create remote Identity object."));
-        SIGNOND_BUS.send(errReply);
+void SignonDaemon::storedIdentityLoaded(StoredIdentityJob *job)
+{
+    const QDBusMessage &message = job->m_message;
+    const SignonIdentityInfo &info = job->m_info;
+
+    if (job->errorOccurred()) {
+        SIGNOND_BUS.send(message.createErrorReply(
+                                        SIGNOND_IDENTITY_NOT_FOUND_ERR_NAME,
+                                        SIGNOND_IDENTITY_NOT_FOUND_ERR_STR));
         return;
     }
 
-    bool ok;
-    SignonIdentityInfo info = identity->queryInfo(ok, false);
+    AccessControlManager::identityLoaded(job->m_id, info.accessControlList(),
+                                         info.ownerList());
+
+    if (!AccessControlManager::isPeerAllowedToUseIdentity(SIGNOND_BUS, message,
+                                                          job->m_id)) {
+        QString errMsg;
+        QTextStream(&errMsg) << SIGNOND_PERMISSION_DENIED_ERR_STR
+                             << "Method:"
+                             << "registerStoredIdentity";
+        SIGNOND_BUS.send(message.createErrorReply(
+                                        SIGNOND_PERMISSION_DENIED_ERR_NAME,
+                                        errMsg));
+        return;
+    }
 
     if (info.isNew())
     {
-        QDBusMessage errReply = message().createErrorReply(
+        QDBusMessage errReply = message.createErrorReply(
                                                         SIGNOND_IDENTITY_NOT_FOUND_ERR_NAME,
                                                         SIGNOND_IDENTITY_NOT_FOUND_ERR_STR);
         SIGNOND_BUS.send(errReply);
-        objectPath = QDBusObjectPath();
         return;
     }
 
+    //1st check if the existing identity is in cache
+    SignonIdentity *identity = m_storedIdentities.value(job->m_id, NULL);
+
+    //if not create it
+    if (identity == NULL)
+        identity = SignonIdentity::createIdentity(job->m_id, this);
+
+    if (identity == NULL)
+    {
+        QDBusMessage errReply = message.createErrorReply(
+                internalServerErrName,
+                internalServerErrStr + QLatin1String("Could not create remote Identity object."));
+        SIGNOND_BUS.send(errReply);
+        return;
+    }
+    identity->setInfo(info);
+
     //cache the identity as stored
     m_storedIdentities.insert(identity->id(), identity);
     identity->keepInUse();
 
-    identityData = info.toVariantList();
-
     TRACE() << "DONE REGISTERING IDENTITY";
-    objectPath = QDBusObjectPath(identity->objectName());
+    QDBusMessage reply = message.createReply();
+    reply << QVariant::fromValue(QDBusObjectPath(identity->objectName()))
+          << QVariant(info.toVariantList());
+    SIGNOND_BUS.send(reply);
 }
 
 QStringList SignonDaemon::queryMethods()
 {
-    QDir pluginsDir(SIGNOND_PLUGINS_DIR);
-    //TODO: in the future remove the sym links comment
-    QStringList fileNames = pluginsDir.entryList(
-            QStringList() << QLatin1String("*.so*"), QDir::Files | QDir::NoDotAndDotDot);
-
-    QStringList ret;
-    QString fileName;
-    foreach (fileName, fileNames) {
-        if (fileName.startsWith(QLatin1String("lib"))) {
-            fileName = fileName.mid(3, fileName.indexOf(QLatin1String("plugin")) -3);
-            if ((fileName.length() > 0) && !ret.contains(fileName))
-                ret << fileName;
-        }
-    }
-
-    return ret;
+    return PluginCatalogue::instance()->methods();
 }
 
 QStringList SignonDaemon::queryMechanisms(const QString &method)
 {
     TRACE() << "\n\n\n Querying mechanisms\n\n";
 
-    QStringList mechs = SignonSessionCore::loadedPluginMethods(method);
+    PluginCatalogue *catalogue = PluginCatalogue::instance();
+
+    if (!catalogue->hasMechanisms(method)) {
+        QStringList mechs = SignonSessionCore::loadedPluginMethods(method);
+
+        if (mechs.size())
+            catalogue->setMechanisms(method, mechs);
+        else if (!catalogue->queryMechanisms(method)) {
+            TRACE() << "Could not load plugin of type: " << method;
+            SIGNOND_BUS.send(mechanismsErrorReply(message(), method));
+            return QStringList();
+        } else if (!catalogue->hasMechanisms(method)) {
+            /* Replied from mechanismsQueried(), once the plugin process
+             * has started */
+            setDelayedReply(true);
+            m_mechanismQueries.insert(method, message());
+            return QStringList();
+        }
+    }
 
-    if (mechs.size())
-        return mechs;
+    return catalogue->mechanisms(method);
+}
 
-    PluginProxy *plugin = PluginProxy::createNewPluginProxy(method);
+QDBusMessage SignonDaemon::mechanismsErrorReply(const QDBusMessage &msg,
+                                                const QString &method)
+{
+    return msg.createErrorReply(
+            SIGNOND_METHOD_NOT_KNOWN_ERR_NAME,
+            QString(SIGNOND_METHOD_NOT_KNOWN_ERR_STR
+                    + QLatin1String("Method %1 is not known or could not load specific configuration.")).arg(method));
+}
 
-    if (!plugin) {
-        TRACE() << "Could not load plugin of type: " << method;
-        QDBusMessage errReply = message().createErrorReply(
-                SIGNOND_METHOD_NOT_KNOWN_ERR_NAME,
-                QString(SIGNOND_METHOD_NOT_KNOWN_ERR_STR
-                        + QLatin1String("Method %1 is not known or could not load specific configuration.")).arg(method));
-        SIGNOND_BUS.send(errReply);
-        return QStringList();
+void SignonDaemon::mechanismsQueried(const QString &method, bool found)
+{
+    TRACE() << method << found;
+
+    PluginCatalogue *catalogue = PluginCatalogue::instance();
+    foreach (QDBusMessage msg, m_mechanismQueries.values(method)) {
+        if (found)
+            SIGNOND_BUS.send(msg.createReply(QVariant(catalogue->mechanisms(method))));
+        else
+            SIGNOND_BUS.send(mechanismsErrorReply(msg, method));
     }
-
-    mechs = plugin->mechanisms();
-    delete plugin;
-
-    return mechs;
+    m_mechanismQueries.remove(method);
 }
 
 
@@ -668,7 +1121,7 @@ QList<QVariant> SignonDaemon::queryIdentities(const QMap<QString, QVariant> &fil
 
     TRACE() << "\n\n\n Querying identities\n\n";
 
-    CredentialsDB *db = m_pCAMManager->credentialsDB();
+    CredentialsDBThread *db = m_pCAMManager->credentialsDB();
     if (!db) {
         qCritical() << Q_FUNC_INFO << m_pCAMManager->lastError();
         return QList<QVariant>();
@@ -681,17 +1134,12 @@ QList<QVariant> SignonDaemon::queryIdentities(const QMap<QString, QVariant> &fil
         filterLocal.insert(it.key(), it.value().toString());
     }
 
-    QList<SignonIdentityInfo> credentials = db->credentials(filterLocal);
-
-    if (db->errorOccurred()) {
-        QDBusMessage errReply = message().createErrorReply(
-                internalServerErrName,
-                internalServerErrStr + QLatin1String("Querying database error occurred."));
-        SIGNOND_BUS.send(errReply);
-        return QList<QVariant>();
-    }
-
-    return SignonIdentityInfo::listToVariantList(credentials);
+    setDelayedReply(true);
+    DaemonStorageJob *job =
+        new DaemonStorageJob(CredentialsDBJob::Identities, message());
+    job->m_filter = filterLocal;
+    db->post(job);
+    return QList<QVariant>();
 }
 
 bool SignonDaemon::clear()
@@ -699,42 +1147,50 @@ bool SignonDaemon::clear()
     SIGNON_RETURN_IF_CAM_UNAVAILABLE(false);
 
     TRACE() << "\n\n\n Clearing DB\n\n";
-    CredentialsDB *db = m_pCAMManager->credentialsDB();
+    CredentialsDBThread *db = m_pCAMManager->credentialsDB();
     if (!db) {
         qCritical() << Q_FUNC_INFO << m_pCAMManager->lastError();
         return false;
     }
 
-    if (!db->clear()) {
-        QDBusMessage errReply = message().createErrorReply(
-                                                SIGNOND_INTERNAL_SERVER_ERR_NAME,
-                                                QString(SIGNOND_INTERNAL_SERVER_ERR_STR
-                                                        + QLatin1String("Database error occurred.")));
-        SIGNOND_BUS.send(errReply);
-        return false;
-    }
-    return true;
+    setDelayedReply(true);
+    db->post(new DaemonStorageJob(CredentialsDBJob::Clear, message()));
+    return false;
 }
 
-QString SignonDaemon::getAuthSessionObjectPath(const quint32 id, const QString type)
+/*
+ * The counters of the result cache, since the daemon started: the lookups
+ * which found a valid result ("ResultHits") and the ones which did not
+ * ("ResultMisses")
+ */
+QVariantMap SignonDaemon::queryCacheStatistics()
 {
+    AuthCoreCache *cache = AuthCoreCache::instance();
 
-    connect(connection().interface(),
-            SIGNAL(serviceOwnerChanged(QString, QString, QString)),
-            SLOT(onServiceOwnerChanged(QString, QString, QString)));
+    QVariantMap statistics;
+    statistics.insert(QLatin1String("ResultHits"), cache->resultHits());
+    statistics.insert(QLatin1String("ResultMisses"), cache->resultMisses());
+    return statistics;
+}
+
+QString SignonDaemon::getAuthSessionObjectPath(const quint32 id, const QString type,
+                                               const QDBusMessage &message)
+{
     bool supportsAuthMethod = false;
-    pid_t ownerPid = AccessControlManager::pidOfPeer(*this);
+    pid_t ownerPid = AccessControlManager::pidOfPeer(SIGNOND_BUS,
+                                                     message.service());
 
     QString objectPath =
         SignonAuthSession::getAuthSessionObjectPath(id, type, this,
                                                     supportsAuthMethod,
                                                     ownerPid,
-                                                    message().service());
+                                                    message);
     if (objectPath.isEmpty() && !supportsAuthMethod) {
-        QDBusMessage errReply = message().createErrorReply(
+        QDBusMessage errReply = message.createErrorReply(
                                                 SIGNOND_METHOD_NOT_KNOWN_ERR_NAME,
                                                 SIGNOND_METHOD_NOT_KNOWN_ERR_STR);
         SIGNOND_BUS.send(errReply);
+        message.setDelayedReply(true);
         return QString();
     }
     return objectPath;
@@ -744,8 +1200,106 @@ void SignonDaemon::onServiceOwnerChanged(const QString &serviceName,
                                        const QString &oldOwner,
                                        const QString &newOwner)
 {
-    if (!oldOwner.isEmpty() && newOwner.isEmpty());
+    if (!oldOwner.isEmpty() && newOwner.isEmpty()) {
         SignonAuthSession::destroySession(serviceName);
+        AccessControlManager::peerDisconnected(serviceName);
+    } else if (oldOwner.isEmpty() && !newOwner.isEmpty()
+               && serviceName.startsWith(QLatin1Char(':'))) {
+        /* A new client: its first calls wait for its process id */
+        (void)AccessControlManager::requestPidOfPeer(SIGNOND_BUS, serviceName);
+    }
+}
+
+QStringList SignonDaemon::backupFileNames() const
+{
+    const CAMConfiguration config = m_configuration->camConfiguration();
+
+    /* The secrets DB comes last, after the key slots of its pages */
+    QStringList fileNames;
+    fileNames << config.m_dbName;
+    QString secretsFileName = backupSecretsFileName();
+    if (!secretsFileName.isEmpty()) {
+        if (m_configuration->useSecureStorage() && config.m_encryptPages)
+            fileNames << secretsFileName + QLatin1String(".keys");
+        fileNames << secretsFileName;
+    }
+    return fileNames;
+}
+
+QString SignonDaemon::backupSecretsFileName() const
+{
+    const CAMConfiguration config = m_configuration->camConfiguration();
+
+    if (m_configuration->useSecureStorage()) {
+        if (config.m_encryptPages)
+            return QLatin1String(signonDefaultPagesDbName);
+        return QLatin1String(signonDefaultFileSystemName);
+    }
+
+    /* The plain secrets DB leaves the device only if asked */
+    if (m_configuration->backupSecrets())
+        return config.m_dbName + QLatin1String(".creds");
+    return QString();
+}
+
+uchar SignonDaemon::startOnlineBackup()
+{
+    if (backupRunning) {
+        BLAME() << "A backup is already running";
+        return 2;
+    }
+
+    CredentialsDBThread *db = m_pCAMManager->credentialsDB();
+    if (db == 0) {
+        qCritical() << "Cannot access the credentials database";
+        return 2;
+    }
+
+    eraseBackupDir();
+
+    const CAMConfiguration config = m_configuration->camConfiguration();
+    QString backupRoot = config.m_storagePath + BACKUP_DIR_NAME();
+    QDir target(backupRoot);
+    if (!target.mkpath(backupRoot)) {
+        qCritical() << "Cannot create target directory";
+        return 2;
+    }
+    setUserOwnership(backupRoot);
+
+    /* The DBs are copied by the backup job, the key slots of the pages
+     * right away: they only change when the keys do */
+    QStringList fileNames;
+    fileNames << backupRoot + QDir::separator() + config.m_dbName;
+
+    QString secretsCopy;
+    QString secretsFileName = backupSecretsFileName();
+    /* The secrets are left out of the backup if they are not available */
+    if (!secretsFileName.isEmpty() && db->isSecretsDBOpen()) {
+        QString secretsPath = backupRoot + QDir::separator() + secretsFileName;
+        if (!m_pCAMManager->prepareSecretsCopy(secretsPath)) {
+            qCritical() << "Cannot copy the secrets DB";
+            return 2;
+        }
+        fileNames << secretsPath;
+
+        if (m_configuration->useSecureStorage()) {
+            secretsCopy = secretsPath;
+            QString keySlots = secretsFileName + QLatin1String(".keys");
+            if (!copyToBackupDir(QStringList() << keySlots)) {
+                qCritical() << "Cannot copy the key slots";
+                CredentialsAccessManager::releaseSecretsCopy(secretsCopy);
+                eraseBackupDir();
+                return 2;
+            }
+            fileNames << backupRoot + QDir::separator() + keySlots;
+        }
+    }
+
+    backupRunning = true;
+    setDelayedReply(true);
+    db->post(new BackupJob(CredentialsDBJob::StartBackup, db, fileNames,
+                           message(), secretsCopy));
+    return 0;
 }
 
 void SignonDaemon::eraseBackupDir() const
@@ -801,6 +1355,18 @@ bool SignonDaemon::copyToBackupDir(const QStringList &fileNames) const
     return ok;
 }
 
+static bool renameFile(const QDir &dir, const QString &from, const QString &to)
+{
+    QByteArray source = QFile::encodeName(dir.filePath(from));
+    QByteArray destination = QFile::encodeName(dir.filePath(to));
+    if (::rename(source.constData(), destination.constData()) != 0) {
+        qCritical() << "Could not rename" << from << "to" << to
+            << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
 bool SignonDaemon::copyFromBackupDir(const QStringList &fileNames) const
 {
     const CAMConfiguration config = m_configuration->camConfiguration();
@@ -815,28 +1381,23 @@ bool SignonDaemon::copyFromBackupDir(const QStringList &fileNames) const
         TRACE() << "Backup does not contain DB:" << config.m_dbName;
     }
 
-    /* Now restore the files from the backup */
+    /* Copy the files from the backup next to the ones they replace: these
+     * are only replaced once all the copies are done */
     bool ok = true;
     QDir target(config.m_storagePath);
-    QStringList movedFiles, copiedFiles;
+    QStringList copiedFiles;
     foreach (QString fileName, fileNames) {
-        /* Remove the target file, if it exists */
-        if (target.exists(fileName)) {
-            if (target.rename(fileName, fileName + QLatin1String(".bak")))
-                movedFiles += fileName;
-        }
-
-        /* Copy the source into the target directory */
         QString source = backupRoot + QDir::separator() + fileName;
         if (!QFile::exists(source)) {
             TRACE() << "Ignoring file not present in backup:" << source;
             continue;
         }
 
-        QString destination =
-            config.m_storagePath + QDir::separator() + fileName;
+        QString restored = fileName + QLatin1String(".restore");
+        if (target.exists(restored))
+            target.remove(restored);
 
-        ok = QFile::copy(source, destination);
+        ok = QFile::copy(source, target.filePath(restored));
         if (ok) {
             copiedFiles << fileName;
         } else {
@@ -846,25 +1407,57 @@ bool SignonDaemon::copyFromBackupDir(const QStringList &fileNames) const
     }
 
     if (!ok) {
-        qWarning() << "Restore failed, recovering previous DB";
+        qWarning() << "Restore failed, keeping the current DB";
+        foreach (QString fileName, copiedFiles)
+            target.remove(fileName + QLatin1String(".restore"));
+        return false;
+    }
 
-        foreach (QString fileName, copiedFiles) {
-            target.remove(fileName);
+    /* rename() replaces each file atomically; the current files are kept
+     * aside until all are replaced, and put back if one can't be, so that
+     * the DBs stay consistent with each other */
+    QStringList keptFiles;
+    QStringList replacedFiles;
+    foreach (QString fileName, copiedFiles) {
+        if (target.exists(fileName)) {
+            if (!renameFile(target, fileName,
+                            fileName + QLatin1String(".old"))) {
+                ok = false;
+                break;
+            }
+            keptFiles << fileName;
         }
 
-        foreach (QString fileName, movedFiles) {
-            if (!target.rename(fileName + QLatin1String(".bak"), fileName)) {
-                qCritical() << "Could not recover:" << fileName;
-            }
+        if (!renameFile(target, fileName + QLatin1String(".restore"),
+                        fileName)) {
+            ok = false;
+            break;
         }
-    } else {
-        /* delete ".bak" files */
-        foreach (QString fileName, movedFiles) {
-            target.remove(fileName + QLatin1String(".bak"));
+        replacedFiles << fileName;
+    }
+
+    if (!ok) {
+        qCritical() << "Restore failed, putting the current DB back";
+        foreach (QString fileName, copiedFiles) {
+            if (keptFiles.contains(fileName))
+                renameFile(target, fileName + QLatin1String(".old"), fileName);
+            else if (replacedFiles.contains(fileName))
+                target.remove(fileName);
+            target.remove(fileName + QLatin1String(".restore"));
         }
+        return false;
+    }
 
+    /* The journals of the replaced DBs must not be applied to the restored
+     * ones */
+    foreach (QString fileName, copiedFiles) {
+        target.remove(fileName + QLatin1String("-journal"));
+        target.remove(fileName + QLatin1String("-wal"));
+        target.remove(fileName + QLatin1String("-shm"));
+        target.remove(fileName + QLatin1String(".old"));
     }
-    return ok;
+
+    return true;
 }
 
 bool SignonDaemon::createStorageFileTree(const QStringList &backupFiles) const
@@ -900,6 +1493,14 @@ uchar SignonDaemon::backupStarts()
     TRACE() << "backup";
     const CAMConfiguration config = m_configuration->camConfiguration();
 
+    /* The DBs are copied while they stay in use, the page-encrypted one
+     * included; the image of the LUKS file system can only be copied once
+     * unmounted, though, which closes the credentials system meanwhile */
+    if (!m_backup && m_pCAMManager->credentialsSystemOpened()
+        && (!m_configuration->useSecureStorage() || config.m_encryptPages)
+        && calledFromDBus())
+        return startOnlineBackup();
+
     QString luksDBName = config.m_encryptedStoragePath
                           + QDir::separator()
                           + config.m_dbName;
@@ -942,11 +1543,7 @@ uchar SignonDaemon::backupStarts()
     }
 
     /* do backup copy: prepare the list of files to be backed up */
-    QStringList backupFiles;
-    backupFiles << config.m_dbName;
-
-    if (m_configuration->useSecureStorage())
-        backupFiles << QLatin1String(signonDefaultFileSystemName);
+    QStringList backupFiles = backupFileNames();
 
     /* make sure that all the backup files and storage directory exist:
        create storage dir and empty files if not so, as backup/restore
@@ -1017,12 +1614,7 @@ uchar SignonDaemon::restoreFinished()
         }
     }
 
-    const CAMConfiguration config = m_configuration->camConfiguration();
-
-    QStringList backupFiles;
-    backupFiles << config.m_dbName;
-    if (m_configuration->useSecureStorage())
-        backupFiles << QLatin1String(signonDefaultFileSystemName);
+    QStringList backupFiles = backupFileNames();
 
     /* perform the copy */
     if (!copyFromBackupDir(backupFiles)) {
@@ -1032,6 +1624,7 @@ uchar SignonDaemon::restoreFinished()
     }
 
     eraseBackupDir();
+    AccessControlManager::clearCachedDecisions();
 
 #ifdef SIGNON_AEGISFS
          QFile restoreFile(m_pCAMManager->restoreFilePath());
@@ -36,18 +36,7 @@ extern "C" {
 #include <QtDBus>
 
 #include "credentialsaccessmanager.h"
-
-#ifndef SIGNOND_PLUGINS_DIR
-    #define SIGNOND_PLUGINS_DIR QLatin1String("/usr/lib/signon")
-#endif
-
-#ifndef SIGNOND_PLUGIN_PREFIX
-    #define SIGNOND_PLUGIN_PREFIX QLatin1String("lib")
-#endif
-
-#ifndef SIGNOND_PLUGIN_SUFFIX
-    #define SIGNOND_PLUGIN_SUFFIX QLatin1String("plugin.so")
-#endif
+#include "plugincatalogue.h"
 
 class QSocketNotifier;
 
@@ -73,18 +62,64 @@ public:
     bool useSecureStorage() const
         { return m_camConfiguration.m_useEncryption; }
 
+    /*!
+     * @returns whether the backups include the secrets DB when it is not
+     * encrypted.
+     */
+    bool backupSecrets() const { return m_backupSecrets; }
+
     uint identityTimeout() const { return m_identityTimeout; }
     uint authSessionTimeout() const { return m_authSessionTimeout; }
 
+    /*!
+     * @returns the number of plugin processes to keep started in advance,
+     * by authentication method.
+     */
+    QMap<QString, int> pluginPoolSizes() const { return m_pluginPoolSizes; }
+
+    /*!
+     * @returns the methods whose requests on an identity must not run
+     * concurrently with any other request on the same identity.
+     */
+    QStringList exclusiveMethods() const { return m_exclusiveMethods; }
+
+    /*!
+     * @returns the maximum number of plugin processes an authentication
+     * session core uses in parallel, by authentication method.
+     */
+    QMap<QString, int> maxPluginInstances() const { return m_maxPluginInstances; }
+
+    /*!
+     * @returns the methods whose identical requests on an identity are
+     * processed once, the result being given to all of them.
+     */
+    QStringList coalescingMethods() const { return m_coalescingMethods; }
+
+    /*!
+     * @returns the methods whose results are cached until the expiry time
+     * given by their plugin.
+     */
+    QStringList resultCacheMethods() const { return m_resultCacheMethods; }
+
 private:
     bool m_loadedFromFile;
 
     // storage configuration
     CAMConfiguration m_camConfiguration;
+    bool m_backupSecrets;
 
     //object timeouts
     uint m_identityTimeout;
     uint m_authSessionTimeout;
+
+    //pre-started plugin processes
+    QMap<QString, int> m_pluginPoolSizes;
+
+    //requests serialization
+    QStringList m_exclusiveMethods;
+    QMap<QString, int> m_maxPluginInstances;
+    QStringList m_coalescingMethods;
+    QStringList m_resultCacheMethods;
 };
 
 class SignonIdentity;
@@ -117,23 +152,30 @@ public:
     int authSessionTimeout() const;
 
 public Q_SLOTS:
-    /* Immediate reply calls */
+    /* Immediate reply calls, also carried on after their dispatch: the
+     * errors are replied to the given call, and so is the stored identity
+     * once it is loaded */
 
-    void registerNewIdentity(QDBusObjectPath &objectPath);
-    void registerStoredIdentity(const quint32 id, QDBusObjectPath &objectPath,
-                                QList<QVariant> &identityData);
-    QString getAuthSessionObjectPath(const quint32 id, const QString type);
+    void registerNewIdentity(QDBusObjectPath &objectPath,
+                             const QDBusMessage &message);
+    void registerStoredIdentity(const quint32 id, const QDBusMessage &message);
+    QString getAuthSessionObjectPath(const quint32 id, const QString type,
+                                     const QDBusMessage &message);
 
     QStringList queryMethods();
     QStringList queryMechanisms(const QString &method);
     QList<QVariant> queryIdentities(const QMap<QString, QVariant> &filter);
     bool clear();
+    QVariantMap queryCacheStatistics();
     void onDisconnected();
 
     void onServiceOwnerChanged(const QString &serviceName,
                              const QString &oldOwner,
                              const QString &newOwner);
 
+private Q_SLOTS:
+    void mechanismsQueried(const QString &method, bool found);
+
 public Q_SLOTS: // backup METHODS
     uchar backupStarts();
     uchar backupFinished();
@@ -141,6 +183,8 @@ public Q_SLOTS: // backup METHODS
     uchar restoreFinished();
 
 private:
+    class StoredIdentityJob;
+
     SignonDaemon(QObject *parent);
     void initExtensions();
     void initExtension(const QString &filePath);
@@ -148,9 +192,15 @@ private:
 
     void unregisterIdentity(SignonIdentity *identity);
     void identityStored(SignonIdentity *identity);
+    void storedIdentityLoaded(StoredIdentityJob *job);
     void setupSignalHandlers();
     void listDBusInterfaces();
+    static QDBusMessage mechanismsErrorReply(const QDBusMessage &msg,
+                                             const QString &method);
 
+    QStringList backupFileNames() const;
+    QString backupSecretsFileName() const;
+    uchar startOnlineBackup();
     void eraseBackupDir() const;
     bool copyToBackupDir(const QStringList &fileNames) const;
     bool copyFromBackupDir(const QStringList &fileNames) const;
@@ -170,6 +220,11 @@ private:
      * */
     CredentialsAccessManager *m_pCAMManager;
 
+    /*
+     * The queryMechanisms() calls waiting for a plugin process to start
+     * */
+    QMultiHash<QString, QDBusMessage> m_mechanismQueries;
+
     bool m_backup;
 
     int m_identityTimeout;
@@ -27,6 +27,47 @@
 
 namespace SignonDaemonNS {
 
+    /*
+     * Loads the lists of an identity for the access control of a call,
+     * which is replayed once they are known.
+     * */
+    class SignonDaemonAdaptor::IdentityJob: public CredentialsDBJob
+    {
+    public:
+        IdentityJob(SignonDaemonAdaptor *adaptor, quint32 id,
+                    const QDBusMessage &message)
+            : CredentialsDBJob(Credentials),
+              m_adaptor(adaptor),
+              m_message(message)
+        {
+            m_id = id;
+            m_flag = false;
+        }
+
+        void finished()
+        {
+            if (m_adaptor.isNull())
+                return;
+
+            if (errorOccurred()) {
+                /* The access control would have failed as well */
+                m_adaptor->securityErrorReply(
+                            m_message.member().toLatin1().constData(),
+                            m_message);
+                return;
+            }
+
+            AccessControlManager::identityLoaded(m_id,
+                                                 m_info.accessControlList(),
+                                                 m_info.ownerList());
+            m_adaptor->replay(m_message);
+        }
+
+    private:
+        QPointer<SignonDaemonAdaptor> m_adaptor;
+        QDBusMessage m_message;
+    };
+
     SignonDaemonAdaptor::SignonDaemonAdaptor(SignonDaemon *parent)
         : QDBusAbstractAdaptor(parent),
           m_parent(parent)
@@ -39,12 +80,22 @@ namespace SignonDaemonNS {
 
     void SignonDaemonAdaptor::registerNewIdentity(QDBusObjectPath &objectPath)
     {
-        m_parent->registerNewIdentity(objectPath);
+        if (deferUntilPidOfPeer())
+            return;
+
+        newIdentity(objectPath, parentDBusContext().message());
+    }
+
+    void SignonDaemonAdaptor::newIdentity(QDBusObjectPath &objectPath,
+                                          const QDBusMessage &message)
+    {
+        m_parent->registerNewIdentity(objectPath, message);
 
         SignonDisposable::destroyUnused();
     }
 
-    void SignonDaemonAdaptor::securityErrorReply(const char *failedMethodName)
+    void SignonDaemonAdaptor::securityErrorReply(const char *failedMethodName,
+                                                 const QDBusMessage &message)
     {
         QString errMsg;
         QTextStream(&errMsg) << SIGNOND_PERMISSION_DENIED_ERR_STR
@@ -52,22 +103,113 @@ namespace SignonDaemonNS {
                              << failedMethodName;
 
         QDBusMessage errReply =
-                    parentDBusContext().message().createErrorReply(
-                                            SIGNOND_PERMISSION_DENIED_ERR_NAME,
-                                            errMsg);
+                    message.createErrorReply(SIGNOND_PERMISSION_DENIED_ERR_NAME,
+                                             errMsg);
         SIGNOND_BUS.send(errReply);
+        message.setDelayedReply(true);
         TRACE() << "\nMethod FAILED Access Control check:\n" << failedMethodName;
     }
 
-    void SignonDaemonAdaptor::registerStoredIdentity(const quint32 id, QDBusObjectPath &objectPath, QList<QVariant> &identityData)
+    bool SignonDaemonAdaptor::deferUntilPidOfPeer()
+    {
+        QDBusMessage message = parentDBusContext().message();
+        QString peerService = message.service();
+
+        /* The calls deferred before keep their order */
+        if (!m_deferredCalls.contains(peerService)) {
+            if (AccessControlManager::isPidOfPeerKnown(peerService))
+                return false;
+
+            QDBusPendingCallWatcher *watcher =
+                new QDBusPendingCallWatcher(
+                    AccessControlManager::requestPidOfPeer(SIGNOND_BUS,
+                                                           peerService),
+                    this);
+            m_pidLookups.insert(watcher, peerService);
+            connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)),
+                    this, SLOT(pidOfPeerKnown(QDBusPendingCallWatcher*)));
+        }
+
+        TRACE() << "Deferring" << message.member() << "of" << peerService;
+        message.setDelayedReply(true);
+        m_deferredCalls[peerService].append(message);
+        return true;
+    }
+
+    bool SignonDaemonAdaptor::loadIdentity(const quint32 id,
+                                           const QDBusMessage &message)
+    {
+        CredentialsDBThread *db =
+            CredentialsAccessManager::instance()->credentialsDB();
+        if (db == 0)
+            return false;
+
+        TRACE() << "Loading identity" << id << "for" << message.member();
+        message.setDelayedReply(true);
+        db->post(new IdentityJob(this, id, message));
+        return true;
+    }
+
+    void SignonDaemonAdaptor::pidOfPeerKnown(QDBusPendingCallWatcher *watcher)
     {
-        if (!AccessControlManager::isPeerAllowedToUseIdentity(
-                                        parentDBusContext(), id)) {
-            securityErrorReply(__func__);
+        watcher->deleteLater();
+        QString peerService = m_pidLookups.take(watcher);
+
+        /* Most likely the peer is gone: do not ask the bus again */
+        if (watcher->isError()) {
+            TRACE() << "Cannot resolve the process id of" << peerService
+                    << watcher->error().message();
+            foreach (QDBusMessage message, m_deferredCalls.take(peerService))
+                SIGNOND_BUS.send(message.createErrorReply(
+                                        SIGNOND_INTERNAL_SERVER_ERR_NAME,
+                                        SIGNOND_INTERNAL_SERVER_ERR_STR));
             return;
         }
 
-        m_parent->registerStoredIdentity(id, objectPath, identityData);
+        foreach (QDBusMessage message, m_deferredCalls.take(peerService))
+            replay(message);
+    }
+
+    void SignonDaemonAdaptor::replay(QDBusMessage message)
+    {
+        QList<QVariant> arguments = message.arguments();
+        QList<QVariant> replyArguments;
+
+        message.setDelayedReply(false);
+        if (message.member() == QLatin1String("registerNewIdentity")) {
+            QDBusObjectPath objectPath;
+            newIdentity(objectPath, message);
+            replyArguments << QVariant::fromValue(objectPath);
+        } else if (message.member() ==
+                   QLatin1String("registerStoredIdentity")) {
+            m_parent->registerStoredIdentity(arguments.value(0).toUInt(),
+                                             message);
+        } else if (message.member() ==
+                   QLatin1String("getAuthSessionObjectPath")) {
+            replyArguments << authSessionObjectPath(
+                                    arguments.value(0).toUInt(),
+                                    arguments.value(1).toString(),
+                                    message);
+        } else {
+            BLAME() << "Unexpected deferred call" << message.member();
+            return;
+        }
+
+        /* Not yet replied to, by an error or by the call itself */
+        if (!message.isDelayedReply())
+            SIGNOND_BUS.send(message.createReply(replyArguments));
+    }
+
+    void SignonDaemonAdaptor::registerStoredIdentity(const quint32 id, QDBusObjectPath &objectPath, QList<QVariant> &identityData)
+    {
+        Q_UNUSED(objectPath);
+        Q_UNUSED(identityData);
+
+        if (deferUntilPidOfPeer())
+            return;
+
+        /* The access control waits for the identity to be loaded */
+        m_parent->registerStoredIdentity(id, parentDBusContext().message());
     }
 
     QStringList SignonDaemonAdaptor::queryMethods()
@@ -77,18 +219,32 @@ namespace SignonDaemonNS {
 
     QString SignonDaemonAdaptor::getAuthSessionObjectPath(const quint32 id, const QString &type)
     {
+        if (deferUntilPidOfPeer())
+            return QString();
+
+        return authSessionObjectPath(id, type, parentDBusContext().message());
+    }
 
+    QString SignonDaemonAdaptor::authSessionObjectPath(const quint32 id,
+                                                       const QString &type,
+                                                       const QDBusMessage &message)
+    {
         /* Access Control */
         if (id != SIGNOND_NEW_IDENTITY) {
+            if (!AccessControlManager::isIdentityLoaded(id)
+                && loadIdentity(id, message))
+                return QString();
+
             if (!AccessControlManager::isPeerAllowedToUseAuthSession(
-                                            parentDBusContext(), id)) {
-                securityErrorReply(__func__);
+                                            SIGNOND_BUS, message, id)) {
+                securityErrorReply("getAuthSessionObjectPath", message);
                 return QString();
             }
         }
 
         TRACE() << "ACM passed, creating AuthSession object";
-        QString sessionPath = m_parent->getAuthSessionObjectPath(id, type);
+        QString sessionPath = m_parent->getAuthSessionObjectPath(id, type,
+                                                                 message);
 
         SignonDisposable::destroyUnused();
 
@@ -104,7 +260,7 @@ namespace SignonDaemonNS {
     {
         /* Access Control */
         if (!AccessControlManager::isPeerKeychainWidget(parentDBusContext())) {
-            securityErrorReply(__func__);
+            securityErrorReply(__func__, parentDBusContext().message());
             return QList<QVariant>();
         }
 
@@ -115,10 +271,15 @@ namespace SignonDaemonNS {
     {
         /* Access Control */
         if (!AccessControlManager::isPeerKeychainWidget(parentDBusContext())) {
-            securityErrorReply(__func__);
+            securityErrorReply(__func__, parentDBusContext().message());
             return false;
         }
 
         return m_parent->clear();
     }
+
+    QVariantMap SignonDaemonAdaptor::queryCacheStatistics()
+    {
+        return m_parent->queryCacheStatistics();
+    }
 } //namespace SignonDaemonNS
@@ -54,12 +54,40 @@ namespace SignonDaemonNS {
         QStringList queryMechanisms(const QString &method);
         QList<QVariant> queryIdentities(const QMap<QString, QVariant> &filter);
         bool clear();
+        QVariantMap queryCacheStatistics();
+
+    private Q_SLOTS:
+        void pidOfPeerKnown(QDBusPendingCallWatcher *watcher);
 
     private:
-        void securityErrorReply(const char *failedMethodName);
+        class IdentityJob;
+
+        void securityErrorReply(const char *failedMethodName,
+                                const QDBusMessage &message);
+
+        /* The first calls of a client wait for its process id, instead of
+         * blocking the daemon on the bus: true if the current call is
+         * deferred, to be replayed by pidOfPeerKnown() */
+        bool deferUntilPidOfPeer();
+
+        /* The access control of a call waits for the lists of the identity
+         * in the storage thread: true if the call is deferred, to be
+         * replayed once they are loaded */
+        bool loadIdentity(const quint32 id, const QDBusMessage &message);
+
+        /* Carries on a deferred call, and replies to it unless an error
+         * was replied or the reply is delayed further */
+        void replay(QDBusMessage message);
+
+        void newIdentity(QDBusObjectPath &objectPath,
+                         const QDBusMessage &message);
+        QString authSessionObjectPath(const quint32 id, const QString &type,
+                                      const QDBusMessage &message);
 
     private:
         SignonDaemon *m_parent;
+        QHash<QString, QList<QDBusMessage> > m_deferredCalls;
+        QHash<QDBusPendingCallWatcher *, QString> m_pidLookups;
     }; //class SignonDaemonAdaptor
 
 } //namespace SignonDaemonNS
@@ -24,33 +24,91 @@
 
 namespace SignonDaemonNS {
 
-static QList<SignonDisposable *> disposableObjects;
+/* The objects waiting for their inactivity time to elapse are kept in a
+ * timer wheel with one slot per second: an object is in the slot of the
+ * second at which it expires, or in the farthest slot if that is beyond the
+ * wheel. Marking an object as used doesn't move it: when its slot comes, the
+ * object is destroyed if it is still unused, or put in a later slot. */
+static const int wheelSize = 128;
+static QSet<SignonDisposable *> wheel[wheelSize];
+static int scheduledObjects = 0;
+
+/* The last second whose slot has been reaped */
+static time_t wheelTime = 0;
+/* The time read on the last tick of the reaper */
+static time_t coarseTime = 0;
+
+/*
+ * Ticks every second while some object is in the wheel
+ */
+class DisposableReaper: public QObject
+{
+public:
+    void start()
+    {
+        if (!m_timer.isActive())
+            m_timer.start(1000, this);
+    }
+    void stop() { m_timer.stop(); }
+    bool isActive() const { return m_timer.isActive(); }
+
+protected:
+    void timerEvent(QTimerEvent *event)
+    {
+        if (event->timerId() == m_timer.timerId())
+            SignonDisposable::destroyUnused();
+    }
+
+private:
+    QBasicTimer m_timer;
+};
+
+static DisposableReaper *reaper = 0;
+
+static bool updateClock()
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        qWarning("Couldn't get time from monotonic clock");
+        return false;
+    }
+
+    /* An empty wheel starts over from the current time */
+    if (scheduledObjects == 0)
+        wheelTime = ts.tv_sec;
+    coarseTime = ts.tv_sec;
+    return true;
+}
 
 SignonDisposable::SignonDisposable(int maxInactivity, QObject *parent)
     : QObject(parent)
     , maxInactivity(maxInactivity)
     , autoDestruct(true)
+    , wheelSlot(-1)
 {
-    disposableObjects.append(this);
-
     // mark as used
     keepInUse();
 }
 
 SignonDisposable::~SignonDisposable()
 {
-    disposableObjects.removeOne(this);
+    if (wheelSlot >= 0) {
+        wheel[wheelSlot].remove(this);
+        scheduledObjects--;
+    }
 }
 
 void SignonDisposable::keepInUse() const
 {
-    struct timespec ts;
+    /* While the reaper ticks, the time it read is recent enough */
+    if (reaper == 0 || !reaper->isActive())
+        updateClock();
 
-    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
-        qWarning("Couldn't get time from monotonic clock");
-        return;
-    }
-    lastActivity = ts.tv_sec;
+    lastActivity = coarseTime;
+
+    if (autoDestruct && wheelSlot < 0)
+        schedule(const_cast<SignonDisposable *>(this));
 }
 
 void SignonDisposable::setAutoDestruct(bool value) const
@@ -59,21 +117,55 @@ void SignonDisposable::setAutoDestruct(bool value) const
     keepInUse();
 }
 
-void SignonDisposable::destroyUnused()
+void SignonDisposable::schedule(SignonDisposable *object)
 {
-    struct timespec ts;
+    time_t expiry = object->lastActivity + object->maxInactivity + 1;
+    time_t ahead = qBound(time_t(1), expiry - wheelTime, time_t(wheelSize - 1));
 
-    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
-        qWarning("Couldn't get time from monotonic clock");
+    object->wheelSlot = (wheelTime + ahead) % wheelSize;
+    wheel[object->wheelSlot].insert(object);
+    scheduledObjects++;
+
+    if (reaper == 0)
+        reaper = new DisposableReaper;
+    reaper->start();
+}
+
+void SignonDisposable::destroyUnused()
+{
+    if (!updateClock())
         return;
-    }
 
-    foreach (SignonDisposable *object, disposableObjects) {
-        if (object->autoDestruct  && (ts.tv_sec - object->lastActivity > object->maxInactivity)) {
-            TRACE() << "Object unused, deleting: " << object;
-            object->destroy();
+    /* Each slot is visited at most once */
+    if (coarseTime - wheelTime > wheelSize)
+        wheelTime = coarseTime - wheelSize;
+
+    while (wheelTime < coarseTime && scheduledObjects > 0) {
+        wheelTime++;
+
+        QSet<SignonDisposable *> &due = wheel[wheelTime % wheelSize];
+        while (!due.isEmpty()) {
+            SignonDisposable *object = *due.begin();
+            due.erase(due.begin());
+            object->wheelSlot = -1;
+            scheduledObjects--;
+
+            /* setAutoDestruct(true) puts it back in the wheel */
+            if (!object->autoDestruct)
+                continue;
+
+            if (coarseTime - object->lastActivity > object->maxInactivity) {
+                TRACE() << "Object unused, deleting: " << object;
+                object->destroy();
+            } else {
+                schedule(object);
+            }
         }
     }
+    wheelTime = coarseTime;
+
+    if (scheduledObjects == 0 && reaper != 0)
+        reaper->stop();
 }
 
 } //namespace SignonDaemonNS
@@ -74,14 +74,20 @@ public:
 
     /*!
      * Deletes all disposable object for which the inactivity time has
-     * elapsed.
+     * elapsed. This is done every second while there are objects with
+     * autodestruction enabled; the cost depends only on the number of
+     * objects whose inactivity time is due.
      */
     static void destroyUnused();
 
+private:
+    static void schedule(SignonDisposable *object);
+
 private:
     int maxInactivity;
     mutable time_t lastActivity;
     mutable bool autoDestruct;
+    mutable int wheelSlot;
 }; //class SignonDaemon
 
 } //namespace SignonDaemonNS
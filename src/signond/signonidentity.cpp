@@ -50,6 +50,77 @@ namespace SignonDaemonNS {
     const QString internalServerErrName = SIGNOND_INTERNAL_SERVER_ERR_NAME;
     const QString internalServerErrStr = SIGNOND_INTERNAL_SERVER_ERR_STR;
 
+    /*
+     * An operation on the identity, run by the storage thread: the D-Bus
+     * call which requested it is replied by the given handler.
+     * */
+    class SignonIdentity::StorageJob: public CredentialsDBJob
+    {
+    public:
+        typedef void (SignonIdentity::*Handler)(StorageJob *job);
+
+        StorageJob(Operation operation, SignonIdentity *identity,
+                   Handler handler)
+            : CredentialsDBJob(operation),
+              m_identity(identity),
+              m_handler(handler),
+              m_message(identity->message())
+        {
+            m_id = identity->m_id;
+        }
+
+        void run(CredentialsDB *db)
+        {
+            if (m_operation != CheckPassword) {
+                CredentialsDBJob::run(db);
+                return;
+            }
+
+            /* The secret is checked against the stored user name */
+            m_info = db->credentials(m_id);
+            if (!db->lastError().isValid())
+                m_ok = db->checkPassword(m_info.id(), m_info.userName(),
+                                         m_password);
+        }
+
+        void finished()
+        {
+            if (m_identity.isNull()) {
+                replyError(internalServerErrName,
+                           internalServerErrStr +
+                           QLatin1String("Identity destroyed."));
+                return;
+            }
+
+            (m_identity->*m_handler)(this);
+        }
+
+        template <typename T>
+        void reply(const T &value)
+        {
+            QDBusMessage dbusreply = m_message.createReply();
+            dbusreply << value;
+            SIGNOND_BUS.send(dbusreply);
+        }
+
+        void reply()
+        {
+            SIGNOND_BUS.send(m_message.createReply());
+        }
+
+        void replyError(const QString &name, const QString &msg)
+        {
+            SIGNOND_BUS.send(m_message.createErrorReply(name, msg));
+        }
+
+        const QDBusMessage &message() const { return m_message; }
+
+    private:
+        QPointer<SignonIdentity> m_identity;
+        Handler m_handler;
+        QDBusMessage m_message;
+    };
+
     SignonIdentity::SignonIdentity(quint32 id, int timeout,
                                    SignonDaemon *parent)
             : SignonDisposable(timeout, parent),
@@ -154,25 +225,19 @@ namespace SignonDaemonNS {
         deleteLater();
     }
 
-    SignonIdentityInfo SignonIdentity::queryInfo(bool &ok, bool queryPassword)
+    void SignonIdentity::postStorageJob(StorageJob *job)
     {
-        ok = true;
-
-        if (m_pInfo) {
-            delete m_pInfo;
-            m_pInfo = NULL;
-        }
-
-        CredentialsDB *db = CredentialsAccessManager::instance()->credentialsDB();
-        m_pInfo = new SignonIdentityInfo(db->credentials(m_id, queryPassword));
+        setDelayedReply(true);
+        CredentialsAccessManager::instance()->credentialsDB()->post(job);
+        keepInUse();
+    }
 
-        if (db->lastError().isValid()) {
-            ok = false;
-            delete m_pInfo;
-            m_pInfo = NULL;
-            return SignonIdentityInfo();
-        }
-        return *m_pInfo;
+    void SignonIdentity::setInfo(const SignonIdentityInfo &info)
+    {
+        delete m_pInfo;
+        m_pInfo = new SignonIdentityInfo(info);
+        AccessControlManager::identityLoaded(m_id, info.accessControlList(),
+                                             info.ownerList());
     }
 
     bool SignonIdentity::addReference(const QString &reference)
@@ -181,7 +246,7 @@ namespace SignonDaemonNS {
 
         SIGNON_RETURN_IF_CAM_UNAVAILABLE(false);
 
-        CredentialsDB *db = CredentialsAccessManager::instance()->credentialsDB();
+        CredentialsDBThread *db = CredentialsAccessManager::instance()->credentialsDB();
         if (db == NULL) {
             BLAME() << "NULL database handler object.";
             return false;
@@ -197,7 +262,7 @@ namespace SignonDaemonNS {
 
         SIGNON_RETURN_IF_CAM_UNAVAILABLE(false);
 
-        CredentialsDB *db = CredentialsAccessManager::instance()->credentialsDB();
+        CredentialsDBThread *db = CredentialsAccessManager::instance()->credentialsDB();
         if (db == NULL) {
             BLAME() << "NULL database handler object.";
             return false;
@@ -211,31 +276,42 @@ namespace SignonDaemonNS {
     {
         SIGNON_RETURN_IF_CAM_UNAVAILABLE(SIGNOND_NEW_IDENTITY);
 
-        bool ok;
-        SignonIdentityInfo info = queryInfo(ok, false);
+        StorageJob *job =
+            new StorageJob(CredentialsDBJob::Credentials, this,
+                           &SignonIdentity::requestCredentialsUpdateLoaded);
+        job->m_flag = false;
+        job->m_data.insert(SSOUI_KEY_MESSAGE, displayMessage);
+        postStorageJob(job);
+        return 0;
+    }
+
+    void SignonIdentity::requestCredentialsUpdateLoaded(StorageJob *job)
+    {
+        const SignonIdentityInfo &info = job->m_info;
 
-        if (!ok) {
+        if (job->errorOccurred()) {
             BLAME() << "Identity not found.";
-            replyError(SIGNOND_IDENTITY_NOT_FOUND_ERR_NAME,
-                       SIGNOND_IDENTITY_NOT_FOUND_ERR_STR);
-            return SIGNOND_NEW_IDENTITY;
+            job->replyError(SIGNOND_IDENTITY_NOT_FOUND_ERR_NAME,
+                            SIGNOND_IDENTITY_NOT_FOUND_ERR_STR);
+            return;
         }
+        setInfo(info);
+
         if (!info.storePassword()) {
             BLAME() << "Password cannot be stored.";
-            replyError(SIGNOND_STORE_FAILED_ERR_NAME,
-                       SIGNOND_STORE_FAILED_ERR_STR);
-            return SIGNOND_NEW_IDENTITY;
+            job->replyError(SIGNOND_STORE_FAILED_ERR_NAME,
+                            SIGNOND_STORE_FAILED_ERR_STR);
+            return;
         }
 
-        //delay dbus reply, ui interaction might take long time to complete
-        setDelayedReply(true);
-        m_message = message();
+        //the reply waits for the ui interaction, which might take long
+        m_message = job->message();
 
         //create ui request to ask password
         QVariantMap uiRequest;
         uiRequest.insert(SSOUI_KEY_QUERYPASSWORD, true);
         uiRequest.insert(SSOUI_KEY_USERNAME, info.userName());
-        uiRequest.insert(SSOUI_KEY_MESSAGE, displayMessage);
+        uiRequest.insert(SSOUI_KEY_MESSAGE, job->m_data.value(SSOUI_KEY_MESSAGE));
         uiRequest.insert(SSOUI_KEY_CAPTION, info.caption());
 
         TRACE() << "Waiting for reply from signon-ui";
@@ -244,7 +320,6 @@ namespace SignonDaemonNS {
         connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)), this, SLOT(queryUiSlot(QDBusPendingCallWatcher*)));
 
         setAutoDestruct(false);
-        return 0;
     }
 
     QList<QVariant> SignonIdentity::queryInfo()
@@ -253,26 +328,39 @@ namespace SignonDaemonNS {
 
         SIGNON_RETURN_IF_CAM_UNAVAILABLE(QList<QVariant>());
 
-        bool ok;
-        SignonIdentityInfo info = queryInfo(ok, false);
+        StorageJob *job =
+            new StorageJob(CredentialsDBJob::Credentials, this,
+                           &SignonIdentity::queryInfoDone);
+        job->m_flag = false;
+        postStorageJob(job);
+        return QList<QVariant>();
+    }
 
-        if (!ok) {
+    void SignonIdentity::queryInfoDone(StorageJob *job)
+    {
+        if (m_pInfo) {
+            delete m_pInfo;
+            m_pInfo = NULL;
+        }
+
+        if (job->errorOccurred()) {
             TRACE();
-            replyError(SIGNOND_CREDENTIALS_NOT_AVAILABLE_ERR_NAME,
-                       SIGNOND_CREDENTIALS_NOT_AVAILABLE_ERR_STR +
-                       QLatin1String("Database querying error occurred."));
-            return QList<QVariant>();
+            job->replyError(SIGNOND_CREDENTIALS_NOT_AVAILABLE_ERR_NAME,
+                            SIGNOND_CREDENTIALS_NOT_AVAILABLE_ERR_STR +
+                            QLatin1String("Database querying error occurred."));
+            return;
         }
 
-        if (info.isNew()) {
+        setInfo(job->m_info);
+
+        if (job->m_info.isNew()) {
             TRACE();
-            replyError(SIGNOND_IDENTITY_NOT_FOUND_ERR_NAME,
-                       SIGNOND_IDENTITY_NOT_FOUND_ERR_STR);
-            return QList<QVariant>();
+            job->replyError(SIGNOND_IDENTITY_NOT_FOUND_ERR_NAME,
+                            SIGNOND_IDENTITY_NOT_FOUND_ERR_STR);
+            return;
         }
 
-        keepInUse();
-        return info.toVariantList();
+        job->reply(job->m_info.toVariantList());
     }
 
     void SignonIdentity::queryUserPassword(const QVariantMap &params) {
@@ -289,35 +377,44 @@ namespace SignonDaemonNS {
     {
         SIGNON_RETURN_IF_CAM_UNAVAILABLE(false);
 
-        bool ok;
-        SignonIdentityInfo info = queryInfo(ok, true);
+        StorageJob *job =
+            new StorageJob(CredentialsDBJob::Credentials, this,
+                           &SignonIdentity::verifyUserLoaded);
+        job->m_data = params;
+        postStorageJob(job);
+        return false;
+    }
+
+    void SignonIdentity::verifyUserLoaded(StorageJob *job)
+    {
+        const SignonIdentityInfo &info = job->m_info;
 
-        if (!ok) {
+        if (job->errorOccurred()) {
             BLAME() << "Identity not found.";
-            replyError(SIGNOND_IDENTITY_NOT_FOUND_ERR_NAME,
-                       SIGNOND_IDENTITY_NOT_FOUND_ERR_STR);
-            return false;
+            job->replyError(SIGNOND_IDENTITY_NOT_FOUND_ERR_NAME,
+                            SIGNOND_IDENTITY_NOT_FOUND_ERR_STR);
+            return;
         }
+        setInfo(info);
+
         if (!info.storePassword() || info.password().isEmpty()) {
             BLAME() << "Password is not stored.";
-            replyError(SIGNOND_CREDENTIALS_NOT_AVAILABLE_ERR_NAME,
-                       SIGNOND_CREDENTIALS_NOT_AVAILABLE_ERR_STR);
-            return false;
+            job->replyError(SIGNOND_CREDENTIALS_NOT_AVAILABLE_ERR_NAME,
+                            SIGNOND_CREDENTIALS_NOT_AVAILABLE_ERR_STR);
+            return;
         }
 
-        //delay dbus reply, ui interaction might take long time to complete
-        setDelayedReply(true);
-        m_message = message();
+        //the reply waits for the ui interaction, which might take long
+        m_message = job->message();
 
         //create ui request to ask password
         QVariantMap uiRequest;
-        uiRequest.unite(params);
+        uiRequest.unite(job->m_data);
         uiRequest.insert(SSOUI_KEY_QUERYPASSWORD, true);
         uiRequest.insert(SSOUI_KEY_USERNAME, info.userName());
         uiRequest.insert(SSOUI_KEY_CAPTION, info.caption());
 
         queryUserPassword(uiRequest);
-        return false;
     }
 
     bool SignonIdentity::verifySecret(const QString &secret)
@@ -334,37 +431,57 @@ namespace SignonDaemonNS {
             return false;
         }
 
-        bool ok;
-        SignonIdentityInfo info = queryInfo(ok);
-        if (!ok) {
-            TRACE();
-            replyError(SIGNOND_CREDENTIALS_NOT_AVAILABLE_ERR_NAME,
-                       SIGNOND_CREDENTIALS_NOT_AVAILABLE_ERR_STR +
-                       QLatin1String("Database querying error occurred."));
-            return false;
+        StorageJob *job =
+            new StorageJob(CredentialsDBJob::CheckPassword, this,
+                           &SignonIdentity::verifySecretDone);
+        job->m_password = decodedSecret;
+        postStorageJob(job);
+        return false;
+    }
+
+    void SignonIdentity::verifySecretDone(StorageJob *job)
+    {
+        if (m_pInfo) {
+            delete m_pInfo;
+            m_pInfo = NULL;
         }
 
-        CredentialsDB *db = CredentialsAccessManager::instance()->credentialsDB();
-        bool ret = db->checkPassword(info.id(), info.userName(), decodedSecret);
+        if (job->errorOccurred()) {
+            TRACE();
+            job->replyError(SIGNOND_CREDENTIALS_NOT_AVAILABLE_ERR_NAME,
+                            SIGNOND_CREDENTIALS_NOT_AVAILABLE_ERR_STR +
+                            QLatin1String("Database querying error occurred."));
+            return;
+        }
 
-        keepInUse();
-        return ret;
+        if (!job->m_info.isNew())
+            setInfo(job->m_info);
+        job->reply(job->m_ok);
     }
 
     void SignonIdentity::remove()
     {
         SIGNON_RETURN_IF_CAM_UNAVAILABLE();
 
-        CredentialsDB *db = CredentialsAccessManager::instance()->credentialsDB();
-        if ((db == 0) || !db->removeCredentials(m_id)) {
-            TRACE() << "Error occurred while inserting/updating credentials.";
-            replyError(SIGNOND_REMOVE_FAILED_ERR_NAME,
-                       SIGNOND_REMOVE_FAILED_ERR_STR +
-                       QLatin1String("Database error occurred."));
+        postStorageJob(new StorageJob(CredentialsDBJob::RemoveCredentials, this,
+                                      &SignonIdentity::removeDone));
+    }
+
+    void SignonIdentity::removeDone(StorageJob *job)
+    {
+        if (!job->m_ok) {
+            TRACE() << "Error occurred while removing credentials.";
+            job->replyError(SIGNOND_REMOVE_FAILED_ERR_NAME,
+                            SIGNOND_REMOVE_FAILED_ERR_STR +
+                            QLatin1String("Database error occurred."));
             return;
         }
+        AccessControlManager::identityChanged(job->m_id);
+        AccessControlManager::identityLoaded(job->m_id, QStringList(),
+                                             QStringList());
+        AuthCoreCache::instance()->removeResults(job->m_id);
         emit infoUpdated((int)SignOn::IdentityRemoved);
-        keepInUse();
+        job->reply();
     }
 
     bool SignonIdentity::signOut()
@@ -380,10 +497,13 @@ namespace SignonDaemonNS {
         */
         if (id() != SIGNOND_NEW_IDENTITY) {
             //clear stored sessiondata
-            CredentialsDB *db = CredentialsAccessManager::instance()->credentialsDB();
-            if ((db == 0) || !db->removeData(m_id)) {
-                TRACE() << "clear data failed";
+            if (CredentialsAccessManager::instance()->credentialsDB() != 0) {
+                postStorageJob(new StorageJob(CredentialsDBJob::RemoveData, this,
+                                              &SignonIdentity::signOutDone));
+                return true;
             }
+            TRACE() << "clear data failed";
+            AuthCoreCache::instance()->removeResults(m_id);
 
             emit infoUpdated((int)SignOn::IdentitySignedOut);
         }
@@ -391,6 +511,17 @@ namespace SignonDaemonNS {
         return true;
     }
 
+    void SignonIdentity::signOutDone(StorageJob *job)
+    {
+        if (!job->m_ok) {
+            TRACE() << "clear data failed";
+        }
+        AuthCoreCache::instance()->removeResults(job->m_id);
+
+        emit infoUpdated((int)SignOn::IdentitySignedOut);
+        job->reply(true);
+    }
+
     quint32 SignonIdentity::store(const QVariantMap &info)
     {
         keepInUse();
@@ -430,14 +561,8 @@ namespace SignonDaemonNS {
 
         if (decodedSecret.isEmpty()) storeSecret = false;
 
-        m_id = storeCredentials(identityInfo, storeSecret);
-
-        if (m_id == SIGNOND_NEW_IDENTITY) {
-            replyError(SIGNOND_STORE_FAILED_ERR_NAME,
-                       SIGNOND_STORE_FAILED_ERR_STR);
-        }
-
-        return m_id;
+        storeCredentials(identityInfo, storeSecret);
+        return SIGNOND_NEW_IDENTITY;
     }
 
     quint32 SignonIdentity::storeCredentials(const quint32 id,
@@ -492,56 +617,71 @@ namespace SignonDaemonNS {
         }
 
         storeCredentials(*m_pInfo, storeSecret);
-
-        if (m_id == SIGNOND_NEW_IDENTITY) {
-            replyError(SIGNOND_STORE_FAILED_ERR_NAME,
-                       SIGNOND_STORE_FAILED_ERR_STR);
-        }
-
-        return m_id;
+        return SIGNOND_NEW_IDENTITY;
     }
 
-    quint32 SignonIdentity::storeCredentials(const SignonIdentityInfo &info, bool storeSecret)
+    void SignonIdentity::storeCredentials(const SignonIdentityInfo &info, bool storeSecret)
     {
-        CredentialsDB *db = CredentialsAccessManager::instance()->credentialsDB();
-        if (db == NULL) {
-            BLAME() << "NULL database handler object.";
-            return SIGNOND_NEW_IDENTITY;
-        }
+        CredentialsDBJob::Operation operation = info.isNew() ?
+            CredentialsDBJob::InsertCredentials :
+            CredentialsDBJob::UpdateCredentials;
+
+        StorageJob *job =
+            new StorageJob(operation, this,
+                           &SignonIdentity::storeCredentialsDone);
+        job->m_info = info;
+        job->m_flag = storeSecret;
+        postStorageJob(job);
+    }
 
-        bool newIdentity = info.isNew();
+    void SignonIdentity::storeCredentialsDone(StorageJob *job)
+    {
+        bool newIdentity =
+            (job->m_operation == CredentialsDBJob::InsertCredentials);
 
         if (newIdentity)
-            m_id = db->insertCredentials(info, storeSecret);
-        else
-            db->updateCredentials(info, storeSecret);
+            m_id = job->m_id;
+
+        /* Also new identities might reuse the id of a removed one */
+        AccessControlManager::identityChanged(m_id);
+        AuthCoreCache::instance()->removeResults(m_id);
 
-        if (db->errorOccurred()) {
+        if (job->errorOccurred() || !job->m_ok) {
             if (newIdentity)
                 m_id = SIGNOND_NEW_IDENTITY;
 
             TRACE() << "Error occurred while inserting/updating credentials.";
-        } else {
-            m_pSignonDaemon->identityStored(this);
-
-            //If secrets db is not available cache auth. data.
-            if (!db->isSecretsDBOpen()) {
-                AuthCache *cache = new AuthCache;
-                cache->setUsername(info.userName());
-                cache->setPassword(info.password());
-                AuthCoreCache::instance()->insert(
-                    AuthCoreCache::CacheId(m_id, AuthCoreCache::AuthMethod()), cache);
-            }
-            TRACE() << "FRESH, JUST STORED CREDENTIALS ID:" << m_id;
-            emit infoUpdated((int)SignOn::IdentityDataUpdated);
+            if (m_id == SIGNOND_NEW_IDENTITY)
+                job->replyError(SIGNOND_STORE_FAILED_ERR_NAME,
+                                SIGNOND_STORE_FAILED_ERR_STR);
+            else
+                job->reply(quint32(m_id));
+            return;
+        }
 
-            if (m_pInfo) {
-                delete m_pInfo;
-                m_pInfo = NULL;
-            }
+        m_pSignonDaemon->identityStored(this);
+        AccessControlManager::identityLoaded(m_id,
+                                             job->m_info.accessControlList(),
+                                             job->m_info.ownerList());
 
+        //If secrets db is not available cache auth. data.
+        CredentialsDBThread *db = CredentialsAccessManager::instance()->credentialsDB();
+        if (db != NULL && !db->isSecretsDBOpen()) {
+            AuthCache *cache = new AuthCache;
+            cache->setUsername(job->m_info.userName());
+            cache->setPassword(job->m_info.password());
+            AuthCoreCache::instance()->insert(
+                AuthCoreCache::CacheId(m_id, AuthCoreCache::AuthMethod()), cache);
         }
-        return m_id;
+        TRACE() << "FRESH, JUST STORED CREDENTIALS ID:" << m_id;
+        emit infoUpdated((int)SignOn::IdentityDataUpdated);
+
+        if (m_pInfo) {
+            delete m_pInfo;
+            m_pInfo = NULL;
+        }
+
+        job->reply(quint32(m_id));
     }
 
     void SignonIdentity::queryUiSlot(QDBusPendingCallWatcher *call)
@@ -588,7 +728,7 @@ namespace SignonDaemonNS {
         }
 
         if (resultParameters.contains(SSOUI_KEY_PASSWORD)) {
-            CredentialsDB *db = CredentialsAccessManager::instance()->credentialsDB();
+            CredentialsDBThread *db = CredentialsAccessManager::instance()->credentialsDB();
             if (db == NULL) {
                 BLAME() << "NULL database handler object.";
                 errReply = m_message.createErrorReply(SIGNOND_STORE_FAILED_ERR_NAME,
@@ -669,7 +809,7 @@ namespace SignonDaemonNS {
         }
 
         if (resultParameters.contains(SSOUI_KEY_PASSWORD)) {
-            CredentialsDB *db = CredentialsAccessManager::instance()->credentialsDB();
+            CredentialsDBThread *db = CredentialsAccessManager::instance()->credentialsDB();
             if (db == NULL) {
                 BLAME() << "NULL database handler object.";
                 errReply = m_message.createErrorReply(SIGNOND_STORE_FAILED_ERR_NAME,
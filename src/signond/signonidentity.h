@@ -60,8 +60,17 @@ namespace SignonDaemonNS {
         static SignonIdentity *createIdentity(quint32 id, SignonDaemon *parent);
         quint32 id() const { return m_id; }
 
-        SignonIdentityInfo queryInfo(bool &ok, bool queryPassword = true);
-        quint32 storeCredentials(const SignonIdentityInfo &info, bool storeSecret);
+        /*!
+         * Keeps the identity as loaded by the daemon, and its lists for the
+         * access control decisions.
+         */
+        void setInfo(const SignonIdentityInfo &info);
+
+        /*!
+         * Stores the identity in the storage thread: the D-Bus reply, with
+         * the id of the identity, is sent once it is stored.
+         */
+        void storeCredentials(const SignonIdentityInfo &info, bool storeSecret);
 
     public Q_SLOTS:
         quint32 requestCredentialsUpdate(const QString &message);
@@ -90,12 +99,27 @@ namespace SignonDaemonNS {
         void infoUpdated(int);
 
     private:
+        class StorageJob;
+
         SignonIdentity(quint32 id, int timeout, SignonDaemon *parent);
         bool init();
         bool credentialsStored() const { return m_id > 0 ? true : false; }
         void replyError(const QString &name, const QString &msg);
         void queryUserPassword(const QVariantMap &params);
 
+        /*
+         * The operations on the stored identity are run by the storage
+         * thread; their D-Bus replies are sent by these methods.
+         * */
+        void postStorageJob(StorageJob *job);
+        void requestCredentialsUpdateLoaded(StorageJob *job);
+        void verifyUserLoaded(StorageJob *job);
+        void queryInfoDone(StorageJob *job);
+        void verifySecretDone(StorageJob *job);
+        void removeDone(StorageJob *job);
+        void signOutDone(StorageJob *job);
+        void storeCredentialsDone(StorageJob *job);
+
     private:
         quint32 m_id;
         SignonUiAdaptor *m_signonui;
@@ -20,6 +20,8 @@
  * 02110-1301 USA
  */
 
+#define SIGNON_TRACE_CATEGORY SignOn::TraceSession
+
 #include "signond-common.h"
 #include "signonauthsession.h"
 #include "signonidentityinfo.h"
@@ -37,11 +39,18 @@
  * the watchdog searches for idle sessions with period of half of idle timeout
  * */
 #define IDLE_WATCHDOG_TIMEOUT SIGNOND_MAX_IDLE_TIME * 500
+/* Time (ms) before starting again more plugin processes after one failed */
+#define PLUGIN_INSTANCE_RETRY_DELAY 10000
 
 #define SSO_KEY_USERNAME QLatin1String("UserName")
 #define SSO_KEY_PASSWORD QLatin1String("Secret")
 #define SSO_KEY_CAPTION QLatin1String("Caption")
 #define SSO_KEY_KEEPALIVE QLatin1String("KeepAlive")
+#define SSO_KEY_RENEWTOKEN QLatin1String("RenewToken")
+#define SSO_KEY_CACHEPOLICY QLatin1String("CachePolicy")
+#define SSO_KEY_RESULTEXPIRESIN QLatin1String("ResultExpiresIn")
+#define SSO_KEY_WINDOWID QLatin1String("WindowId")
+#define SSO_KEY_NETWORKTIMEOUT QLatin1String("NetworkTimeout")
 
 using namespace SignonDaemonNS;
 using namespace SignOnCrypto;
@@ -55,10 +64,41 @@ QMap<QString, SignonSessionCore *> sessionsOfStoredCredentials;
  * */
 QList<SignonSessionCore *> sessionsOfNonStoredCredentials;
 /*
- * cache of session queues: we have to serialize of requests done for a given identity
- * in order to prevent parallel UI sessions for the same username/password
+ * Requests done for a given identity: the session cores waiting to process a
+ * request (one entry per request, in order of arrival) and the ones which are
+ * processing one. The UI interactions are serialized, in order to prevent
+ * parallel UI sessions for the same username/password.
+ * */
+struct IdentityRequests
+{
+    IdentityRequests(): uiOwner(0) {}
+
+    QQueue<SignonSessionCore *> waiting;
+    QList<SignonSessionCore *> running;
+    SignonSessionCore *uiOwner;
+    QQueue<SignonSessionCore *> waitingForUi;
+};
+QMap<quint32, IdentityRequests> queuesOfRequestsByIdentity;
+
+/*
+ * Methods whose requests run alone on their identity
+ * */
+static QSet<QString> exclusiveMethods;
+
+/*
+ * Maximum number of plugin processes of a session core, by method
+ * */
+static QHash<QString, int> maxPluginInstancesByMethod;
+
+/*
+ * Methods whose identical requests share the result of the first one
  * */
-QMap<quint32, QQueue<SignonSessionCore *> > queuesOfRequestsByIdentity;
+static QSet<QString> coalescingMethods;
+
+/*
+ * Methods whose results are cached
+ * */
+static QSet<QString> resultCacheMethods;
 
 static QVariantMap filterVariantMap(const QVariantMap &other)
 {
@@ -79,21 +119,184 @@ static QString sessionName(const quint32 id, const QString &method)
 
 static pid_t pidOfContext(const QDBusConnection &connection, const QDBusMessage &message)
 {
-    return connection.interface()->servicePid(message.service()).value();
+    return AccessControlManager::pidOfPeer(connection, message.service());
+}
+
+/*
+ * Only the values which can be compared in their serialized form are part
+ * of a request key: D-Bus structures are opaque to QDataStream.
+ * */
+static bool isComparable(const QVariant &value)
+{
+    if (value.type() == QVariant::List) {
+        foreach (QVariant item, value.toList()) {
+            if (!isComparable(item))
+                return false;
+        }
+        return true;
+    }
+
+    if (value.type() == QVariant::Map) {
+        foreach (QVariant item, value.toMap()) {
+            if (!isComparable(item))
+                return false;
+        }
+        return true;
+    }
+
+    return value.type() < QVariant::UserType;
+}
+
+SignonSessionCore::ActiveRequest::ActiveRequest(const RequestData &data,
+                                                PluginProxy *plugin)
+    : m_data(data),
+      m_plugin(plugin),
+      m_canceled(false),
+      m_detached(false),
+      m_loading(false),
+      m_queryCredsUiDisplayed(false),
+      m_hasPendingUi(false),
+      m_pendingUiRefresh(false)
+{
 }
 
+/*
+ * Loads the stored identity and the data of the method in the storage
+ * thread, for a request about to be given to its plugin.
+ * */
+class SignonSessionCore::RequestDataJob: public CredentialsDBJob
+{
+public:
+    RequestDataJob(SignonSessionCore *core, ActiveRequest *request)
+        : CredentialsDBJob(Credentials),
+          m_core(core),
+          m_request(request),
+          m_cancelKey(request->m_data.m_cancelKey),
+          m_secretsDBOpen(false)
+    {
+        m_id = core->m_id;
+        m_method = core->m_method;
+    }
+
+    void run(CredentialsDB *db)
+    {
+        m_info = db->credentials(m_id);
+        m_secretsDBOpen = db->isSecretsDBOpen();
+        if (m_secretsDBOpen)
+            m_data = db->loadData(m_id, m_method);
+    }
+
+    void finished()
+    {
+        if (!m_core.isNull())
+            m_core->requestDataLoaded(this);
+    }
+
+    QPointer<SignonSessionCore> m_core;
+    ActiveRequest *m_request;
+    QString m_cancelKey;
+    bool m_secretsDBOpen;
+};
+
+/*
+ * Updates the stored identity with the credentials given by the plugin. The
+ * identity is read again in the storage thread, not to undo the changes
+ * stored since the request started.
+ * */
+class CredentialsStoreJob: public CredentialsDBJob
+{
+public:
+    CredentialsStoreJob(quint32 id, const StoreOperation &operation)
+        : CredentialsDBJob(UpdateCredentials)
+    {
+        m_id = id;
+        m_data = operation.m_credsData;
+        m_password = operation.m_passwordUpdate;
+    }
+
+    void run(CredentialsDB *db)
+    {
+        SignonIdentityInfo info = db->credentials(m_id);
+        if (db->lastError().isValid() || info.isNew())
+            return;
+
+        if (!m_password.isEmpty())
+            info.setPassword(m_password);
+
+        //allow update only for not validated username
+        if (!info.validated()
+                && m_data.contains(SSO_KEY_USERNAME)
+                && !m_data[SSO_KEY_USERNAME].toString().isEmpty())
+            info.setUserName(m_data[SSO_KEY_USERNAME].toString());
+
+        if (m_data.contains(SSO_KEY_PASSWORD)
+            && !m_data[SSO_KEY_PASSWORD].toString().isEmpty())
+            info.setPassword(m_data[SSO_KEY_PASSWORD].toString());
+
+        info.setValidated(true);
+
+        m_id = db->updateCredentials(info);
+        m_ok = (m_id != 0);
+    }
+};
+
+/*
+ * Checks in the storage thread whether the credentials or the data given by
+ * the plugin are stored at once: the ones of a validated identity wait for
+ * the secrets DB, if it is not open.
+ * */
+class SignonSessionCore::StoreCheckJob: public CredentialsDBJob
+{
+public:
+    StoreCheckJob(SignonSessionCore *core, const StoreOperation &operation,
+                  bool queryCredsUiDisplayed)
+        : CredentialsDBJob(Credentials),
+          m_core(core),
+          m_store(operation),
+          m_queryCredsUiDisplayed(queryCredsUiDisplayed),
+          m_secretsDBOpen(false)
+    {
+        m_id = core->m_id;
+    }
+
+    void run(CredentialsDB *db)
+    {
+        m_info = db->credentials(m_id, false);
+        m_secretsDBOpen = db->isSecretsDBOpen();
+    }
+
+    void finished()
+    {
+        if (m_secretsDBOpen || !m_info.validated()) {
+            SignonSessionCore::processStoreOperation(m_id, m_store);
+            return;
+        }
+
+        /* Queued only if the operation follows a query of the credentials
+         * by the UI, to avoid unexpected UI pop-ups */
+        if (!m_core.isNull() && m_queryCredsUiDisplayed)
+            m_core->queueStoreOperation(m_store);
+    }
+
+private:
+    QPointer<SignonSessionCore> m_core;
+    StoreOperation m_store;
+    bool m_queryCredsUiDisplayed;
+    bool m_secretsDBOpen;
+};
+
 SignonSessionCore::SignonSessionCore(quint32 id,
                                      const QString &method,
                                      int timeout,
                                      SignonDaemon *parent)
     : SignonDisposable(timeout, parent),
+      m_pluginInstanceFailed(false),
       m_id(id),
       m_method(method),
-      m_passwordUpdate(QString()),
-      m_queryCredsUiDisplayed(false),
       m_refCount(0)
 {
     m_watcher = NULL;
+    m_uiRequest = NULL;
     m_plugin = NULL;
 
     if (!(m_encryptor = new Encryptor))
@@ -118,12 +321,15 @@ SignonSessionCore::~SignonSessionCore()
     AuthCoreCache::instance()->authSessionDestroyed(
         AuthCoreCache::CacheId(m_id, m_method));
 
-    if (queuesOfRequestsByIdentity.contains(m_id)) {
-        QQueue <SignonSessionCore *> queue = queuesOfRequestsByIdentity[m_id];
-        queue.removeAll(this);
-    }
+    if (m_id)
+        dropFromQueueOfRequestsByIdentity(m_id, this);
+
+    qDeleteAll(m_activeRequests);
+    m_activeRequests.clear();
+
+    qDeleteAll(m_plugins);
+    m_plugins.clear();
 
-    delete m_plugin;
     delete m_watcher;
     delete m_signonui;
     delete m_encryptor;
@@ -131,9 +337,72 @@ SignonSessionCore::~SignonSessionCore()
     m_plugin = NULL;
     m_signonui = NULL;
     m_watcher = NULL;
+    m_uiRequest = NULL;
     m_encryptor = NULL;
 }
 
+void SignonSessionCore::setRequestPolicy(const QString &method,
+                                         RequestPolicy policy)
+{
+    TRACE() << method << policy;
+
+    if (policy == ExclusiveRequests)
+        exclusiveMethods.insert(method);
+    else
+        exclusiveMethods.remove(method);
+}
+
+SignonSessionCore::RequestPolicy SignonSessionCore::requestPolicy(const QString &method)
+{
+    return exclusiveMethods.contains(method) ?
+        ExclusiveRequests : ConcurrentRequests;
+}
+
+void SignonSessionCore::setMaxPluginInstances(const QString &method, int max)
+{
+    TRACE() << method << max;
+
+    if (max > 1)
+        maxPluginInstancesByMethod.insert(method, max);
+    else
+        maxPluginInstancesByMethod.remove(method);
+}
+
+int SignonSessionCore::maxPluginInstances(const QString &method)
+{
+    return maxPluginInstancesByMethod.value(method, 1);
+}
+
+void SignonSessionCore::setCoalescingEnabled(const QString &method, bool enabled)
+{
+    TRACE() << method << enabled;
+
+    if (enabled)
+        coalescingMethods.insert(method);
+    else
+        coalescingMethods.remove(method);
+}
+
+bool SignonSessionCore::isCoalescingEnabled(const QString &method)
+{
+    return coalescingMethods.contains(method);
+}
+
+void SignonSessionCore::setResultCacheEnabled(const QString &method, bool enabled)
+{
+    TRACE() << method << enabled;
+
+    if (enabled)
+        resultCacheMethods.insert(method);
+    else
+        resultCacheMethods.remove(method);
+}
+
+bool SignonSessionCore::isResultCacheEnabled(const QString &method)
+{
+    return resultCacheMethods.contains(method);
+}
+
 SignonSessionCore *SignonSessionCore::sessionCore(const quint32 id, const QString &method, SignonDaemon *parent)
 {
     QString objectName;
@@ -178,57 +447,136 @@ QString SignonSessionCore::method() const
 
 bool SignonSessionCore::setupPlugin()
 {
-    m_plugin = PluginProxy::createNewPluginProxy(m_method);
+    /* The plugin process is started without waiting for it: the requests
+     * are processed once pluginStarted() is called. */
+    m_plugin = PluginProxy::requestPluginProxy(m_method);
 
     if (!m_plugin) {
         TRACE() << "Plugin of type " << m_method << " cannot be found";
         return false;
     }
 
-    connect(m_plugin,
+    connectPlugin(m_plugin);
+    m_plugins.append(m_plugin);
+
+    m_plugin->start();
+    return true;
+}
+
+void SignonSessionCore::connectPlugin(PluginProxy *plugin)
+{
+    connect(plugin,
+            SIGNAL(startupFinished(bool)),
+            this,
+            SLOT(pluginStarted(bool)));
+
+    connect(plugin,
             SIGNAL(processResultReply(const QString&, const QVariantMap&)),
             this,
             SLOT(processResultReply(const QString&, const QVariantMap&)),
             Qt::DirectConnection);
 
-    connect(m_plugin,
+    connect(plugin,
             SIGNAL(processStore(const QString&, const QVariantMap&)),
             this,
             SLOT(processStore(const QString&, const QVariantMap&)),
             Qt::DirectConnection);
 
-    connect(m_plugin,
+    connect(plugin,
             SIGNAL(processUiRequest(const QString&, const QVariantMap&)),
             this,
             SLOT(processUiRequest(const QString&, const QVariantMap&)),
             Qt::DirectConnection);
 
-    connect(m_plugin,
+    connect(plugin,
             SIGNAL(processRefreshRequest(const QString&, const QVariantMap&)),
             this,
             SLOT(processRefreshRequest(const QString&, const QVariantMap&)),
             Qt::DirectConnection);
 
-    connect(m_plugin,
+    connect(plugin,
             SIGNAL(processError(const QString&, int, const QString&)),
             this,
             SLOT(processError(const QString&, int, const QString&)),
             Qt::DirectConnection);
 
-    connect(m_plugin,
+    connect(plugin,
             SIGNAL(stateChanged(const QString&, int, const QString&)),
             this,
             SLOT(stateChangedSlot(const QString&, int, const QString&)),
             Qt::DirectConnection);
+}
 
-    return true;
+bool SignonSessionCore::isPluginStarted() const
+{
+    return m_plugin->isStarted();
 }
 
-void SignonSessionCore::stopAllAuthSessions()
+void SignonSessionCore::startPlugin()
 {
-    foreach (QQueue<SignonSessionCore *> queue, queuesOfRequestsByIdentity)
-        queue.clear();
+    keepInUse();
+    m_plugin->start();
+}
+
+void SignonSessionCore::pluginStarted(bool started)
+{
+    PluginProxy *plugin = qobject_cast<PluginProxy *>(sender());
+    TRACE() << m_method << started;
+
+    if (plugin != NULL && plugin != m_plugin) {
+        /* one of the additional plugin processes */
+        if (started) {
+            m_pluginInstanceFailed = false;
+        } else {
+            BLAME() << "Additional plugin of type " << m_method << " cannot be started";
+            m_plugins.removeOne(plugin);
+            plugin->deleteLater();
+
+            /* don't start more processes for a while, the requests are
+             * handled by the ones already running */
+            if (!m_pluginInstanceFailed) {
+                m_pluginInstanceFailed = true;
+                QTimer::singleShot(PLUGIN_INSTANCE_RETRY_DELAY,
+                                   this, SLOT(retryPluginInstances()));
+            }
+        }
 
+        QMetaObject::invokeMethod(this, "startNewRequest", Qt::QueuedConnection);
+        return;
+    }
+
+    if (started) {
+        QMetaObject::invokeMethod(this, "startNewRequest", Qt::QueuedConnection);
+    } else {
+        BLAME() << "Plugin of type " << m_method << " cannot be started";
+
+        /* Fail all the requests waiting for the plugin */
+        while (!m_listOfRequests.isEmpty()) {
+            RequestData rd = m_listOfRequests.dequeue();
+            QList<RequestData> failed = m_coalesced.take(rd.m_coalesceKey);
+            failed.prepend(rd);
+            foreach (RequestData failedRd, failed) {
+                QDBusMessage errReply = failedRd.m_msg.createErrorReply(
+                                                    SIGNOND_RUNTIME_ERR_NAME,
+                                                    SIGNOND_RUNTIME_ERR_STR);
+                failedRd.m_conn.send(errReply);
+            }
+        }
+
+        if (m_id && queuesOfRequestsByIdentity.contains(m_id)) {
+            queuesOfRequestsByIdentity[m_id].waiting.removeAll(this);
+            wakeUpQueueOfRequestsByIdentity(m_id);
+        }
+
+        /* gives back the turns granted to the failed requests */
+        QMetaObject::invokeMethod(this, "startNewRequest", Qt::QueuedConnection);
+    }
+
+    emit pluginStartupFinished(started);
+}
+
+void SignonSessionCore::stopAllAuthSessions()
+{
     queuesOfRequestsByIdentity.clear();
 
     qDeleteAll(sessionsOfStoredCredentials);
@@ -241,12 +589,12 @@ void SignonSessionCore::stopAllAuthSessions()
 QStringList SignonSessionCore::loadedPluginMethods(const QString &method)
 {
     foreach (SignonSessionCore *corePtr, sessionsOfStoredCredentials) {
-        if (corePtr->method() == method)
+        if (corePtr->method() == method && corePtr->isPluginStarted())
             return corePtr->queryAvailableMechanisms(QStringList());
     }
 
     foreach (SignonSessionCore *corePtr, sessionsOfNonStoredCredentials) {
-        if (corePtr->method() == method)
+        if (corePtr->method() == method && corePtr->isPluginStarted())
             return corePtr->queryAvailableMechanisms(QStringList());
     }
 
@@ -270,10 +618,10 @@ void SignonSessionCore::process(const QDBusConnection &connection,
                                  const QString &cancelKey)
 {
     keepInUse();
+    QVariantMap sessionData(sessionDataVa);
     if (m_encryptor->isVariantMapEncrypted(sessionDataVa)) {
         pid_t pid = pidOfContext(connection, message);
-        QVariantMap decodedData(m_encryptor->
-                                decodeVariantMap(sessionDataVa, pid));
+        sessionData = m_encryptor->decodeVariantMap(sessionDataVa, pid);
         if (m_encryptor->status() != Encryptor::Ok) {
             replyError(connection,
                        message,
@@ -281,19 +629,52 @@ void SignonSessionCore::process(const QDBusConnection &connection,
                        QString::fromLatin1("Failed to decrypt incoming message"));
             return;
         }
-        m_listOfRequests.enqueue(RequestData(connection,
-                                             message,
-                                             decodedData,
-                                             mechanism,
-                                             cancelKey));
-    } else {
-        m_listOfRequests.enqueue(RequestData(connection,
-                                             message,
-                                             sessionDataVa,
-                                             mechanism,
-                                             cancelKey));
     }
 
+    RequestData rd(connection, message, sessionData, mechanism, cancelKey);
+
+    /* The key costs an access control lookup and the serialization of the
+     * parameters: it is computed only for the methods which use it */
+    int cachePolicy = sessionData.value(SSO_KEY_CACHEPOLICY).toInt();
+    bool coalescing = isCoalescingEnabled(m_method);
+    bool caching = isResultCacheEnabled(m_method)
+        && cachePolicy != NoCachePolicy;
+    QByteArray key;
+    if (coalescing || caching)
+        key = requestKey(connection, message, sessionData, mechanism);
+
+    if (!key.isEmpty()) {
+        if (coalescing)
+            rd.m_coalesceKey = key;
+
+        if (caching) {
+            rd.m_cacheKey = key;
+
+            /* A still valid result is returned without involving the plugin,
+             * unless an earlier request of the session is still pending */
+            QVariantMap cached;
+            if (cachePolicy == DefaultCachePolicy
+                && !sessionData.value(SSO_KEY_RENEWTOKEN).toBool()
+                && !isPending(cancelKey)
+                && AuthCoreCache::instance()->result(
+                    AuthCoreCache::CacheId(m_id, m_method), key, cached)) {
+                TRACE() << "The request is served from the cache";
+                replyResult(rd, cached);
+                return;
+            }
+        }
+    }
+
+    /* An identical request is already on its way: this one waits for its
+     * result instead of being processed again */
+    if (!rd.m_coalesceKey.isEmpty() && hasCoalescingLeader(rd.m_coalesceKey)) {
+        TRACE() << "The request is coalesced with an identical one";
+        m_coalesced[rd.m_coalesceKey].append(rd);
+        return;
+    }
+
+    m_listOfRequests.enqueue(rd);
+
     if (m_id) {
         addToQueueOfRequestsByIdentity(m_id, this);
         if (CredentialsAccessManager::instance()->isCredentialsSystemReady())
@@ -307,55 +688,71 @@ void SignonSessionCore::cancel(const QString &cancelKey)
 {
     TRACE();
 
-    int requestIndex;
-    for (requestIndex = 0; requestIndex < m_listOfRequests.size(); requestIndex++) {
-        if (m_listOfRequests.at(requestIndex).m_cancelKey == cancelKey)
+    ActiveRequest *request = NULL;
+    foreach (ActiveRequest *active, m_activeRequests) {
+        if (active->m_data.m_cancelKey == cancelKey
+            && !active->m_canceled && !active->m_detached) {
+            request = active;
             break;
-    }
-
-    TRACE() << "The request is found with index " << requestIndex;
-    bool requestIsInProcessing = false;
-
-    if (requestIndex < m_listOfRequests.size()) {
-        if (requestIndex == 0) {
-            if (queuesOfRequestsByIdentity.contains(m_id)) {
-                QQueue<SignonSessionCore *> queue = queuesOfRequestsByIdentity[m_id];
-
-                if (queue.head() == this)
-                    requestIsInProcessing = true;
-                else {
-                    queue.removeOne(this);
-                }
-            }
         }
+    }
 
-        if (requestIsInProcessing) {
-
-            m_canceled = cancelKey;
-            m_plugin->cancel();
-
-            if (m_watcher && !m_watcher->isFinished()) {
-                m_signonui->cancelUiRequest(cancelKey);
+    if (request != NULL) {
+        TRACE() << "The request is in processing";
 
-                m_watcher->disconnect();
-                m_watcher->deleteLater();
-                m_watcher = 0;
-            }
+        /* the coalesced requests still wait for its result */
+        if (m_coalesced.contains(request->m_data.m_coalesceKey)) {
+            TRACE() << "The request goes on for the coalesced ones";
+            request->m_detached = true;
+        } else {
+            cancelActiveRequest(request);
         }
 
         /*
-        * We must let to the m_listOfRequests to have the canceled request data
-        * in order to delay the next request execution until the actual cancelation
+        * The canceled request is kept among the active ones in order to delay
+        * the next request with the same cancel key until the actual cancelation
         * will happen. We will know about that precisely: plugin must reply via
         * resultSlot or via errorSlot.
         * */
-        RequestData rd((requestIsInProcessing ?
-                       m_listOfRequests.head() :
-                       m_listOfRequests.takeAt(requestIndex)));
+        QDBusMessage errReply = request->m_data.m_msg.createErrorReply(
+                                                    SIGNOND_SESSION_CANCELED_ERR_NAME,
+                                                    SIGNOND_SESSION_CANCELED_ERR_STR);
+        request->m_data.m_conn.send(errReply);
+        return;
+    }
+
+    int requestIndex;
+    for (requestIndex = 0; requestIndex < m_listOfRequests.size(); requestIndex++) {
+        if (m_listOfRequests.at(requestIndex).m_cancelKey == cancelKey)
+            break;
+    }
+
+    TRACE() << "The request is found with index " << requestIndex;
+
+    if (requestIndex < m_listOfRequests.size()) {
+        RequestData rd(m_listOfRequests.at(requestIndex));
         QDBusMessage errReply = rd.m_msg.createErrorReply(SIGNOND_SESSION_CANCELED_ERR_NAME,
                                                          SIGNOND_SESSION_CANCELED_ERR_STR);
         rd.m_conn.send(errReply);
+
+        if (m_coalesced.contains(rd.m_coalesceKey)) {
+            /* the first coalesced request takes the place of the canceled one */
+            QList<RequestData> &coalesced = m_coalesced[rd.m_coalesceKey];
+            m_listOfRequests[requestIndex] = coalesced.takeFirst();
+            if (coalesced.isEmpty())
+                m_coalesced.remove(rd.m_coalesceKey);
+            return;
+        }
+
+        m_listOfRequests.removeAt(requestIndex);
+
+        if (m_id && queuesOfRequestsByIdentity.contains(m_id)) {
+            if (!queuesOfRequestsByIdentity[m_id].waiting.removeOne(this))
+                QMetaObject::invokeMethod(this, "startNewRequest", Qt::QueuedConnection);
+        }
         TRACE() << "Size of the queue is " << m_listOfRequests.size();
+    } else if (cancelCoalesced(cancelKey)) {
+        TRACE() << "The coalesced request is canceled";
     }
 }
 
@@ -381,100 +778,170 @@ void SignonSessionCore::setId(quint32 id)
         sessionsOfNonStoredCredentials.removeOne(this);
         sessionsOfStoredCredentials[key] = this;
     }
+
+    if (m_id)
+        dropFromQueueOfRequestsByIdentity(m_id, this);
+
     m_id = id;
+
+    /* the requests move along to the queue of the new identity */
+    if (m_id) {
+        IdentityRequests &requests = queuesOfRequestsByIdentity[m_id];
+        for (int i = 0; i < m_activeRequests.count(); i++)
+            requests.running.append(this);
+        for (int i = 0; i < m_listOfRequests.count(); i++)
+            requests.waiting.enqueue(this);
+
+        if (CredentialsAccessManager::instance()->isCredentialsSystemReady())
+            wakeUpQueueOfRequestsByIdentity(m_id);
+    }
 }
 
-void SignonSessionCore::startProcess()
+void SignonSessionCore::startProcess(int requestIndex, PluginProxy *plugin)
 {
     TRACE() << "the number of requests is : " << m_listOfRequests.length();
 
-    if (m_listOfRequests.length() == 0) {
+    if (requestIndex >= m_listOfRequests.length()) {
         BLAME() << "problems in data queueing: no request to be processed!!!!";
         return;
     }
 
     keepInUse();
 
-    RequestData data = m_listOfRequests.head();
-    QVariantMap parameters = data.m_params;
+    ActiveRequest *request =
+        new ActiveRequest(m_listOfRequests.takeAt(requestIndex), plugin);
+    m_activeRequests.append(request);
+    TRACE_EVENT("startProcess", m_id, m_activeRequests.count());
 
-    if (data.m_cancelKey == m_canceled) {
+    if (m_id) {
+        /* The request is given to its plugin once the stored data are
+         * loaded */
+        CredentialsDBThread *db = CredentialsAccessManager::instance()->credentialsDB();
+        Q_ASSERT(db != 0);
 
-        //no need to send cancel error as it is sent already
-        m_listOfRequests.removeFirst();
-        if (m_id)
-            removeFromQueueOfRequestsByIdentity(m_id, this);
-        else
-            QMetaObject::invokeMethod(this, "startNewRequest", Qt::QueuedConnection);
+        request->m_loading = true;
+        db->post(new RequestDataJob(this, request));
+        return;
+    }
+
+    processRequest(request, request->m_data.m_params);
+}
 
-        m_canceled = QString();
+void SignonSessionCore::requestDataLoaded(RequestDataJob *job)
+{
+    ActiveRequest *request = job->m_request;
+
+    /* The request might have been finished meanwhile */
+    if (!m_activeRequests.contains(request)
+        || request->m_data.m_cancelKey != job->m_cancelKey
+        || !request->m_loading)
+        return;
+
+    request->m_loading = false;
+    TRACE_EVENT("dataLoaded", m_id, m_activeRequests.count());
+
+    if (request->m_canceled) {
+        TRACE() << "The request was canceled while loading its data";
+        finishRequest(request);
         return;
     }
 
-    if (m_id) {
-        CredentialsDB *db = CredentialsAccessManager::instance()->credentialsDB();
-        Q_ASSERT(db != 0);
+    /* The identity might not allow the mechanism: the coalesced requests,
+     * identical, share the failure */
+    QString allowedMechanism;
+    if (!job->m_info.checkMethodAndMechanism(m_method,
+                                             request->m_data.m_mechanism,
+                                             allowedMechanism)) {
+        QString errMsg;
+        QTextStream(&errMsg) << SIGNOND_METHOD_OR_MECHANISM_NOT_ALLOWED_ERR_STR
+                             << " Method:"
+                             << m_method
+                             << ", mechanism:"
+                             << request->m_data.m_mechanism
+                             << ", allowed:"
+                             << allowedMechanism;
+
+        QList<RequestData> failed =
+            m_coalesced.take(request->m_data.m_coalesceKey);
+        if (!request->m_detached)
+            failed.prepend(request->m_data);
+        foreach (RequestData rd, failed)
+            rd.m_conn.send(rd.m_msg.createErrorReply(
+                                SIGNOND_METHOD_OR_MECHANISM_NOT_ALLOWED_ERR_NAME,
+                                errMsg));
+        finishRequest(request);
+        return;
+    }
+    request->m_data.m_mechanism = allowedMechanism;
+    request->m_caption = job->m_info.caption();
 
-        SignonIdentityInfo info = db->credentials(m_id);
-        if (info.id() != SIGNOND_NEW_IDENTITY) {
+    RequestData data = request->m_data;
+    QVariantMap parameters = data.m_params;
+    const SignonIdentityInfo &info = job->m_info;
 
-            if (!parameters.contains(SSO_KEY_PASSWORD)) {
-                //If secrets db not available attempt loading data from cache
-                if (db->isSecretsDBOpen()) {
-                    parameters[SSO_KEY_PASSWORD] = info.password();
-                }
+    if (info.id() != SIGNOND_NEW_IDENTITY) {
 
-                /* Temporary fix - keep it until session core refactoring is complete and auth cache
-                 * will be dumped in the secrets db. */
-                if (parameters[SSO_KEY_PASSWORD].toString().isEmpty()) {
-                    AuthCache *cache = AuthCoreCache::instance()->data(info.id());
-                    if (cache != 0) {
-                        TRACE() << "Using cached secret.";
-                        parameters[SSO_KEY_PASSWORD] = cache->password();
-                    } else {
-                        TRACE() << "Secrets storage not available and authentication "
-                                   "cache is empty - if SSO requires a password, "
-                                   "auth. will fail.";
-                    }
-                }
-            }
-            //database overrules over sessiondata for validated username,
-            //so that identity cannot be misused
-            if (info.validated() || !parameters.contains(SSO_KEY_USERNAME)) {
-                parameters[SSO_KEY_USERNAME] = info.userName();
+        if (!parameters.contains(SSO_KEY_PASSWORD)) {
+            //If secrets db not available attempt loading data from cache
+            if (job->m_secretsDBOpen) {
+                parameters[SSO_KEY_PASSWORD] = info.password();
             }
 
-            pid_t pid = pidOfContext(data.m_conn, data.m_msg);
-            QSet<QString> clientTokenSet = AccessControlManager::accessTokens(pid).toSet();
-            QSet<QString> identityAclTokenSet = info.accessControlList().toSet();
-            QSet<QString> paramsTokenSet = clientTokenSet.intersect(identityAclTokenSet);
-
-            if (!paramsTokenSet.isEmpty()) {
-                QStringList tokenList = paramsTokenSet.toList();
-                parameters[SSO_ACCESS_CONTROL_TOKENS] = tokenList;
+            /* Temporary fix - keep it until session core refactoring is complete and auth cache
+             * will be dumped in the secrets db. */
+            if (parameters[SSO_KEY_PASSWORD].toString().isEmpty()) {
+                AuthCache *cache = AuthCoreCache::instance()->data(info.id());
+                if (cache != 0) {
+                    TRACE() << "Using cached secret.";
+                    parameters[SSO_KEY_PASSWORD] = cache->password();
+                } else {
+                    TRACE() << "Secrets storage not available and authentication "
+                               "cache is empty - if SSO requires a password, "
+                               "auth. will fail.";
+                }
             }
-        } else {
-            BLAME() << "Error occurred while getting data from credentials database.";
         }
-
-        QVariantMap storedParams;
-        if (db->isSecretsDBOpen()) {
-            storedParams = db->loadData(m_id, m_method);
+        //database overrules over sessiondata for validated username,
+        //so that identity cannot be misused
+        if (info.validated() || !parameters.contains(SSO_KEY_USERNAME)) {
+            parameters[SSO_KEY_USERNAME] = info.userName();
         }
-        /* Temporary fix - keep it until session core refactoring is complete and auth cache
-         * will be dumped in the secrets db. */
-        if (storedParams.isEmpty()) {
-            AuthCache *cache = AuthCoreCache::instance()->data(info.id());
-            if (cache != 0) {
-                TRACE() << "Using cached BLOB data.";
-                storedParams = cache->blobData();
-            }
+
+        pid_t pid = pidOfContext(data.m_conn, data.m_msg);
+        QSet<QString> clientTokenSet = AccessControlManager::accessTokens(pid).toSet();
+        QSet<QString> identityAclTokenSet = info.accessControlList().toSet();
+        QSet<QString> paramsTokenSet = clientTokenSet.intersect(identityAclTokenSet);
+
+        if (!paramsTokenSet.isEmpty()) {
+            QStringList tokenList = paramsTokenSet.toList();
+            parameters[SSO_ACCESS_CONTROL_TOKENS] = tokenList;
         }
+    } else {
+        BLAME() << "Error occurred while getting data from credentials database.";
+    }
 
-        //parameters will overwrite any common keys on stored params
-        parameters = mergeVariantMaps(storedParams, parameters);
+    QVariantMap storedParams = job->m_data;
+    /* Temporary fix - keep it until session core refactoring is complete and auth cache
+     * will be dumped in the secrets db. */
+    if (storedParams.isEmpty()) {
+        AuthCache *cache = AuthCoreCache::instance()->data(info.id());
+        if (cache != 0) {
+            TRACE() << "Using cached BLOB data.";
+            storedParams = cache->blobData();
+        }
     }
 
+    //parameters will overwrite any common keys on stored params
+    parameters = mergeVariantMaps(storedParams, parameters);
+
+    processRequest(request, parameters);
+}
+
+void SignonSessionCore::processRequest(ActiveRequest *request, QVariantMap parameters)
+{
+    RequestData data = request->m_data;
+    PluginProxy *plugin = request->m_plugin;
+
     if (parameters.contains(SSOUI_KEY_UIPOLICY)
         && parameters[SSOUI_KEY_UIPOLICY] == RequestPasswordPolicy) {
 
@@ -484,24 +951,18 @@ void SignonSessionCore::startProcess()
 
     /* Temporary caching, if credentials are valid
      * this data will be effectively cached */
-    m_tmpUsername = parameters[SSO_KEY_USERNAME].toString();
-    m_tmpPassword = parameters[SSO_KEY_PASSWORD].toString();
+    request->m_tmpUsername = parameters[SSO_KEY_USERNAME].toString();
+    request->m_tmpPassword = parameters[SSO_KEY_PASSWORD].toString();
 
     if (parameters.contains(SSO_KEY_KEEPALIVE)) {
         setAutoDestruct(!parameters[SSO_KEY_KEEPALIVE].toBool());
     }
 
-    if (!m_plugin->process(data.m_cancelKey, parameters, data.m_mechanism)) {
+    if (!plugin->process(data.m_cancelKey, parameters, data.m_mechanism)) {
         QDBusMessage errReply = data.m_msg.createErrorReply(SIGNOND_RUNTIME_ERR_NAME,
                                                             SIGNOND_RUNTIME_ERR_STR);
         data.m_conn.send(errReply);
-        m_listOfRequests.removeFirst();
-
-        if (m_id)
-            removeFromQueueOfRequestsByIdentity(m_id, this);
-        else
-            QMetaObject::invokeMethod(this, "startNewRequest", Qt::QueuedConnection);
-
+        finishRequest(request);
     } else
         stateChangedSlot(data.m_cancelKey, SignOn::SessionStarted, QLatin1String("The request is started successfully"));
 }
@@ -619,116 +1080,99 @@ void SignonSessionCore::replyError(const QDBusConnection &conn, const QDBusMessa
     conn.send(errReply);
 }
 
-void SignonSessionCore::processStoreOperation(const StoreOperation &operation)
+void SignonSessionCore::checkStoreOperation(const StoreOperation &operation,
+                                            bool queryCredsUiDisplayed)
 {
-    TRACE() << "Processing store operation.";
-    CredentialsDB *db = CredentialsAccessManager::instance()->credentialsDB();
+    CredentialsDBThread *db = CredentialsAccessManager::instance()->credentialsDB();
     Q_ASSERT(db != 0);
 
-    if (operation.m_storeType != StoreOperation::Blob) {
-
-        SignonIdentityInfo info = operation.m_info;
-
-        QVariantMap data = operation.m_credsData;
-
-        //allow update only for not validated username
-        if (!info.validated()
-                && data.contains(SSO_KEY_USERNAME)
-                && !data[SSO_KEY_USERNAME].toString().isEmpty())
-            info.setUserName(data[SSO_KEY_USERNAME].toString());
-
-        if (!m_passwordUpdate.isEmpty())
-            info.setPassword(m_passwordUpdate);
-
-        if (data.contains(SSO_KEY_PASSWORD)
-            && !data[SSO_KEY_PASSWORD].toString().isEmpty())
-            info.setPassword(data[SSO_KEY_PASSWORD].toString());
+    db->post(new StoreCheckJob(this, operation, queryCredsUiDisplayed));
+}
 
-        info.setValidated(true);
+void SignonSessionCore::queueStoreOperation(const StoreOperation &operation)
+{
+    TRACE() << "Secure storage not available. Queueing store operations.";
+    m_storeQueue.enqueue(operation);
+
+    SecureStorageEvent *event =
+        new SecureStorageEvent(
+            (QEvent::Type)SIGNON_SECURE_STORAGE_NOT_AVAILABLE);
+    event->m_sender = static_cast<QObject *>(this);
+
+    QCoreApplication::postEvent(
+        CredentialsAccessManager::instance(),
+        event,
+        Qt::HighEventPriority);
+}
 
-        if (!(db->updateCredentials(info))) {
-            BLAME() << "Error occured while updating credentials.";
-        }
+void SignonSessionCore::processStoreOperation(quint32 id,
+                                              const StoreOperation &operation)
+{
+    TRACE() << "Processing store operation.";
+    CredentialsDBThread *db = CredentialsAccessManager::instance()->credentialsDB();
+    Q_ASSERT(db != 0);
 
+    /* The operations are run by the storage thread: their errors are only
+     * logged */
+    if (operation.m_storeType != StoreOperation::Blob) {
+        db->post(new CredentialsStoreJob(id, operation));
     } else {
         TRACE() << "Processing --- StoreOperation::Blob";
 
-        if(!db->storeData(m_id,
-                          operation.m_authMethod,
-                          operation.m_blobData)) {
-            BLAME() << "Error occured while storing data.";
-        }
+        CredentialsDBJob *job = new CredentialsDBJob(CredentialsDBJob::StoreData);
+        job->m_id = id;
+        job->m_method = operation.m_authMethod;
+        job->m_data = operation.m_blobData;
+        db->post(job);
     }
 }
 
 void SignonSessionCore::processResultReply(const QString &cancelKey, const QVariantMap &data)
 {
     TRACE();
+    TRACE_EVENT("result", m_id, m_activeRequests.count());
 
     keepInUse();
 
-    if (!m_listOfRequests.size())
+    ActiveRequest *request = activeRequest(cancelKey);
+    if (request == NULL)
         return;
 
-    RequestData rd = m_listOfRequests.dequeue();
+    RequestData rd = request->m_data;
 
-    if (cancelKey != m_canceled) {
-        QVariantList arguments;
+    if (!request->m_canceled) {
         QVariantMap filteredData = filterVariantMap(data);
 
         CredentialsAccessManager *camManager = CredentialsAccessManager::instance();
-        CredentialsDB *db = camManager->credentialsDB();
+        CredentialsDBThread *db = camManager->credentialsDB();
         Q_ASSERT(db != 0);
 
         //put temporary password from ui interaction into result if plugin didn't return new password
-        if (!filteredData.contains(SSO_KEY_PASSWORD) && !m_tmpPassword.isEmpty()) {
-            filteredData[SSO_KEY_PASSWORD] = m_tmpPassword;
-            m_tmpPassword.clear();
+        if (!filteredData.contains(SSO_KEY_PASSWORD)
+            && !request->m_tmpPassword.isEmpty()) {
+            filteredData[SSO_KEY_PASSWORD] = request->m_tmpPassword;
+            request->m_tmpPassword.clear();
         }
 
         //update database entry
         if (m_id != SIGNOND_NEW_IDENTITY) {
-            SignonIdentityInfo info = db->credentials(m_id);
-
             StoreOperation storeOp(StoreOperation::Credentials);
             storeOp.m_credsData = filteredData;
-            storeOp.m_info = info;
+            storeOp.m_passwordUpdate = request->m_passwordUpdate;
 
             /* If the credentials are validated, the secrets db is not available and
-             * not authorized keys are available inform the CAM about the situation. */
-            if (info.validated() && !db->isSecretsDBOpen()) {
-                /* Send the storage not available event only if the curent result
-                 * processing is following a previous signon UI query. This is
-                 * to avoid unexpected UI pop-ups.
-                 */
-                if (m_queryCredsUiDisplayed) {
-                    m_storeQueue.enqueue(storeOp);
-
-                    SecureStorageEvent *event =
-                        new SecureStorageEvent(
-                            (QEvent::Type)SIGNON_SECURE_STORAGE_NOT_AVAILABLE);
-
-                    event->m_sender = static_cast<QObject *>(this);
-
-                    QCoreApplication::postEvent(
-                        CredentialsAccessManager::instance(),
-                        event,
-                        Qt::HighEventPriority);
-                }
-            } else {
-                processStoreOperation(storeOp);
-            }
+             * not authorized keys are available inform the CAM about the situation:
+             * the result is replied meanwhile. */
+            checkStoreOperation(storeOp, request->m_queryCredsUiDisplayed);
         }
 
         /* If secrets db not available cache credentials for this session core.
          * Avoid creating an invalid caching record - cache only if the password
          * is not empty. */
-        if (!db->isSecretsDBOpen() && !m_tmpPassword.isEmpty()) {
+        if (!db->isSecretsDBOpen() && !request->m_tmpPassword.isEmpty()) {
             AuthCache *cache = new AuthCache;
-            cache->setUsername(m_tmpUsername);
-            cache->setPassword(m_tmpPassword);
-            m_tmpUsername.clear();
-            m_tmpPassword.clear();
+            cache->setUsername(request->m_tmpUsername);
+            cache->setPassword(request->m_tmpPassword);
             AuthCoreCache::instance()->insert(
                 AuthCoreCache::CacheId(m_id, m_method), cache);
         }
@@ -738,45 +1182,57 @@ void SignonSessionCore::processResultReply(const QString &cancelKey, const QVari
             && filteredData.contains(SSO_KEY_PASSWORD))
             filteredData.remove(SSO_KEY_PASSWORD);
 
-        pid_t pid = pidOfContext(rd.m_conn, rd.m_msg);
-        QVariantMap encodedData(m_encryptor->
-                                encodeVariantMap(filteredData, pid));
-        if (m_encryptor->status() != Encryptor::Ok) {
-            replyError(rd.m_conn,
-                       rd.m_msg,
-                       Error::EncryptionFailure,
-                       QString::fromLatin1("Failed to encrypt outgoing message"));
-        } else {
-            encodedData = filterVariantMap(encodedData);
-            arguments << encodedData;
-            rd.m_conn.send(rd.m_msg.createReply(arguments));
-        }
+        uint expiresIn = filteredData.value(SSO_KEY_RESULTEXPIRESIN).toUInt();
+        if (!rd.m_cacheKey.isEmpty() && expiresIn > 0)
+            AuthCoreCache::instance()->insertResult(
+                AuthCoreCache::CacheId(m_id, m_method),
+                rd.m_cacheKey, filteredData, expiresIn);
 
-        m_canceled = QString();
+        if (!request->m_detached)
+            replyResult(rd, filteredData);
 
-        if (m_watcher && !m_watcher->isFinished()) {
-            m_signonui->cancelUiRequest(rd.m_cancelKey);
-
-            m_watcher->disconnect();
-            m_watcher->deleteLater();
-            m_watcher = 0;
+        if (!rd.m_coalesceKey.isEmpty()) {
+            foreach (RequestData coalesced, m_coalesced.take(rd.m_coalesceKey))
+                replyResult(coalesced, filteredData);
         }
-        m_queryCredsUiDisplayed = false;
     }
-    m_canceled = QString();
-    if (m_id)
-        removeFromQueueOfRequestsByIdentity(m_id, this);
-    else
-        QMetaObject::invokeMethod(this, "startNewRequest", Qt::QueuedConnection);
+
+    finishRequest(request);
+}
+
+void SignonSessionCore::replyResult(const RequestData &rd, const QVariantMap &data)
+{
+    QVariantList arguments;
+
+    /* the result is encrypted for each of the processes it goes to */
+    pid_t pid = pidOfContext(rd.m_conn, rd.m_msg);
+    QVariantMap encodedData(m_encryptor->encodeVariantMap(data, pid));
+    if (m_encryptor->status() != Encryptor::Ok) {
+        replyError(rd.m_conn,
+                   rd.m_msg,
+                   Error::EncryptionFailure,
+                   QString::fromLatin1("Failed to encrypt outgoing message"));
+    } else {
+        encodedData = filterVariantMap(encodedData);
+        arguments << encodedData;
+        rd.m_conn.send(rd.m_msg.createReply(arguments));
+    }
 }
 
 void SignonSessionCore::processStore(const QString &cancelKey, const QVariantMap &data)
 {
-    Q_UNUSED(cancelKey);
     TRACE();
 
     keepInUse();
-    m_passwordUpdate.clear();
+
+    ActiveRequest *request = activeRequest(cancelKey);
+    bool queryCredsUiDisplayed = false;
+    if (request != NULL) {
+        queryCredsUiDisplayed = request->m_queryCredsUiDisplayed;
+        request->m_passwordUpdate.clear();
+        request->m_queryCredsUiDisplayed = false;
+    }
+
     if (m_id == SIGNOND_NEW_IDENTITY) {
         BLAME() << "Cannot store without identity";
         return;
@@ -788,7 +1244,7 @@ void SignonSessionCore::processStore(const QString &cancelKey, const QVariantMap
     filteredData.remove(SSO_ACCESS_CONTROL_TOKENS);
 
     //store data into db
-    CredentialsDB *db = CredentialsAccessManager::instance()->credentialsDB();
+    CredentialsDBThread *db = CredentialsAccessManager::instance()->credentialsDB();
     Q_ASSERT(db != NULL);
 
     StoreOperation storeOp(StoreOperation::Blob);
@@ -797,29 +1253,7 @@ void SignonSessionCore::processStore(const QString &cancelKey, const QVariantMap
 
     /* If the credentials are validated, the secrets db is not available and
      * not authorized keys are available inform the CAM about the situation. */
-    SignonIdentityInfo info = db->credentials(m_id);
-    if (info.validated() && !db->isSecretsDBOpen()) {
-        /* Send the storage not available event only if the curent store
-         * processing is following a previous signon UI query. This is to avoid
-         * unexpected UI pop-ups.
-         */
-        if (m_queryCredsUiDisplayed) {
-            TRACE() << "Secure storage not available. Queueing store operations.";
-            m_storeQueue.enqueue(storeOp);
-
-            SecureStorageEvent *event =
-                new SecureStorageEvent(
-                    (QEvent::Type)SIGNON_SECURE_STORAGE_NOT_AVAILABLE);
-            event->m_sender = static_cast<QObject *>(this);
-
-            QCoreApplication::postEvent(
-                CredentialsAccessManager::instance(),
-                event,
-                Qt::HighEventPriority);
-        }
-    } else {
-        processStoreOperation(storeOp);
-    }
+    checkStoreOperation(storeOp, queryCredsUiDisplayed);
 
     /* If secrets db not available cache credentials for this session core.
      * Avoid creating an invalid caching record - cache only if the BLOB data
@@ -831,7 +1265,6 @@ void SignonSessionCore::processStore(const QString &cancelKey, const QVariantMap
         AuthCoreCache::instance()->insert(
             AuthCoreCache::CacheId(m_id, m_method), cache);
     }
-    m_queryCredsUiDisplayed = false;
 
     return;
 }
@@ -842,37 +1275,74 @@ void SignonSessionCore::processUiRequest(const QString &cancelKey, const QVarian
 
     keepInUse();
 
-    if (cancelKey != m_canceled && m_listOfRequests.size()) {
-        QString uiRequestId = m_listOfRequests.head().m_cancelKey;
+    ActiveRequest *request = activeRequest(cancelKey);
+    if (request != NULL)
+        showUi(request, data, false);
+}
 
-        if (m_watcher) {
-            if (!m_watcher->isFinished())
-                m_signonui->cancelUiRequest(uiRequestId);
+void SignonSessionCore::processRefreshRequest(const QString &cancelKey, const QVariantMap &data)
+{
+    TRACE();
 
-            m_watcher->disconnect();
-            m_watcher->deleteLater();
-            m_watcher = 0;
-        }
+    keepInUse();
+
+    ActiveRequest *request = activeRequest(cancelKey);
+    if (request != NULL)
+        showUi(request, data, true);
+}
 
-        m_listOfRequests.head().m_params = filterVariantMap(data);
-        m_listOfRequests.head().m_params[SSOUI_KEY_REQUESTID] = uiRequestId;
+void SignonSessionCore::showUi(ActiveRequest *request,
+                               const QVariantMap &data,
+                               bool refresh)
+{
+    if (request->m_canceled)
+        return;
+
+    /* One dialog at a time: for the session core, and for the identity */
+    if ((m_watcher && m_uiRequest != request)
+        || (m_id && !acquireUiOfIdentity(m_id, this))) {
+        TRACE() << "Waiting for the UI to be released";
+        request->m_hasPendingUi = true;
+        request->m_pendingUiData = data;
+        request->m_pendingUiRefresh = refresh;
+        return;
+    }
+
+    QString uiRequestId = request->m_data.m_cancelKey;
+    QVariantMap &params = request->m_data.m_params;
+
+    if (m_watcher) {
+        if (!m_watcher->isFinished())
+            m_signonui->cancelUiRequest(uiRequestId);
+
+        m_watcher->disconnect();
+        m_watcher->deleteLater();
+        m_watcher = 0;
+    }
+
+    params = filterVariantMap(data);
+
+    if (refresh) {
+        m_watcher = new QDBusPendingCallWatcher(m_signonui->refreshDialog(params),
+                                                this);
+    } else {
+        params[SSOUI_KEY_REQUESTID] = uiRequestId;
 
         if (m_id == SIGNOND_NEW_IDENTITY)
-            m_listOfRequests.head().m_params[SSOUI_KEY_STORED_IDENTITY] = false;
+            params[SSOUI_KEY_STORED_IDENTITY] = false;
         else
-            m_listOfRequests.head().m_params[SSOUI_KEY_STORED_IDENTITY] = true;
+            params[SSOUI_KEY_STORED_IDENTITY] = true;
 
         CredentialsAccessManager *camManager = CredentialsAccessManager::instance();
-        CredentialsDB *db = camManager->credentialsDB();
+        CredentialsDBThread *db = camManager->credentialsDB();
         Q_ASSERT(db != 0);
 
         //check that we have caption
         if (!data.contains(SSO_KEY_CAPTION)) {
             TRACE() << "Caption missing";
             if (m_id != SIGNOND_NEW_IDENTITY) {
-                SignonIdentityInfo info = db->credentials(m_id);
-                m_listOfRequests.head().m_params.insert(SSO_KEY_CAPTION, info.caption());
-                TRACE() << "Got caption: " << info.caption();
+                params.insert(SSO_KEY_CAPTION, request->m_caption);
+                TRACE() << "Got caption: " << request->m_caption;
             }
         }
 
@@ -886,78 +1356,52 @@ void SignonSessionCore::processUiRequest(const QString &cancelKey, const QVarian
             if (!camManager->keysAvailable()) {
                 TRACE() << "Secrets DB not available."
                         << "CAM has no keys available. Informing signon-ui.";
-                m_listOfRequests.head().m_params[
-                    SSOUI_KEY_STORAGE_KEYS_UNAVAILABLE] = true;
+                params[SSOUI_KEY_STORAGE_KEYS_UNAVAILABLE] = true;
             }
         }
 
-        m_watcher = new QDBusPendingCallWatcher(m_signonui->queryDialog(m_listOfRequests.head().m_params),
+        m_watcher = new QDBusPendingCallWatcher(m_signonui->queryDialog(params),
                                                 this);
-        connect(m_watcher, SIGNAL(finished(QDBusPendingCallWatcher*)), this, SLOT(queryUiSlot(QDBusPendingCallWatcher*)));
     }
-}
-
-void SignonSessionCore::processRefreshRequest(const QString &cancelKey, const QVariantMap &data)
-{
-    TRACE();
 
-    keepInUse();
-
-    if (cancelKey != m_canceled && m_listOfRequests.size()) {
-        QString uiRequestId = m_listOfRequests.head().m_cancelKey;
-
-        if (m_watcher) {
-            if (!m_watcher->isFinished())
-                m_signonui->cancelUiRequest(uiRequestId);
-
-            m_watcher->disconnect();
-            m_watcher->deleteLater();
-            m_watcher = 0;
-        }
-
-        m_listOfRequests.head().m_params = filterVariantMap(data);
-        m_watcher = new QDBusPendingCallWatcher(m_signonui->refreshDialog(m_listOfRequests.head().m_params),
-                                                this);
-        connect(m_watcher, SIGNAL(finished(QDBusPendingCallWatcher*)), this, SLOT(queryUiSlot(QDBusPendingCallWatcher*)));
-    }
+    m_uiRequest = request;
+    connect(m_watcher, SIGNAL(finished(QDBusPendingCallWatcher*)), this, SLOT(queryUiSlot(QDBusPendingCallWatcher*)));
 }
 
 void SignonSessionCore::processError(const QString &cancelKey, int err, const QString &message)
 {
     TRACE();
+    TRACE_EVENT("error", m_id, err);
     keepInUse();
-    m_tmpUsername.clear();
-    m_tmpPassword.clear();
 
-    if (!m_listOfRequests.size())
+    ActiveRequest *request = activeRequest(cancelKey);
+    if (request == NULL)
         return;
 
-    RequestData rd = m_listOfRequests.dequeue();
-
-    if (cancelKey != m_canceled) {
-        replyError(rd.m_conn, rd.m_msg, err, message);
+    if (!request->m_canceled) {
+        const RequestData &rd = request->m_data;
+        if (!request->m_detached)
+            replyError(rd.m_conn, rd.m_msg, err, message);
 
-        if (m_watcher && !m_watcher->isFinished()) {
-            m_signonui->cancelUiRequest(rd.m_cancelKey);
-
-            m_watcher->disconnect();
-            m_watcher->deleteLater();
-            m_watcher = 0;
+        if (!rd.m_coalesceKey.isEmpty()) {
+            foreach (RequestData coalesced, m_coalesced.take(rd.m_coalesceKey))
+                replyError(coalesced.m_conn, coalesced.m_msg, err, message);
         }
     }
 
-    m_canceled = QString();
-    if (m_id)
-        removeFromQueueOfRequestsByIdentity(m_id, this);
-    else
-        QMetaObject::invokeMethod(this, "startNewRequest", Qt::QueuedConnection);
+    finishRequest(request);
 }
 
 void SignonSessionCore::stateChangedSlot(const QString &cancelKey, int state, const QString &message)
 {
-    if (cancelKey != m_canceled && m_listOfRequests.size()) {
-        RequestData rd = m_listOfRequests.head();
-        emit stateChanged(rd.m_cancelKey, (int)state, message);
+    ActiveRequest *request = activeRequest(cancelKey);
+    if (request != NULL && !request->m_canceled) {
+        if (!request->m_detached)
+            emit stateChanged(request->m_data.m_cancelKey, (int)state, message);
+
+        foreach (RequestData coalesced,
+                 m_coalesced.value(request->m_data.m_coalesceKey))
+            emit stateChanged(coalesced.m_cancelKey, (int)state, message);
     }
 
     keepInUse();
@@ -980,7 +1424,7 @@ void SignonSessionCore::customEvent(QEvent *event)
 
         TRACE() << "Processing queued stored operations.";
         while (!m_storeQueue.empty()) {
-            processStoreOperation(m_storeQueue.dequeue());
+            processStoreOperation(m_id, m_storeQueue.dequeue());
         }
     } else if (event->type() == SIGNON_SECURE_STORAGE_NOT_AVAILABLE) {
         TRACE() << "Secure storage still not available. "
@@ -996,12 +1440,13 @@ void SignonSessionCore::queryUiSlot(QDBusPendingCallWatcher *call)
     keepInUse();
 
     //we should not do anything if the cancellation did not stop the Ui response.
-    if (m_watcher == NULL || m_listOfRequests.size() == 0)
+    ActiveRequest *request = m_uiRequest;
+    if (m_watcher == NULL || request == NULL)
         return;
 
     QDBusPendingReply<QVariantMap> reply = *call;
     bool isRequestToRefresh = false;
-    Q_ASSERT_X( m_listOfRequests.size() != 0, __func__, "queue of requests is empty");
+    QVariantMap &params = request->m_data.m_params;
 
     if (!reply.isError() && reply.count()) {
         QVariantMap resultParameters = reply.argumentAt<0>();
@@ -1010,57 +1455,72 @@ void SignonSessionCore::queryUiSlot(QDBusPendingCallWatcher *call)
             resultParameters.remove(SSOUI_KEY_REFRESH);
         }
 
-         m_listOfRequests.head().m_params = resultParameters;
+        params = resultParameters;
 
         /* If the query ui was canceled or any other error occurred
          * do not set this flag to true. */
         if (resultParameters.contains(SSOUI_KEY_ERROR)
             && (resultParameters[SSOUI_KEY_ERROR] == QUERY_ERROR_CANCELED)) {
 
-            m_queryCredsUiDisplayed = false;
+            request->m_queryCredsUiDisplayed = false;
         } else {
-            m_queryCredsUiDisplayed = true;
+            request->m_queryCredsUiDisplayed = true;
         }
     } else {
-        m_listOfRequests.head().m_params.insert(SSOUI_KEY_ERROR, (int)SignOn::QUERY_ERROR_NO_SIGNONUI);
+        params.insert(SSOUI_KEY_ERROR, (int)SignOn::QUERY_ERROR_NO_SIGNONUI);
     }
 
-    if (m_listOfRequests.head().m_cancelKey != m_canceled) {
+    if (!request->m_canceled) {
         /* Temporary caching, if credentials are valid
          * this data will be effectively cached */
-        m_tmpUsername = m_listOfRequests.head().m_params.value(
-            SSO_KEY_USERNAME, QVariant()).toString();
-        m_tmpPassword = m_listOfRequests.head().m_params.value(
-            SSO_KEY_PASSWORD, QVariant()).toString();
+        request->m_tmpUsername = params.value(SSO_KEY_USERNAME, QVariant()).toString();
+        request->m_tmpPassword = params.value(SSO_KEY_PASSWORD, QVariant()).toString();
 
         if (isRequestToRefresh) {
             TRACE() << "REFRESH IS REQUIRED";
 
-            m_listOfRequests.head().m_params.remove(SSOUI_KEY_REFRESH);
-            m_plugin->processRefresh(m_listOfRequests.head().m_cancelKey,
-                                     m_listOfRequests.head().m_params);
+            params.remove(SSOUI_KEY_REFRESH);
+            request->m_plugin->processRefresh(request->m_data.m_cancelKey, params);
         } else {
-            if (m_listOfRequests.head().m_params.contains(SSO_KEY_PASSWORD))
-                m_passwordUpdate = m_listOfRequests.head().m_params[SSO_KEY_PASSWORD].toString();
-            m_plugin->processUi(m_listOfRequests.head().m_cancelKey,
-                                m_listOfRequests.head().m_params);
+            if (params.contains(SSO_KEY_PASSWORD))
+                request->m_passwordUpdate = params[SSO_KEY_PASSWORD].toString();
+            request->m_plugin->processUi(request->m_data.m_cancelKey, params);
         }
     }
 
     m_watcher->disconnect();
     m_watcher->deleteLater();
     m_watcher = 0;
+    m_uiRequest = 0;
+
+    showPendingUi();
 }
 
-void SignonSessionCore::addToQueueOfRequestsByIdentity(quint32 id, SignonSessionCore *core) {
-    TRACE();
+void SignonSessionCore::showPendingUi()
+{
+    /* a dialog is being shown: wait for it to be closed */
+    if (m_watcher != NULL)
+        return;
+
+    foreach (ActiveRequest *request, m_activeRequests) {
+        if (!request->m_hasPendingUi)
+            continue;
 
-    if (!queuesOfRequestsByIdentity.contains(id)) {
-        QQueue<SignonSessionCore *> queue;
-        queuesOfRequestsByIdentity.insert(id, queue);
+        request->m_hasPendingUi = false;
+        QVariantMap data = request->m_pendingUiData;
+        request->m_pendingUiData.clear();
+        showUi(request, data, request->m_pendingUiRefresh);
+        return;
     }
 
-    queuesOfRequestsByIdentity[id].enqueue(core);
+    if (m_id)
+        releaseUiOfIdentity(m_id, this);
+}
+
+void SignonSessionCore::addToQueueOfRequestsByIdentity(quint32 id, SignonSessionCore *core) {
+    TRACE();
+
+    queuesOfRequestsByIdentity[id].waiting.enqueue(core);
 }
 
 void SignonSessionCore::removeFromQueueOfRequestsByIdentity(quint32 id, SignonSessionCore *core)
@@ -1069,15 +1529,23 @@ void SignonSessionCore::removeFromQueueOfRequestsByIdentity(quint32 id, SignonSe
     if (!queuesOfRequestsByIdentity.contains(id))
         return;
 
-    TRACE();
-    QQueue<SignonSessionCore *> queue = queuesOfRequestsByIdentity[id];
-    if (queue.isEmpty())
+    if (!queuesOfRequestsByIdentity[id].running.removeOne(core))
         return;
 
-    if (queue.head() != core)
+    wakeUpQueueOfRequestsByIdentity(id);
+}
+
+void SignonSessionCore::dropFromQueueOfRequestsByIdentity(quint32 id, SignonSessionCore *core)
+{
+    TRACE() << id;
+    if (!queuesOfRequestsByIdentity.contains(id))
         return;
 
-    queuesOfRequestsByIdentity[id].removeOne(core);
+    IdentityRequests &requests = queuesOfRequestsByIdentity[id];
+    requests.waiting.removeAll(core);
+    requests.running.removeAll(core);
+
+    releaseUiOfIdentity(id, core);
     wakeUpQueueOfRequestsByIdentity(id);
 }
 
@@ -1087,18 +1555,330 @@ void SignonSessionCore::wakeUpQueueOfRequestsByIdentity(quint32 id) {
     if (!queuesOfRequestsByIdentity.contains(id))
         return;
 
-    QQueue<SignonSessionCore *> queue = queuesOfRequestsByIdentity[id];
+    IdentityRequests &requests = queuesOfRequestsByIdentity[id];
+
+    if (requests.waiting.isEmpty()) {
+        if (requests.running.isEmpty() && requests.uiOwner == 0)
+            queuesOfRequestsByIdentity.remove(id);
+        return;
+    }
+
+    TRACE() << requests.waiting.size() << requests.running.size();
+
+    foreach (SignonSessionCore *core, requests.running) {
+        if (exclusiveMethods.contains(core->m_method))
+            return;
+    }
+
+    int i = 0;
+    while (i < requests.waiting.size()) {
+        SignonSessionCore *core = requests.waiting.at(i);
+
+        /* a session core processes as many requests as its plugins can */
+        if (requests.running.count(core) >= core->maxRequests()) {
+            i++;
+            continue;
+        }
+
+        if (exclusiveMethods.contains(core->m_method)) {
+            /* the requests which came later don't overtake this one */
+            if (!requests.running.isEmpty())
+                break;
+        }
+
+        requests.waiting.removeAt(i);
+        requests.running.append(core);
+        QMetaObject::invokeMethod(core, "startNewRequest", Qt::QueuedConnection);
+
+        if (exclusiveMethods.contains(core->m_method))
+            break;
+    }
+}
+
+int SignonSessionCore::runningRequestsOfIdentity(quint32 id, SignonSessionCore *core)
+{
+    if (!queuesOfRequestsByIdentity.contains(id))
+        return 0;
+
+    return queuesOfRequestsByIdentity[id].running.count(core);
+}
+
+bool SignonSessionCore::acquireUiOfIdentity(quint32 id, SignonSessionCore *core)
+{
+    IdentityRequests &requests = queuesOfRequestsByIdentity[id];
+
+    if (requests.uiOwner == 0 || requests.uiOwner == core) {
+        requests.uiOwner = core;
+        return true;
+    }
+
+    if (!requests.waitingForUi.contains(core))
+        requests.waitingForUi.enqueue(core);
 
-    if (queue.isEmpty())
+    return false;
+}
+
+void SignonSessionCore::releaseUiOfIdentity(quint32 id, SignonSessionCore *core)
+{
+    if (!queuesOfRequestsByIdentity.contains(id))
         return;
 
-    TRACE() << queue.size();
+    IdentityRequests &requests = queuesOfRequestsByIdentity[id];
+    requests.waitingForUi.removeAll(core);
 
-    SignonSessionCore *core = queue.head();
-    if (!core)
+    if (requests.uiOwner != core)
         return;
 
-    QMetaObject::invokeMethod(core, "startNewRequest", Qt::QueuedConnection);
+    requests.uiOwner = 0;
+    if (!requests.waitingForUi.isEmpty()) {
+        requests.uiOwner = requests.waitingForUi.dequeue();
+        QMetaObject::invokeMethod(requests.uiOwner, "showPendingUi",
+                                  Qt::QueuedConnection);
+    }
+}
+
+void SignonSessionCore::retryPluginInstances()
+{
+    TRACE() << m_method;
+    m_pluginInstanceFailed = false;
+    startNewRequest();
+}
+
+int SignonSessionCore::maxRequests() const
+{
+    if (exclusiveMethods.contains(m_method))
+        return 1;
+
+    /* each plugin process takes as many requests as its plugin declares */
+    int pluginRequests = m_plugin ? m_plugin->maxConcurrentRequests() : 1;
+    return maxPluginInstances(m_method) * pluginRequests;
+}
+
+int SignonSessionCore::grantedRequests()
+{
+    /* the requests on stored identities wait for their turn */
+    if (m_id)
+        return runningRequestsOfIdentity(m_id, this);
+
+    return maxRequests();
+}
+
+SignonSessionCore::ActiveRequest *SignonSessionCore::activeRequest(const QString &cancelKey) const
+{
+    foreach (ActiveRequest *request, m_activeRequests) {
+        if (request->m_data.m_cancelKey == cancelKey)
+            return request;
+    }
+
+    return NULL;
+}
+
+QByteArray SignonSessionCore::requestKey(const QDBusConnection &connection,
+                                         const QDBusMessage &message,
+                                         const QVariantMap &params,
+                                         const QString &mechanism) const
+{
+    /* The requests carrying a secret are checked by the plugin one by one */
+    if (m_id == 0
+        || params.contains(SSO_KEY_PASSWORD)
+        || !isComparable(params))
+        return QByteArray();
+
+    /* The parameters which don't change the result are left out */
+    QVariantMap normalizedParams(params);
+    normalizedParams.remove(SSO_KEY_CACHEPOLICY);
+    normalizedParams.remove(SSO_KEY_KEEPALIVE);
+    normalizedParams.remove(SSO_KEY_CAPTION);
+    normalizedParams.remove(SSO_KEY_WINDOWID);
+    normalizedParams.remove(SSO_KEY_NETWORKTIMEOUT);
+
+    /* The access control tokens of the caller end up in the parameters
+     * given to the plugin: the requests share them as well */
+    QStringList tokens =
+        AccessControlManager::accessTokens(pidOfContext(connection, message));
+    tokens.sort();
+
+    QByteArray key;
+    QDataStream stream(&key, QIODevice::WriteOnly);
+    stream << mechanism << normalizedParams << tokens;
+    return key;
+}
+
+bool SignonSessionCore::isPending(const QString &cancelKey) const
+{
+    if (activeRequest(cancelKey) != NULL || isCoalesced(cancelKey))
+        return true;
+
+    foreach (RequestData rd, m_listOfRequests) {
+        if (rd.m_cancelKey == cancelKey)
+            return true;
+    }
+
+    return false;
+}
+
+bool SignonSessionCore::hasCoalescingLeader(const QByteArray &coalesceKey) const
+{
+    foreach (ActiveRequest *request, m_activeRequests) {
+        if (request->m_data.m_coalesceKey == coalesceKey && !request->m_canceled)
+            return true;
+    }
+
+    foreach (RequestData rd, m_listOfRequests) {
+        if (rd.m_coalesceKey == coalesceKey)
+            return true;
+    }
+
+    return false;
+}
+
+bool SignonSessionCore::isCoalesced(const QString &cancelKey) const
+{
+    foreach (QList<RequestData> coalesced, m_coalesced) {
+        foreach (RequestData rd, coalesced) {
+            if (rd.m_cancelKey == cancelKey)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+bool SignonSessionCore::cancelCoalesced(const QString &cancelKey)
+{
+    QMutableHashIterator<QByteArray, QList<RequestData> > it(m_coalesced);
+    while (it.hasNext()) {
+        it.next();
+        QList<RequestData> &coalesced = it.value();
+
+        for (int i = 0; i < coalesced.count(); i++) {
+            if (coalesced.at(i).m_cancelKey != cancelKey)
+                continue;
+
+            RequestData rd(coalesced.takeAt(i));
+            QDBusMessage errReply = rd.m_msg.createErrorReply(SIGNOND_SESSION_CANCELED_ERR_NAME,
+                                                             SIGNOND_SESSION_CANCELED_ERR_STR);
+            rd.m_conn.send(errReply);
+
+            if (coalesced.isEmpty()) {
+                QByteArray key = it.key();
+                it.remove();
+
+                /* nobody is waiting anymore for a request its caller canceled */
+                foreach (ActiveRequest *request, m_activeRequests) {
+                    if (request->m_detached && !request->m_canceled
+                        && request->m_data.m_coalesceKey == key)
+                        cancelActiveRequest(request);
+                }
+            }
+
+            /* the next request of the session can be processed */
+            QMetaObject::invokeMethod(this, "startNewRequest", Qt::QueuedConnection);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void SignonSessionCore::cancelActiveRequest(ActiveRequest *request)
+{
+    request->m_canceled = true;
+    request->m_hasPendingUi = false;
+    /* The requests still loading their data are finished once loaded */
+    if (!request->m_loading)
+        request->m_plugin->cancel(request->m_data.m_cancelKey);
+
+    if (m_uiRequest == request) {
+        if (m_watcher && !m_watcher->isFinished())
+            m_signonui->cancelUiRequest(request->m_data.m_cancelKey);
+
+        if (m_watcher) {
+            m_watcher->disconnect();
+            m_watcher->deleteLater();
+            m_watcher = 0;
+        }
+        m_uiRequest = 0;
+        QMetaObject::invokeMethod(this, "showPendingUi", Qt::QueuedConnection);
+    }
+}
+
+PluginProxy *SignonSessionCore::idlePlugin()
+{
+    bool starting = false;
+
+    foreach (PluginProxy *plugin, m_plugins) {
+        int load = 0;
+        foreach (ActiveRequest *request, m_activeRequests) {
+            if (request->m_plugin == plugin)
+                load++;
+        }
+        if (load >= plugin->maxConcurrentRequests())
+            continue;
+
+        if (plugin->isStarted())
+            return plugin;
+
+        plugin->start();
+        starting = true;
+    }
+
+    int maxPlugins = exclusiveMethods.contains(m_method) ?
+        1 : maxPluginInstances(m_method);
+    if (starting
+        || m_pluginInstanceFailed
+        || m_plugins.count() >= maxPlugins)
+        return NULL;
+
+    /* Start one more plugin process: the request will be processed by the
+     * first process to become available */
+    TRACE() << "Starting plugin process" << m_plugins.count() + 1 << "of type" << m_method;
+    PluginProxy *plugin = PluginProxy::requestPluginProxy(m_method);
+    if (plugin == NULL)
+        return NULL;
+
+    connectPlugin(plugin);
+    m_plugins.append(plugin);
+
+    if (plugin->isStarted())
+        return plugin;
+
+    plugin->start();
+    return NULL;
+}
+
+void SignonSessionCore::finishRequest(ActiveRequest *request)
+{
+    m_activeRequests.removeOne(request);
+
+    /* the coalesced requests which got no reply share the failure */
+    if (!request->m_data.m_coalesceKey.isEmpty()) {
+        foreach (RequestData rd, m_coalesced.take(request->m_data.m_coalesceKey)) {
+            QDBusMessage errReply = rd.m_msg.createErrorReply(SIGNOND_RUNTIME_ERR_NAME,
+                                                             SIGNOND_RUNTIME_ERR_STR);
+            rd.m_conn.send(errReply);
+        }
+    }
+
+    if (m_uiRequest == request) {
+        if (m_watcher) {
+            if (!m_watcher->isFinished())
+                m_signonui->cancelUiRequest(request->m_data.m_cancelKey);
+
+            m_watcher->disconnect();
+            m_watcher->deleteLater();
+            m_watcher = 0;
+        }
+        m_uiRequest = 0;
+        QMetaObject::invokeMethod(this, "showPendingUi", Qt::QueuedConnection);
+    }
+
+    delete request;
+
+    if (m_id)
+        removeFromQueueOfRequestsByIdentity(m_id, this);
+
+    QMetaObject::invokeMethod(this, "startNewRequest", Qt::QueuedConnection);
 }
 
 void SignonSessionCore::startNewRequest()
@@ -1106,28 +1886,60 @@ void SignonSessionCore::startNewRequest()
     TRACE();
 
     keepInUse();
-    bool processShouldBeStarted = true;
 
-    if (!m_listOfRequests.length()) {
+    if (m_listOfRequests.isEmpty()) {
         TRACE() << "the data queue is EMPTY!!!";
-        processShouldBeStarted = false;
-    } else if (m_plugin && m_plugin->isProcessing()) {
-        TRACE() << " the plugin is in challenge processing";
-        processShouldBeStarted = false;
-    } else if (m_watcher && !m_watcher->isFinished()) {
-        TRACE() << "watcher is in running mode";
-        processShouldBeStarted = false;
+
+        /* give back the turns granted for requests canceled meanwhile */
+        if (m_id) {
+            while (runningRequestsOfIdentity(m_id, this) > m_activeRequests.count())
+                removeFromQueueOfRequestsByIdentity(m_id, this);
+        }
+        return;
     }
 
-    TRACE() << "Start the authentication process: " << processShouldBeStarted;
+    if (grantedRequests() <= m_activeRequests.count()) {
+        TRACE() << "waiting for the other requests on the identity";
+        if (m_id && CredentialsAccessManager::instance()->isCredentialsSystemReady())
+            wakeUpQueueOfRequestsByIdentity(m_id);
+        return;
+    }
+
+    if (!m_plugin->isStarted()) {
+        TRACE() << "the plugin process is not started yet";
+        m_plugin->start();
+        return;
+    }
+
+    while (m_activeRequests.count() < grantedRequests()) {
+        /* The requests with the same cancel key come from the same
+         * authentication session: they are processed in order */
+        int requestIndex = 0;
+        for (; requestIndex < m_listOfRequests.count(); requestIndex++) {
+            const QString &cancelKey = m_listOfRequests.at(requestIndex).m_cancelKey;
+            if (activeRequest(cancelKey) == NULL && !isCoalesced(cancelKey))
+                break;
+        }
 
-    if (processShouldBeStarted)
-        startProcess();
+        if (requestIndex == m_listOfRequests.count()) {
+            TRACE() << "the queued requests wait for their session";
+            break;
+        }
+
+        PluginProxy *plugin = idlePlugin();
+        if (plugin == NULL) {
+            TRACE() << "no plugin process is available";
+            break;
+        }
+
+        TRACE() << "Start the authentication process";
+        startProcess(requestIndex, plugin);
+    }
 }
 
 void SignonSessionCore::destroy()
 {
-    if (m_plugin->isProcessing() ||
+    if (!m_activeRequests.isEmpty() ||
         m_watcher != NULL) {
         keepInUse();
         return;
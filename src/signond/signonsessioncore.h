@@ -54,11 +54,54 @@ class SignonDaemon;
         Q_OBJECT
 
     public:
+        /*!
+         * @enum RequestPolicy
+         * How the requests of a method are scheduled among the other requests
+         * on the same identity: concurrent requests run alongside those of
+         * other methods, with only their UI interactions being serialized;
+         * exclusive requests run one at a time, alone on the identity.
+         */
+        enum RequestPolicy {
+            ConcurrentRequests = 0,
+            ExclusiveRequests
+        };
+
+        static void setRequestPolicy(const QString &method, RequestPolicy policy);
+        static RequestPolicy requestPolicy(const QString &method);
+
+        /*!
+         * Sets the maximum number of plugin processes a session core of the
+         * given method uses to process its requests in parallel (1 if not
+         * set); exclusive methods always use only one.
+         */
+        static void setMaxPluginInstances(const QString &method, int max);
+        static int maxPluginInstances(const QString &method);
+
+        /*!
+         * Enables the coalescing of the requests of a method: a request on a
+         * stored identity identical to one already queued or in processing,
+         * and carrying no secret, is not processed on its own but gets a
+         * copy of the result of the other one.
+         */
+        static void setCoalescingEnabled(const QString &method, bool enabled);
+        static bool isCoalescingEnabled(const QString &method);
+
+        /*!
+         * Enables the caching of the results of a method: a result for
+         * which the plugin gives an expiry time is returned to the identical
+         * requests on the stored identity until then, unless their
+         * CachePolicy says otherwise.
+         */
+        static void setResultCacheEnabled(const QString &method, bool enabled);
+        static bool isResultCacheEnabled(const QString &method);
+
         static SignonSessionCore *sessionCore(const quint32 id, const QString &method, SignonDaemon *parent);
         virtual ~SignonSessionCore();
         quint32 id() const;
         QString method() const;
         bool setupPlugin();
+        bool isPluginStarted() const;
+        void startPlugin();
         /*
          * just for any case
          * */
@@ -91,9 +134,12 @@ class SignonDaemon;
 
     Q_SIGNALS:
         void stateChanged(const QString &requestId, int state, const QString &message);
+        void pluginStartupFinished(bool started);
 
     private Q_SLOTS:
         void startNewRequest();
+        void pluginStarted(bool started);
+        void retryPluginInstances();
 
         void processResultReply(const QString &cancelKey, const QVariantMap &data);
         void processStore(const QString &cancelKey, const QVariantMap &data);
@@ -103,6 +149,7 @@ class SignonDaemon;
         void stateChangedSlot(const QString &cancelKey, int state, const QString &message);
 
         void queryUiSlot(QDBusPendingCallWatcher *call);
+        void showPendingUi();
 
     protected:
         SignonSessionCore(quint32 id, const QString &method, int timeout, SignonDaemon *parent);
@@ -113,38 +160,100 @@ class SignonDaemon;
         static void addToQueueOfRequestsByIdentity(quint32 id, SignonSessionCore *core);
         static void removeFromQueueOfRequestsByIdentity(quint32 id, SignonSessionCore *core);
         static void wakeUpQueueOfRequestsByIdentity(quint32 id);
+        static void dropFromQueueOfRequestsByIdentity(quint32 id, SignonSessionCore *core);
+        static int runningRequestsOfIdentity(quint32 id, SignonSessionCore *core);
+        static bool acquireUiOfIdentity(quint32 id, SignonSessionCore *core);
+        static void releaseUiOfIdentity(quint32 id, SignonSessionCore *core);
 
     private:
-        Q_INVOKABLE void startProcess();
+        /*
+         * A request being processed by one of the plugin processes
+         * */
+        struct ActiveRequest
+        {
+            ActiveRequest(const RequestData &data, PluginProxy *plugin);
+
+            RequestData m_data;
+            PluginProxy *m_plugin;
+            bool m_canceled;
+            //canceled by its caller, but still processed for the coalesced ones
+            bool m_detached;
+            //waiting for the stored data, not yet given to the plugin
+            bool m_loading;
+            //caption of the stored identity, loaded along with its data
+            QString m_caption;
+
+            //Temporary caching
+            QString m_tmpUsername;
+            QString m_tmpPassword;
+            QString m_passwordUpdate;
+
+            /* Flag used for handling post ui querying results' processing.
+             * Secure storage not available events won't be posted if the current
+             * session processing was not preceded by a signon UI query credentials
+             * interaction, when this flag is set to true. */
+            bool m_queryCredsUiDisplayed;
+
+            /* UI interaction requested by the plugin while another one was
+             * shown: it is done by showPendingUi() once the UI is released. */
+            bool m_hasPendingUi;
+            QVariantMap m_pendingUiData;
+            bool m_pendingUiRefresh;
+        };
+
+        void connectPlugin(PluginProxy *plugin);
+        PluginProxy *idlePlugin();
+        int maxRequests() const;
+        int grantedRequests();
+        ActiveRequest *activeRequest(const QString &cancelKey) const;
+        void finishRequest(ActiveRequest *request);
+        void showUi(ActiveRequest *request, const QVariantMap &data, bool refresh);
+
+        QByteArray requestKey(const QDBusConnection &connection,
+                              const QDBusMessage &message,
+                              const QVariantMap &params,
+                              const QString &mechanism) const;
+        bool isPending(const QString &cancelKey) const;
+        bool hasCoalescingLeader(const QByteArray &coalesceKey) const;
+        bool isCoalesced(const QString &cancelKey) const;
+        bool cancelCoalesced(const QString &cancelKey);
+        void cancelActiveRequest(ActiveRequest *request);
+        void replyResult(const RequestData &rd, const QVariantMap &data);
+
+        class RequestDataJob;
+        class StoreCheckJob;
+
+        void startProcess(int requestIndex, PluginProxy *plugin);
+        void requestDataLoaded(RequestDataJob *job);
+        void processRequest(ActiveRequest *request, QVariantMap parameters);
         void replyError(const QDBusConnection &conn, const QDBusMessage &msg, int err, const QString &message);
-        void processStoreOperation(const StoreOperation &operation);
+        void checkStoreOperation(const StoreOperation &operation,
+                                 bool queryCredsUiDisplayed);
+        void queueStoreOperation(const StoreOperation &operation);
+        static void processStoreOperation(quint32 id,
+                                          const StoreOperation &operation);
 
     private:
         PluginProxy *m_plugin;
+        QList<PluginProxy *> m_plugins;
+        bool m_pluginInstanceFailed;
+
         QQueue<RequestData> m_listOfRequests;
+        QList<ActiveRequest *> m_activeRequests;
+        //requests waiting for the result of an identical one, by coalesce key
+        QHash<QByteArray, QList<RequestData> > m_coalesced;
         SignonUiAdaptor *m_signonui;
         SignOnCrypto::Encryptor *m_encryptor;
 
         QDBusPendingCallWatcher *m_watcher;
-
-        QString m_canceled;
+        ActiveRequest *m_uiRequest;
 
         quint32 m_id;
         QString m_method;
-        QString m_passwordUpdate;
 
         //Queues store operations when the secure storage is unavailable
         QQueue<StoreOperation> m_storeQueue;
 
-        //Temporary caching
-        QString m_tmpUsername;
-        QString m_tmpPassword;
-
-        /* Flag used for handling post ui querying results' processing.
-         * Secure storage not available events won't be posted if the current
-         * session processing was not preceded by a signon UI query credentials
-         * interaction, when this flag is set to true. */
-        bool m_queryCredsUiDisplayed;
         quint32 m_refCount;
 
         Q_DISABLE_COPY(SignonSessionCore)
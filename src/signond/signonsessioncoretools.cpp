@@ -23,6 +23,7 @@
 
 #include "signonsessioncoretools.h"
 
+#include <QDateTime>
 #include <QDebug>
 #include "signond-common.h"
 
@@ -54,7 +55,7 @@ StoreOperation::StoreOperation(const StoreType type) : m_storeType(type)
 StoreOperation::StoreOperation(const StoreOperation &src)
     : m_storeType(src.m_storeType),
       m_credsData(src.m_credsData),
-      m_info(src.m_info),
+      m_passwordUpdate(src.m_passwordUpdate),
       m_authMethod(src.m_authMethod),
       m_blobData(src.m_blobData)
 {}
@@ -81,7 +82,9 @@ RequestData::RequestData(const RequestData &other)
       m_msg(other.m_msg),
       m_params(other.m_params),
       m_mechanism(other.m_mechanism),
-      m_cancelKey(other.m_cancelKey)
+      m_cancelKey(other.m_cancelKey),
+      m_coalesceKey(other.m_coalesceKey),
+      m_cacheKey(other.m_cacheKey)
 {}
 
 RequestData::~RequestData()
@@ -91,6 +94,12 @@ RequestData::~RequestData()
 
 AuthCoreCache *AuthCoreCache::m_instance = 0;
 
+/*
+ * Number of results cached for an identity: when exceeded, the results
+ * which would expire first are dropped
+ * */
+static const int maxResultsByIdentity = 16;
+
 AuthCoreCache::AuthCache::AuthCache()
 {}
 
@@ -102,13 +111,17 @@ bool AuthCoreCache::AuthCache::isEmpty() const
     return (m_password.isEmpty() && m_blobData.isEmpty());
 }
 
-AuthCoreCache::AuthCoreCache(QObject *parent) : QObject(parent)
+AuthCoreCache::AuthCoreCache(QObject *parent)
+    : QObject(parent),
+      m_resultHits(0),
+      m_resultMisses(0)
 {
 }
 
 AuthCoreCache::~AuthCoreCache()
 {
     clear();
+    clearResults();
     m_instance = 0;
 }
 
@@ -177,3 +190,77 @@ void AuthCoreCache::clear()
 
     m_cachingSessionsMethods.clear();
 }
+
+bool AuthCoreCache::result(const CacheId &id, const QByteArray &requestKey,
+                           QVariantMap &result)
+{
+    ResultId resultId(id.second, requestKey);
+    bool found = false;
+
+    if (m_results.contains(id.first)) {
+        QHash<ResultId, CachedResult> &results = m_results[id.first];
+        if (results.contains(resultId)) {
+            const CachedResult &cached = results[resultId];
+            if (cached.m_expiry > QDateTime::currentDateTime().toTime_t()) {
+                result = cached.m_data;
+                found = true;
+            } else {
+                results.remove(resultId);
+                if (results.isEmpty())
+                    m_results.remove(id.first);
+            }
+        }
+    }
+
+    if (found)
+        m_resultHits++;
+    else
+        m_resultMisses++;
+
+    TRACE() << (found ? "Cached result found." : "No cached result.")
+            << "Hits:" << m_resultHits << "misses:" << m_resultMisses;
+
+    return found;
+}
+
+void AuthCoreCache::insertResult(const CacheId &id, const QByteArray &requestKey,
+                                 const QVariantMap &result, uint expiresIn)
+{
+    if (expiresIn == 0) return;
+
+    uint now = QDateTime::currentDateTime().toTime_t();
+    QHash<ResultId, CachedResult> &results = m_results[id.first];
+
+    QMutableHashIterator<ResultId, CachedResult> it(results);
+    while (it.hasNext()) {
+        if (it.next().value().m_expiry <= now)
+            it.remove();
+    }
+
+    ResultId resultId(id.second, requestKey);
+    while (!results.contains(resultId)
+           && results.count() >= maxResultsByIdentity) {
+        QHash<ResultId, CachedResult>::iterator first = results.begin();
+        for (QHash<ResultId, CachedResult>::iterator i = results.begin();
+             i != results.end(); ++i) {
+            if (i.value().m_expiry < first.value().m_expiry)
+                first = i;
+        }
+        results.erase(first);
+    }
+
+    CachedResult cached;
+    cached.m_data = result;
+    cached.m_expiry = now + expiresIn;
+    results.insert(resultId, cached);
+}
+
+void AuthCoreCache::removeResults(const IdentityId id)
+{
+    m_results.remove(id);
+}
+
+void AuthCoreCache::clearResults()
+{
+    m_results.clear();
+}
@@ -58,7 +58,8 @@ struct StoreOperation {
 public:
     StoreType m_storeType;
     QVariantMap m_credsData;
-    SignonIdentityInfo m_info;
+    //the password given by the UI, if any
+    QString m_passwordUpdate;
     //Blob store related
     QString m_authMethod;
     QVariantMap m_blobData;
@@ -86,6 +87,10 @@ public:
     QVariantMap m_params;
     QString m_mechanism;
     QString m_cancelKey;
+    //identical requests share it, if coalescing is enabled for the method
+    QByteArray m_coalesceKey;
+    //key of the result in the cache, if it can be cached
+    QByteArray m_cacheKey;
 };
 
 /*!
@@ -95,6 +100,8 @@ public:
  * Once all references of authentication sessions for a specifc
  * credentials ID are destroyed, the cache for that specific ID
  * will be deleted.
+ * The results of the requests are cached as well, until the expiry time
+ * given by the plugin or until the credentials are changed.
  */
 class AuthCoreCache : public QObject
 {
@@ -105,6 +112,7 @@ public:
     typedef QString AuthMethod;
     typedef QList<AuthMethod> AuthMethods;
     typedef QPair<IdentityId, AuthMethod> CacheId;
+    typedef QPair<AuthMethod, QByteArray> ResultId;
 
     class AuthCache
     {
@@ -147,9 +155,38 @@ public:
 
     void authSessionDestroyed(const CacheId &id);
 
+    /*!
+     * Looks for a still valid result of the request identified by
+     * requestKey.
+     * @returns true if one was found, and copied to result.
+     */
+    bool result(const CacheId &id, const QByteArray &requestKey,
+                QVariantMap &result);
+    void insertResult(const CacheId &id, const QByteArray &requestKey,
+                      const QVariantMap &result, uint expiresIn);
+
+    /*!
+     * Drops the cached results of an identity, e.g. when its credentials
+     * are changed.
+     */
+    void removeResults(const IdentityId id);
+    void clearResults();
+
+    quint64 resultHits() const { return m_resultHits; }
+    quint64 resultMisses() const { return m_resultMisses; }
+
 private:
+    struct CachedResult {
+        QVariantMap m_data;
+        uint m_expiry;
+    };
+
     QHash<IdentityId, AuthCache *> m_cache;
     QHash<IdentityId, AuthMethods> m_cachingSessionsMethods;
+
+    QHash<IdentityId, QHash<ResultId, CachedResult> > m_results;
+    quint64 m_resultHits;
+    quint64 m_resultMisses;
 };
 
 typedef AuthCoreCache::AuthCache AuthCache;
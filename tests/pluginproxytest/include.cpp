@@ -26,7 +26,9 @@
 #define PLUGINPROXY_EXTERNAL_INCLUDED_
 
 #include "pluginproxy.cpp"
-#include "blobiohandler.cpp"
+#include "plugincatalogue.cpp"
+#include "ipcchannel.cpp"
+#include "commondebug.cpp"
 
 #endif //_EXTERNAL_INCLUDED_
 
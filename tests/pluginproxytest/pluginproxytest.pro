@@ -28,7 +28,8 @@ SOURCES = \
 
 HEADERS += testpluginproxy.h \
            $${TOP_SRC_DIR}/src/signond/pluginproxy.h \
-           $${TOP_SRC_DIR}/lib/plugins/signon-plugins-common/SignOn/blobiohandler.h \
+           $${TOP_SRC_DIR}/src/signond/plugincatalogue.h \
+           $${TOP_SRC_DIR}/lib/plugins/signon-plugins-common/SignOn/ipcchannel.h \
            $${TOP_SRC_DIR}/lib/plugins/signon-plugins-common/SignOn/encrypteddevice.h \
            $${TOP_SRC_DIR}/lib/plugins/SignOn/authpluginif.h
 
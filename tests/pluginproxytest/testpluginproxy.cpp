@@ -25,6 +25,25 @@
 #include <sys/types.h>
 #include <pwd.h>
 
+/* Starts a plugin process, driving the event loop until it is started */
+static PluginProxy *startPluginProxy(const QString &type)
+{
+    PluginProxy *pp = PluginProxy::requestPluginProxy(type);
+    if (pp == NULL || pp->isStarted())
+        return pp;
+
+    QSignalSpy spy(pp, SIGNAL(startupFinished(bool)));
+    pp->start();
+    for (int i = 0; i < 100 && spy.count() == 0; i++)
+        QTest::qWait(100);
+
+    if (!pp->isStarted()) {
+        delete pp;
+        return NULL;
+    }
+    return pp;
+}
+
 void TestPluginProxy::initTestCase()
 {
     m_proxy = NULL;
@@ -48,14 +67,14 @@ void TestPluginProxy::cleanupTestCase()
 
 void TestPluginProxy::create_nonexisting()
 {
-    PluginProxy *pp = PluginProxy::createNewPluginProxy("nonexisting");
+    PluginProxy *pp = startPluginProxy("nonexisting");
     QVERIFY(pp == NULL);
 }
 
 void TestPluginProxy::create_dummy()
 {
 
-    PluginProxy *pp = PluginProxy::createNewPluginProxy("ssotest");
+    PluginProxy *pp = startPluginProxy("ssotest");
     QVERIFY(pp != NULL);
 
     m_proxy = pp;
@@ -120,6 +139,40 @@ void TestPluginProxy::process_for_dummy()
     QVERIFY(outData.contains("Realm") && outData["Realm"] == "testRealm_after_test");
 }
 
+void TestPluginProxy::process_busy_for_dummy()
+{
+    QVERIFY(m_proxy->maxConcurrentRequests() == 1);
+
+    QVariantMap inDataV;
+    inDataV["UserName"] = "testUsername";
+
+    QSignalSpy spyResult(m_proxy, SIGNAL(processResultReply(const QString&, const QVariantMap&)));
+    QSignalSpy spyError(m_proxy, SIGNAL(processError(const QString&, int, const QString&)));
+    QEventLoop loop;
+
+    QObject::connect(m_proxy,
+                     SIGNAL(processResultReply(const QString&, const QVariantMap&)),
+                     &loop,
+                     SLOT(quit()));
+
+    QTimer::singleShot(10*1000, &loop, SLOT(quit()));
+
+    QString cancelKey = QUuid::createUuid().toString();
+    QString otherKey = QUuid::createUuid().toString();
+    QVERIFY(m_proxy->process(cancelKey, inDataV, "mech1"));
+
+    //the dummy plugin takes one request at a time
+    QVERIFY(!m_proxy->process(otherKey, inDataV, "mech1"));
+    m_proxy->cancel(otherKey);
+
+    loop.exec();
+
+    QCOMPARE(spyResult.count(), 1);
+    QCOMPARE(spyError.count(), 0);
+    QVERIFY(spyResult.at(0).at(0).toString() == cancelKey);
+    QVERIFY(!m_proxy->isProcessing());
+}
+
 void TestPluginProxy::processUi_for_dummy()
 {
     SessionData inData;
@@ -236,6 +289,50 @@ void TestPluginProxy::process_and_cancel_for_dummy()
     QVERIFY(errMsg == QString("The operation is canceled"));
 }
 
+void TestPluginProxy::cancel_in_nested_loop_for_dummy()
+{
+    /* The plugin waits in an event loop of its own within process() */
+    QVariantMap inDataV;
+    inDataV["UserName"] = "testUsername";
+    inDataV["Delay"] = 20 * 1000;
+
+    QSignalSpy spyResult(m_proxy, SIGNAL(processResultReply(const QString&, const QVariantMap&)));
+    QSignalSpy spyError(m_proxy, SIGNAL(processError(const QString&, int, const QString&)));
+    QEventLoop loop;
+
+    QObject::connect(m_proxy,
+                     SIGNAL(processResultReply(const QString&, const QVariantMap&)),
+                     &loop,
+                     SLOT(quit()));
+    QObject::connect(m_proxy,
+                     SIGNAL(processError(const QString&, int, const QString&)),
+                     &loop,
+                     SLOT(quit()));
+
+    QTimer::singleShot(10*1000, &loop, SLOT(quit()));
+
+    QString cancelKey = QUuid::createUuid().toString();
+    QVERIFY(m_proxy->process(cancelKey, inDataV, "mech1"));
+    QTest::qWait(500);
+    QTime time;
+    time.start();
+    m_proxy->cancel(cancelKey);
+    loop.exec();
+
+    //the cancel got to the plugin before its delay was over
+    QVERIFY(time.elapsed() < 5000);
+    QCOMPARE(spyResult.count(), 0);
+    QCOMPARE(spyError.count(), 1);
+    QCOMPARE(spyError.at(0).at(0).toString(), cancelKey);
+    QCOMPARE(spyError.at(0).at(1).toInt(), (int)Error::SessionCanceled);
+
+    //the plugin process goes on with the next request
+    inDataV.remove("Delay");
+    QVERIFY(m_proxy->process(cancelKey, inDataV, "mech1"));
+    loop.exec();
+    QCOMPARE(spyResult.count(), 1);
+}
+
 void TestPluginProxy::process_wrong_mech_for_dummy()
 {
     SessionData inData;
@@ -295,6 +392,110 @@ void TestPluginProxy::wrong_user_for_dummy()
 #endif
 }
 
+void TestPluginProxy::request_dummy()
+{
+    PluginProxy *pp = PluginProxy::requestPluginProxy("ssotest");
+    QVERIFY(pp != NULL);
+    QVERIFY(!pp->isStarted());
+
+    QSignalSpy spy(pp, SIGNAL(startupFinished(bool)));
+    pp->start();
+    for (int i = 0; i < 50 && spy.count() == 0; i++)
+        QTest::qWait(100);
+
+    QCOMPARE(spy.count(), 1);
+    QVERIFY(spy.at(0).at(0).toBool());
+    QVERIFY(pp->isStarted());
+    QVERIFY(pp->mechanisms().contains("mech1"));
+    delete pp;
+
+    pp = PluginProxy::requestPluginProxy("nonexisting");
+    QSignalSpy failSpy(pp, SIGNAL(startupFinished(bool)));
+    pp->start();
+    for (int i = 0; i < 50 && failSpy.count() == 0; i++)
+        QTest::qWait(100);
+
+    QCOMPARE(failSpy.count(), 1);
+    QVERIFY(!failSpy.at(0).at(0).toBool());
+    QVERIFY(!pp->isStarted());
+    delete pp;
+}
+
+void TestPluginProxy::pool_for_dummy()
+{
+    PluginProxyPool *pool = PluginProxyPool::instance();
+    pool->setSize("ssotest", 1);
+    QCOMPARE(pool->size("ssotest"), 1);
+
+    //let the pool start the process
+    PluginProxy *pp = NULL;
+    for (int i = 0; i < 50 && pp == NULL; i++) {
+        QTest::qWait(100);
+        pp = pool->take("ssotest");
+    }
+    QVERIFY(pp != NULL);
+    QVERIFY(pp->type() == "ssotest");
+    QVERIFY(pool->take("ssotest") == NULL);
+
+    //an unused proxy can go back to the pool
+    pool->release(pp);
+    pp = startPluginProxy("ssotest");
+    QVERIFY(pp != NULL);
+    QVERIFY(pp->mechanisms().contains("mech1"));
+    delete pp;
+
+    pool->setSize("ssotest", 0);
+    QCOMPARE(pool->size("ssotest"), 0);
+
+    //a plugin which fails to start doesn't turn the pool off
+    pool->setSize("nonexisting", 1);
+    for (int i = 0; i < 50 && pool->failures("nonexisting") == 0; i++)
+        QTest::qWait(100);
+    QCOMPARE(pool->failures("nonexisting"), 1);
+    QCOMPARE(pool->size("nonexisting"), 1);
+    QVERIFY(pool->take("nonexisting") == NULL);
+
+    //the next attempt comes after the backoff
+    for (int i = 0; i < 50 && pool->failures("nonexisting") < 2; i++)
+        QTest::qWait(100);
+    QCOMPARE(pool->failures("nonexisting"), 2);
+    QCOMPARE(pool->size("nonexisting"), 1);
+
+    pool->setSize("nonexisting", 0);
+}
+
+void TestPluginProxy::catalogue_for_dummy()
+{
+    QString cacheFileName = QDir::tempPath() + QLatin1String("/signon-plugins.cache");
+    QFile::remove(cacheFileName);
+
+    PluginCatalogue *catalogue = PluginCatalogue::instance();
+    catalogue->setCacheFileName(cacheFileName);
+    QVERIFY(catalogue->methods().contains("ssotest"));
+    QVERIFY(!catalogue->contains("nonexisting"));
+    QVERIFY(!catalogue->queryMechanisms("nonexisting"));
+
+    QVERIFY(!catalogue->hasMechanisms("ssotest"));
+    QSignalSpy spy(catalogue, SIGNAL(mechanismsQueried(const QString&, bool)));
+    QVERIFY(catalogue->queryMechanisms("ssotest"));
+    for (int i = 0; i < 100 && spy.count() == 0; i++)
+        QTest::qWait(100);
+    QCOMPARE(spy.count(), 1);
+    QVERIFY(spy.at(0).at(1).toBool());
+    QVERIFY(catalogue->hasMechanisms("ssotest"));
+    QVERIFY(catalogue->mechanisms("ssotest").contains("mech1"));
+
+    //the mechanisms are read back from the cache file
+    delete catalogue;
+    catalogue = PluginCatalogue::instance();
+    catalogue->setCacheFileName(cacheFileName);
+    QVERIFY(catalogue->hasMechanisms("ssotest"));
+    QVERIFY(catalogue->mechanisms("ssotest").contains("mech1"));
+
+    delete catalogue;
+    QFile::remove(cacheFileName);
+}
+
 #if defined(SSO_CI_TESTMANAGEMENT)
     void TestPluginProxy::runAllTests()
     {
@@ -304,8 +505,13 @@ void TestPluginProxy::wrong_user_for_dummy()
          type_for_dummy();
          mechanisms_for_dummy();
          process_for_dummy();
+         process_busy_for_dummy();
          process_wrong_mech_for_dummy();
          process_and_cancel_for_dummy();
+         cancel_in_nested_loop_for_dummy();
+         request_dummy();
+         pool_for_dummy();
+         catalogue_for_dummy();
          cleanupTestCase();
     }
 #else
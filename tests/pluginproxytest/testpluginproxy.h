@@ -30,6 +30,7 @@
 #include "SignOn/sessiondata.h"
 #include "SignOn/authpluginif.h"
 #include "pluginproxy.h"
+#include "plugincatalogue.h"
 
 using namespace SignonDaemonNS;
 using namespace SignOn;
@@ -52,10 +53,15 @@ class TestPluginProxy: public QObject
     void type_for_dummy();
     void mechanisms_for_dummy();
     void process_for_dummy();
+    void process_busy_for_dummy();
     void processUi_for_dummy();
     void process_wrong_mech_for_dummy();
     void process_and_cancel_for_dummy();
+    void cancel_in_nested_loop_for_dummy();
     void wrong_user_for_dummy();
+    void request_dummy();
+    void pool_for_dummy();
+    void catalogue_for_dummy();
 
 private:
     PluginProxy *m_proxy;
@@ -0,0 +1,235 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2009-2010 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+#include "databasebenchmark.h"
+
+#include "signonidentityinfo.cpp"
+
+const QString dbFile = QLatin1String("/tmp/signon_benchmark.db");
+
+static void addRows()
+{
+    QTest::addColumn<int>("identities");
+    QTest::addColumn<bool>("migrated");
+
+    QList<int> sizes = QList<int>() << 100 << 1000 << 5000;
+    foreach (int size, sizes) {
+        QTest::newRow(qPrintable(QString::fromLatin1("%1 v2").arg(size)))
+            << size << false;
+        QTest::newRow(qPrintable(QString::fromLatin1("%1 v3").arg(size)))
+            << size << true;
+    }
+}
+
+static void addConfigurationRows()
+{
+    QTest::addColumn<QString>("journalMode");
+    QTest::addColumn<QString>("synchronous");
+
+    QTest::newRow("DELETE FULL") << QString::fromLatin1("DELETE")
+                                 << QString::fromLatin1("FULL");
+    QTest::newRow("WAL FULL") << QString::fromLatin1("WAL")
+                              << QString::fromLatin1("FULL");
+    QTest::newRow("WAL NORMAL") << QString::fromLatin1("WAL")
+                                << QString::fromLatin1("NORMAL");
+}
+
+static SignonIdentityInfo identityInfo(quint32 id, int index)
+{
+    QMap<QString, QVariant> methods;
+    methods.insert(QLatin1String("password"), QStringList());
+
+    QStringList acl = QStringList()
+        << QString::fromLatin1("AID::%1").arg(index);
+    return SignonIdentityInfo(id,
+                              QString::fromLatin1("user%1").arg(index),
+                              QString(), false,
+                              QString::fromLatin1("Caption %1").arg(index),
+                              methods,
+                              QStringList() << QLatin1String("example.com"),
+                              acl,
+                              acl);
+}
+
+void DatabaseBenchmark::populate(int count,
+                                 const SqlDatabaseConfiguration &configuration)
+{
+    QFile::remove(dbFile);
+    QFile::remove(dbFile + QLatin1String("-wal"));
+    QFile::remove(dbFile + QLatin1String("-shm"));
+    m_db = new CredentialsDB(dbFile, configuration);
+    QVERIFY(m_db->init());
+
+    m_ids.clear();
+    for (int i = 0; i < count; i++)
+        m_ids.append(m_db->insertCredentials(identityInfo(0, i), false));
+}
+
+void DatabaseBenchmark::populate(int count, bool migrated)
+{
+    QFile::remove(dbFile);
+    m_db = new CredentialsDB(dbFile);
+    m_db->init();
+
+    MetaDataDB *meta = m_db->metaDataDB;
+    meta->exec(QLatin1String("PRAGMA synchronous = OFF"));
+
+    QMap<QString, QVariant> methods;
+    methods.insert(QLatin1String("password"), QStringList());
+    methods.insert(QLatin1String("sasl"),
+                   QStringList() << QLatin1String("PLAIN")
+                                 << QLatin1String("DIGEST-MD5"));
+
+    m_ids.clear();
+    for (int i = 0; i < count; i++) {
+        QStringList acl = QStringList()
+            << QString::fromLatin1("AID::%1").arg(i)
+            << QString::fromLatin1("app-%1::property").arg(i % 50);
+        SignonIdentityInfo info(0,
+                                QString::fromLatin1("user%1").arg(i),
+                                QString(), false,
+                                QString::fromLatin1("Caption %1").arg(i),
+                                methods,
+                                QStringList() << QLatin1String("example.com"),
+                                acl,
+                                acl);
+        m_ids.append(m_db->insertCredentials(info, false));
+    }
+
+    /* Turn the database back into a version 2 one: no indexes, and the
+     * triggers emulating the foreign keys */
+    meta->exec(QLatin1String("DROP INDEX idx_ACL_identity_id"));
+    meta->exec(QLatin1String("DROP INDEX idx_OWNER_identity_id"));
+
+    QStringList triggers = meta->foreignKeyTriggers();
+    foreach (QString statement, meta->tableUpdates2()) {
+        if (statement.startsWith(QLatin1String("CREATE TRIGGER")))
+            triggers << statement;
+    }
+    foreach (QString trigger, triggers) {
+        meta->exec(trigger);
+        QVERIFY(!meta->errorOccurred());
+    }
+    meta->exec(QLatin1String("PRAGMA user_version = 2"));
+
+    if (migrated)
+        QVERIFY(meta->updateDB(2));
+    meta->exec(QLatin1String("ANALYZE"));
+}
+
+void DatabaseBenchmark::cleanup()
+{
+    delete m_db;
+    m_db = 0;
+    QFile::remove(dbFile);
+    QFile::remove(dbFile + QLatin1String("-wal"));
+    QFile::remove(dbFile + QLatin1String("-shm"));
+}
+
+void DatabaseBenchmark::identityLookup_data()
+{
+    addRows();
+}
+
+void DatabaseBenchmark::identityLookup()
+{
+    QFETCH(int, identities);
+    QFETCH(bool, migrated);
+
+    populate(identities, migrated);
+
+    /* Bypass the identity cache of CredentialsDB: the DB is measured */
+    MetaDataDB *meta = m_db->metaDataDB;
+    int i = 0;
+    QBENCHMARK {
+        SignonIdentityInfo info =
+            meta->identity(m_ids.at(i++ % m_ids.count()));
+        Q_UNUSED(info);
+    }
+}
+
+void DatabaseBenchmark::aclLookup_data()
+{
+    addRows();
+}
+
+void DatabaseBenchmark::aclLookup()
+{
+    QFETCH(int, identities);
+    QFETCH(bool, migrated);
+
+    populate(identities, migrated);
+
+    int i = 0;
+    QBENCHMARK {
+        QStringList acl =
+            m_db->accessControlList(m_ids.at(i++ % m_ids.count()));
+        Q_UNUSED(acl);
+    }
+}
+
+void DatabaseBenchmark::configurationWrite_data()
+{
+    addConfigurationRows();
+}
+
+void DatabaseBenchmark::configurationWrite()
+{
+    QFETCH(QString, journalMode);
+    QFETCH(QString, synchronous);
+
+    SqlDatabaseConfiguration configuration;
+    configuration.m_journalMode = journalMode;
+    configuration.m_synchronous = synchronous;
+    populate(100, configuration);
+
+    /* Each update is a transaction of its own, synced as configured */
+    int i = 0;
+    QBENCHMARK {
+        m_db->updateCredentials(identityInfo(m_ids.at(i % m_ids.count()), i),
+                                false);
+        i++;
+    }
+}
+
+void DatabaseBenchmark::configurationRead_data()
+{
+    addConfigurationRows();
+}
+
+void DatabaseBenchmark::configurationRead()
+{
+    QFETCH(QString, journalMode);
+    QFETCH(QString, synchronous);
+
+    SqlDatabaseConfiguration configuration;
+    configuration.m_journalMode = journalMode;
+    configuration.m_synchronous = synchronous;
+    populate(100, configuration);
+
+    /* The ACL is not cached: each lookup reads the DB */
+    int i = 0;
+    QBENCHMARK {
+        QStringList acl =
+            m_db->accessControlList(m_ids.at(i++ % m_ids.count()));
+        Q_UNUSED(acl);
+    }
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2009-2010 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef DATABASEBENCHMARK_H_
+#define DATABASEBENCHMARK_H_
+
+#include <QtTest/QtTest>
+#include <QtCore>
+
+#include "credentialsdb.h"
+
+using namespace SignonDaemonNS;
+
+/*!
+ * Measures the cost of the identity lookups done by the daemon, on
+ * databases of growing size, before and after the version 3 schema
+ * migration; compares the write throughput and the read latency of the
+ * journal modes and synchronous levels.
+ */
+class DatabaseBenchmark: public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void cleanup();
+
+    void identityLookup_data();
+    void identityLookup();
+    void aclLookup_data();
+    void aclLookup();
+    void configurationWrite_data();
+    void configurationWrite();
+    void configurationRead_data();
+    void configurationRead();
+
+private:
+    void populate(int count, bool migrated);
+    void populate(int count, const SqlDatabaseConfiguration &configuration);
+
+private:
+    CredentialsDB *m_db;
+    QList<quint32> m_ids;
+};
+
+#endif //DATABASEBENCHMARK_H_
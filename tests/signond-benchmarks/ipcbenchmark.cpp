@@ -0,0 +1,132 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2011 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "ipcbenchmark.h"
+
+#include <unistd.h>
+
+#include "SignOn/blobiohandler.h"
+#include "SignOn/ipcchannel.h"
+#include "SignOn/ipc.h"
+
+using namespace SignOn;
+
+void IpcBenchmark::onFrameReceived(quint16 opcode, quint32 requestId,
+                                   const QByteArray &payload)
+{
+    Q_UNUSED(opcode);
+    Q_UNUSED(requestId);
+
+    QDataStream in(payload);
+    in >> m_received;
+}
+
+void IpcBenchmark::onDataReceived(const QVariantMap &map)
+{
+    m_received = map;
+}
+
+void IpcBenchmark::roundTrip_data()
+{
+    QTest::addColumn<int>("size");
+    QTest::addColumn<bool>("framed");
+    QTest::addColumn<bool>("shared");
+
+    QList<int> sizes =
+        QList<int>() << 100 << 1024 << 10 * 1024 << 100 * 1024 << 1024 * 1024;
+    foreach (int size, sizes) {
+        QTest::newRow(qPrintable(QString::fromLatin1("%1 legacy").arg(size)))
+            << size << false << false;
+        QTest::newRow(qPrintable(QString::fromLatin1("%1 framed").arg(size)))
+            << size << true << false;
+        QTest::newRow(qPrintable(QString::fromLatin1("%1 shared").arg(size)))
+            << size << true << true;
+    }
+}
+
+void IpcBenchmark::roundTrip()
+{
+    QFETCH(int, size);
+    QFETCH(bool, framed);
+    QFETCH(bool, shared);
+
+    QVariantMap data;
+    data.insert(QLatin1String("UserName"), QLatin1String("user"));
+    data.insert(QLatin1String("Realm"), QLatin1String("example.com"));
+    data.insert(QLatin1String("Blob"), QByteArray(size, 'x'));
+
+    QByteArray pipe;
+    QBuffer buffer(&pipe);
+    buffer.open(QIODevice::ReadWrite);
+
+    if (framed) {
+        IpcChannel sender(&buffer, &buffer);
+        IpcChannel receiver(&buffer, &buffer);
+        connect(&receiver,
+                SIGNAL(frameReceived(quint16, quint32, const QByteArray&)),
+                this,
+                SLOT(onFrameReceived(quint16, quint32, const QByteArray&)));
+
+        if (shared) {
+            int fd = IpcChannel::createSharedMemory();
+            QVERIFY(fd >= 0);
+            QVERIFY(sender.attachSharedMemory(fd, true));
+            QVERIFY(receiver.attachSharedMemory(fd, false));
+            ::close(fd);
+            sender.setSharedMemoryEnabled(true);
+        }
+
+        QBENCHMARK {
+            buffer.seek(0);
+            QDataStream &out = sender.startFrame(PLUGIN_OP_PROCESS);
+            out << data;
+            sender.sendFrame();
+
+            buffer.seek(0);
+            receiver.readFrames(1);
+        }
+    } else {
+        BlobIOHandler handler(&buffer, &buffer);
+        connect(&handler, SIGNAL(dataReceived(const QVariantMap &)),
+                this, SLOT(onDataReceived(const QVariantMap &)));
+
+        QBENCHMARK {
+            buffer.seek(0);
+            QDataStream out(&buffer);
+            out << (quint32)PLUGIN_OP_PROCESS;
+            handler.sendData(data);
+
+            buffer.seek(0);
+            QDataStream in(&buffer);
+            quint32 opcode;
+            int blobSize;
+            in >> opcode >> blobSize;
+
+            /* No read notification from a buffer: the pages are pulled */
+            handler.receiveData(blobSize);
+            while (handler.m_blobBuffer.size() < blobSize)
+                handler.readBlob();
+        }
+    }
+
+    QCOMPARE(m_received, data);
+}
@@ -0,0 +1,49 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2011 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef IPCBENCHMARK_H_
+#define IPCBENCHMARK_H_
+
+#include <QtTest/QtTest>
+#include <QtCore>
+
+/*!
+ * Measures the cost of a session data round trip through the plugin IPC,
+ * with the framed channel and with the former paged blob transfer.
+ */
+class IpcBenchmark: public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void roundTrip_data();
+    void roundTrip();
+
+    void onFrameReceived(quint16 opcode, quint32 requestId,
+                         const QByteArray &payload);
+    void onDataReceived(const QVariantMap &map);
+
+private:
+    QVariantMap m_received;
+};
+
+#endif //IPCBENCHMARK_H_
@@ -0,0 +1,54 @@
+include( ../../common-project-config.pri )
+include( $$TOP_SRC_DIR/common-vars.pri )
+
+CONFIG += \
+    qtestlib \
+    link_pkgconfig
+
+QT += core \
+    sql
+
+QT -= gui
+
+PKGCONFIG += \
+    libsignoncrypto-qt \
+    accounts-qt \
+    sqlite3
+
+DEFINES += SIGNOND_TRACE \
+           SIGNON_PLUGIN_TRACE
+
+HEADERS += \
+    databasebenchmark.h \
+    ipcbenchmark.h \
+    storagebenchmark.h \
+    $$TOP_SRC_DIR/src/signond/credentialsdb.h \
+    $$TOP_SRC_DIR/src/signond/credentialsdbthread.h \
+    $$TOP_SRC_DIR/lib/plugins/signon-plugins-common/SignOn/blobiohandler.h \
+    $$TOP_SRC_DIR/lib/plugins/signon-plugins-common/SignOn/ipcchannel.h
+
+SOURCES = \
+    signond-benchmarks.cpp \
+    databasebenchmark.cpp \
+    ipcbenchmark.cpp \
+    storagebenchmark.cpp \
+    $$TOP_SRC_DIR/src/signond/credentialsdb.cpp \
+    $$TOP_SRC_DIR/src/signond/credentialsdbthread.cpp \
+    $$TOP_SRC_DIR/lib/plugins/signon-plugins-common/SignOn/blobiohandler.cpp \
+    $$TOP_SRC_DIR/lib/plugins/signon-plugins-common/SignOn/commondebug.cpp \
+    $$TOP_SRC_DIR/lib/plugins/signon-plugins-common/SignOn/ipcchannel.cpp
+
+TARGET = signon-benchmarks
+
+INCLUDEPATH += . \
+    $$TOP_SRC_DIR/lib/plugins \
+    $$TOP_SRC_DIR/lib/plugins/signon-plugins-common \
+    $$TOP_SRC_DIR/lib/signond \
+    $$TOP_SRC_DIR/src/signond
+
+QMAKE_CXXFLAGS += -fno-exceptions \
+    -fno-rtti
+
+target.path = /usr/bin
+
+INSTALLS += target
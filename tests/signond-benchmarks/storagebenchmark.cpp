@@ -0,0 +1,140 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2011 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "storagebenchmark.h"
+
+const QString storageDbFile = QLatin1String("/tmp/signon_storage_benchmark.db");
+
+static const int identityCount = 100;
+
+static SignonIdentityInfo identityInfo(quint32 id, int index)
+{
+    QMap<QString, QVariant> methods;
+    methods.insert(QLatin1String("password"), QStringList());
+
+    QStringList acl = QStringList()
+        << QString::fromLatin1("AID::%1").arg(index);
+    return SignonIdentityInfo(id,
+                              QString::fromLatin1("user%1").arg(index),
+                              QString(), false,
+                              QString::fromLatin1("Caption %1").arg(index),
+                              methods,
+                              QStringList() << QLatin1String("example.com"),
+                              acl,
+                              acl);
+}
+
+void StorageBenchmark::init()
+{
+    QFile::remove(storageDbFile);
+    m_db = new CredentialsDBThread(storageDbFile);
+    QVERIFY(m_db->init());
+
+    m_ids.clear();
+    for (int i = 0; i < identityCount; i++)
+        m_ids.append(m_db->insertCredentials(identityInfo(0, i), false));
+}
+
+SignonIdentityInfo StorageBenchmark::identity(int index) const
+{
+    return identityInfo(m_ids.at(index % m_ids.count()), index);
+}
+
+void StorageBenchmark::cleanup()
+{
+    /* The posted jobs are deleted along with their pending events */
+    delete m_db;
+    m_db = 0;
+    QFile::remove(storageDbFile);
+}
+
+void StorageBenchmark::update_data()
+{
+    QTest::addColumn<bool>("posted");
+
+    QTest::newRow("waited for") << false;
+    QTest::newRow("posted") << true;
+}
+
+void StorageBenchmark::update()
+{
+    QFETCH(bool, posted);
+
+    int i = 0;
+    QBENCHMARK {
+        if (posted) {
+            CredentialsDBJob *job =
+                new CredentialsDBJob(CredentialsDBJob::UpdateCredentials);
+            job->m_info = identity(i++);
+            job->m_flag = false;
+            m_db->post(job);
+        } else {
+            m_db->updateCredentials(identity(i++), false);
+        }
+    }
+
+    /* The posted updates are done before the DB is closed */
+    QVERIFY(m_db->credentials(m_ids.first(), false).id() == m_ids.first());
+}
+
+void StorageBenchmark::readAfterUpdates_data()
+{
+    QTest::addColumn<int>("updates");
+    QTest::addColumn<bool>("sameIdentity");
+
+    QList<int> counts = QList<int>() << 0 << 10 << 50;
+    foreach (int count, counts) {
+        QTest::newRow(qPrintable(QString::fromLatin1("%1 updates").arg(count)))
+            << count << false;
+        QTest::newRow(qPrintable(QString::fromLatin1("%1 updates, same identity")
+                                 .arg(count)))
+            << count << true;
+    }
+}
+
+void StorageBenchmark::readAfterUpdates()
+{
+    QFETCH(int, updates);
+    QFETCH(bool, sameIdentity);
+
+    /* The read overtakes the updates posted before it on the other
+     * identities, and waits for the ones on its own: the time of the posts
+     * themselves is negligible */
+    int i = 0;
+    QBENCHMARK {
+        int last = i;
+        for (int j = 0; j < updates; j++) {
+            CredentialsDBJob *job =
+                new CredentialsDBJob(CredentialsDBJob::UpdateCredentials);
+            last = i++;
+            job->m_info = identity(last);
+            job->m_flag = false;
+            m_db->post(job);
+        }
+
+        int read = sameIdentity ? last : i;
+        SignonIdentityInfo info =
+            m_db->credentials(m_ids.at(read % m_ids.count()), false);
+        if (sameIdentity && updates > 0)
+            QCOMPARE(info.userName(), identity(last).userName());
+    }
+}
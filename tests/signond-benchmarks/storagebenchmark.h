@@ -0,0 +1,60 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2011 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+
+#ifndef STORAGEBENCHMARK_H_
+#define STORAGEBENCHMARK_H_
+
+#include <QtTest/QtTest>
+#include <QtCore>
+
+#include "credentialsdbthread.h"
+
+using namespace SignonDaemonNS;
+
+/*!
+ * Compares the time the caller is blocked by the identity updates when it
+ * waits for them, as the daemon used to, and when it posts them to the
+ * storage thread; measures the reads queued behind posted updates.
+ */
+class StorageBenchmark: public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void init();
+    void cleanup();
+
+    void update_data();
+    void update();
+    void readAfterUpdates_data();
+    void readAfterUpdates();
+
+private:
+    SignonIdentityInfo identity(int index) const;
+
+private:
+    CredentialsDBThread *m_db;
+    QList<quint32> m_ids;
+};
+
+#endif //STORAGEBENCHMARK_H_
@@ -25,6 +25,8 @@
 
 #include "credentialsdb.h"
 #include "signonidentityinfo.cpp"
+#include "SignOn/crypto-manager.h"
+#include "SignOn/encrypted-vfs.h"
 
 const QString dbFile = QLatin1String("/tmp/signon_test.db");
 const QString secretsDbFile = QLatin1String("/tmp/signon_test_secrets.db");
@@ -79,6 +81,17 @@ void TestDatabase::createTableStructureTest()
     m_db->init();
     QVERIFY(m_meta->hasTables());
 
+    QStringList indexes = m_meta->queryList(QString::fromLatin1(
+            "SELECT name FROM sqlite_master WHERE type = 'index'"));
+    QVERIFY(indexes.contains(QLatin1String("idx_ACL_identity_id")));
+    QVERIFY(indexes.contains(QLatin1String("idx_OWNER_identity_id")));
+
+    if (m_meta->foreignKeysEnabled()) {
+        QStringList triggers = m_meta->queryList(QString::fromLatin1(
+                "SELECT name FROM sqlite_master WHERE type = 'trigger'"));
+        QVERIFY(triggers.count() == 0);
+    }
+
     bool success = m_db->openSecretsDB(secretsDbFile);
     QVERIFY(success);
     QVERIFY(m_db->secretsDB->hasTables());
@@ -118,6 +131,31 @@ void TestDatabase::queryListTest()
     QVERIFY(list.count() == 0);
 }
 
+void TestDatabase::preparedQueryTest()
+{
+    QString queryStr = QString::fromLatin1(
+            "SELECT realm FROM TESTING WHERE identity_id = :id");
+    QSqlQuery query = m_meta->prepare(queryStr);
+    query.bindValue(QLatin1String(":id"), 80);
+    QStringList list = m_meta->queryList(query);
+    QVERIFY(list.count() == 2);
+
+    //the same statement must be reused
+    QSqlQuery query2 = m_meta->prepare(queryStr);
+    QVERIFY(query2.result() == query.result());
+    query2.bindValue(QLatin1String(":id"), 81);
+    list = m_meta->queryList(query2);
+    QVERIFY(list.count() == 0);
+
+    //and dropped when the cache is invalidated
+    m_meta->clearPreparedQueries();
+    QSqlQuery query3 = m_meta->prepare(queryStr);
+    QVERIFY(query3.result() != query.result());
+    query3.bindValue(QLatin1String(":id"), 80);
+    list = m_meta->queryList(query3);
+    QVERIFY(list.count() == 2);
+}
+
 void TestDatabase::insertMethodsTest()
 {
     //test empty list
@@ -226,7 +264,44 @@ void TestDatabase::credentialsTest()
     foreach(SignonIdentityInfo info, creds) {
         qDebug() << info.id() << info.caption();
     }
-    //TODO check filtering when implemented
+
+    //filtering
+    SignonIdentityInfo info2 =
+        SignonIdentityInfo(0,
+                           QLatin1String("User2"),
+                           QLatin1String("Pass2"), true,
+                           QLatin1String("Other caption"),
+                           QMap<QString, QVariant>(),
+                           QStringList() << QLatin1String("Realm4.com"),
+                           testAcl);
+    id = m_db->insertCredentials(info2, true);
+    creds = m_db->credentials(filter);
+    QVERIFY(creds.count() == 3);
+
+    filter.insert(QLatin1String("Caption"), QLatin1String("Other*"));
+    creds = m_db->credentials(filter);
+    QVERIFY(creds.count() == 1);
+    QCOMPARE(creds.first().id(), id);
+    QVERIFY(creds.first().realms() == info2.realms());
+    QVERIFY(creds.first().accessControlList() == testAcl);
+
+    filter.clear();
+    filter.insert(QLatin1String("AuthMethod"), QLatin1String("Method3"));
+    creds = m_db->credentials(filter);
+    QVERIFY(creds.count() == 2);
+    foreach(SignonIdentityInfo info, creds) {
+        QVERIFY(info.methods() ==
+                SignonIdentityInfo::mapVariantToMapList(testMethods));
+    }
+
+    filter.insert(QLatin1String("Realm"), QLatin1String("Realm2.com"));
+    filter.insert(QLatin1String("Username"), QLatin1String("U*"));
+    creds = m_db->credentials(filter);
+    QVERIFY(creds.count() == 2);
+
+    filter.insert(QLatin1String("Realm"), QLatin1String("Realm4.com"));
+    creds = m_db->credentials(filter);
+    QVERIFY(creds.count() == 0);
 }
 
 void TestDatabase::insertCredentialsTest()
@@ -552,6 +627,40 @@ void TestDatabase::dataTest()
     result = m_db->loadData(id, method);
     QVERIFY(result.isEmpty());
 
+    /* only the changed keys are written */
+    data.clear();
+    data.insert(QLatin1String("token"), QLatin1String("tokenval"));
+    data.insert(QLatin1String("token2"), QLatin1String("tokenval2"));
+    data.insert(QLatin1String("token3"), QLatin1String("tokenval3"));
+    ret = m_db->storeData(id, method, data);
+    QVERIFY(ret);
+
+    QString changesQuery = QLatin1String("SELECT total_changes()");
+    QSqlQuery query = m_db->secretsDB->exec(changesQuery);
+    QVERIFY(query.first());
+    int changes = query.value(0).toInt();
+    query.finish();
+
+    ret = m_db->storeData(id, method, data);
+    QVERIFY(ret);
+    query = m_db->secretsDB->exec(changesQuery);
+    QVERIFY(query.first());
+    QCOMPARE(query.value(0).toInt(), changes);
+    query.finish();
+
+    data.insert(QLatin1String("token2"), QLatin1String("tokenval2updated"));
+    data.insert(QLatin1String("token3"), QVariant());
+    ret = m_db->storeData(id, method, data);
+    QVERIFY(ret);
+    query = m_db->secretsDB->exec(changesQuery);
+    QVERIFY(query.first());
+    QCOMPARE(query.value(0).toInt(), changes + 2);
+    query.finish();
+
+    data.remove(QLatin1String("token3"));
+    result = m_db->loadData(id, method);
+    QVERIFY(result == data);
+
 }
 
 
@@ -608,6 +717,259 @@ void TestDatabase::referenceTest()
 
 }
 
+void TestDatabase::identityCacheTest()
+{
+    m_db->openSecretsDB(secretsDbFile);
+
+    SignonIdentityInfo info =
+        SignonIdentityInfo(0,
+                           QLatin1String("User"),
+                           QLatin1String("Pass"), true,
+                           QLatin1String("Caption"),
+                           testMethods,
+                           testRealms,
+                           testAcl);
+
+    quint32 id = m_db->insertCredentials(info, true);
+
+    //the second lookup must not hit the DB
+    int hits = m_db->identityCacheHits();
+    int misses = m_db->identityCacheMisses();
+    SignonIdentityInfo retInfo = m_db->credentials(id, false);
+    QCOMPARE(retInfo.caption(), QLatin1String("Caption"));
+    QCOMPARE(m_db->identityCacheMisses(), misses + 1);
+    retInfo = m_db->credentials(id, true);
+    QCOMPARE(retInfo.caption(), QLatin1String("Caption"));
+    QCOMPARE(retInfo.password(), QLatin1String("Pass"));
+    QCOMPARE(m_db->identityCacheHits(), hits + 1);
+
+    //updates must be visible
+    info.setId(id);
+    info.setCaption(QLatin1String("New caption"));
+    QVERIFY(m_db->updateCredentials(info, true) == id);
+    retInfo = m_db->credentials(id, false);
+    QCOMPARE(retInfo.caption(), QLatin1String("New caption"));
+    QCOMPARE(m_db->identityCacheMisses(), misses + 2);
+
+    //and so must removals
+    QVERIFY(m_db->removeCredentials(id));
+    retInfo = m_db->credentials(id, false);
+    QVERIFY(retInfo.isNew());
+}
+
+void TestDatabase::backupTest()
+{
+    QString metaDataBackup = QLatin1String("/tmp/signon_test_backup.db");
+    QString secretsBackup = QLatin1String("/tmp/signon_test_backup.db.creds");
+    QFile::remove(metaDataBackup);
+    QFile::remove(secretsBackup);
+
+    m_db->openSecretsDB(secretsDbFile);
+    m_db->clear();
+
+    SignonIdentityInfo info =
+        SignonIdentityInfo(0,
+                           QLatin1String("User"),
+                           QLatin1String("Pass"), true,
+                           QLatin1String("Caption"),
+                           testMethods,
+                           testRealms,
+                           testAcl);
+    quint32 id = m_db->insertCredentials(info, true);
+
+    QVERIFY(m_db->startBackup(metaDataBackup, secretsBackup));
+    QVERIFY(!m_db->backupStep(1));
+
+    //the changes made during the backup are copied too
+    info.setUserName(QLatin1String("User2"));
+    info.setPassword(QLatin1String("Pass2"));
+    quint32 id2 = m_db->insertCredentials(info, true);
+
+    int steps = 0;
+    while (!m_db->backupStep(1)) {
+        QVERIFY(!m_db->errorOccurred());
+        QVERIFY(++steps < 1000);
+    }
+
+    {
+        QSqlDatabase backup =
+            QSqlDatabase::addDatabase(QLatin1String("QSQLITE"),
+                                      QLatin1String("backupTest"));
+        backup.setDatabaseName(metaDataBackup);
+        QVERIFY(backup.open());
+        QSqlQuery query(QLatin1String("SELECT id FROM CREDENTIALS ORDER BY id"),
+                        backup);
+        QVERIFY(query.next());
+        QCOMPARE(query.value(0).toUInt(), id);
+        QVERIFY(query.next());
+        QCOMPARE(query.value(0).toUInt(), id2);
+        query.finish();
+        backup.close();
+
+        backup.setDatabaseName(secretsBackup);
+        QVERIFY(backup.open());
+        query = QSqlQuery(QString::fromLatin1("SELECT password FROM CREDENTIALS "
+                                              "WHERE id = %1").arg(id2),
+                          backup);
+        QVERIFY(query.first());
+        QCOMPARE(query.value(0).toString(), QLatin1String("Pass2"));
+        query.finish();
+        backup.close();
+    }
+    QSqlDatabase::removeDatabase(QLatin1String("backupTest"));
+
+    //closing the secrets DB aborts the backup
+    QVERIFY(m_db->startBackup(metaDataBackup, secretsBackup));
+    m_db->closeSecretsDB();
+    while (!m_db->backupStep(1000) && !m_db->errorOccurred());
+    QVERIFY(m_db->errorOccurred());
+
+    QFile::remove(metaDataBackup);
+    QFile::remove(secretsBackup);
+}
+
+static QList<quint32> backupIds(const QString &fileName)
+{
+    QList<quint32> ids;
+    {
+        QSqlDatabase backup =
+            QSqlDatabase::addDatabase(QLatin1String("QSQLITE"),
+                                      QLatin1String("backupIds"));
+        backup.setDatabaseName(fileName);
+        if (backup.open()) {
+            QSqlQuery query(QLatin1String("SELECT id FROM CREDENTIALS ORDER BY id"),
+                            backup);
+            while (query.next())
+                ids.append(query.value(0).toUInt());
+            query.finish();
+            backup.close();
+        }
+    }
+    QSqlDatabase::removeDatabase(QLatin1String("backupIds"));
+    return ids;
+}
+
+void TestDatabase::backupSnapshotTest()
+{
+    QString metaDataBackup = QLatin1String("/tmp/signon_test_backup.db");
+    QString secretsBackup = QLatin1String("/tmp/signon_test_backup.db.creds");
+    QFile::remove(metaDataBackup);
+    QFile::remove(secretsBackup);
+
+    m_db->openSecretsDB(secretsDbFile);
+    m_db->clear();
+
+    SignonIdentityInfo info =
+        SignonIdentityInfo(0,
+                           QLatin1String("User"),
+                           QLatin1String("Pass"), true,
+                           QLatin1String("Caption"),
+                           testMethods,
+                           testRealms,
+                           testAcl);
+    QList<quint32> ids;
+    for (int i = 0; i < 10; i++)
+        ids.append(m_db->insertCredentials(info, true));
+
+    /* An identity is stored in both DBs after each step: the copies, of
+     * different sizes, are completed together, with all of them */
+    QVERIFY(m_db->startBackup(metaDataBackup, secretsBackup));
+    int steps = 0;
+    while (!m_db->backupStep(1)) {
+        QVERIFY(!m_db->errorOccurred());
+        QVERIFY(++steps < 1000);
+        ids.append(m_db->insertCredentials(info, true));
+    }
+    QVERIFY(steps > 0);
+
+    QCOMPARE(backupIds(metaDataBackup), ids);
+    QCOMPARE(backupIds(secretsBackup), ids);
+
+    QFile::remove(metaDataBackup);
+    QFile::remove(secretsBackup);
+}
+
+void TestDatabase::pageEncryptionTest()
+{
+    QString storage = QLatin1String("/tmp/signon_test_pages");
+    QFile::remove(storage);
+    QFile::remove(storage + QLatin1String(".keys"));
+
+    CryptoManager manager;
+    manager.setStorageType(CryptoManager::PageStorage);
+    manager.setFileSystemPath(storage);
+    QVERIFY(!manager.fileSystemIsSetup());
+
+    manager.setEncryptionKey("key1");
+    QVERIFY(manager.setupFileSystem());
+    QVERIFY(manager.fileSystemIsSetup());
+    QVERIFY(manager.fileSystemIsMounted());
+
+    m_db->m_secretsConfiguration.m_vfs =
+        QLatin1String(EncryptedVfs::name());
+    QVERIFY(m_db->openSecretsDB(storage));
+    SignonIdentityInfo info =
+        SignonIdentityInfo(0,
+                           QLatin1String("User"),
+                           QLatin1String("PagePassword"), true,
+                           QLatin1String("Caption"),
+                           testMethods,
+                           testRealms,
+                           testAcl);
+    quint32 id = m_db->insertCredentials(info, true);
+    QVERIFY(id != 0);
+
+    //the online backup keeps the pages encrypted
+    QString metaDataBackup = QLatin1String("/tmp/signon_test_pages_meta");
+    QString secretsBackup = storage + QLatin1String(".backup");
+    QVERIFY(manager.registerPageStorageCopy(secretsBackup));
+    QVERIFY(m_db->startBackup(metaDataBackup, secretsBackup));
+    while (!m_db->backupStep(1000))
+        QVERIFY(!m_db->errorOccurred());
+    CryptoManager::unregisterPageStorageCopy(secretsBackup);
+    m_db->closeSecretsDB();
+
+    //nothing is stored in clear
+    foreach (QString fileName, QStringList() << storage << secretsBackup) {
+        QFile file(fileName);
+        QVERIFY(file.open(QIODevice::ReadOnly));
+        QByteArray contents = file.readAll();
+        file.close();
+        QVERIFY(!contents.isEmpty());
+        QVERIFY(!contents.contains("SQLite format"));
+        QVERIFY(!contents.contains("PagePassword"));
+    }
+    QFile::remove(metaDataBackup);
+    QFile::remove(secretsBackup);
+
+    QVERIFY(manager.addEncryptionKey("key2", "key1"));
+    QVERIFY(manager.unmountFileSystem());
+
+    //without its key, the DB is not opened
+    QVERIFY(!m_db->openSecretsDB(storage));
+
+    manager.setEncryptionKey("wrong");
+    QVERIFY(!manager.mountFileSystem());
+
+    manager.setEncryptionKey("key2");
+    QVERIFY(manager.mountFileSystem());
+    QVERIFY(m_db->openSecretsDB(storage));
+    QCOMPARE(m_db->credentials(id, true).password(),
+             QLatin1String("PagePassword"));
+    m_db->closeSecretsDB();
+
+    QVERIFY(manager.removeEncryptionKey("key1", "key2"));
+    QVERIFY(!manager.encryptionKeyInUse("key1"));
+    QVERIFY(manager.encryptionKeyInUse("key2"));
+    //the last key can't be removed
+    QVERIFY(!manager.removeEncryptionKey("key2", "key2"));
+
+    QVERIFY(manager.deleteFileSystem());
+    QVERIFY(!manager.fileSystemIsSetup());
+    QVERIFY(!QFile::exists(storage));
+    m_db->m_secretsConfiguration = SqlDatabaseConfiguration();
+}
+
 void TestDatabase::accessControlListTest()
 {
     quint32 id;
@@ -681,6 +1043,10 @@ void TestDatabase::runAllTests()
     queryListTest();
     cleanup();
 
+    init();
+    preparedQueryTest();
+    cleanup();
+
     init();
     insertMethodsTest();
     cleanup();
@@ -721,6 +1087,22 @@ void TestDatabase::runAllTests()
     referenceTest();
     cleanup();
 
+    init();
+    identityCacheTest();
+    cleanup();
+
+    init();
+    backupTest();
+    cleanup();
+
+    init();
+    backupSnapshotTest();
+    cleanup();
+
+    init();
+    pageEncryptionTest();
+    cleanup();
+
     init();
     accessControlListTest();
     cleanup();
@@ -50,6 +50,7 @@ private Q_SLOTS:
 
     void createTableStructureTest();
     void queryListTest();
+    void preparedQueryTest();
     void insertMethodsTest();
 
     void methodsTest();
@@ -62,6 +63,10 @@ private Q_SLOTS:
 
     void dataTest();
     void referenceTest();
+    void identityCacheTest();
+    void backupTest();
+    void backupSnapshotTest();
+    void pageEncryptionTest();
 
     void accessControlListTest();
     void credentialsOwnerSecurityTokenTest();
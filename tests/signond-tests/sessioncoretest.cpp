@@ -0,0 +1,819 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "sessioncoretest.h"
+
+#include <SignOnCrypto/Encryptor>
+
+#include "signond/signoncommon.h"
+#include "SignOn/authpluginif.h"
+
+using namespace SignOnCrypto;
+
+const char TestSessionCore::clientArgument[] = "--session-client";
+
+/* The delay (ms) of the plugin in the requests which must overlap */
+#define PLUGIN_DELAY 1500
+
+/* The delay (ms) of the plugin in the requests which other ones, some of
+ * them from another process, are coalesced with */
+#define COALESCING_DELAY 4000
+
+QVariantMap FakeSignonUi::queryDialog(const QVariantMap &parameters)
+{
+    Q_UNUSED(parameters);
+
+    setDelayedReply(true);
+    m_openDialogs.append(message());
+    m_shownDialogs++;
+    m_maxOpenDialogs = qMax(m_maxOpenDialogs, m_openDialogs.count());
+    QTimer::singleShot(m_delay, this, SLOT(closeDialog()));
+    return QVariantMap();
+}
+
+QVariantMap FakeSignonUi::refreshDialog(const QVariantMap &parameters)
+{
+    Q_UNUSED(parameters);
+    return QVariantMap();
+}
+
+void FakeSignonUi::cancelUiRequest(const QString &requestId)
+{
+    Q_UNUSED(requestId);
+}
+
+void FakeSignonUi::closeDialog()
+{
+    if (m_openDialogs.isEmpty())
+        return;
+
+    QVariantMap reply;
+    reply.insert(QLatin1String("QueryErrorCode"), (int)SignOn::QUERY_ERROR_NONE);
+    reply.insert(QLatin1String("UserName"), QLatin1String("user"));
+    reply.insert(QLatin1String("Secret"), QLatin1String("secret"));
+    QDBusMessage dialog = m_openDialogs.takeFirst();
+    connection().send(dialog.createReply(QVariant(reply)));
+}
+
+void TestSessionCore::initTestCase()
+{
+    m_daemon = NULL;
+    m_configFileName = QDir::tempPath() + QLatin1String("/signond-sessioncore-test.conf");
+    m_storagePath = QDir::tempPath() + QLatin1String("/signond-sessioncore-test");
+
+    /* Kill any running instances of signond */
+    QProcess::execute("pkill -9 signond");
+}
+
+void TestSessionCore::cleanupTestCase()
+{
+    stopDaemon();
+    QFile::remove(m_configFileName);
+}
+
+bool TestSessionCore::startDaemon(const QString &settings)
+{
+    stopDaemon();
+
+    /* Every daemon starts with an empty storage */
+    QDir storage(m_storagePath);
+    foreach (QString fileName, storage.entryList(QDir::Files))
+        storage.remove(fileName);
+    QDir().mkpath(m_storagePath);
+
+    QFile file(m_configFileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+    QTextStream(&file) << "[General]\n"
+        << "UseSecureStorage=no\n"
+        << "StoragePath=" << m_storagePath << "\n"
+        << settings;
+    file.close();
+
+    QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+    env.insert(QLatin1String("SSO_CONFIG_FILE"), m_configFileName);
+    m_daemon = new QProcess();
+    m_daemon->setProcessEnvironment(env);
+    m_daemon->start("signond");
+    if (!m_daemon->waitForStarted(10 * 1000))
+        return false;
+
+    QDBusConnectionInterface *bus = SIGNOND_BUS.interface();
+    for (int i = 0; i < 100 && !bus->isServiceRegistered(SIGNOND_SERVICE); i++)
+        QTest::qWait(100);
+    return bus->isServiceRegistered(SIGNOND_SERVICE);
+}
+
+void TestSessionCore::stopDaemon()
+{
+    if (m_daemon == NULL)
+        return;
+
+    m_daemon->kill();
+    m_daemon->waitForFinished();
+    delete m_daemon;
+    m_daemon = NULL;
+
+    QDBusConnectionInterface *bus = SIGNOND_BUS.interface();
+    for (int i = 0; i < 50 && bus->isServiceRegistered(SIGNOND_SERVICE); i++)
+        QTest::qWait(100);
+}
+
+QVariantMap TestSessionCore::identityInfo()
+{
+    QVariantMap methods;
+    methods.insert(QLatin1String("ssotest"),
+                   QStringList() << QLatin1String("mech1") << QLatin1String("mech2"));
+    methods.insert(QLatin1String("ssotest2"), QStringList() << QLatin1String("mech1"));
+
+    Encryptor encryptor;
+    QVariantMap info;
+    info.insert(SIGNOND_IDENTITY_INFO_USERNAME, QLatin1String("user"));
+    info.insert(SIGNOND_IDENTITY_INFO_SECRET,
+                encryptor.encodeString(QLatin1String("secret"), 0));
+    info.insert(SIGNOND_IDENTITY_INFO_STORESECRET, true);
+    info.insert(SIGNOND_IDENTITY_INFO_CAPTION, QLatin1String("session core test"));
+    info.insert(SIGNOND_IDENTITY_INFO_AUTHMETHODS, methods);
+    return info;
+}
+
+quint32 TestSessionCore::storeIdentity(QString *path)
+{
+    QDBusMessage reply = callDaemon(QLatin1String("registerNewIdentity"));
+    if (reply.type() != QDBusMessage::ReplyMessage || reply.arguments().isEmpty())
+        return 0;
+    QString identityPath = reply.arguments().first().value<QDBusObjectPath>().path();
+    if (path != 0)
+        *path = identityPath;
+
+    reply = callIdentity(identityPath, QLatin1String("store"),
+                         QVariantList() << identityInfo());
+    if (reply.type() != QDBusMessage::ReplyMessage || reply.arguments().isEmpty())
+        return 0;
+    return reply.arguments().first().toUInt();
+}
+
+QDBusMessage TestSessionCore::callIdentity(const QString &path,
+                                           const QString &method,
+                                           const QVariantList &arguments)
+{
+    QDBusMessage msg = QDBusMessage::createMethodCall(SIGNOND_SERVICE, path,
+                                                      SIGNOND_IDENTITY_INTERFACE,
+                                                      method);
+    msg.setArguments(arguments);
+    return SIGNOND_BUS.call(msg);
+}
+
+QDBusMessage TestSessionCore::callDaemon(const QString &method)
+{
+    QDBusMessage msg = QDBusMessage::createMethodCall(SIGNOND_SERVICE,
+                                                      SIGNOND_DAEMON_OBJECTPATH,
+                                                      SIGNOND_DAEMON_INTERFACE,
+                                                      method);
+    return SIGNOND_BUS.call(msg);
+}
+
+QVariantMap TestSessionCore::cacheStatistics()
+{
+    QDBusMessage reply = callDaemon(QLatin1String("queryCacheStatistics"));
+    if (reply.type() != QDBusMessage::ReplyMessage || reply.arguments().isEmpty())
+        return QVariantMap();
+    return qdbus_cast<QVariantMap>(reply.arguments().first());
+}
+
+QString TestSessionCore::authSession(quint32 id, const QString &method)
+{
+    QDBusMessage msg = QDBusMessage::createMethodCall(SIGNOND_SERVICE,
+                                                      SIGNOND_DAEMON_OBJECTPATH,
+                                                      SIGNOND_DAEMON_INTERFACE,
+                                                      QLatin1String("getAuthSessionObjectPath"));
+    msg << id << method;
+    QDBusMessage reply = SIGNOND_BUS.call(msg);
+    if (reply.type() != QDBusMessage::ReplyMessage || reply.arguments().isEmpty())
+        return QString();
+    return reply.arguments().first().toString();
+}
+
+QDBusPendingCall TestSessionCore::process(const QString &session,
+                                          const QVariantMap &params,
+                                          const QString &mechanism)
+{
+    QDBusMessage msg = QDBusMessage::createMethodCall(SIGNOND_SERVICE, session,
+                                                      SIGNOND_AUTH_SESSION_INTERFACE,
+                                                      QLatin1String("process"));
+    msg << params << mechanism;
+    return SIGNOND_BUS.asyncCall(msg);
+}
+
+QVariantMap TestSessionCore::processOnce(const QString &session,
+                                         const QVariantMap &params)
+{
+    QDBusPendingCall call = process(session, params);
+    call.waitForFinished();
+    return result(call);
+}
+
+void TestSessionCore::cancel(const QString &session)
+{
+    QDBusMessage msg = QDBusMessage::createMethodCall(SIGNOND_SERVICE, session,
+                                                      SIGNOND_AUTH_SESSION_INTERFACE,
+                                                      QLatin1String("cancel"));
+    SIGNOND_BUS.send(msg);
+}
+
+/* Returns the indexes of the calls in the order their replies came */
+QList<int> TestSessionCore::waitForReplies(const QList<QDBusPendingCall> &calls,
+                                           int timeout)
+{
+    QList<int> order;
+    QTime time;
+    time.start();
+    while (order.count() < calls.count() && time.elapsed() < timeout) {
+        QTest::qWait(10);
+        for (int i = 0; i < calls.count(); i++) {
+            if (calls.at(i).isFinished() && !order.contains(i))
+                order.append(i);
+        }
+    }
+    return order;
+}
+
+QVariantMap TestSessionCore::result(const QDBusPendingCall &call)
+{
+    QDBusPendingReply<QVariantMap> reply(call);
+    if (!reply.isValid())
+        return QVariantMap();
+
+    /* fails unless the result is encrypted for this process */
+    Encryptor encryptor;
+    QVariantMap data = encryptor.decodeVariantMap(reply.value(), 0);
+    if (encryptor.status() != Encryptor::Ok)
+        return QVariantMap();
+    return data;
+}
+
+/* Runs the test binary as a client doing one request on the ssotest plugin */
+QProcess *TestSessionCore::startClient(quint32 id, const QVariantMap &params)
+{
+    QStringList arguments;
+    arguments << QLatin1String(clientArgument) << QString::number(id)
+        << QLatin1String("ssotest") << QLatin1String("mech1");
+
+    QMapIterator<QString, QVariant> it(params);
+    while (it.hasNext()) {
+        it.next();
+        arguments << it.key() + QLatin1Char('=') + it.value().toString();
+    }
+
+    QProcess *client = new QProcess();
+    client->start(QCoreApplication::applicationFilePath(), arguments);
+    client->waitForStarted();
+    return client;
+}
+
+/* The result printed by the client, or its error as the "Error" key */
+QVariantMap TestSessionCore::clientResult(QProcess *client)
+{
+    QVariantMap data;
+    if (client->waitForFinished(20000)) {
+        foreach (QByteArray line, client->readAllStandardOutput().split('\n')) {
+            int separator = line.indexOf('=');
+            if (separator > 0)
+                data.insert(QString::fromUtf8(line.left(separator)),
+                            QString::fromUtf8(line.mid(separator + 1)));
+        }
+    }
+    delete client;
+    return data;
+}
+
+void TestSessionCore::spreadOverPluginInstances()
+{
+    QVERIFY(startDaemon("[PluginInstances]\nssotest=3\n"));
+    quint32 id = storeIdentity();
+    QVERIFY(id != 0);
+
+    QVariantMap params;
+    params.insert("Delay", PLUGIN_DELAY);
+
+    QTime time;
+    time.start();
+    QList<QDBusPendingCall> calls;
+    for (int i = 0; i < 3; i++)
+        calls << process(authSession(id, "ssotest"), params);
+    QCOMPARE(waitForReplies(calls).count(), 3);
+
+    //processed at the same time, by as many plugin processes
+    QVERIFY(time.elapsed() < 2 * PLUGIN_DELAY);
+    QSet<int> pids;
+    foreach (QDBusPendingCall call, calls) {
+        QVariantMap data = result(call);
+        QVERIFY(data.contains("ProcessId"));
+        pids.insert(data.value("ProcessId").toInt());
+    }
+    QCOMPARE(pids.count(), 3);
+}
+
+void TestSessionCore::maxPluginInstances()
+{
+    QVERIFY(startDaemon("[PluginInstances]\nssotest=2\n"));
+    quint32 id = storeIdentity();
+    QVERIFY(id != 0);
+
+    QVariantMap params;
+    params.insert("Delay", PLUGIN_DELAY);
+
+    QTime time;
+    time.start();
+    QList<QDBusPendingCall> calls;
+    for (int i = 0; i < 4; i++)
+        calls << process(authSession(id, "ssotest"), params);
+    QCOMPARE(waitForReplies(calls).count(), 4);
+
+    //two rounds on two plugin processes
+    QVERIFY(time.elapsed() >= 2 * PLUGIN_DELAY);
+    QVERIFY(time.elapsed() < 4 * PLUGIN_DELAY);
+    QSet<int> pids;
+    foreach (QDBusPendingCall call, calls)
+        pids.insert(result(call).value("ProcessId").toInt());
+    QCOMPARE(pids.count(), 2);
+}
+
+void TestSessionCore::cancelKeyFairness()
+{
+    QVERIFY(startDaemon("[PluginInstances]\nssotest=2\n"));
+    quint32 id = storeIdentity();
+    QVERIFY(id != 0);
+
+    QVariantMap params;
+    params.insert("Delay", PLUGIN_DELAY);
+
+    /* The second request of the first session waits for the first one,
+     * while the request of the other session takes the free process */
+    QString session = authSession(id, "ssotest");
+    QString otherSession = authSession(id, "ssotest");
+    QList<QDBusPendingCall> calls;
+    calls << process(session, params);
+    calls << process(session, params);
+    calls << process(otherSession, params);
+
+    QList<int> order = waitForReplies(calls);
+    QCOMPARE(order.count(), 3);
+    QVERIFY(order.indexOf(2) < order.indexOf(1));
+    QVERIFY(order.indexOf(0) < order.indexOf(1));
+    foreach (QDBusPendingCall call, calls)
+        QVERIFY(!call.isError());
+}
+
+void TestSessionCore::cancelWhileLoading()
+{
+    QVERIFY(startDaemon(QString()));
+    quint32 id = storeIdentity();
+    QVERIFY(id != 0);
+
+    QVariantMap params;
+    params.insert("Delay", PLUGIN_DELAY);
+
+    /* Canceled right away, most likely while the stored data of the request
+     * are being loaded */
+    QList<QDBusPendingCall> calls;
+    QStringList sessions;
+    for (int i = 0; i < 5; i++) {
+        sessions << authSession(id, "ssotest");
+        calls << process(sessions.last(), params);
+        cancel(sessions.last());
+    }
+    QCOMPARE(waitForReplies(calls).count(), 5);
+    foreach (QDBusPendingCall call, calls) {
+        QVERIFY(call.isError());
+        QCOMPARE(call.error().name(), QString(SIGNOND_SESSION_CANCELED_ERR_NAME));
+    }
+
+    //the sessions and the plugin go on with the next requests
+    params.clear();
+    calls.clear();
+    foreach (QString session, sessions)
+        calls << process(session, params);
+    QCOMPARE(waitForReplies(calls).count(), 5);
+    foreach (QDBusPendingCall call, calls)
+        QVERIFY(result(call).contains("ProcessId"));
+}
+
+void TestSessionCore::coalescedResult()
+{
+    QVERIFY(startDaemon("[RequestCoalescing]\nssotest=yes\n"));
+    quint32 id = storeIdentity();
+    QVERIFY(id != 0);
+
+    QVariantMap params;
+    params.insert("Delay", COALESCING_DELAY);
+    params.insert("Tag", "coalesced");
+
+    QList<QDBusPendingCall> calls;
+    calls << process(authSession(id, "ssotest"), params);
+    QTest::qWait(500);
+
+    /* the followers: one of this process and one of another process */
+    calls << process(authSession(id, "ssotest"), params);
+    QProcess *client = startClient(id, params);
+
+    QCOMPARE(waitForReplies(calls).count(), 2);
+    QVariantMap leaderResult = result(calls.at(0));
+    QCOMPARE(leaderResult.value("Run").toInt(), 1);
+    QCOMPARE(result(calls.at(1)), leaderResult);
+
+    //the other process could decrypt the copy which went to it
+    QVariantMap clientData = clientResult(client);
+    QVERIFY(!clientData.contains("Error"));
+    QCOMPARE(clientData.value("Run").toString(), QString("1"));
+    QCOMPARE(clientData.value("ProcessId").toString(),
+             leaderResult.value("ProcessId").toString());
+}
+
+void TestSessionCore::coalescedFollowerCancel()
+{
+    QVERIFY(startDaemon("[RequestCoalescing]\nssotest=yes\n"));
+    quint32 id = storeIdentity();
+    QVERIFY(id != 0);
+
+    QVariantMap params;
+    params.insert("Delay", COALESCING_DELAY);
+
+    QStringList sessions;
+    QList<QDBusPendingCall> calls;
+    for (int i = 0; i < 3; i++) {
+        sessions << authSession(id, "ssotest");
+        calls << process(sessions.last(), params);
+        QTest::qWait(500);
+    }
+    cancel(sessions.at(1));
+
+    /* only the canceled follower is detached, right away */
+    QList<int> order = waitForReplies(calls);
+    QCOMPARE(order.count(), 3);
+    QCOMPARE(order.first(), 1);
+    QCOMPARE(calls.at(1).error().name(), QString(SIGNOND_SESSION_CANCELED_ERR_NAME));
+    QCOMPARE(result(calls.at(0)).value("Run").toInt(), 1);
+    QCOMPARE(result(calls.at(2)).value("Run").toInt(), 1);
+}
+
+void TestSessionCore::coalescedLeaderCancel()
+{
+    QVERIFY(startDaemon("[RequestCoalescing]\nssotest=yes\n"));
+    quint32 id = storeIdentity();
+    QVERIFY(id != 0);
+
+    QVariantMap params;
+    params.insert("Delay", COALESCING_DELAY);
+
+    QString leader = authSession(id, "ssotest");
+    QList<QDBusPendingCall> calls;
+    calls << process(leader, params);
+    QTest::qWait(500);
+    calls << process(authSession(id, "ssotest"), params);
+    QTest::qWait(500);
+    cancel(leader);
+
+    /* the plugin goes on for the follower, which gets the result */
+    QList<int> order = waitForReplies(calls);
+    QCOMPARE(order.count(), 2);
+    QCOMPARE(order.first(), 0);
+    QCOMPARE(calls.at(0).error().name(), QString(SIGNOND_SESSION_CANCELED_ERR_NAME));
+    QCOMPARE(result(calls.at(1)).value("Run").toInt(), 1);
+
+    //the canceled session is usable again
+    params.clear();
+    calls.clear();
+    calls << process(leader, params);
+    QCOMPARE(waitForReplies(calls).count(), 1);
+    QCOMPARE(result(calls.at(0)).value("Run").toInt(), 2);
+}
+
+void TestSessionCore::coalescedLeaderFailure()
+{
+    QVERIFY(startDaemon("[RequestCoalescing]\nssotest=yes\n"));
+    quint32 id = storeIdentity();
+    QVERIFY(id != 0);
+
+    QVariantMap params;
+    params.insert("Delay", COALESCING_DELAY);
+    params.insert("Error", (int)SignOn::Error::NotAuthorized);
+
+    QList<QDBusPendingCall> calls;
+    calls << process(authSession(id, "ssotest"), params);
+    QTest::qWait(500);
+    calls << process(authSession(id, "ssotest"), params);
+    QProcess *client = startClient(id, params);
+
+    QCOMPARE(waitForReplies(calls).count(), 2);
+    foreach (QDBusPendingCall call, calls) {
+        QVERIFY(call.isError());
+        QCOMPARE(call.error().name(), QString(SIGNOND_NOT_AUTHORIZED_ERR_NAME));
+    }
+    QCOMPARE(clientResult(client).value("Error").toString(),
+             QString(SIGNOND_NOT_AUTHORIZED_ERR_NAME));
+}
+
+void TestSessionCore::cachedResult()
+{
+    QVERIFY(startDaemon("[ResultCache]\nssotest=yes\n"));
+    quint32 id = storeIdentity();
+    QVERIFY(id != 0);
+
+    QVariantMap params;
+    params.insert("ResultExpiresIn", 60);
+
+    /* the plugin runs once, for both sessions */
+    QCOMPARE(processOnce(authSession(id, "ssotest"), params).value("Run").toInt(), 1);
+    QCOMPARE(processOnce(authSession(id, "ssotest"), params).value("Run").toInt(), 1);
+
+    //other parameters make another request
+    params.insert("Tag", "other");
+    QCOMPARE(processOnce(authSession(id, "ssotest"), params).value("Run").toInt(), 2);
+
+    QVariantMap statistics = cacheStatistics();
+    QCOMPARE(statistics.value("ResultHits").toULongLong(), Q_UINT64_C(1));
+    QCOMPARE(statistics.value("ResultMisses").toULongLong(), Q_UINT64_C(2));
+}
+
+void TestSessionCore::cachedResultExpiry()
+{
+    QVERIFY(startDaemon("[ResultCache]\nssotest=yes\n"));
+    quint32 id = storeIdentity();
+    QVERIFY(id != 0);
+
+    QVariantMap params;
+    params.insert("ResultExpiresIn", 2);
+
+    QString session = authSession(id, "ssotest");
+    QCOMPARE(processOnce(session, params).value("Run").toInt(), 1);
+    QCOMPARE(processOnce(session, params).value("Run").toInt(), 1);
+
+    QTest::qWait(3000);
+    QCOMPARE(processOnce(session, params).value("Run").toInt(), 2);
+
+    //the results the plugin gives no lifetime to are not cached
+    params.clear();
+    QCOMPARE(processOnce(session, params).value("Run").toInt(), 3);
+    QCOMPARE(processOnce(session, params).value("Run").toInt(), 4);
+}
+
+void TestSessionCore::cacheBypass()
+{
+    QVERIFY(startDaemon("[ResultCache]\nssotest=yes\n"));
+    quint32 id = storeIdentity();
+    QVERIFY(id != 0);
+
+    QVariantMap params;
+    params.insert("ResultExpiresIn", 60);
+    QString session = authSession(id, "ssotest");
+    QCOMPARE(processOnce(session, params).value("Run").toInt(), 1);
+
+    QVariantMap renew(params);
+    renew.insert("RenewToken", true);
+    QCOMPARE(processOnce(session, renew).value("Run").toInt(), 2);
+
+    /* NoCache neither uses nor stores the result */
+    QVariantMap noCache(params);
+    noCache.insert("CachePolicy", (int)SignOn::NoCachePolicy);
+    QCOMPARE(processOnce(session, noCache).value("Run").toInt(), 3);
+    QCOMPARE(processOnce(session, params).value("Run").toInt(), 1);
+
+    /* Refresh doesn't use the result, but stores the new one */
+    QVariantMap refresh(params);
+    refresh.insert("CachePolicy", (int)SignOn::RefreshCachePolicy);
+    QCOMPARE(processOnce(session, refresh).value("Run").toInt(), 4);
+    QCOMPARE(processOnce(session, params).value("Run").toInt(), 4);
+}
+
+void TestSessionCore::cacheInvalidation()
+{
+    QVERIFY(startDaemon("[ResultCache]\nssotest=yes\n"));
+    QString path;
+    quint32 id = storeIdentity(&path);
+    QVERIFY(id != 0);
+
+    QVariantMap params;
+    params.insert("ResultExpiresIn", 60);
+    QString session = authSession(id, "ssotest");
+    QCOMPARE(processOnce(session, params).value("Run").toInt(), 1);
+    QCOMPARE(processOnce(session, params).value("Run").toInt(), 1);
+
+    /* storing the identity again drops its results */
+    QVariantMap info = identityInfo();
+    info.insert(SIGNOND_IDENTITY_INFO_ID, id);
+    QCOMPARE(callIdentity(path, "store", QVariantList() << info).type(),
+             QDBusMessage::ReplyMessage);
+    QCOMPARE(processOnce(session, params).value("Run").toInt(), 2);
+    QCOMPARE(processOnce(session, params).value("Run").toInt(), 2);
+
+    //and so does signing out
+    QCOMPARE(callIdentity(path, "signOut").type(), QDBusMessage::ReplyMessage);
+    QCOMPARE(processOnce(session, params).value("Run").toInt(), 3);
+    QCOMPARE(processOnce(session, params).value("Run").toInt(), 3);
+
+    /* Once the identity is removed or the storage cleared, the lookups of
+     * the cache miss, whatever the plugin does then */
+    quint64 hits = cacheStatistics().value("ResultHits").toULongLong();
+    quint64 misses = cacheStatistics().value("ResultMisses").toULongLong();
+    QCOMPARE(callIdentity(path, "remove").type(), QDBusMessage::ReplyMessage);
+    processOnce(session, params);
+    QCOMPARE(cacheStatistics().value("ResultHits").toULongLong(), hits);
+    QCOMPARE(cacheStatistics().value("ResultMisses").toULongLong(), misses + 1);
+
+    id = storeIdentity();
+    QVERIFY(id != 0);
+    session = authSession(id, "ssotest");
+    processOnce(session, params);
+    processOnce(session, params);
+    QCOMPARE(cacheStatistics().value("ResultHits").toULongLong(), hits + 1);
+    hits = cacheStatistics().value("ResultHits").toULongLong();
+    misses = cacheStatistics().value("ResultMisses").toULongLong();
+    QCOMPARE(callDaemon("clear").type(), QDBusMessage::ReplyMessage);
+    processOnce(session, params);
+    QCOMPARE(cacheStatistics().value("ResultHits").toULongLong(), hits);
+    QCOMPARE(cacheStatistics().value("ResultMisses").toULongLong(), misses + 1);
+}
+
+void TestSessionCore::concurrentMethods()
+{
+    QVERIFY(startDaemon(QString()));
+    quint32 id = storeIdentity();
+    QVERIFY(id != 0);
+
+    QVariantMap params;
+    params.insert("Delay", PLUGIN_DELAY);
+
+    /* the request of ssotest2 doesn't wait for the one of ssotest */
+    QTime time;
+    time.start();
+    QList<QDBusPendingCall> calls;
+    calls << process(authSession(id, "ssotest"), params);
+    calls << process(authSession(id, "ssotest2"), QVariantMap());
+
+    QList<int> order = waitForReplies(calls);
+    QCOMPARE(order.count(), 2);
+    QCOMPARE(order.first(), 1);
+    QVERIFY(time.elapsed() < 2 * PLUGIN_DELAY);
+    foreach (QDBusPendingCall call, calls)
+        QVERIFY(!call.isError());
+}
+
+void TestSessionCore::exclusiveRequests()
+{
+    QVERIFY(startDaemon("[Concurrency]\nssotest=exclusive\n"
+                        "[PluginInstances]\nssotest=2\n"));
+    quint32 id = storeIdentity();
+    QVERIFY(id != 0);
+
+    QVariantMap params;
+    params.insert("Delay", PLUGIN_DELAY);
+
+    /* one at a time, even with two plugin processes; the request of
+     * ssotest2 waits for them */
+    QTime time;
+    time.start();
+    QList<QDBusPendingCall> calls;
+    calls << process(authSession(id, "ssotest"), params);
+    calls << process(authSession(id, "ssotest"), params);
+    calls << process(authSession(id, "ssotest2"), QVariantMap());
+
+    QList<int> order = waitForReplies(calls);
+    QCOMPARE(order, QList<int>() << 0 << 1 << 2);
+    QVERIFY(time.elapsed() >= 2 * PLUGIN_DELAY);
+    QCOMPARE(result(calls.at(1)).value("ProcessId").toInt(),
+             result(calls.at(0)).value("ProcessId").toInt());
+    QVERIFY(!calls.at(2).isError());
+}
+
+void TestSessionCore::exclusiveRequestNotOvertaken()
+{
+    QVERIFY(startDaemon("[Concurrency]\nssotest2=exclusive\n"
+                        "[PluginInstances]\nssotest=2\n"));
+    quint32 id = storeIdentity();
+    QVERIFY(id != 0);
+
+    QVariantMap params;
+    params.insert("Delay", PLUGIN_DELAY);
+
+    /* The request of ssotest2 waits for the running one, and the request
+     * of ssotest coming later waits for it, although a plugin process is
+     * free */
+    QList<QDBusPendingCall> calls;
+    calls << process(authSession(id, "ssotest"), params);
+    calls << process(authSession(id, "ssotest2"), QVariantMap());
+    calls << process(authSession(id, "ssotest"), QVariantMap());
+
+    QList<int> order = waitForReplies(calls);
+    QCOMPARE(order, QList<int>() << 0 << 1 << 2);
+    foreach (QDBusPendingCall call, calls)
+        QVERIFY(!call.isError());
+}
+
+void TestSessionCore::oneDialogByIdentity()
+{
+    FakeSignonUi signonUi(1000);
+    QVERIFY(SIGNOND_BUS.registerObject(QLatin1String("/SignonUi"), &signonUi,
+                                       QDBusConnection::ExportAllSlots));
+    QVERIFY(SIGNOND_BUS.registerService(QLatin1String("com.nokia.singlesignonui")));
+
+    QVERIFY(startDaemon(QString()));
+    quint32 id = storeIdentity();
+    QVERIFY(id != 0);
+
+    /* both plugins ask for a dialog at the same time */
+    QVariantMap chain;
+    chain.insert("ChainOfStates", QStringList() << QLatin1String("Login"));
+    QList<QDBusPendingCall> calls;
+    calls << process(authSession(id, "ssotest"), QVariantMap(),
+                     QLatin1String("mech2"));
+    calls << process(authSession(id, "ssotest2"), chain);
+
+    QCOMPARE(waitForReplies(calls).count(), 2);
+    foreach (QDBusPendingCall call, calls)
+        QVERIFY(!call.isError());
+    QCOMPARE(result(calls.at(0)).value("UserName").toString(), QString("user"));
+    QCOMPARE(signonUi.shownDialogs(), 2);
+    QCOMPARE(signonUi.maxOpenDialogs(), 1);
+
+    SIGNOND_BUS.unregisterService(QLatin1String("com.nokia.singlesignonui"));
+    SIGNOND_BUS.unregisterObject(QLatin1String("/SignonUi"));
+}
+
+int TestSessionCore::runClient(const QStringList &arguments)
+{
+    /* identity id, method, mechanism, and the parameters as key=value */
+    if (arguments.count() < 3)
+        return 2;
+
+    QVariantMap params;
+    foreach (QString argument, arguments.mid(3)) {
+        int separator = argument.indexOf(QLatin1Char('='));
+        QString value = argument.mid(separator + 1);
+        bool isNumber = false;
+        int number = value.toInt(&isNumber);
+        params.insert(argument.left(separator),
+                      isNumber ? QVariant(number) : QVariant(value));
+    }
+
+    TestSessionCore client;
+    QString session = client.authSession(arguments.at(0).toUInt(), arguments.at(1));
+    QDBusPendingCall call = client.process(session, params, arguments.at(2));
+    call.waitForFinished();
+
+    QTextStream out(stdout);
+    if (call.isError()) {
+        out << "Error=" << call.error().name() << endl;
+        return 1;
+    }
+
+    QMapIterator<QString, QVariant> it(result(call));
+    while (it.hasNext()) {
+        it.next();
+        out << it.key() << "=" << it.value().toString() << endl;
+    }
+    return 0;
+}
+
+#if defined(SSO_CI_TESTMANAGEMENT)
+    void TestSessionCore::runAllTests()
+    {
+        initTestCase();
+        spreadOverPluginInstances();
+        maxPluginInstances();
+        cancelKeyFairness();
+        cancelWhileLoading();
+        coalescedResult();
+        coalescedFollowerCancel();
+        coalescedLeaderCancel();
+        coalescedLeaderFailure();
+        cachedResult();
+        cachedResultExpiry();
+        cacheBypass();
+        cacheInvalidation();
+        concurrentMethods();
+        exclusiveRequests();
+        exclusiveRequestNotOvertaken();
+        oneDialogByIdentity();
+        cleanupTestCase();
+    }
+#endif
@@ -0,0 +1,134 @@
+/*
+ * This file is part of signon
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * Contact: Alberto Mardegan <alberto.mardegan@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef SESSIONCORE_TEST_H
+#define SESSIONCORE_TEST_H
+
+#include <QtTest/QtTest>
+#include <QtCore>
+#include <QtDBus>
+
+/*
+ * Stands for signon-ui: each dialog is closed, as accepted, after the given
+ * time (ms). Counts the dialogs, and how many were open at the same time.
+ */
+class FakeSignonUi: public QObject, protected QDBusContext
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "com.nokia.singlesignonui")
+
+public:
+    FakeSignonUi(int delay):
+        m_delay(delay), m_shownDialogs(0), m_maxOpenDialogs(0) {}
+
+    int shownDialogs() const { return m_shownDialogs; }
+    int maxOpenDialogs() const { return m_maxOpenDialogs; }
+
+public Q_SLOTS:
+    QVariantMap queryDialog(const QVariantMap &parameters);
+    QVariantMap refreshDialog(const QVariantMap &parameters);
+    void cancelUiRequest(const QString &requestId);
+
+private Q_SLOTS:
+    void closeDialog();
+
+private:
+    int m_delay;
+    int m_shownDialogs;
+    int m_maxOpenDialogs;
+    QList<QDBusMessage> m_openDialogs;
+};
+
+/*
+ * Tests the scheduling of the authentication requests by the daemon, which
+ * is run with a configuration of the test. The requests go to the ssotest
+ * plugin, which can be told to wait or to fail, and tells which process
+ * handled them.
+ */
+class TestSessionCore: public QObject
+{
+    Q_OBJECT
+
+#if defined(SSO_CI_TESTMANAGEMENT)
+     public Q_SLOTS:
+     void runAllTests();
+#else
+     private Q_SLOTS:
+#endif
+    void initTestCase();
+    void cleanupTestCase();
+
+    void spreadOverPluginInstances();
+    void maxPluginInstances();
+    void cancelKeyFairness();
+    void cancelWhileLoading();
+    void coalescedResult();
+    void coalescedFollowerCancel();
+    void coalescedLeaderCancel();
+    void coalescedLeaderFailure();
+    void cachedResult();
+    void cachedResultExpiry();
+    void cacheBypass();
+    void cacheInvalidation();
+    void concurrentMethods();
+    void exclusiveRequests();
+    void exclusiveRequestNotOvertaken();
+    void oneDialogByIdentity();
+
+public:
+    TestSessionCore(): m_daemon(NULL) {}
+
+    /* The argument running the test binary as a second client */
+    static const char clientArgument[];
+    static int runClient(const QStringList &arguments);
+
+private:
+    bool startDaemon(const QString &settings);
+    void stopDaemon();
+
+    static QVariantMap identityInfo();
+    quint32 storeIdentity(QString *path = 0);
+    QDBusMessage callIdentity(const QString &path, const QString &method,
+                              const QVariantList &arguments = QVariantList());
+    QDBusMessage callDaemon(const QString &method);
+    QVariantMap cacheStatistics();
+    QString authSession(quint32 id, const QString &method);
+    QDBusPendingCall process(const QString &session,
+                             const QVariantMap &params,
+                             const QString &mechanism = QLatin1String("mech1"));
+    QVariantMap processOnce(const QString &session, const QVariantMap &params);
+    void cancel(const QString &session);
+
+    QProcess *startClient(quint32 id, const QVariantMap &params);
+    static QVariantMap clientResult(QProcess *client);
+
+    QList<int> waitForReplies(const QList<QDBusPendingCall> &calls,
+                              int timeout = 20000);
+    static QVariantMap result(const QDBusPendingCall &call);
+
+private:
+    QProcess *m_daemon;
+    QString m_configFileName;
+    QString m_storagePath;
+};
+
+#endif // SESSIONCORE_TEST_H
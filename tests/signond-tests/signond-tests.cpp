@@ -25,6 +25,9 @@
 #include "timeouts.h"
 #include "backuptest.h"
 #include "databasetest.h"
+#include "sessioncoretest.h"
+
+#include "SignOn/encrypted-vfs.h"
 
 #ifdef CAM_UNIT_TESTS_FIXED
 #include "credentialsaccessmanagertest.h"
@@ -44,12 +47,14 @@ private Q_SLOTS:
      void runCAMTests();
      void runBackupTests();
      void runDatabaseTests();
+     void runSessionCoreTests();
 
 public:
      TestPluginProxy testPluginProxy;
      TimeoutsTest testTimeouts;
      TestBackup testBackup;
      TestDatabase testDatabase;
+     TestSessionCore testSessionCore;
 #ifdef CAM_UNIT_TESTS_FIXED
      CredentialsAccessManagerTest testCAM;
 #endif
@@ -85,9 +90,19 @@ void SignondTest::runDatabaseTests()
     testDatabase.runAllTests();
 }
 
+void SignondTest::runSessionCoreTests()
+{
+    testSessionCore.runAllTests();
+}
+
 int main(int argc, char **argv)
 {
     QCoreApplication app(argc, argv);
+    //the session core tests run a second client in another process
+    if (argc > 1 && qstrcmp(argv[1], TestSessionCore::clientArgument) == 0)
+        return TestSessionCore::runClient(app.arguments().mid(2));
+    //before any DB is opened
+    SignOn::EncryptedVfs::initialize();
     SignondTest signondTest;
     QTest::qExec(&signondTest, argc, argv);
 }
@@ -17,7 +17,8 @@ QT -= gui
 PKGCONFIG += \
     libcrypto \
     libsignoncrypto-qt \
-    accounts-qt
+    accounts-qt \
+    sqlite3
 
 LIBS += -L/usr/lib \
         -lsignon-extension \
@@ -27,16 +28,19 @@ QMAKE_LIBDIR += \
     $${TOP_BUILD_DIR}/lib/signond/SignOn
 
 DEFINES += SIGNOND_TRACE \
-           SIGNON_PLUGIN_TRACE
+           SIGNON_PLUGIN_TRACE \
+           SIGNON_ENABLE_UNSTABLE_APIS
 
 HEADERS += \
     timeouts.h \
     $$TOP_SRC_DIR/src/signond/pluginproxy.h \
+    $$TOP_SRC_DIR/src/signond/plugincatalogue.h \
     $$TOP_SRC_DIR/tests/pluginproxytest/testpluginproxy.h \
     backuptest.h \
     databasetest.h \
+    sessioncoretest.h \
     $$TOP_SRC_DIR/src/signond/credentialsdb.h \
-    $${TOP_SRC_DIR}/lib/plugins/signon-plugins-common/SignOn/blobiohandler.h \
+    $${TOP_SRC_DIR}/lib/plugins/signon-plugins-common/SignOn/ipcchannel.h \
     $${TOP_SRC_DIR}/lib/plugins/signon-plugins-common/SignOn/encrypteddevice.h
 
 SOURCES = \
@@ -46,6 +50,7 @@ SOURCES = \
     $$TOP_SRC_DIR/tests/pluginproxytest/include.cpp \
     backuptest.cpp \
     databasetest.cpp \
+    sessioncoretest.cpp \
     $${TOP_SRC_DIR}/lib/plugins/signon-plugins-common/SignOn/encrypteddevice.cpp \
            $$TOP_SRC_DIR/src/signond/credentialsdb.cpp
 
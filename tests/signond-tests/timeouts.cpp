@@ -131,6 +131,58 @@ void TimeoutsTest::identityTimeout()
     QVERIFY(!identityAlive(path));
 }
 
+void TimeoutsTest::identityTimeoutWithoutTraffic()
+{
+    QEventLoop loop;
+    QTimer::singleShot(test_timeout, &loop, SLOT(quit()));
+    QObject::connect(this, SIGNAL(finished()), &loop, SLOT(quit()));
+
+    QMap<MethodName,MechanismsList> methods;
+    methods.insert("dummy", QStringList() << "mech1" << "mech2");
+    IdentityInfo info = IdentityInfo(QLatin1String("timeout test"),
+                                     QLatin1String("timeout@test"),
+                                     methods);
+    Identity *identity = Identity::newIdentity(info);
+    QVERIFY(identity != NULL);
+
+    QObject::connect(identity,
+                     SIGNAL(credentialsStored(const quint32)),
+                     this,
+                     SLOT(credentialsStored(const quint32)));
+    QObject::connect(identity,
+                     SIGNAL(error(Identity::IdentityError,const QString&)),
+                     this,
+                     SLOT(identityError(Identity::IdentityError,const QString&)));
+
+    identity->storeCredentials();
+
+    loop.exec();
+    QVERIFY(identity->id() != SSO_NEW_IDENTITY);
+
+    QDBusConnection conn = SIGNOND_BUS;
+
+    QDBusMessage msg = QDBusMessage::createMethodCall(SIGNOND_SERVICE,
+                                                      SIGNOND_DAEMON_OBJECTPATH,
+                                                      SIGNOND_DAEMON_INTERFACE,
+                                                      "registerStoredIdentity");
+    QList<QVariant> args;
+    args << identity->id();
+    msg.setArguments(args);
+
+    QDBusMessage reply = conn.call(msg);
+    QVERIFY(reply.type() == QDBusMessage::ReplyMessage);
+
+    QDBusObjectPath objectPath = reply.arguments()[0].value<QDBusObjectPath>();
+    QString path = objectPath.path();
+    qDebug() << "Got path" << path;
+    QVERIFY(!path.isEmpty());
+
+    /* No other call reaches the daemon meanwhile: the identity must be
+     * destroyed by the daemon on its own */
+    QTest::qSleep(7 * 1000);
+    QVERIFY(!identityAlive(path));
+}
+
 void TimeoutsTest::identityRegisterTwice()
 {
     QEventLoop loop;
@@ -254,6 +306,7 @@ void TimeoutsTest::runAllTests()
 
     init();
     identityTimeout();
+    identityTimeoutWithoutTraffic();
     identityRegisterTwice();
 
     cleanupTestCase();
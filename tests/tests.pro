@@ -17,3 +17,4 @@ SUBDIRS += pluginproxytest/pluginproxytest.pro
 SUBDIRS += libsignon-qt-tests/libsignon-qt-tests.pro
 SUBDIRS += libsignon-qt-tests/libsignon-qt-untrusted-tests.pro
 SUBDIRS += signond-tests/signond-tests.pro
+SUBDIRS += signond-benchmarks/signond-benchmarks.pro